@@ -1,15 +1,22 @@
+#include "common.h"
+
 #include "whisper.h"
 
+#include <chrono>
 #include <cstdio>
 #include <string>
 #include <thread>
+#include <vector>
 
 // command-line parameters
 struct whisper_params {
     int32_t n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
-    int32_t what = 0; // what to benchmark: 0 - whisper ecoder, 1 - memcpy, 2 - ggml_mul_mat
+    int32_t what = 0; // what to benchmark: 0 - whisper ecoder, 1 - memcpy, 2 - ggml_mul_mat, 3 - model cascade
 
     std::string model = "models/ggml-base.en.bin";
+    std::string model_large;
+
+    std::vector<std::string> fname_inp = {};
 };
 
 void whisper_print_usage(int argc, char ** argv, const whisper_params & params);
@@ -22,9 +29,11 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
             whisper_print_usage(argc, argv, params);
             exit(0);
         }
-        else if (arg == "-t" || arg == "--threads") { params.n_threads = std::stoi(argv[++i]); }
-        else if (arg == "-m" || arg == "--model")   { params.model     = argv[++i]; }
-        else if (arg == "-w" || arg == "--what")    { params.what     = atoi(argv[++i]); }
+        else if (arg == "-t"  || arg == "--threads")     { params.n_threads   = std::stoi(argv[++i]); }
+        else if (arg == "-m"  || arg == "--model")       { params.model       = argv[++i]; }
+        else if (arg == "-ml" || arg == "--model-large") { params.model_large = argv[++i]; }
+        else if (arg == "-f"  || arg == "--file")        { params.fname_inp.emplace_back(argv[++i]); }
+        else if (arg == "-w"  || arg == "--what")        { params.what        = atoi(argv[++i]); }
         else {
             fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
             whisper_print_usage(argc, argv, params);
@@ -43,10 +52,13 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -h,       --help        [default] show this help message and exit\n");
     fprintf(stderr, "  -t N,     --threads N   [%-7d] number of threads to use during computation\n", params.n_threads);
     fprintf(stderr, "  -m FNAME, --model FNAME [%-7s] model path\n",                                  params.model.c_str());
+    fprintf(stderr, "  -ml FNAME,--model-large [%-7s] large model path (model cascade)\n",                params.model_large.c_str());
+    fprintf(stderr, "  -f FNAME, --file FNAME  [%-7s] input WAV file (model cascade, default: samples/jfk.wav)\n", "");
     fprintf(stderr, "  -w N,     --what N      [%-7d] what to benchmark:\n",                          params.what);
     fprintf(stderr, "                           %-7s  0 - whisper encoder\n",                         "");
     fprintf(stderr, "                           %-7s  1 - memcpy\n",                                  "");
     fprintf(stderr, "                           %-7s  2 - ggml_mul_mat\n",                            "");
+    fprintf(stderr, "                           %-7s  3 - model cascade\n",                           "");
     fprintf(stderr, "\n");
 }
 
@@ -93,6 +105,84 @@ int whisper_bench_encoder(const whisper_params & params) {
     return 0;
 }
 
+// transcribe the files with the large model alone, then with the small model escalating to the large one, and
+// report the share of escalated windows + the throughput of both setups
+int whisper_bench_cascade(const whisper_params & params) {
+    if (params.model_large.empty()) {
+        fprintf(stderr, "error: the model cascade benchmark needs a large model (-ml)\n");
+        return 1;
+    }
+
+    struct whisper_context * ctx_small = whisper_init_from_file(params.model.c_str());
+    struct whisper_context * ctx_large = whisper_init_from_file(params.model_large.c_str());
+
+    if (ctx_small == nullptr || ctx_large == nullptr) {
+        fprintf(stderr, "error: failed to initialize whisper context\n");
+        return 2;
+    }
+
+    const std::vector<std::string> fname_inp = params.fname_inp.empty() ? std::vector<std::string>{ "samples/jfk.wav" } : params.fname_inp;
+
+    double t_audio_s   = 0.0;
+    double t_large_s   = 0.0;
+    double t_cascade_s = 0.0;
+
+    for (const auto & fname : fname_inp) {
+        std::vector<float> pcmf32;
+        std::vector<std::vector<float>> pcmf32s;
+
+        if (!::read_wav(fname, pcmf32, pcmf32s, false)) {
+            fprintf(stderr, "error: failed to read WAV file '%s'\n", fname.c_str());
+            return 3;
+        }
+
+        whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+        wparams.print_progress   = false;
+        wparams.print_timestamps = false;
+        wparams.n_threads        = params.n_threads;
+
+        const auto t_start = std::chrono::high_resolution_clock::now();
+
+        if (whisper_full(ctx_large, wparams, pcmf32.data(), pcmf32.size()) != 0) {
+            fprintf(stderr, "error: failed to process '%s'\n", fname.c_str());
+            return 4;
+        }
+
+        const auto t_mid = std::chrono::high_resolution_clock::now();
+
+        wparams.cascade.ctx_large = ctx_large;
+
+        if (whisper_full(ctx_small, wparams, pcmf32.data(), pcmf32.size()) != 0) {
+            fprintf(stderr, "error: failed to process '%s'\n", fname.c_str());
+            return 4;
+        }
+
+        const auto t_end = std::chrono::high_resolution_clock::now();
+
+        t_audio_s   += float(pcmf32.size())/WHISPER_SAMPLE_RATE;
+        t_large_s   += std::chrono::duration<double>(t_mid - t_start).count();
+        t_cascade_s += std::chrono::duration<double>(t_end - t_mid).count();
+    }
+
+    whisper_print_timings(ctx_small);
+
+    // the counters of the cascade add up over the files
+    const whisper_timings timings = whisper_get_timings(ctx_small);
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s: %d files, %.1f s of audio, n_threads = %d\n", __func__, (int) fname_inp.size(), t_audio_s, params.n_threads);
+    fprintf(stderr, "%s: windows escalated = %d / %d (%.1f%%)\n", __func__, timings.n_cascade_escalated, timings.n_cascade, timings.n_cascade > 0 ? 100.0*timings.n_cascade_escalated/timings.n_cascade : 0.0);
+    fprintf(stderr, "%s: large model   = %8.2f s (%6.2fx real-time)\n", __func__, t_large_s,   t_audio_s/t_large_s);
+    fprintf(stderr, "%s: model cascade = %8.2f s (%6.2fx real-time)\n", __func__, t_cascade_s, t_audio_s/t_cascade_s);
+    fprintf(stderr, "%s: throughput gain = %.2fx\n", __func__, t_large_s/t_cascade_s);
+
+    whisper_free(ctx_small);
+    whisper_free(ctx_large);
+
+    return 0;
+}
+
 int main(int argc, char ** argv) {
     whisper_params params;
 
@@ -106,6 +196,7 @@ int main(int argc, char ** argv) {
         case 0: ret = whisper_bench_encoder(params);                break;
         case 1: ret = whisper_bench_memcpy(params.n_threads);       break;
         case 2: ret = whisper_bench_ggml_mul_mat(params.n_threads); break;
+        case 3: ret = whisper_bench_cascade(params);                break;
         default: fprintf(stderr, "error: unknown benchmark: %d\n", params.what); break;
     }
 
@@ -216,27 +216,31 @@ int process_command_list(struct whisper_context * ctx, audio_async &audio, const
 
     for (const auto & cmd : allowed_commands) {
         whisper_token tokens[1024];
-        allowed_tokens.emplace_back();
 
-        for (int l = 0; l < (int) cmd.size(); ++l) {
-            // NOTE: very important to add the whitespace !
-            //       the reason is that the first decoded token starts with a whitespace too!
-            std::string ss = std::string(" ") + cmd.substr(0, l + 1);
+        // NOTE: very important to add the whitespace !
+        //       the reason is that the first decoded token starts with a whitespace too!
+        const std::string ss = std::string(" ") + cmd;
 
-            const int n = whisper_tokenize(ctx, ss.c_str(), tokens, 1024);
-            if (n < 0) {
-                fprintf(stderr, "%s: error: failed to tokenize command '%s'\n", __func__, cmd.c_str());
-                return 3;
-            }
-
-            if (n == 1) {
-                allowed_tokens.back().push_back(tokens[0]);
-            }
+        const int n = whisper_tokenize(ctx, ss.c_str(), tokens, 1024);
+        if (n <= 0) {
+            fprintf(stderr, "%s: error: failed to tokenize command '%s'\n", __func__, cmd.c_str());
+            return 3;
         }
 
+        allowed_tokens.emplace_back(tokens, tokens + n);
+
         max_len = std::max(max_len, (int) cmd.size());
     }
 
+    // the decoder is constrained to the token sequences of the commands
+    std::vector<const whisper_token *> allowed_tokens_ptr;
+    std::vector<int>                   allowed_tokens_n;
+
+    for (const auto & tokens : allowed_tokens) {
+        allowed_tokens_ptr.push_back(tokens.data());
+        allowed_tokens_n.push_back(tokens.size());
+    }
+
     fprintf(stderr, "%s: allowed commands [ tokens ]:\n", __func__);
     fprintf(stderr, "\n");
     for (int i = 0; i < (int) allowed_commands.size(); ++i) {
@@ -309,7 +313,6 @@ int process_command_list(struct whisper_context * ctx, audio_async &audio, const
             wparams.translate        = params.translate;
             wparams.no_context       = true;
             wparams.single_segment   = true;
-            wparams.max_tokens       = 1;
             wparams.language         = params.language.c_str();
             wparams.n_threads        = params.n_threads;
 
@@ -319,87 +322,70 @@ int process_command_list(struct whisper_context * ctx, audio_async &audio, const
             wparams.prompt_tokens    = k_tokens.data();
             wparams.prompt_n_tokens  = k_tokens.size();
 
-            // run the transformer and a single decoding pass
+            wparams.constraint.tokens      = allowed_tokens_ptr.data();
+            wparams.constraint.n_tokens    = allowed_tokens_n.data();
+            wparams.constraint.n_sequences = allowed_tokens.size();
+
+            // run the transformer and decode one of the commands
             if (whisper_full(ctx, wparams, pcmf32_cur.data(), pcmf32_cur.size()) != 0) {
                 fprintf(stderr, "%s: ERROR: whisper_full() failed\n", __func__);
                 break;
             }
 
-            // estimate command probability
-            // NOTE: not optimal
+            // find the decoded command - the probability of the command is the product of the probabilities of its tokens
             {
-                const auto * logits = whisper_get_logits(ctx);
-
-                std::vector<float> probs(whisper_n_vocab(ctx), 0.0f);
+                std::vector<whisper_token_data> tokens;
 
-                // compute probs from logits via softmax
-                {
-                    float max = -1e9;
-                    for (int i = 0; i < (int) probs.size(); ++i) {
-                        max = std::max(max, logits[i]);
+                if (whisper_full_n_segments(ctx) > 0) {
+                    for (int j = 0; j < whisper_full_n_tokens(ctx, 0); ++j) {
+                        const auto token = whisper_full_get_token_data(ctx, 0, j);
+                        if (token.id < whisper_token_eot(ctx)) {
+                            tokens.push_back(token);
+                        }
                     }
+                }
 
-                    float sum = 0.0f;
-                    for (int i = 0; i < (int) probs.size(); ++i) {
-                        probs[i] = expf(logits[i] - max);
-                        sum += probs[i];
+                int index = -1;
+                for (int i = 0; i < (int) allowed_tokens.size(); ++i) {
+                    if (allowed_tokens[i].size() != tokens.size()) {
+                        continue;
                     }
 
-                    for (int i = 0; i < (int) probs.size(); ++i) {
-                        probs[i] /= sum;
+                    bool match = true;
+                    for (int j = 0; j < (int) tokens.size(); ++j) {
+                        match = match && allowed_tokens[i][j] == tokens[j].id;
                     }
-                }
-
-                std::vector<std::pair<float, int>> probs_id;
 
-                double psum = 0.0;
-                for (int i = 0; i < (int) allowed_commands.size(); ++i) {
-                    probs_id.emplace_back(probs[allowed_tokens[i][0]], i);
-                    for (int j = 1; j < (int) allowed_tokens[i].size(); ++j) {
-                        probs_id.back().first += probs[allowed_tokens[i][j]];
+                    if (match) {
+                        index = i;
+                        break;
                     }
-                    probs_id.back().first /= allowed_tokens[i].size();
-                    psum += probs_id.back().first;
                 }
 
-                // normalize
-                for (auto & p : probs_id) {
-                    p.first /= psum;
-                }
+                const auto t_end = std::chrono::high_resolution_clock::now();
 
-                // sort descending
-                {
-                    using pair_type = decltype(probs_id)::value_type;
-                    std::sort(probs_id.begin(), probs_id.end(), [](const pair_type & a, const pair_type & b) {
-                        return a.first > b.first;
-                    });
-                }
+                if (index < 0) {
+                    fprintf(stdout, "%s: no command detected | t = %d ms\n", __func__,
+                            (int) std::chrono::duration_cast<std::chrono::milliseconds>(t_end - t_start).count());
+                } else {
+                    float prob = 1.0f;
 
-                // print the commands and the respective probabilities
-                {
+                    // print the tokens of the command and the respective probabilities
                     fprintf(stdout, "\n");
-                    for (const auto & cmd : probs_id) {
-                        fprintf(stdout, "%s: %s%-*s%s = %f | ", __func__, "\033[1m", max_len, allowed_commands[cmd.second].c_str(), "\033[0m", cmd.first);
-                        for (int token : allowed_tokens[cmd.second]) {
-                            fprintf(stdout, "'%4s' %f ", whisper_token_to_str(ctx, token), probs[token]);
-                        }
-                        fprintf(stdout, "\n");
+                    fprintf(stdout, "%s: %s%-*s%s | ", __func__, "\033[1m", max_len, allowed_commands[index].c_str(), "\033[0m");
+                    for (const auto & token : tokens) {
+                        fprintf(stdout, "'%4s' %f ", whisper_token_to_str(ctx, token.id), token.p);
+                        prob *= token.p;
                     }
-                }
-
-                // best command
-                {
-                    const auto t_end = std::chrono::high_resolution_clock::now();
-
-                    const float prob = probs_id[0].first;
-                    const int index = probs_id[0].second;
+                    fprintf(stdout, "\n");
 
+                    // best command
                     fprintf(stdout, "\n");
                     fprintf(stdout, "%s: detected command: %s%s%s | p = %f | t = %d ms\n", __func__,
                             "\033[1m", allowed_commands[index].c_str(), "\033[0m", prob,
                             (int) std::chrono::duration_cast<std::chrono::milliseconds>(t_end - t_start).count());
-                    fprintf(stdout, "\n");
                 }
+                fprintf(stdout, "\n");
             }
 
             audio.clear();
@@ -2,9 +2,15 @@
 
 #include "whisper.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
 #include <cstdio>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <vector>
@@ -56,6 +62,8 @@ void replace_all(std::string & s, const std::string & search, const std::string
 struct whisper_params {
     int32_t n_threads    = std::min(4, (int32_t) std::thread::hardware_concurrency());
     int32_t n_processors =  1;
+    int32_t n_chunks     =  0;
+    int32_t overlap_ms   =  0;
     int32_t offset_t_ms  =  0;
     int32_t offset_n     =  0;
     int32_t duration_ms  =  0;
@@ -64,13 +72,22 @@ struct whisper_params {
     int32_t max_len      =  0;
     int32_t best_of      =  2;
     int32_t beam_size    = -1;
-
-    float word_thold    =  0.01f;
-    float entropy_thold =  2.40f;
-    float logprob_thold = -1.00f;
+    float   beam_patience = -1.0f;
+    int32_t n_draft      =  4;
+    int32_t n_fallback_parallel = 0;
+    int32_t n_batch_workers = 0;
+    int32_t n_decode_batch  = 0;
+
+    float word_thold      =  0.01f;
+    float entropy_thold   =  2.40f;
+    float logprob_thold   = -1.00f;
+    float no_speech_thold =  0.60f;
+    float vad_thold       = 10.00f;
 
     bool speed_up        = false;
     bool debug_mode      = false;
+    bool flash_attn      = false;
+    bool vad             = false;
     bool translate       = false;
     bool detect_language = false;
     bool diarize         = false;
@@ -94,6 +111,7 @@ struct whisper_params {
     std::string prompt;
     std::string font_path = "/System/Library/Fonts/Supplemental/Courier New Bold.ttf";
     std::string model     = "models/ggml-base.en.bin";
+    std::string model_draft;
 
     // [TDRZ] speaker turn string
     std::string tdrz_speaker_turn = " [SPEAKER_TURN]"; // TODO: set from command line
@@ -126,6 +144,10 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
         }
         else if (arg == "-t"    || arg == "--threads")         { params.n_threads       = std::stoi(argv[++i]); }
         else if (arg == "-p"    || arg == "--processors")      { params.n_processors    = std::stoi(argv[++i]); }
+        else if (arg == "-pch"  || arg == "--par-chunks")      { params.n_chunks        = std::stoi(argv[++i]); }
+        else if (arg == "-po"   || arg == "--par-overlap")     { params.overlap_ms      = std::stoi(argv[++i]); }
+        else if (arg == "-bw"   || arg == "--batch-workers")   { params.n_batch_workers = std::stoi(argv[++i]); }
+        else if (arg == "-db"   || arg == "--decode-batch")    { params.n_decode_batch  = std::stoi(argv[++i]); }
         else if (arg == "-ot"   || arg == "--offset-t")        { params.offset_t_ms     = std::stoi(argv[++i]); }
         else if (arg == "-on"   || arg == "--offset-n")        { params.offset_n        = std::stoi(argv[++i]); }
         else if (arg == "-d"    || arg == "--duration")        { params.duration_ms     = std::stoi(argv[++i]); }
@@ -133,16 +155,22 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
         else if (arg == "-ml"   || arg == "--max-len")         { params.max_len         = std::stoi(argv[++i]); }
         else if (arg == "-bo"   || arg == "--best-of")         { params.best_of         = std::stoi(argv[++i]); }
         else if (arg == "-bs"   || arg == "--beam-size")       { params.beam_size       = std::stoi(argv[++i]); }
+        else if (arg == "-bp"   || arg == "--beam-patience")   { params.beam_patience   = std::stof(argv[++i]); }
         else if (arg == "-wt"   || arg == "--word-thold")      { params.word_thold      = std::stof(argv[++i]); }
         else if (arg == "-et"   || arg == "--entropy-thold")   { params.entropy_thold   = std::stof(argv[++i]); }
         else if (arg == "-lpt"  || arg == "--logprob-thold")   { params.logprob_thold   = std::stof(argv[++i]); }
+        else if (arg == "-nth"  || arg == "--no-speech-thold") { params.no_speech_thold = std::stof(argv[++i]); }
         // else if (arg == "-su"   || arg == "--speed-up")        { params.speed_up        = true; }
         else if (arg == "-debug"|| arg == "--debug-mode")      { params.debug_mode      = true; }
+        else if (arg == "-fa"   || arg == "--flash-attn")      { params.flash_attn      = true; }
+        else if (arg == "-vad"  || arg == "--vad")             { params.vad             = true; }
+        else if (arg == "-vt"   || arg == "--vad-thold")       { params.vad_thold       = std::stof(argv[++i]); }
         else if (arg == "-tr"   || arg == "--translate")       { params.translate       = true; }
         else if (arg == "-di"   || arg == "--diarize")         { params.diarize         = true; }
         else if (arg == "-tdrz" || arg == "--tinydiarize")     { params.tinydiarize     = true; }
         else if (arg == "-sow"  || arg == "--split-on-word")   { params.split_on_word   = true; }
         else if (arg == "-nf"   || arg == "--no-fallback")     { params.no_fallback     = true; }
+        else if (arg == "-pf"   || arg == "--par-fallback")    { params.n_fallback_parallel = std::stoi(argv[++i]); }
         else if (arg == "-otxt" || arg == "--output-txt")      { params.output_txt      = true; }
         else if (arg == "-ovtt" || arg == "--output-vtt")      { params.output_vtt      = true; }
         else if (arg == "-osrt" || arg == "--output-srt")      { params.output_srt      = true; }
@@ -160,6 +188,8 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
         else if (arg == "-dl"   || arg == "--detect-language") { params.detect_language = true; }
         else if (                  arg == "--prompt")          { params.prompt          = argv[++i]; }
         else if (arg == "-m"    || arg == "--model")           { params.model           = argv[++i]; }
+        else if (arg == "-md"   || arg == "--model-draft")     { params.model_draft     = argv[++i]; }
+        else if (arg == "-nd"   || arg == "--n-draft")         { params.n_draft         = std::stoi(argv[++i]); }
         else if (arg == "-f"    || arg == "--file")            { params.fname_inp.emplace_back(argv[++i]); }
         else if (arg == "-oved" || arg == "--ov-e-device")     { params.openvino_encode_device = argv[++i]; }
         else if (arg == "-ls"   || arg == "--log-score")       { params.log_score = true; }
@@ -181,6 +211,10 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -h,        --help              [default] show this help message and exit\n");
     fprintf(stderr, "  -t N,      --threads N         [%-7d] number of threads to use during computation\n",    params.n_threads);
     fprintf(stderr, "  -p N,      --processors N      [%-7d] number of processors to use during computation\n", params.n_processors);
+    fprintf(stderr, "  -pch N,    --par-chunks N      [%-7d] number of audio chunks for the processors (0 = one per processor)\n", params.n_chunks);
+    fprintf(stderr, "  -po N,     --par-overlap N     [%-7d] overlap of the audio chunks in milliseconds\n", params.overlap_ms);
+    fprintf(stderr, "  -bw N,     --batch-workers N   [%-7d] number of files transcribed at once, -t threads each (0 = one by one)\n", params.n_batch_workers);
+    fprintf(stderr, "  -db N,     --decode-batch N    [%-7d] max decoder steps of the workers and decoders evaluated at once (0 = off)\n", params.n_decode_batch);
     fprintf(stderr, "  -ot N,     --offset-t N        [%-7d] time offset in milliseconds\n",                    params.offset_t_ms);
     fprintf(stderr, "  -on N,     --offset-n N        [%-7d] segment index offset\n",                           params.offset_n);
     fprintf(stderr, "  -d  N,     --duration N        [%-7d] duration of audio to process in milliseconds\n",   params.duration_ms);
@@ -189,15 +223,21 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -sow,      --split-on-word     [%-7s] split on word rather than on token\n",             params.split_on_word ? "true" : "false");
     fprintf(stderr, "  -bo N,     --best-of N         [%-7d] number of best candidates to keep\n",              params.best_of);
     fprintf(stderr, "  -bs N,     --beam-size N       [%-7d] beam size for beam search\n",                      params.beam_size);
+    fprintf(stderr, "  -bp N,     --beam-patience N   [%-7.2f] stop beam search after beam size * N completed beams (N <= 1)\n", params.beam_patience);
     fprintf(stderr, "  -wt N,     --word-thold N      [%-7.2f] word timestamp probability threshold\n",         params.word_thold);
     fprintf(stderr, "  -et N,     --entropy-thold N   [%-7.2f] entropy threshold for decoder fail\n",           params.entropy_thold);
     fprintf(stderr, "  -lpt N,    --logprob-thold N   [%-7.2f] log probability threshold for decoder fail\n",   params.logprob_thold);
+    fprintf(stderr, "  -nth N,    --no-speech-thold N [%-7.2f] no speech probability threshold to skip a window\n", params.no_speech_thold);
     // fprintf(stderr, "  -su,       --speed-up          [%-7s] speed up audio by x2 (reduced accuracy)\n",        params.speed_up ? "true" : "false");
     fprintf(stderr, "  -debug,    --debug-mode        [%-7s] enable debug mode (eg. dump log_mel)\n",           params.debug_mode ? "true" : "false");
+    fprintf(stderr, "  -fa,       --flash-attn        [%-7s] use the tiled flash attention kernel\n",           params.flash_attn ? "true" : "false");
+    fprintf(stderr, "  -vad,      --vad               [%-7s] decode only the speech regions of the audio\n",    params.vad ? "true" : "false");
+    fprintf(stderr, "  -vt N,     --vad-thold N       [%-7.2f] speech level above the noise floor in dB\n",     params.vad_thold);
     fprintf(stderr, "  -tr,       --translate         [%-7s] translate from source language to english\n",      params.translate ? "true" : "false");
     fprintf(stderr, "  -di,       --diarize           [%-7s] stereo audio diarization\n",                       params.diarize ? "true" : "false");
     fprintf(stderr, "  -tdrz,     --tinydiarize       [%-7s] enable tinydiarize (requires a tdrz model)\n",     params.tinydiarize ? "true" : "false");
     fprintf(stderr, "  -nf,       --no-fallback       [%-7s] do not use temperature fallback while decoding\n", params.no_fallback ? "true" : "false");
+    fprintf(stderr, "  -pf N,     --par-fallback N    [%-7d] number of fallback temperatures decoded in parallel\n", params.n_fallback_parallel);
     fprintf(stderr, "  -otxt,     --output-txt        [%-7s] output result in a text file\n",                   params.output_txt ? "true" : "false");
     fprintf(stderr, "  -ovtt,     --output-vtt        [%-7s] output result in a vtt file\n",                    params.output_vtt ? "true" : "false");
     fprintf(stderr, "  -osrt,     --output-srt        [%-7s] output result in a srt file\n",                    params.output_srt ? "true" : "false");
@@ -215,6 +255,8 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -dl,       --detect-language   [%-7s] exit after automatically detecting language\n",    params.detect_language ? "true" : "false");
     fprintf(stderr, "             --prompt PROMPT     [%-7s] initial prompt\n",                                 params.prompt.c_str());
     fprintf(stderr, "  -m FNAME,  --model FNAME       [%-7s] model path\n",                                     params.model.c_str());
+    fprintf(stderr, "  -md FNAME, --model-draft FNAME [%-7s] draft model path for speculative greedy decoding\n", params.model_draft.c_str());
+    fprintf(stderr, "  -nd N,     --n-draft N         [%-7d] number of tokens to draft per step\n",            params.n_draft);
     fprintf(stderr, "  -f FNAME,  --file FNAME        [%-7s] input WAV file path\n",                            "");
     fprintf(stderr, "  -oved D,   --ov-e-device DNAME [%-7s] the OpenVINO device used for encode inference\n",  params.openvino_encode_device.c_str());
     fprintf(stderr, "  -ls,       --log-score         [%-7s] log best decoder scores of tokens\n",              params.log_score?"true":"false");
@@ -269,11 +311,11 @@ void whisper_print_progress_callback(struct whisper_context * ctx, struct whispe
     }
 }
 
-void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * /*state*/, int n_new, void * user_data) {
+void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data) {
     const auto & params  = *((whisper_print_user_data *) user_data)->params;
     const auto & pcmf32s = *((whisper_print_user_data *) user_data)->pcmf32s;
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
 
     std::string speaker = "";
 
@@ -289,8 +331,8 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
 
     for (int i = s0; i < n_segments; i++) {
         if (!params.no_timestamps || params.diarize) {
-            t0 = whisper_full_get_segment_t0(ctx, i);
-            t1 = whisper_full_get_segment_t1(ctx, i);
+            t0 = whisper_full_get_segment_t0_from_state(state, i);
+            t1 = whisper_full_get_segment_t1_from_state(state, i);
         }
 
         if (!params.no_timestamps) {
@@ -302,29 +344,29 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
         }
 
         if (params.print_colors) {
-            for (int j = 0; j < whisper_full_n_tokens(ctx, i); ++j) {
+            for (int j = 0; j < whisper_full_n_tokens_from_state(state, i); ++j) {
                 if (params.print_special == false) {
-                    const whisper_token id = whisper_full_get_token_id(ctx, i, j);
+                    const whisper_token id = whisper_full_get_token_id_from_state(state, i, j);
                     if (id >= whisper_token_eot(ctx)) {
                         continue;
                     }
                 }
 
-                const char * text = whisper_full_get_token_text(ctx, i, j);
-                const float  p    = whisper_full_get_token_p   (ctx, i, j);
+                const char * text = whisper_full_get_token_text_from_state(ctx, state, i, j);
+                const float  p    = whisper_full_get_token_p_from_state(state, i, j);
 
                 const int col = std::max(0, std::min((int) k_colors.size() - 1, (int) (std::pow(p, 3)*float(k_colors.size()))));
 
                 printf("%s%s%s%s", speaker.c_str(), k_colors[col].c_str(), text, "\033[0m");
             }
         } else {
-            const char * text = whisper_full_get_segment_text(ctx, i);
+            const char * text = whisper_full_get_segment_text_from_state(state, i);
 
             printf("%s%s", speaker.c_str(), text);
         }
 
         if (params.tinydiarize) {
-            if (whisper_full_get_segment_speaker_turn_next(ctx, i)) {
+            if (whisper_full_get_segment_speaker_turn_next_from_state(state, i)) {
                 printf("%s", params.tdrz_speaker_turn.c_str());
             }
         }
@@ -338,7 +380,7 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
     }
 }
 
-bool output_txt(struct whisper_context * ctx, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
+bool output_txt(struct whisper_context * /*ctx*/, struct whisper_state * state, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
     std::ofstream fout(fname);
     if (!fout.is_open()) {
         fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
@@ -347,15 +389,15 @@ bool output_txt(struct whisper_context * ctx, const char * fname, const whisper_
 
     fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
     for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
+        const char * text = whisper_full_get_segment_text_from_state(state, i);
         std::string speaker = "";
 
         if (params.diarize && pcmf32s.size() == 2)
         {
-            const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-            const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+            const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+            const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
             speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
         }
 
@@ -365,7 +407,7 @@ bool output_txt(struct whisper_context * ctx, const char * fname, const whisper_
     return true;
 }
 
-bool output_vtt(struct whisper_context * ctx, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
+bool output_vtt(struct whisper_context * /*ctx*/, struct whisper_state * state, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
     std::ofstream fout(fname);
     if (!fout.is_open()) {
         fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
@@ -376,11 +418,11 @@ bool output_vtt(struct whisper_context * ctx, const char * fname, const whisper_
 
     fout << "WEBVTT\n\n";
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
     for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-        const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+        const char * text = whisper_full_get_segment_text_from_state(state, i);
+        const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+        const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
         std::string speaker = "";
 
         if (params.diarize && pcmf32s.size() == 2)
@@ -397,7 +439,7 @@ bool output_vtt(struct whisper_context * ctx, const char * fname, const whisper_
     return true;
 }
 
-bool output_srt(struct whisper_context * ctx, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
+bool output_srt(struct whisper_context * /*ctx*/, struct whisper_state * state, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
     std::ofstream fout(fname);
     if (!fout.is_open()) {
         fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
@@ -406,11 +448,11 @@ bool output_srt(struct whisper_context * ctx, const char * fname, const whisper_
 
     fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
     for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-        const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+        const char * text = whisper_full_get_segment_text_from_state(state, i);
+        const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+        const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
         std::string speaker = "";
 
         if (params.diarize && pcmf32s.size() == 2)
@@ -457,7 +499,7 @@ char *escape_double_quotes_and_backslashes(const char *str) {
     return escaped;
 }
 
-bool output_csv(struct whisper_context * ctx, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
+bool output_csv(struct whisper_context * /*ctx*/, struct whisper_state * state, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
     std::ofstream fout(fname);
     if (!fout.is_open()) {
         fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
@@ -466,7 +508,7 @@ bool output_csv(struct whisper_context * ctx, const char * fname, const whisper_
 
     fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
     fout << "start,end,";
     if (params.diarize && pcmf32s.size() == 2)
     {
@@ -475,9 +517,9 @@ bool output_csv(struct whisper_context * ctx, const char * fname, const whisper_
     fout << "text\n";
 
     for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-        const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+        const char * text = whisper_full_get_segment_text_from_state(state, i);
+        const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+        const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
         char * text_escaped = escape_double_quotes_and_backslashes(text);
 
         //need to multiply times returned from whisper_full_get_segment_t{0,1}() by 10 to get milliseconds.
@@ -492,18 +534,18 @@ bool output_csv(struct whisper_context * ctx, const char * fname, const whisper_
     return true;
 }
 
-bool output_score(struct whisper_context * ctx, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
+bool output_score(struct whisper_context * ctx, struct whisper_state * state, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
     std::ofstream fout(fname);
     fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
     // fprintf(stderr,"segments: %d\n",n_segments);
     for (int i = 0; i < n_segments; ++i) {
-        const int n_tokens = whisper_full_n_tokens(ctx, i);
+        const int n_tokens = whisper_full_n_tokens_from_state(state, i);
         // fprintf(stderr,"tokens: %d\n",n_tokens);
         for (int j = 0; j < n_tokens; j++) {
-            auto token = whisper_full_get_token_text(ctx, i, j);
-            auto probability = whisper_full_get_token_p(ctx, i, j);
+            auto token = whisper_full_get_token_text_from_state(ctx, state, i, j);
+            auto probability = whisper_full_get_token_p_from_state(state, i, j);
             fout << token << '\t' << probability << std::endl;
             // fprintf(stderr,"token: %s %f\n",token,probability);
 	    }
@@ -511,7 +553,7 @@ bool output_score(struct whisper_context * ctx, const char * fname, const whispe
     return true;
 }
 
-bool output_json(struct whisper_context * ctx, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
+bool output_json(struct whisper_context * ctx, struct whisper_state * state, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
     std::ofstream fout(fname);
     int indent = 0;
 
@@ -608,16 +650,16 @@ bool output_json(struct whisper_context * ctx, const char * fname, const whisper
             value_b("translate", params.translate, true);
         end_obj(false);
         start_obj("result");
-            value_s("language", whisper_lang_str(whisper_full_lang_id(ctx)), true);
+            value_s("language", whisper_lang_str(whisper_full_lang_id_from_state(state)), true);
         end_obj(false);
         start_arr("transcription");
 
-            const int n_segments = whisper_full_n_segments(ctx);
+            const int n_segments = whisper_full_n_segments_from_state(state);
             for (int i = 0; i < n_segments; ++i) {
-                const char * text = whisper_full_get_segment_text(ctx, i);
+                const char * text = whisper_full_get_segment_text_from_state(state, i);
 
-                const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-                const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+                const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+                const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
 
                 start_obj(nullptr);
                     start_obj("timestamps");
@@ -635,7 +677,7 @@ bool output_json(struct whisper_context * ctx, const char * fname, const whisper
                     }
 
                     if (params.tinydiarize) {
-                        value_b("speaker_turn_next", whisper_full_get_segment_speaker_turn_next(ctx, i), true);
+                        value_b("speaker_turn_next", whisper_full_get_segment_speaker_turn_next_from_state(state, i), true);
                     }
                 end_obj(i == (n_segments - 1));
             }
@@ -648,7 +690,7 @@ bool output_json(struct whisper_context * ctx, const char * fname, const whisper
 // karaoke video generation
 // outputs a bash script that uses ffmpeg to generate a video with the subtitles
 // TODO: font parameter adjustments
-bool output_wts(struct whisper_context * ctx, const char * fname, const char * fname_inp, const whisper_params & params, float t_sec, std::vector<std::vector<float>> pcmf32s) {
+bool output_wts(struct whisper_context * ctx, struct whisper_state * state, const char * fname, const char * fname_inp, const whisper_params & params, float t_sec, std::vector<std::vector<float>> pcmf32s) {
     std::ofstream fout(fname);
 
     fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
@@ -666,15 +708,15 @@ bool output_wts(struct whisper_context * ctx, const char * fname, const char * f
 
     fout << "ffmpeg -i " << fname_inp << " -f lavfi -i color=size=1200x120:duration=" << t_sec << ":rate=25:color=black -vf \"";
 
-    for (int i = 0; i < whisper_full_n_segments(ctx); i++) {
-        const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-        const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+    for (int i = 0; i < whisper_full_n_segments_from_state(state); i++) {
+        const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+        const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
 
-        const int n = whisper_full_n_tokens(ctx, i);
+        const int n = whisper_full_n_tokens_from_state(state, i);
 
         std::vector<whisper_token_data> tokens(n);
         for (int j = 0; j < n; ++j) {
-            tokens[j] = whisper_full_get_token_data(ctx, i, j);
+            tokens[j] = whisper_full_get_token_data_from_state(state, i, j);
         }
 
         if (i > 0) {
@@ -773,7 +815,7 @@ bool output_wts(struct whisper_context * ctx, const char * fname, const char * f
     return true;
 }
 
-bool output_lrc(struct whisper_context * ctx, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
+bool output_lrc(struct whisper_context * /*ctx*/, struct whisper_state * state, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
     std::ofstream fout(fname);
     if (!fout.is_open()) {
         fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
@@ -784,10 +826,10 @@ bool output_lrc(struct whisper_context * ctx, const char * fname, const whisper_
 
     fout << "[by:whisper.cpp]\n";
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
     for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        const int64_t t = whisper_full_get_segment_t0(ctx, i);
+        const char * text = whisper_full_get_segment_text_from_state(state, i);
+        const int64_t t = whisper_full_get_segment_t0_from_state(state, i);
 
         int64_t msec = t * 10;
         int64_t min = msec / (1000 * 60);
@@ -802,8 +844,8 @@ bool output_lrc(struct whisper_context * ctx, const char * fname, const whisper_
 
         if (params.diarize && pcmf32s.size() == 2)
         {
-            const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-            const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+            const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+            const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
             speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
         }
 
@@ -813,6 +855,292 @@ bool output_lrc(struct whisper_context * ctx, const char * fname, const whisper_
     return true;
 }
 
+whisper_full_params whisper_full_params_from(const whisper_params & params, struct whisper_context * ctx_draft) {
+    whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+    wparams.strategy = params.beam_size > 1 ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY;
+
+    wparams.print_realtime   = false;
+    wparams.print_progress   = params.print_progress;
+    wparams.print_timestamps = !params.no_timestamps;
+    wparams.print_special    = params.print_special;
+    wparams.translate        = params.translate;
+    wparams.language         = params.language.c_str();
+    wparams.detect_language  = params.detect_language;
+    wparams.n_threads        = params.n_threads;
+    wparams.n_max_text_ctx   = params.max_context >= 0 ? params.max_context : wparams.n_max_text_ctx;
+    wparams.offset_ms        = params.offset_t_ms;
+    wparams.duration_ms      = params.duration_ms;
+
+    wparams.token_timestamps = params.output_wts || params.max_len > 0;
+    wparams.thold_pt         = params.word_thold;
+    wparams.max_len          = params.output_wts && params.max_len == 0 ? 60 : params.max_len;
+    wparams.split_on_word    = params.split_on_word;
+
+    wparams.speed_up         = params.speed_up;
+    wparams.debug_mode       = params.debug_mode;
+    wparams.flash_attn       = params.flash_attn;
+
+    wparams.vad.enable       = params.vad;
+    wparams.vad.thold        = params.vad_thold;
+
+    wparams.tdrz_enable      = params.tinydiarize; // [TDRZ]
+
+    wparams.initial_prompt   = params.prompt.c_str();
+
+    wparams.greedy.best_of        = params.best_of;
+    wparams.beam_search.beam_size = params.beam_size;
+    wparams.beam_search.patience  = params.beam_patience;
+
+    wparams.speculative.ctx_draft = ctx_draft;
+    wparams.speculative.n_draft   = params.n_draft;
+
+    wparams.temperature_inc  = params.no_fallback ? 0.0f : wparams.temperature_inc;
+    wparams.n_fallback_parallel = params.n_fallback_parallel;
+    wparams.entropy_thold    = params.entropy_thold;
+    wparams.logprob_thold    = params.logprob_thold;
+    wparams.no_speech_thold  = params.no_speech_thold;
+
+    wparams.parallel.n_chunks   = params.n_chunks;
+    wparams.parallel.overlap_ms = params.overlap_ms;
+
+    return wparams;
+}
+
+void output_results(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+               const std::string & fname_inp,
+               const std::string & fname_out,
+            const whisper_params & params,
+        const std::vector<float> & pcmf32,
+        const std::vector<std::vector<float>> & pcmf32s) {
+    printf("\n");
+
+    // output to text file
+    if (params.output_txt) {
+        const auto fname_txt = fname_out + ".txt";
+        output_txt(ctx, state, fname_txt.c_str(), params, pcmf32s);
+    }
+
+    // output to VTT file
+    if (params.output_vtt) {
+        const auto fname_vtt = fname_out + ".vtt";
+        output_vtt(ctx, state, fname_vtt.c_str(), params, pcmf32s);
+    }
+
+    // output to SRT file
+    if (params.output_srt) {
+        const auto fname_srt = fname_out + ".srt";
+        output_srt(ctx, state, fname_srt.c_str(), params, pcmf32s);
+    }
+
+    // output to WTS file
+    if (params.output_wts) {
+        const auto fname_wts = fname_out + ".wts";
+        output_wts(ctx, state, fname_wts.c_str(), fname_inp.c_str(), params, float(pcmf32.size() + 1000)/WHISPER_SAMPLE_RATE, pcmf32s);
+    }
+
+    // output to CSV file
+    if (params.output_csv) {
+        const auto fname_csv = fname_out + ".csv";
+        output_csv(ctx, state, fname_csv.c_str(), params, pcmf32s);
+    }
+
+    // output to JSON file
+    if (params.output_jsn) {
+        const auto fname_jsn = fname_out + ".json";
+        output_json(ctx, state, fname_jsn.c_str(), params, pcmf32s);
+    }
+
+    // output to LRC file
+    if (params.output_lrc) {
+        const auto fname_lrc = fname_out + ".lrc";
+        output_lrc(ctx, state, fname_lrc.c_str(), params, pcmf32s);
+    }
+
+    // output to score file
+    if (params.log_score) {
+        const auto fname_score = fname_out + ".score.txt";
+        output_score(ctx, state, fname_score.c_str(), params, pcmf32s);
+    }
+}
+
+// a file of the batch, with its audio once it has been read
+struct batch_job {
+    std::string fname_inp;
+    std::string fname_out;
+
+    size_t size = 0; // file size, used as an estimate of the duration
+
+    std::vector<float> pcmf32;
+    std::vector<std::vector<float>> pcmf32s;
+};
+
+// transcribe the input files with n_batch_workers states of the same context
+//
+// the longest files are started first so that the workers finish at about the same time, and a
+// prefetch thread reads the audio of the next files while the workers are busy
+// with a draft model, each transcription takes a state of ctx_draft from its pool
+// returns the number of files that failed
+int run_batch(struct whisper_context * ctx, struct whisper_context * ctx_draft, const whisper_params & params) {
+    const int n_workers = params.n_batch_workers;
+
+    std::vector<batch_job> jobs(params.fname_inp.size());
+
+    for (int f = 0; f < (int) params.fname_inp.size(); ++f) {
+        jobs[f].fname_inp = params.fname_inp[f];
+        jobs[f].fname_out = f < (int) params.fname_out.size() && !params.fname_out[f].empty() ? params.fname_out[f] : params.fname_inp[f];
+
+        std::ifstream fin(jobs[f].fname_inp, std::ios::binary | std::ios::ate);
+        if (fin) {
+            jobs[f].size = fin.tellg();
+        }
+    }
+
+    std::stable_sort(jobs.begin(), jobs.end(), [](const batch_job & a, const batch_job & b) {
+        return a.size > b.size;
+    });
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "system_info: n_threads = %d / %d | %s\n",
+            params.n_threads*n_workers, std::thread::hardware_concurrency(), whisper_print_system_info());
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s: processing %d files, %d workers, %d threads per worker, lang = %s, task = %s, %stimestamps = %d ...\n",
+            __func__, (int) jobs.size(), n_workers, params.n_threads,
+            params.language.c_str(),
+            params.translate ? "translate" : "transcribe",
+            params.tinydiarize ? "tdrz = 1, " : "",
+            params.no_timestamps ? 0 : 1);
+
+    // files that have been read, waiting for a worker
+    std::mutex              queue_mutex;
+    std::condition_variable queue_cv;
+    std::deque<batch_job *> queue;
+    bool                    queue_done = false;
+
+    const size_t queue_max = 2*n_workers;
+
+    std::mutex print_mutex;
+
+    std::atomic<int>     n_failed(0);
+    std::atomic<int>     n_done(0);
+    std::atomic<int64_t> n_samples(0);
+
+    auto prefetch = [&]() {
+        for (auto & job : jobs) {
+            if (!::read_wav(job.fname_inp, job.pcmf32, job.pcmf32s, params.diarize)) {
+                std::lock_guard<std::mutex> lock(print_mutex);
+                fprintf(stderr, "error: failed to read WAV file '%s'\n", job.fname_inp.c_str());
+                n_failed++;
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queue_cv.wait(lock, [&]() { return queue.size() < queue_max; });
+            queue.push_back(&job);
+            queue_cv.notify_all();
+        }
+
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        queue_done = true;
+        queue_cv.notify_all();
+    };
+
+    auto worker = [&](struct whisper_state * state) {
+        whisper_full_params wparams = whisper_full_params_from(params, ctx_draft);
+
+        while (true) {
+            batch_job * job = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                queue_cv.wait(lock, [&]() { return !queue.empty() || queue_done; });
+                if (queue.empty()) {
+                    break;
+                }
+                job = queue.front();
+                queue.pop_front();
+                queue_cv.notify_all();
+            }
+
+            const auto t0 = std::chrono::high_resolution_clock::now();
+
+            const int ret = whisper_full_with_state(ctx, state, wparams, job->pcmf32.data(), job->pcmf32.size());
+
+            const auto t1 = std::chrono::high_resolution_clock::now();
+
+            {
+                std::lock_guard<std::mutex> lock(print_mutex);
+
+                if (ret != 0) {
+                    fprintf(stderr, "error: failed to process '%s'\n", job->fname_inp.c_str());
+                    n_failed++;
+                } else {
+                    fprintf(stderr, "\nrun_batch: '%s' (%.1f sec) done in %.2f sec\n",
+                            job->fname_inp.c_str(), float(job->pcmf32.size())/WHISPER_SAMPLE_RATE,
+                            std::chrono::duration<double>(t1 - t0).count());
+
+                    whisper_print_user_data user_data = { &params, &job->pcmf32s, 0 };
+                    whisper_print_segment_callback(ctx, state, whisper_full_n_segments_from_state(state), &user_data);
+
+                    output_results(ctx, state, job->fname_inp, job->fname_out, params, job->pcmf32, job->pcmf32s);
+
+                    n_done++;
+                    n_samples += job->pcmf32.size();
+                }
+            }
+
+            // the audio is not needed anymore
+            job->pcmf32  = std::vector<float>();
+            job->pcmf32s = std::vector<std::vector<float>>();
+        }
+    };
+
+    std::vector<struct whisper_state *> states;
+
+    for (int i = 0; i < n_workers; ++i) {
+        struct whisper_state * state = whisper_state_acquire(ctx);
+        if (state == nullptr) {
+            fprintf(stderr, "%s: failed to allocate a state, using %d workers\n", __func__, i);
+            break;
+        }
+
+        states.push_back(state);
+    }
+
+    if (states.empty()) {
+        return jobs.size();
+    }
+
+    const auto t_start = std::chrono::high_resolution_clock::now();
+
+    std::thread prefetch_thread(prefetch);
+
+    std::vector<std::thread> workers;
+    for (auto * state : states) {
+        workers.emplace_back(worker, state);
+    }
+
+    for (auto & w : workers) {
+        w.join();
+    }
+    prefetch_thread.join();
+
+    for (auto * state : states) {
+        whisper_state_release(ctx, state);
+    }
+
+    const double t_sec   = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - t_start).count();
+    const double t_audio = double(n_samples)/WHISPER_SAMPLE_RATE;
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s: %d files in %.2f sec, %d failed | %.2f files/s, %.4f audio hours/s, %.1fx real time\n",
+            __func__, n_done.load(), t_sec, n_failed.load(),
+            n_done/t_sec, t_audio/3600.0/t_sec, t_audio/t_sec);
+
+    return n_failed;
+}
+
 int main(int argc, char ** argv) {
     whisper_params params;
 
@@ -851,6 +1179,54 @@ int main(int argc, char ** argv) {
     // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
     whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
 
+    if (!whisper_is_multilingual(ctx)) {
+        if (params.language != "en" || params.translate) {
+            params.language = "en";
+            params.translate = false;
+            fprintf(stderr, "%s: WARNING: model is not multilingual, ignoring language and translation options\n", __func__);
+        }
+    }
+    if (params.detect_language) {
+        params.language = "auto";
+    }
+
+    if (params.n_decode_batch > 0) {
+        whisper_decode_batching_set(ctx, params.n_decode_batch, 2000);
+    }
+
+    // the draft model for speculative decoding (optional)
+    struct whisper_context * ctx_draft = nullptr;
+
+    if (!params.model_draft.empty()) {
+        ctx_draft = whisper_init_from_file(params.model_draft.c_str());
+
+        if (ctx_draft == nullptr) {
+            fprintf(stderr, "error: failed to initialize whisper context for the draft model\n");
+            return 3;
+        }
+    }
+
+    if (params.n_batch_workers > 0) {
+        if (params.n_processors > 1) {
+            fprintf(stderr, "%s: WARNING: the files of a batch are processed with one processor each, ignoring --processors\n", __func__);
+        }
+
+        // the draft states of the workers are kept between the files
+        if (ctx_draft) {
+            whisper_state_pool_set_max(ctx_draft, params.n_batch_workers);
+        }
+
+        const int n_failed = run_batch(ctx, ctx_draft, params);
+
+        if (ctx_draft) {
+            whisper_free(ctx_draft);
+        }
+
+        whisper_free(ctx);
+
+        return n_failed > 0 ? 10 : 0;
+    }
+
     for (int f = 0; f < (int) params.fname_inp.size(); ++f) {
         const auto fname_inp = params.fname_inp[f];
 		const auto fname_out = f < (int) params.fname_out.size() && !params.fname_out[f].empty() ? params.fname_out[f] : params.fname_inp[f];
@@ -873,16 +1249,6 @@ int main(int argc, char ** argv) {
         // print some info about the processing
         {
             fprintf(stderr, "\n");
-            if (!whisper_is_multilingual(ctx)) {
-                if (params.language != "en" || params.translate) {
-                    params.language = "en";
-                    params.translate = false;
-                    fprintf(stderr, "%s: WARNING: model is not multilingual, ignoring language and translation options\n", __func__);
-                }
-            }
-            if (params.detect_language) {
-                params.language = "auto";
-            }
             fprintf(stderr, "%s: processing '%s' (%d samples, %.1f sec), %d threads, %d processors, lang = %s, task = %s, %stimestamps = %d ...\n",
                     __func__, fname_inp.c_str(), int(pcmf32.size()), float(pcmf32.size())/WHISPER_SAMPLE_RATE,
                     params.n_threads, params.n_processors,
@@ -896,40 +1262,7 @@ int main(int argc, char ** argv) {
 
         // run the inference
         {
-            whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
-
-            wparams.strategy = params.beam_size > 1 ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY;
-
-            wparams.print_realtime   = false;
-            wparams.print_progress   = params.print_progress;
-            wparams.print_timestamps = !params.no_timestamps;
-            wparams.print_special    = params.print_special;
-            wparams.translate        = params.translate;
-            wparams.language         = params.language.c_str();
-            wparams.detect_language  = params.detect_language;
-            wparams.n_threads        = params.n_threads;
-            wparams.n_max_text_ctx   = params.max_context >= 0 ? params.max_context : wparams.n_max_text_ctx;
-            wparams.offset_ms        = params.offset_t_ms;
-            wparams.duration_ms      = params.duration_ms;
-
-            wparams.token_timestamps = params.output_wts || params.max_len > 0;
-            wparams.thold_pt         = params.word_thold;
-            wparams.max_len          = params.output_wts && params.max_len == 0 ? 60 : params.max_len;
-            wparams.split_on_word    = params.split_on_word;
-
-            wparams.speed_up         = params.speed_up;
-            wparams.debug_mode       = params.debug_mode;
-
-            wparams.tdrz_enable      = params.tinydiarize; // [TDRZ]
-
-            wparams.initial_prompt   = params.prompt.c_str();
-
-            wparams.greedy.best_of        = params.best_of;
-            wparams.beam_search.beam_size = params.beam_size;
-
-            wparams.temperature_inc  = params.no_fallback ? 0.0f : wparams.temperature_inc;
-            wparams.entropy_thold    = params.entropy_thold;
-            wparams.logprob_thold    = params.logprob_thold;
+            whisper_full_params wparams = whisper_full_params_from(params, ctx_draft);
 
             whisper_print_user_data user_data = { &params, &pcmf32s, 0 };
 
@@ -964,61 +1297,15 @@ int main(int argc, char ** argv) {
         }
 
         // output stuff
-        {
-            printf("\n");
-
-            // output to text file
-            if (params.output_txt) {
-                const auto fname_txt = fname_out + ".txt";
-                output_txt(ctx, fname_txt.c_str(), params, pcmf32s);
-            }
-
-            // output to VTT file
-            if (params.output_vtt) {
-                const auto fname_vtt = fname_out + ".vtt";
-                output_vtt(ctx, fname_vtt.c_str(), params, pcmf32s);
-            }
-
-            // output to SRT file
-            if (params.output_srt) {
-                const auto fname_srt = fname_out + ".srt";
-                output_srt(ctx, fname_srt.c_str(), params, pcmf32s);
-            }
-
-            // output to WTS file
-            if (params.output_wts) {
-                const auto fname_wts = fname_out + ".wts";
-                output_wts(ctx, fname_wts.c_str(), fname_inp.c_str(), params, float(pcmf32.size() + 1000)/WHISPER_SAMPLE_RATE, pcmf32s);
-            }
-
-            // output to CSV file
-            if (params.output_csv) {
-                const auto fname_csv = fname_out + ".csv";
-                output_csv(ctx, fname_csv.c_str(), params, pcmf32s);
-            }
-
-            // output to JSON file
-            if (params.output_jsn) {
-                const auto fname_jsn = fname_out + ".json";
-                output_json(ctx, fname_jsn.c_str(), params, pcmf32s);
-            }
-
-            // output to LRC file
-            if (params.output_lrc) {
-                const auto fname_lrc = fname_out + ".lrc";
-                output_lrc(ctx, fname_lrc.c_str(), params, pcmf32s);
-            }
-
-            // output to score file
-            if (params.log_score) {
-                const auto fname_score = fname_out + ".score.txt";
-                output_score(ctx, fname_score.c_str(), params, pcmf32s);
-            }
-        }
+        output_results(ctx, whisper_get_state(ctx), fname_inp, fname_out, params, pcmf32, pcmf32s);
     }
 
     whisper_print_timings(ctx);
     whisper_free(ctx);
 
+    if (ctx_draft) {
+        whisper_free(ctx_draft);
+    }
+
     return 0;
 }
@@ -0,0 +1,306 @@
+// load generator for the server example
+//
+// c connections send n transcription requests in total to a running server and report the throughput, the latency
+// percentiles and the rejected requests (503 - queue full)
+//
+#include "common.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// command-line parameters
+struct load_params {
+    int32_t n_conn     = 4;
+    int32_t n_requests = 32;
+    int32_t chunk_kb   = 0;
+    int32_t port       = 8080;
+
+    bool raw = false;
+
+    std::string host     = "127.0.0.1";
+    std::string language = "";
+    std::string fname    = "samples/jfk.wav";
+};
+
+static void load_print_usage(int /*argc*/, char ** argv, const load_params & params) {
+    fprintf(stderr, "\n");
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h,       --help          [default] show this help message and exit\n");
+    fprintf(stderr, "  -c N,     --connections N [%-7d] number of concurrent connections\n",                        params.n_conn);
+    fprintf(stderr, "  -n N,     --requests N    [%-7d] total number of requests\n",                               params.n_requests);
+    fprintf(stderr, "  -ck N,    --chunked N     [%-7d] upload with chunked transfer encoding, N KB per chunk (0 = off)\n", params.chunk_kb);
+    fprintf(stderr, "  -r,       --raw           [%-7s] upload raw 16-bit PCM instead of the WAV file\n",           params.raw ? "true" : "false");
+    fprintf(stderr, "  -l LANG,  --language LANG [%-7s] spoken language (server default if empty)\n",              params.language.c_str());
+    fprintf(stderr, "  -f FNAME, --file FNAME    [%-7s] input WAV file\n",                                         params.fname.c_str());
+    fprintf(stderr, "            --host HOST     [%-7s] server address\n",                                         params.host.c_str());
+    fprintf(stderr, "            --port N        [%-7d] server port\n",                                            params.port);
+    fprintf(stderr, "\n");
+}
+
+static bool load_params_parse(int argc, char ** argv, load_params & params) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            load_print_usage(argc, argv, params);
+            exit(0);
+        }
+        else if (arg == "-c"  || arg == "--connections") { params.n_conn     = std::stoi(argv[++i]); }
+        else if (arg == "-n"  || arg == "--requests")    { params.n_requests = std::stoi(argv[++i]); }
+        else if (arg == "-ck" || arg == "--chunked")     { params.chunk_kb   = std::stoi(argv[++i]); }
+        else if (arg == "-r"  || arg == "--raw")         { params.raw        = true; }
+        else if (arg == "-l"  || arg == "--language")    { params.language   = argv[++i]; }
+        else if (arg == "-f"  || arg == "--file")        { params.fname      = argv[++i]; }
+        else if (                arg == "--host")        { params.host       = argv[++i]; }
+        else if (                arg == "--port")        { params.port       = std::stoi(argv[++i]); }
+        else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            load_print_usage(argc, argv, params);
+            exit(0);
+        }
+    }
+
+    params.n_conn = std::max(1, params.n_conn);
+
+    return true;
+}
+
+static int load_connect(const load_params & params) {
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons(params.port);
+    inet_pton(AF_INET, params.host.c_str(), &addr.sin_addr);
+
+    if (connect(fd, (sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static bool send_all(int fd, const char * data, size_t n) {
+    while (n > 0) {
+        const ssize_t k = send(fd, data, n, MSG_NOSIGNAL);
+        if (k <= 0) {
+            return false;
+        }
+        data += k;
+        n    -= k;
+    }
+    return true;
+}
+
+// send a request and read the status of its response
+// returns the status, or -1 if the connection failed. keep_alive is cleared when the server closes the connection
+static int load_request(int fd, const load_params & params, const std::string & body, bool & keep_alive) {
+    std::string head = "POST /inference";
+    if (!params.language.empty()) {
+        head += "?language=" + params.language;
+    }
+    head += " HTTP/1.1\r\nHost: " + params.host + "\r\n";
+    head += params.raw ? "Content-Type: audio/l16\r\n" : "Content-Type: audio/wav\r\n";
+
+    if (params.chunk_kb > 0) {
+        head += "Transfer-Encoding: chunked\r\n\r\n";
+    } else {
+        head += "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n";
+    }
+
+    if (!send_all(fd, head.data(), head.size())) {
+        return -1;
+    }
+
+    if (params.chunk_kb > 0) {
+        const size_t n_chunk = size_t(params.chunk_kb)*1024;
+
+        for (size_t i = 0; i < body.size(); i += n_chunk) {
+            const size_t n = std::min(n_chunk, body.size() - i);
+
+            char size_line[32];
+            snprintf(size_line, sizeof(size_line), "%zx\r\n", n);
+
+            // a rejected request is answered before the end of the upload
+            if (!send_all(fd, size_line, strlen(size_line)) || !send_all(fd, body.data() + i, n) || !send_all(fd, "\r\n", 2)) {
+                break;
+            }
+        }
+
+        send_all(fd, "0\r\n\r\n", 5);
+    } else {
+        send_all(fd, body.data(), body.size());
+    }
+
+    // response head
+    std::string resp;
+    size_t end = std::string::npos;
+    while ((end = resp.find("\r\n\r\n")) == std::string::npos) {
+        char buf[4096];
+        const ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            return -1;
+        }
+        resp.append(buf, n);
+    }
+
+    const int status = atoi(resp.c_str() + resp.find(' ') + 1);
+
+    std::string head_lc = resp.substr(0, end);
+    std::transform(head_lc.begin(), head_lc.end(), head_lc.begin(), [](unsigned char c) { return std::tolower(c); });
+
+    keep_alive = head_lc.find("connection: close") == std::string::npos;
+
+    size_t n_body = 0;
+    const size_t p = head_lc.find("content-length:");
+    if (p != std::string::npos) {
+        n_body = strtoull(head_lc.c_str() + p + 15, nullptr, 10);
+    }
+
+    // response body
+    size_t n_read = resp.size() - end - 4;
+    while (n_read < n_body) {
+        char buf[4096];
+        const ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            return -1;
+        }
+        n_read += n;
+    }
+
+    return status;
+}
+
+int main(int argc, char ** argv) {
+    load_params params;
+
+    if (load_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    std::string body;
+    double audio_s = 0.0;
+
+    {
+        std::vector<float> pcmf32;
+        std::vector<std::vector<float>> pcmf32s;
+        if (!read_wav(params.fname, pcmf32, pcmf32s, false)) {
+            fprintf(stderr, "error: failed to read WAV file '%s'\n", params.fname.c_str());
+            return 2;
+        }
+
+        audio_s = double(pcmf32.size())/COMMON_SAMPLE_RATE;
+
+        if (params.raw) {
+            body.resize(2*pcmf32.size());
+            for (size_t i = 0; i < pcmf32.size(); ++i) {
+                const int16_t s = (int16_t) std::max(-32768.0f, std::min(32767.0f, pcmf32[i]*32768.0f));
+                body[2*i + 0] = char(s & 0xff);
+                body[2*i + 1] = char((s >> 8) & 0xff);
+            }
+        } else {
+            FILE * f = fopen(params.fname.c_str(), "rb");
+            char buf[64*1024];
+            size_t n = 0;
+            while (f && (n = fread(buf, 1, sizeof(buf), f)) > 0) {
+                body.append(buf, n);
+            }
+            if (f) {
+                fclose(f);
+            }
+        }
+    }
+
+    std::atomic<int> n_next = { 0 };
+
+    std::mutex mutex;
+    std::vector<double> latencies; // successful requests
+    std::map<int, int>  statuses;
+
+    const auto t_start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (int c = 0; c < params.n_conn; ++c) {
+        threads.emplace_back([&]() {
+            int fd = -1;
+
+            while (n_next++ < params.n_requests) {
+                if (fd < 0) {
+                    fd = load_connect(params);
+                }
+
+                const auto t0 = std::chrono::steady_clock::now();
+
+                bool keep_alive = false;
+                const int status = fd < 0 ? -1 : load_request(fd, params, body, keep_alive);
+
+                const double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+                if (status < 0 || !keep_alive) {
+                    if (fd >= 0) {
+                        close(fd);
+                    }
+                    fd = -1;
+                }
+
+                std::lock_guard<std::mutex> lock(mutex);
+                statuses[status]++;
+                if (status == 200) {
+                    latencies.push_back(t);
+                }
+            }
+
+            if (fd >= 0) {
+                close(fd);
+            }
+        });
+    }
+
+    for (auto & t : threads) {
+        t.join();
+    }
+
+    const double t_total = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+
+    std::sort(latencies.begin(), latencies.end());
+
+    auto percentile = [&](double p) {
+        if (latencies.empty()) {
+            return 0.0;
+        }
+        const size_t i = std::min(latencies.size() - 1, size_t(p*latencies.size()));
+        return latencies[i];
+    };
+
+    const int n_ok = latencies.size();
+
+    printf("\n");
+    printf("requests:   %d in %.2f s with %d connections\n", params.n_requests, t_total, params.n_conn);
+    for (const auto & s : statuses) {
+        printf("  status %3d: %d\n", s.first, s.second);
+    }
+    printf("throughput: %.2f req/s, %.2f s of audio per second\n", n_ok/t_total, n_ok*audio_s/t_total);
+    printf("latency:    p50 %.3f s, p90 %.3f s, p99 %.3f s, max %.3f s\n",
+            percentile(0.50), percentile(0.90), percentile(0.99), latencies.empty() ? 0.0 : latencies.back());
+
+    return statuses.size() == 1 && statuses.count(200) ? 0 : 1;
+}
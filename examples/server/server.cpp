@@ -0,0 +1,1380 @@
+// HTTP/1.1 transcription server
+//
+// One whisper_context is loaded at startup and shared by a fixed number of workers. Each request takes a state from the
+// state pool of the context for the duration of its transcription. Uploads are admitted into a bounded queue - when the
+// queue is full, new requests are rejected with 503 before their body is read, so that the clients back off instead of
+// piling up on the server.
+//
+//   POST /inference  - body: WAV (audio/wav) or raw 16 kHz mono 16-bit PCM (audio/l16, application/octet-stream),
+//                      with Content-Length or chunked transfer encoding. Query: language=xx, translate=1,
+//                      priority=interactive|normal|batch
+//   GET  /metrics    - queue depth and per-stage latency histograms (Prometheus text format)
+//   GET  /health     - 200 once the model is loaded
+//
+// With --deadline, each request has a time budget from its request line: a request still queued at the deadline gets a
+// 503, a transcription that reaches it stops and returns the segments done so far with "partial": true
+//
+#include "common.h"
+
+#include "whisper.h"
+#include "dr_wav.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// command-line parameters
+struct server_params {
+    int32_t n_threads    = std::min(4, (int32_t) std::thread::hardware_concurrency());
+    int32_t n_workers    = 2;
+    int32_t n_queue      = 16;
+    int32_t decode_batch = 0;
+    int32_t port         = 8080;
+    int32_t timeout_s    = 30;
+    int32_t max_body_mb  = 256;
+    int32_t n_conn_max   = 64;
+    int32_t beam_size    = -1;
+    int32_t deadline_ms  = 0;
+    int32_t n_cores      = -1;
+
+    bool translate = false;
+
+    std::string host     = "127.0.0.1";
+    std::string language = "en";
+    std::string model    = "models/ggml-base.en.bin";
+};
+
+static void server_print_usage(int /*argc*/, char ** argv, const server_params & params) {
+    fprintf(stderr, "\n");
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h,       --help           [default] show this help message and exit\n");
+    fprintf(stderr, "  -t N,     --threads N      [%-7d] number of threads per transcription\n",                    params.n_threads);
+    fprintf(stderr, "  -w N,     --workers N      [%-7d] number of transcriptions at once\n",                       params.n_workers);
+    fprintf(stderr, "  -q N,     --queue N        [%-7d] max requests admitted and not started yet (uploading or queued)\n", params.n_queue);
+    fprintf(stderr, "  -db N,    --decode-batch N [%-7d] max decoder steps of the workers evaluated at once (0 = off)\n", params.decode_batch);
+    fprintf(stderr, "  -bs N,    --beam-size N    [%-7d] beam size for beam search\n",                             params.beam_size);
+    fprintf(stderr, "  -l LANG,  --language LANG  [%-7s] default spoken language ('auto' for auto-detect)\n",         params.language.c_str());
+    fprintf(stderr, "  -tr,      --translate      [%-7s] translate from source language to english by default\n",  params.translate ? "true" : "false");
+    fprintf(stderr, "  -m FNAME, --model FNAME    [%-7s] model path\n",                                             params.model.c_str());
+    fprintf(stderr, "            --host HOST      [%-7s] address to listen on\n",                                  params.host.c_str());
+    fprintf(stderr, "            --port N         [%-7d] port to listen on\n",                                     params.port);
+    fprintf(stderr, "            --timeout N      [%-7d] socket read/write timeout in seconds\n",                  params.timeout_s);
+    fprintf(stderr, "            --max-body N     [%-7d] max request body in MB\n",                                params.max_body_mb);
+    fprintf(stderr, "            --max-conn N     [%-7d] max open connections, new ones get a 503\n",             params.n_conn_max);
+    fprintf(stderr, "            --deadline N     [%-7d] time budget of a request in ms, partial result when exceeded (0 = off)\n", params.deadline_ms);
+    fprintf(stderr, "            --cores N        [%-7d] threads shared by all the workers by priority (0 = all cores, -1 = off)\n", params.n_cores);
+    fprintf(stderr, "\n");
+}
+
+static bool server_params_parse(int argc, char ** argv, server_params & params) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            server_print_usage(argc, argv, params);
+            exit(0);
+        }
+        else if (arg == "-t"  || arg == "--threads")      { params.n_threads    = std::stoi(argv[++i]); }
+        else if (arg == "-w"  || arg == "--workers")      { params.n_workers    = std::stoi(argv[++i]); }
+        else if (arg == "-q"  || arg == "--queue")        { params.n_queue      = std::stoi(argv[++i]); }
+        else if (arg == "-db" || arg == "--decode-batch") { params.decode_batch = std::stoi(argv[++i]); }
+        else if (arg == "-bs" || arg == "--beam-size")    { params.beam_size    = std::stoi(argv[++i]); }
+        else if (arg == "-l"  || arg == "--language")     { params.language     = argv[++i]; }
+        else if (arg == "-tr" || arg == "--translate")    { params.translate    = true; }
+        else if (arg == "-m"  || arg == "--model")        { params.model        = argv[++i]; }
+        else if (                arg == "--host")         { params.host         = argv[++i]; }
+        else if (                arg == "--port")         { params.port         = std::stoi(argv[++i]); }
+        else if (                arg == "--timeout")      { params.timeout_s    = std::stoi(argv[++i]); }
+        else if (                arg == "--max-body")     { params.max_body_mb  = std::stoi(argv[++i]); }
+        else if (                arg == "--max-conn")     { params.n_conn_max   = std::stoi(argv[++i]); }
+        else if (                arg == "--deadline")     { params.deadline_ms  = std::stoi(argv[++i]); }
+        else if (                arg == "--cores")        { params.n_cores      = std::stoi(argv[++i]); }
+        else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            server_print_usage(argc, argv, params);
+            exit(0);
+        }
+    }
+
+    params.n_workers = std::max(1, params.n_workers);
+    params.n_queue   = std::max(1, params.n_queue);
+
+    params.n_conn_max = std::max(1, params.n_conn_max);
+
+    return true;
+}
+
+//
+// metrics
+//
+
+// cumulative latency histogram, in the layout of the Prometheus text format
+struct histogram {
+    static constexpr int n_buckets = 14;
+
+    const double le[n_buckets] = { 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0, 60.0, 120.0 };
+
+    uint64_t counts[n_buckets + 1] = {}; // last: +Inf
+
+    double   sum   = 0.0;
+    uint64_t count = 0;
+
+    void add(double t) {
+        int i = 0;
+        while (i < n_buckets && t > le[i]) {
+            ++i;
+        }
+
+        counts[i]++;
+        sum += t;
+        count++;
+    }
+
+    void print(std::ostringstream & out, const char * name, const char * stage) const {
+        uint64_t n = 0;
+        for (int i = 0; i <= n_buckets; ++i) {
+            n += counts[i];
+
+            char le_str[32];
+            if (i < n_buckets) {
+                snprintf(le_str, sizeof(le_str), "%g", le[i]);
+            } else {
+                snprintf(le_str, sizeof(le_str), "+Inf");
+            }
+
+            out << name << "_bucket{stage=\"" << stage << "\",le=\"" << le_str << "\"} " << n << "\n";
+        }
+
+        out << name << "_sum{stage=\"" << stage << "\"} " << sum << "\n";
+        out << name << "_count{stage=\"" << stage << "\"} " << count << "\n";
+    }
+};
+
+enum server_stage {
+    STAGE_UPLOAD = 0, // request line to the end of the body
+    STAGE_QUEUE,      // end of the body to the start of the transcription
+    STAGE_INFERENCE,  // whisper_full_with_state()
+    STAGE_TOTAL,      // request line to the end of the response
+    STAGE_COUNT,
+};
+
+static const char * k_stage_names[STAGE_COUNT] = { "upload", "queue", "inference", "total" };
+
+// stages of the 30 s windows of the transcriptions, from whisper_full_get_window_timings_from_state()
+enum server_window_stage {
+    WINDOW_ENCODE = 0,  // encoder
+    WINDOW_DECODE,      // decoder evaluations of all the temperatures
+    WINDOW_FIRST_TOKEN, // start of the window to the first sampled token
+    WINDOW_TOTAL,       // encoding, decoding and output of the window
+    WINDOW_COUNT,
+};
+
+static const char * k_window_stage_names[WINDOW_COUNT] = { "encode", "decode", "first_token", "total" };
+
+struct server_metrics {
+    std::mutex mutex;
+
+    histogram stages[STAGE_COUNT];
+    histogram windows[WINDOW_COUNT];
+
+    uint64_t n_windows   = 0;
+    uint64_t n_fallbacks = 0; // temperature fallbacks of the windows
+
+    uint64_t n_ok        = 0; // 200
+    uint64_t n_rejected  = 0; // 503 - queue full
+    uint64_t n_bad       = 0; // 4xx
+    uint64_t n_failed    = 0; // 500
+    uint64_t n_partial   = 0; // 200 - stopped at the deadline
+    uint64_t n_expired   = 0; // 503 - deadline passed in the queue
+    double   audio_s     = 0.0;
+
+    void add(server_stage stage, double t) {
+        std::lock_guard<std::mutex> lock(mutex);
+        stages[stage].add(t);
+    }
+
+    void add_windows(whisper_state * state) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        const int n = whisper_full_n_windows_from_state(state);
+        for (int i = 0; i < n; ++i) {
+            const auto window = whisper_full_get_window_timings_from_state(state, i);
+
+            windows[WINDOW_ENCODE].add(1e-6*window.t_encode_us);
+            windows[WINDOW_DECODE].add(1e-6*window.t_decode_us);
+            windows[WINDOW_TOTAL] .add(1e-6*window.t_total_us);
+
+            if (window.t_first_token_us >= 0) {
+                windows[WINDOW_FIRST_TOKEN].add(1e-6*window.t_first_token_us);
+            }
+
+            n_windows++;
+            n_fallbacks += window.n_fallback;
+        }
+    }
+
+    void count(int status) {
+        std::lock_guard<std::mutex> lock(mutex);
+        switch (status) {
+            case 200: n_ok++;       break;
+            case 503: n_rejected++; break;
+            case 500: n_failed++;   break;
+            default:  n_bad++;      break;
+        }
+    }
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+//
+// request queue
+//
+
+struct server_job {
+    std::vector<float> pcmf32;
+
+    std::string language;
+    bool        translate;
+
+    whisper_priority priority; // with --cores
+
+    std::chrono::steady_clock::time_point t_queued;
+    std::chrono::steady_clock::time_point t_deadline; // with --deadline
+
+    std::promise<std::pair<int, std::string>> result; // status, body
+};
+
+// bounded admission queue: a request takes a slot before its body is read and gives it back when a worker starts it
+struct server_queue {
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    std::deque<server_job *> jobs;
+
+    int  n_max       = 0;
+    int  n_admitted  = 0; // uploading + queued
+    int  n_busy      = 0; // workers running a transcription
+    bool stop        = false;
+
+    bool admit() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stop || n_admitted >= n_max) {
+            return false;
+        }
+        n_admitted++;
+        return true;
+    }
+
+    // the upload failed
+    void cancel() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            n_admitted--;
+        }
+        cv.notify_all();
+    }
+
+    void push(server_job * job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(job);
+        }
+        cv.notify_one();
+    }
+
+    // returns nullptr once stopped and all the admitted requests have been started
+    server_job * pop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return !jobs.empty() || (stop && n_admitted == 0); });
+        if (jobs.empty()) {
+            return nullptr;
+        }
+
+        server_job * job = jobs.front();
+        jobs.pop_front();
+
+        n_admitted--;
+        n_busy++;
+
+        // the last admitted request of a stopped server - the other workers can exit
+        if (stop && n_admitted == 0) {
+            cv.notify_all();
+        }
+
+        return job;
+    }
+
+    void done() {
+        std::lock_guard<std::mutex> lock(mutex);
+        n_busy--;
+    }
+};
+
+//
+// server
+//
+
+struct server_context {
+    server_params params;
+
+    struct whisper_context * ctx = nullptr;
+
+    server_queue   queue;
+    server_metrics metrics;
+
+    // open connections and whether they have a request in progress (admitted or about to be)
+    // on exit, the reads of the idle connections are shut down and the uploads in progress are read to the end
+    std::mutex          conn_mutex;
+    std::map<int, bool> conn_fds;
+    bool                conn_stop = false;
+
+    // mark the connection busy before its request is admitted - returns false once the server is stopping
+    bool conn_set_busy(int fd, bool busy) {
+        std::lock_guard<std::mutex> lock(conn_mutex);
+        if (busy && conn_stop) {
+            return false;
+        }
+        conn_fds[fd] = busy;
+        return true;
+    }
+};
+
+static std::atomic<bool> g_stop = { false };
+
+static void server_sigint_handler(int) {
+    g_stop = true;
+}
+
+//  500 -> 00:00:05,000
+static std::string to_timestamp(int64_t t) {
+    int64_t msec = t * 10;
+    int64_t hr = msec / (1000 * 60 * 60);
+    msec = msec - hr * (1000 * 60 * 60);
+    int64_t min = msec / (1000 * 60);
+    msec = msec - min * (1000 * 60);
+    int64_t sec = msec / 1000;
+    msec = msec - sec * 1000;
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%02d:%02d:%02d,%03d", (int) hr, (int) min, (int) sec, (int) msec);
+
+    return std::string(buf);
+}
+
+static std::string json_escape(const char * str) {
+    std::string res;
+    for (const char * p = str; *p; ++p) {
+        const unsigned char c = *p;
+        switch (c) {
+            case '"':  res += "\\\""; break;
+            case '\\': res += "\\\\"; break;
+            case '\n': res += "\\n";  break;
+            case '\r': res += "\\r";  break;
+            case '\t': res += "\\t";  break;
+            default:
+                if (c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    res += buf;
+                } else {
+                    res += c;
+                }
+        }
+    }
+    return res;
+}
+
+// the result in the layout of the output_json() of the main example
+static std::string result_json(struct whisper_context * ctx, struct whisper_state * state, const server_params & params, const server_job & job) {
+    std::ostringstream out;
+    int indent = 0;
+
+    auto doindent = [&]() {
+        for (int i = 0; i < indent; i++) out << "\t";
+    };
+
+    auto start_arr = [&](const char *name) {
+        doindent();
+        out << "\"" << name << "\": [\n";
+        indent++;
+    };
+
+    auto end_arr = [&](bool end) {
+        indent--;
+        doindent();
+        out << (end ? "]\n" : "},\n");
+    };
+
+    auto start_obj = [&](const char *name) {
+        doindent();
+        if (name) {
+            out << "\"" << name << "\": {\n";
+        } else {
+            out << "{\n";
+        }
+        indent++;
+    };
+
+    auto end_obj = [&](bool end) {
+        indent--;
+        doindent();
+        out << (end ? "}\n" : "},\n");
+    };
+
+    auto start_value = [&](const char *name) {
+        doindent();
+        out << "\"" << name << "\": ";
+    };
+
+    auto value_s = [&](const char *name, const char *val, bool end) {
+        start_value(name);
+        out << "\"" << json_escape(val) << (end ? "\"\n" : "\",\n");
+    };
+
+    auto end_value = [&](bool end) {
+        out << (end ? "\n" : ",\n");
+    };
+
+    auto value_i = [&](const char *name, const int64_t val, bool end) {
+        start_value(name);
+        out << val;
+        end_value(end);
+    };
+
+    auto value_b = [&](const char *name, const bool val, bool end) {
+        start_value(name);
+        out << (val ? "true" : "false");
+        end_value(end);
+    };
+
+    start_obj(nullptr);
+        value_s("systeminfo", whisper_print_system_info(), false);
+        start_obj("model");
+            value_s("type", whisper_model_type_readable(ctx), false);
+            value_b("multilingual", whisper_is_multilingual(ctx), false);
+            value_i("vocab", whisper_model_n_vocab(ctx), false);
+            start_obj("audio");
+                value_i("ctx", whisper_model_n_audio_ctx(ctx), false);
+                value_i("state", whisper_model_n_audio_state(ctx), false);
+                value_i("head", whisper_model_n_audio_head(ctx), false);
+                value_i("layer", whisper_model_n_audio_layer(ctx), true);
+            end_obj(false);
+            start_obj("text");
+                value_i("ctx", whisper_model_n_text_ctx(ctx), false);
+                value_i("state", whisper_model_n_text_state(ctx), false);
+                value_i("head", whisper_model_n_text_head(ctx), false);
+                value_i("layer", whisper_model_n_text_layer(ctx), true);
+            end_obj(false);
+            value_i("mels", whisper_model_n_mels(ctx), false);
+            value_i("ftype", whisper_model_ftype(ctx), true);
+        end_obj(false);
+        start_obj("params");
+            value_s("model", params.model.c_str(), false);
+            value_s("language", job.language.c_str(), false);
+            value_b("translate", job.translate, true);
+        end_obj(false);
+        start_obj("result");
+            const bool partial = whisper_full_stop_reason_from_state(state) != WHISPER_STOP_NONE;
+
+            value_s("language", whisper_lang_str(whisper_full_lang_id_from_state(state)), !partial);
+            if (partial) {
+                value_b("partial", true, true);
+            }
+        end_obj(false);
+        start_arr("transcription");
+
+            const int n_segments = whisper_full_n_segments_from_state(state);
+            for (int i = 0; i < n_segments; ++i) {
+                const char * text = whisper_full_get_segment_text_from_state(state, i);
+
+                const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+                const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
+
+                start_obj(nullptr);
+                    start_obj("timestamps");
+                        value_s("from", to_timestamp(t0).c_str(), false);
+                        value_s("to", to_timestamp(t1).c_str(), true);
+                    end_obj(false);
+                    start_obj("offsets");
+                        value_i("from", t0 * 10, false);
+                        value_i("to", t1 * 10, true);
+                    end_obj(false);
+                    value_s("text", text, true);
+                end_obj(i == (n_segments - 1));
+            }
+
+        end_arr(true);
+    end_obj(true);
+
+    return out.str();
+}
+
+static std::string error_json(const std::string & msg) {
+    return "{\n\t\"error\": \"" + json_escape(msg.c_str()) + "\"\n}\n";
+}
+
+// transcribe the queued jobs with a state of the pool of the context
+static void server_worker(server_context & sctx) {
+    const auto & params = sctx.params;
+
+    while (server_job * job = sctx.queue.pop()) {
+        sctx.metrics.add(STAGE_QUEUE, seconds_since(job->t_queued));
+
+        std::pair<int, std::string> res;
+
+        // the remaining time budget of the request
+        int deadline_ms = 0;
+        if (params.deadline_ms > 0) {
+            deadline_ms = std::chrono::duration_cast<std::chrono::milliseconds>(job->t_deadline - std::chrono::steady_clock::now()).count();
+        }
+
+        struct whisper_state * state = nullptr;
+
+        if (params.deadline_ms > 0 && deadline_ms <= 0) {
+            res = { 503, error_json("the deadline of the request passed while it was queued") };
+
+            std::lock_guard<std::mutex> lock(sctx.metrics.mutex);
+            sctx.metrics.n_expired++;
+        } else if ((state = whisper_state_acquire(sctx.ctx)) == nullptr) {
+            res = { 500, error_json("failed to allocate a state") };
+        } else {
+            whisper_full_params wparams = whisper_full_default_params(params.beam_size > 1 ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY);
+
+            wparams.print_realtime   = false;
+            wparams.print_progress   = false;
+            wparams.print_timestamps = false;
+            wparams.print_special    = false;
+            wparams.translate        = job->translate;
+            wparams.language         = job->language.c_str();
+            wparams.n_threads        = params.n_threads;
+            wparams.deadline_ms      = deadline_ms;
+            wparams.priority         = job->priority;
+
+            if (params.beam_size > 1) {
+                wparams.beam_search.beam_size = params.beam_size;
+            }
+
+            const auto t_start = std::chrono::steady_clock::now();
+
+            if (whisper_full_with_state(sctx.ctx, state, wparams, job->pcmf32.data(), job->pcmf32.size()) != 0) {
+                res = { 500, error_json("failed to process audio") };
+            } else {
+                sctx.metrics.add(STAGE_INFERENCE, seconds_since(t_start));
+                sctx.metrics.add_windows(state);
+
+                if (whisper_full_stop_reason_from_state(state) != WHISPER_STOP_NONE) {
+                    std::lock_guard<std::mutex> lock(sctx.metrics.mutex);
+                    sctx.metrics.n_partial++;
+                }
+
+                res = { 200, result_json(sctx.ctx, state, params, *job) };
+            }
+
+            whisper_state_release(sctx.ctx, state);
+        }
+
+        sctx.queue.done();
+
+        job->result.set_value(std::move(res));
+    }
+}
+
+//
+// HTTP
+//
+
+static bool send_all(int fd, const char * data, size_t n) {
+    while (n > 0) {
+        const ssize_t k = send(fd, data, n, MSG_NOSIGNAL);
+        if (k <= 0) {
+            return false;
+        }
+        data += k;
+        n    -= k;
+    }
+    return true;
+}
+
+static const char * status_text(int status) {
+    switch (status) {
+        case 100: return "Continue";
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 411: return "Length Required";
+        case 413: return "Payload Too Large";
+        case 415: return "Unsupported Media Type";
+        case 500: return "Internal Server Error";
+        case 503: return "Service Unavailable";
+        default:  return "Unknown";
+    }
+}
+
+static bool send_response(int fd, int status, const char * content_type, const std::string & body, bool keep_alive) {
+    char head[512];
+    snprintf(head, sizeof(head),
+            "HTTP/1.1 %d %s\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Length: %zu\r\n"
+            "Connection: %s\r\n"
+            "%s"
+            "\r\n",
+            status, status_text(status), content_type, body.size(), keep_alive ? "keep-alive" : "close",
+            status == 503 ? "Retry-After: 1\r\n" : "");
+
+    return send_all(fd, head, strlen(head)) && send_all(fd, body.data(), body.size());
+}
+
+// buffered reads from a connection
+struct http_reader {
+    int fd = -1;
+
+    std::string buf;
+    size_t      pos = 0;
+
+    bool fill() {
+        if (pos > 0 && pos == buf.size()) {
+            buf.clear();
+            pos = 0;
+        }
+
+        char tmp[64*1024];
+        const ssize_t n = recv(fd, tmp, sizeof(tmp), 0);
+        if (n <= 0) {
+            return false;
+        }
+
+        buf.append(tmp, n);
+        return true;
+    }
+
+    bool read_line(std::string & line, size_t n_max = 8*1024) {
+        while (true) {
+            const size_t end = buf.find("\r\n", pos);
+            if (end != std::string::npos) {
+                line = buf.substr(pos, end - pos);
+                pos = end + 2;
+                return true;
+            }
+            if (buf.size() - pos > n_max || !fill()) {
+                return false;
+            }
+        }
+    }
+
+    // pass the next n bytes to the sink
+    template<typename F>
+    bool read(size_t n, F && sink) {
+        while (n > 0) {
+            if (pos == buf.size() && !fill()) {
+                return false;
+            }
+            const size_t k = std::min(n, buf.size() - pos);
+            sink(buf.data() + pos, k);
+            pos += k;
+            n   -= k;
+        }
+        return true;
+    }
+};
+
+struct http_request {
+    std::string method;
+    std::string path;
+    std::string query;
+
+    std::vector<std::pair<std::string, std::string>> headers; // lower-case names
+
+    std::string header(const char * name) const {
+        for (const auto & h : headers) {
+            if (h.first == name) {
+                return h.second;
+            }
+        }
+        return "";
+    }
+
+    std::string query_param(const char * name) const {
+        const std::string key = std::string(name) + "=";
+        size_t p = 0;
+        while (p < query.size()) {
+            size_t e = query.find('&', p);
+            if (e == std::string::npos) {
+                e = query.size();
+            }
+            if (query.compare(p, key.size(), key) == 0) {
+                return query.substr(p + key.size(), e - p - key.size());
+            }
+            p = e + 1;
+        }
+        return "";
+    }
+};
+
+static std::string to_lower(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return std::tolower(c); });
+    return s;
+}
+
+// parse the size in a Content-Length header or a chunk line
+// the digits must be followed by the end, whitespace or a chunk extension (';')
+static bool parse_size(const std::string & str, int base, size_t & n) {
+    if (str.empty() || !(base == 16 ? isxdigit((unsigned char) str[0]) : isdigit((unsigned char) str[0]))) {
+        return false;
+    }
+
+    char * end = nullptr;
+    errno = 0;
+    const unsigned long long v = strtoull(str.c_str(), &end, base);
+    if (errno != 0 || (*end != '\0' && *end != ' ' && *end != '\t' && !(*end == ';' && base == 16))) {
+        return false;
+    }
+
+    n = v;
+
+    return true;
+}
+
+static bool read_request_head(http_reader & reader, http_request & req) {
+    std::string line;
+    if (!reader.read_line(line) || line.empty()) {
+        return false;
+    }
+
+    std::istringstream ss(line);
+    std::string target;
+    ss >> req.method >> target;
+
+    const size_t q = target.find('?');
+    req.path  = target.substr(0, q);
+    req.query = q == std::string::npos ? "" : target.substr(q + 1);
+
+    while (true) {
+        if (!reader.read_line(line)) {
+            return false;
+        }
+        if (line.empty()) {
+            break;
+        }
+
+        const size_t c = line.find(':');
+        if (c == std::string::npos) {
+            continue;
+        }
+
+        const size_t v = line.find_first_not_of(" \t", c + 1);
+        req.headers.emplace_back(to_lower(line.substr(0, c)), v == std::string::npos ? "" : line.substr(v));
+    }
+
+    return true;
+}
+
+// the uploaded audio - raw PCM is converted as it arrives, WAV is decoded at the end
+struct audio_upload {
+    enum format_t {
+        FORMAT_RAW,  // 16-bit little-endian mono PCM at 16 kHz
+        FORMAT_WAV,
+        FORMAT_AUTO, // no content type - WAV if the data starts with a RIFF header, raw PCM otherwise
+    };
+
+    format_t format = FORMAT_AUTO;
+
+    std::vector<uint8_t> bytes; // WAV / auto, or the odd byte of raw PCM
+    std::vector<float>   pcmf32;
+
+    size_t n_total = 0;
+
+    void add_raw(const uint8_t * data, size_t n) {
+        size_t i = 0;
+        if (!bytes.empty() && n > 0) {
+            pcmf32.push_back(float(int16_t(bytes[0] | (data[0] << 8)))/32768.0f);
+            bytes.clear();
+            i = 1;
+        }
+
+        for (; i + 1 < n; i += 2) {
+            pcmf32.push_back(float(int16_t(data[i] | (data[i + 1] << 8)))/32768.0f);
+        }
+
+        if (i < n) {
+            bytes.push_back(data[i]);
+        }
+    }
+
+    void add(const char * data, size_t n) {
+        n_total += n;
+
+        if (format == FORMAT_RAW) {
+            add_raw((const uint8_t *) data, n);
+        } else {
+            bytes.insert(bytes.end(), data, data + n);
+        }
+    }
+
+    bool finish(std::string & err) {
+        if (format == FORMAT_AUTO) {
+            std::vector<uint8_t> data;
+            data.swap(bytes);
+
+            format = data.size() >= 4 && memcmp(data.data(), "RIFF", 4) == 0 ? FORMAT_WAV : FORMAT_RAW;
+
+            if (format == FORMAT_RAW) {
+                add_raw(data.data(), data.size());
+            } else {
+                bytes.swap(data);
+            }
+        }
+
+        if (format == FORMAT_RAW) {
+            return true;
+        }
+
+        drwav wav;
+        if (!drwav_init_memory(&wav, bytes.data(), bytes.size(), nullptr)) {
+            err = "failed to parse the WAV data";
+            return false;
+        }
+
+        if ((wav.channels != 1 && wav.channels != 2) || wav.sampleRate != COMMON_SAMPLE_RATE || wav.bitsPerSample != 16) {
+            drwav_uninit(&wav);
+            err = "the WAV data must be 16-bit mono or stereo at 16 kHz";
+            return false;
+        }
+
+        const uint64_t n = wav.totalPCMFrameCount;
+
+        std::vector<int16_t> pcm16(n*wav.channels);
+        drwav_read_pcm_frames_s16(&wav, n, pcm16.data());
+        drwav_uninit(&wav);
+
+        pcmf32.resize(n);
+        for (uint64_t i = 0; i < n; i++) {
+            pcmf32[i] = wav.channels == 1 ? float(pcm16[i])/32768.0f : float(pcm16[2*i] + pcm16[2*i + 1])/65536.0f;
+        }
+
+        bytes.clear();
+        bytes.shrink_to_fit();
+
+        return true;
+    }
+};
+
+// read the body with Content-Length or chunked transfer encoding
+// returns 0 on success, or the status of the error
+// the size of each chunk is checked against the rest of the budget before the chunk is read
+static int read_request_body(http_reader & reader, const http_request & req, size_t n_max, audio_upload & upload) {
+    auto sink = [&](const char * data, size_t n) {
+        upload.add(data, n);
+    };
+
+    if (to_lower(req.header("transfer-encoding")).find("chunked") != std::string::npos) {
+        std::string line;
+        while (true) {
+            if (!reader.read_line(line)) {
+                return 400;
+            }
+
+            size_t n = 0;
+            if (!parse_size(line, 16, n)) {
+                return 400;
+            }
+
+            if (n == 0) {
+                break;
+            }
+
+            if (n > n_max - upload.n_total) {
+                return 413;
+            }
+
+            if (!reader.read(n, sink) || !reader.read_line(line)) {
+                return 400;
+            }
+        }
+
+        // trailers
+        while (reader.read_line(line) && !line.empty()) {}
+
+        return 0;
+    }
+
+    const std::string length = req.header("content-length");
+    if (length.empty()) {
+        return 411;
+    }
+
+    size_t n = 0;
+    if (!parse_size(length, 10, n)) {
+        return 400;
+    }
+
+    if (n > n_max) {
+        return 413;
+    }
+
+    return reader.read(n, sink) ? 0 : 400;
+}
+
+static std::string metrics_text(server_context & sctx) {
+    std::ostringstream out;
+
+    int n_queued   = 0;
+    int n_admitted = 0;
+    int n_busy     = 0;
+    {
+        std::lock_guard<std::mutex> lock(sctx.queue.mutex);
+        n_queued   = sctx.queue.jobs.size();
+        n_admitted = sctx.queue.n_admitted;
+        n_busy     = sctx.queue.n_busy;
+    }
+
+    out << "# HELP whisper_server_queue_depth Requests waiting for a worker.\n";
+    out << "# TYPE whisper_server_queue_depth gauge\n";
+    out << "whisper_server_queue_depth " << n_queued << "\n";
+    out << "# HELP whisper_server_uploads Admitted requests still uploading their audio.\n";
+    out << "# TYPE whisper_server_uploads gauge\n";
+    out << "whisper_server_uploads " << n_admitted - n_queued << "\n";
+    out << "# HELP whisper_server_queue_capacity Max requests admitted and not started yet.\n";
+    out << "# TYPE whisper_server_queue_capacity gauge\n";
+    out << "whisper_server_queue_capacity " << sctx.params.n_queue << "\n";
+    out << "# HELP whisper_server_busy_workers Workers running a transcription.\n";
+    out << "# TYPE whisper_server_busy_workers gauge\n";
+    out << "whisper_server_busy_workers " << n_busy << "\n";
+    out << "# HELP whisper_server_connections Open connections.\n";
+    out << "# TYPE whisper_server_connections gauge\n";
+    {
+        std::lock_guard<std::mutex> lock(sctx.conn_mutex);
+        out << "whisper_server_connections " << sctx.conn_fds.size() << "\n";
+    }
+
+    const auto pool = whisper_state_pool_get_stats(sctx.ctx);
+
+    out << "# HELP whisper_server_states States of the state pool.\n";
+    out << "# TYPE whisper_server_states gauge\n";
+    out << "whisper_server_states{state=\"idle\"} "   << pool.n_idle   << "\n";
+    out << "whisper_server_states{state=\"active\"} " << pool.n_active << "\n";
+
+    const auto batching = whisper_decode_batching_get_stats(sctx.ctx);
+
+    out << "# HELP whisper_server_decode_batches Batched decoder evaluations and their steps.\n";
+    out << "# TYPE whisper_server_decode_batches counter\n";
+    out << "whisper_server_decode_batches{kind=\"graphs\"} " << batching.n_graphs << "\n";
+    out << "whisper_server_decode_batches{kind=\"steps\"} "  << batching.n_steps  << "\n";
+
+    const auto sched = whisper_cpu_scheduler_get_stats();
+
+    if (sched.n_cores > 0) {
+        static const char * names[WHISPER_PRIORITY_COUNT] = { "interactive", "normal", "batch" };
+
+        out << "# HELP whisper_server_cpu_cores Thread budget of the CPU scheduler.\n";
+        out << "# TYPE whisper_server_cpu_cores gauge\n";
+        out << "whisper_server_cpu_cores " << sched.n_cores << "\n";
+        out << "# HELP whisper_server_cpu_graphs_total Graphs run by the CPU scheduler by priority.\n";
+        out << "# TYPE whisper_server_cpu_graphs_total counter\n";
+        for (int i = 0; i < WHISPER_PRIORITY_COUNT; ++i) {
+            out << "whisper_server_cpu_graphs_total{priority=\"" << names[i] << "\"} " << sched.n_graphs[i] << "\n";
+        }
+        out << "# HELP whisper_server_cpu_threads_total Threads granted to the graphs by priority.\n";
+        out << "# TYPE whisper_server_cpu_threads_total counter\n";
+        for (int i = 0; i < WHISPER_PRIORITY_COUNT; ++i) {
+            out << "whisper_server_cpu_threads_total{priority=\"" << names[i] << "\"} " << sched.n_threads[i] << "\n";
+        }
+        out << "# HELP whisper_server_cpu_wait_seconds_total Time the graphs waited for a core by priority.\n";
+        out << "# TYPE whisper_server_cpu_wait_seconds_total counter\n";
+        for (int i = 0; i < WHISPER_PRIORITY_COUNT; ++i) {
+            out << "whisper_server_cpu_wait_seconds_total{priority=\"" << names[i] << "\"} " << 1e-6*sched.t_wait_us[i] << "\n";
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(sctx.metrics.mutex);
+
+    const auto & m = sctx.metrics;
+
+    out << "# HELP whisper_server_requests_total Transcription requests by result.\n";
+    out << "# TYPE whisper_server_requests_total counter\n";
+    out << "whisper_server_requests_total{result=\"ok\"} "       << m.n_ok       << "\n";
+    out << "whisper_server_requests_total{result=\"rejected\"} " << m.n_rejected << "\n";
+    out << "whisper_server_requests_total{result=\"bad\"} "      << m.n_bad      << "\n";
+    out << "whisper_server_requests_total{result=\"failed\"} "   << m.n_failed   << "\n";
+    out << "# HELP whisper_server_deadline_total Requests over the --deadline budget: partial results (200) and expired in the queue (503).\n";
+    out << "# TYPE whisper_server_deadline_total counter\n";
+    out << "whisper_server_deadline_total{result=\"partial\"} " << m.n_partial << "\n";
+    out << "whisper_server_deadline_total{result=\"expired\"} " << m.n_expired << "\n";
+    out << "# HELP whisper_server_audio_seconds_total Transcribed audio.\n";
+    out << "# TYPE whisper_server_audio_seconds_total counter\n";
+    out << "whisper_server_audio_seconds_total " << m.audio_s << "\n";
+    out << "# HELP whisper_server_stage_seconds Latency of the stages of the transcription requests.\n";
+    out << "# TYPE whisper_server_stage_seconds histogram\n";
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+        m.stages[i].print(out, "whisper_server_stage_seconds", k_stage_names[i]);
+    }
+    out << "# HELP whisper_server_windows_total Decoded 30 s windows and their temperature fallbacks.\n";
+    out << "# TYPE whisper_server_windows_total counter\n";
+    out << "whisper_server_windows_total{kind=\"windows\"} "   << m.n_windows   << "\n";
+    out << "whisper_server_windows_total{kind=\"fallbacks\"} " << m.n_fallbacks << "\n";
+    out << "# HELP whisper_server_window_seconds Latency of the stages of the decoded 30 s windows.\n";
+    out << "# TYPE whisper_server_window_seconds histogram\n";
+    for (int i = 0; i < WINDOW_COUNT; ++i) {
+        m.windows[i].print(out, "whisper_server_window_seconds", k_window_stage_names[i]);
+    }
+
+    return out.str();
+}
+
+// handle a transcription request, returns false if the connection cannot be used anymore
+static bool handle_inference(server_context & sctx, http_reader & reader, const http_request & req, std::chrono::steady_clock::time_point t_start, bool keep_alive) {
+    const int fd = reader.fd;
+
+    auto reply = [&](int status, const std::string & body, bool keep) {
+        sctx.metrics.count(status);
+        return send_response(fd, status, "application/json", body, keep) && keep;
+    };
+
+    // backpressure - reject before reading the upload, the body is not read so the connection is closed
+    // the connection is marked busy first, so that it is not shut down on exit once the request is admitted
+    if (!sctx.conn_set_busy(fd, true) || !sctx.queue.admit()) {
+        return reply(503, error_json("the server is busy, try again later"), false);
+    }
+
+    const std::string type = to_lower(req.header("content-type"));
+
+    audio_upload upload;
+
+    if (type.find("wav") != std::string::npos) {
+        upload.format = audio_upload::FORMAT_WAV;
+    } else if (type.find("audio/l16") != std::string::npos || type.find("audio/pcm") != std::string::npos ||
+               type.find("application/octet-stream") != std::string::npos) {
+        upload.format = audio_upload::FORMAT_RAW;
+    } else if (!type.empty()) {
+        sctx.queue.cancel();
+        return reply(415, error_json("unsupported content type '" + type + "'"), false);
+    }
+
+    if (to_lower(req.header("expect")) == "100-continue") {
+        const char * cont = "HTTP/1.1 100 Continue\r\n\r\n";
+        if (!send_all(fd, cont, strlen(cont))) {
+            sctx.queue.cancel();
+            return false;
+        }
+    }
+
+    const int status = read_request_body(reader, req, size_t(sctx.params.max_body_mb)*1024*1024, upload);
+    if (status != 0) {
+        sctx.queue.cancel();
+        return reply(status, error_json(status == 413 ? "the audio is too large" : "failed to read the request body"), false);
+    }
+
+    std::string err;
+    if (!upload.finish(err)) {
+        sctx.queue.cancel();
+        return reply(400, error_json(err), keep_alive);
+    }
+
+    sctx.metrics.add(STAGE_UPLOAD, seconds_since(t_start));
+
+    server_job job;
+    job.pcmf32    = std::move(upload.pcmf32);
+    job.language  = sctx.params.language;
+    job.translate = sctx.params.translate;
+    job.priority  = WHISPER_PRIORITY_NORMAL;
+
+    const std::string language = req.query_param("language");
+    if (!language.empty()) {
+        if (language != "auto" && whisper_lang_id(language.c_str()) == -1) {
+            sctx.queue.cancel();
+            return reply(400, error_json("unknown language '" + language + "'"), keep_alive);
+        }
+        job.language = language;
+    }
+
+    const std::string translate = req.query_param("translate");
+    if (!translate.empty()) {
+        job.translate = translate == "1" || translate == "true";
+    }
+
+    const std::string priority = req.query_param("priority");
+    if (!priority.empty()) {
+        if (priority == "interactive") {
+            job.priority = WHISPER_PRIORITY_INTERACTIVE;
+        } else if (priority == "batch") {
+            job.priority = WHISPER_PRIORITY_BATCH;
+        } else if (priority != "normal") {
+            sctx.queue.cancel();
+            return reply(400, error_json("unknown priority '" + priority + "'"), keep_alive);
+        }
+    }
+
+    if (!whisper_is_multilingual(sctx.ctx) && (job.language != "en" || job.translate)) {
+        job.language  = "en";
+        job.translate = false;
+    }
+
+    const double audio_s = double(job.pcmf32.size())/WHISPER_SAMPLE_RATE;
+
+    auto result = job.result.get_future();
+
+    job.t_queued   = std::chrono::steady_clock::now();
+    job.t_deadline = t_start + std::chrono::milliseconds(sctx.params.deadline_ms);
+    sctx.queue.push(&job);
+
+    const auto res = result.get();
+
+    if (res.first == 200) {
+        std::lock_guard<std::mutex> lock(sctx.metrics.mutex);
+        sctx.metrics.audio_s += audio_s;
+    }
+
+    const bool ok = reply(res.first, res.second, keep_alive);
+
+    sctx.metrics.add(STAGE_TOTAL, seconds_since(t_start));
+
+    return ok;
+}
+
+static void handle_connection(server_context & sctx, int fd) {
+    http_reader reader;
+    reader.fd = fd;
+
+    while (!g_stop) {
+        http_request req;
+        if (!read_request_head(reader, req)) {
+            break;
+        }
+
+        const auto t_start = std::chrono::steady_clock::now();
+
+        const bool keep_alive = to_lower(req.header("connection")) != "close";
+
+        bool ok = false;
+
+        if (req.path == "/inference" && req.method == "POST") {
+            ok = handle_inference(sctx, reader, req, t_start, keep_alive);
+
+            sctx.conn_set_busy(fd, false);
+        } else if (req.path == "/metrics" && req.method == "GET") {
+            ok = send_response(fd, 200, "text/plain; version=0.0.4", metrics_text(sctx), keep_alive) && keep_alive;
+        } else if (req.path == "/health" && req.method == "GET") {
+            ok = send_response(fd, 200, "application/json", "{\n\t\"status\": \"ok\"\n}\n", keep_alive) && keep_alive;
+        } else if (req.path == "/inference" || req.path == "/metrics" || req.path == "/health") {
+            // the body of the request is not read - close the connection
+            send_response(fd, 405, "application/json", error_json("method not allowed"), false);
+        } else {
+            send_response(fd, 404, "application/json", error_json("not found"), false);
+        }
+
+        if (!ok) {
+            break;
+        }
+    }
+
+    // lingering close: the client may still be sending the body of a rejected request - read it for a while, so that
+    // the response is not lost to a connection reset
+    shutdown(fd, SHUT_WR);
+
+    {
+        timeval tv = {};
+        tv.tv_sec = 1;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        const auto t_close = std::chrono::steady_clock::now();
+
+        char buf[16*1024];
+        while (recv(fd, buf, sizeof(buf), 0) > 0 && seconds_since(t_close) < 5.0) {}
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(sctx.conn_mutex);
+        sctx.conn_fds.erase(fd);
+    }
+
+    close(fd);
+}
+
+static int server_listen(const server_params & params) {
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "error: failed to create a socket\n");
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons(params.port);
+
+    if (inet_pton(AF_INET, params.host.c_str(), &addr.sin_addr) != 1) {
+        fprintf(stderr, "error: invalid address '%s'\n", params.host.c_str());
+        close(fd);
+        return -1;
+    }
+
+    if (bind(fd, (sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 128) != 0) {
+        fprintf(stderr, "error: failed to listen on %s:%d\n", params.host.c_str(), params.port);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int main(int argc, char ** argv) {
+    server_context sctx;
+
+    auto & params = sctx.params;
+
+    if (server_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    if (params.language != "auto" && whisper_lang_id(params.language.c_str()) == -1) {
+        fprintf(stderr, "error: unknown language '%s'\n", params.language.c_str());
+        server_print_usage(argc, argv, params);
+        exit(0);
+    }
+
+    sctx.ctx = whisper_init_from_file(params.model.c_str());
+    if (sctx.ctx == nullptr) {
+        fprintf(stderr, "error: failed to initialize whisper context\n");
+        return 2;
+    }
+
+    // the states of the workers are kept between requests
+    whisper_state_pool_set_max(sctx.ctx, params.n_workers);
+
+    if (params.decode_batch > 0) {
+        whisper_decode_batching_set(sctx.ctx, params.decode_batch, 2000);
+    }
+
+    if (params.n_cores >= 0) {
+        params.n_cores = whisper_cpu_scheduler_set(params.n_cores);
+    }
+
+    const int fd_listen = server_listen(params);
+    if (fd_listen < 0) {
+        whisper_free(sctx.ctx);
+        return 3;
+    }
+
+    signal(SIGINT,  server_sigint_handler);
+    signal(SIGTERM, server_sigint_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    sctx.queue.n_max = params.n_queue;
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < params.n_workers; ++i) {
+        workers.emplace_back(server_worker, std::ref(sctx));
+    }
+
+    fprintf(stderr, "%s: listening on http://%s:%d with %d workers x %d threads, queue %d\n",
+            __func__, params.host.c_str(), params.port, params.n_workers, params.n_threads, params.n_queue);
+
+    while (!g_stop) {
+        pollfd pfd = { fd_listen, POLLIN, 0 };
+        if (poll(&pfd, 1, 200) <= 0) {
+            continue;
+        }
+
+        const int fd = accept(fd_listen, nullptr, nullptr);
+        if (fd < 0) {
+            continue;
+        }
+
+        timeval tv = {};
+        tv.tv_sec = params.timeout_s;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        // one thread per connection - past the limit, the connection is rejected without reading the request
+        bool accepted = false;
+        {
+            std::lock_guard<std::mutex> lock(sctx.conn_mutex);
+            if ((int) sctx.conn_fds.size() < params.n_conn_max) {
+                sctx.conn_fds[fd] = false;
+                accepted = true;
+            }
+        }
+
+        if (!accepted) {
+            sctx.metrics.count(503);
+            send_response(fd, 503, "application/json", error_json("too many connections, try again later"), false);
+            close(fd);
+            continue;
+        }
+
+        std::thread(handle_connection, std::ref(sctx), fd).detach();
+    }
+
+    fprintf(stderr, "%s: shutting down\n", __func__);
+
+    close(fd_listen);
+
+    // no new requests are admitted - the workers finish once all the admitted requests have been started
+    {
+        std::lock_guard<std::mutex> lock(sctx.queue.mutex);
+        sctx.queue.stop = true;
+    }
+    sctx.queue.cv.notify_all();
+
+    // stop reading from the idle connections, so that they are closed. the admitted uploads are read to the end and
+    // get their response
+    {
+        std::lock_guard<std::mutex> lock(sctx.conn_mutex);
+        sctx.conn_stop = true;
+        for (const auto & conn : sctx.conn_fds) {
+            if (!conn.second) {
+                shutdown(conn.first, SHUT_RD);
+            }
+        }
+    }
+
+    for (auto & worker : workers) {
+        worker.join();
+    }
+
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(sctx.conn_mutex);
+            if (sctx.conn_fds.empty()) {
+                break;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    whisper_free(sctx.ctx);
+
+    return 0;
+}
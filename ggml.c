@@ -506,6 +506,206 @@ void ggml_fp32_to_fp16_row(const float * x, ggml_fp16_t * y, size_t n) {
     }
 }
 
+//
+// row helpers used for sampling
+//
+
+// exp(x) for x <= 0 - Cephes polynomial, within 2 ulp of expf(), x < -87.3f is flushed to 0 (including -INFINITY)
+#if defined(__AVX2__) && defined(__FMA__)
+inline static __m256 ggml_v_expf_neg(__m256 x) {
+    const __m256 x_min = _mm256_set1_ps(-87.33654f);
+    const __m256 uflow = _mm256_cmp_ps(x, x_min, _CMP_LT_OQ);
+
+    x = _mm256_max_ps(x, x_min);
+
+    // n = round(x/ln(2)), r = x - n*ln(2)
+    const __m256 magic = _mm256_set1_ps(12582912.0f);
+    const __m256 n = _mm256_sub_ps(_mm256_fmadd_ps(x, _mm256_set1_ps(1.44269504088896341f), magic), magic);
+
+    __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), x);
+    r = _mm256_fnmadd_ps(n, _mm256_set1_ps(-2.12194440e-4f), r);
+
+    // exp(r), |r| <= ln(2)/2
+    __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+    p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+
+    // 2^n
+    const __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+
+    return _mm256_andnot_ps(uflow, _mm256_mul_ps(p, _mm256_castsi256_ps(e)));
+}
+#elif defined(__ARM_NEON)
+inline static float32x4_t ggml_v_expf_neg(float32x4_t x) {
+    const float32x4_t x_min = vdupq_n_f32(-87.33654f);
+    const uint32x4_t  uflow = vcltq_f32(x, x_min);
+
+    x = vmaxq_f32(x, x_min);
+
+    // n = round(x/ln(2)), r = x - n*ln(2)
+    const float32x4_t magic = vdupq_n_f32(12582912.0f);
+    const float32x4_t n = vsubq_f32(vaddq_f32(vmulq_f32(x, vdupq_n_f32(1.44269504088896341f)), magic), magic);
+
+    float32x4_t r = vsubq_f32(x, vmulq_f32(n, vdupq_n_f32(0.693359375f)));
+    r = vsubq_f32(r, vmulq_f32(n, vdupq_n_f32(-2.12194440e-4f)));
+
+    // exp(r), |r| <= ln(2)/2
+    float32x4_t p = vdupq_n_f32(1.9875691500e-4f);
+    p = vaddq_f32(vmulq_f32(p, r), vdupq_n_f32(1.3981999507e-3f));
+    p = vaddq_f32(vmulq_f32(p, r), vdupq_n_f32(8.3334519073e-3f));
+    p = vaddq_f32(vmulq_f32(p, r), vdupq_n_f32(4.1665795894e-2f));
+    p = vaddq_f32(vmulq_f32(p, r), vdupq_n_f32(1.6666665459e-1f));
+    p = vaddq_f32(vmulq_f32(p, r), vdupq_n_f32(5.0000001201e-1f));
+    p = vaddq_f32(vmulq_f32(p, vmulq_f32(r, r)), vaddq_f32(r, vdupq_n_f32(1.0f)));
+
+    // 2^n
+    const int32x4_t e = vshlq_n_s32(vaddq_s32(vcvtq_s32_f32(n), vdupq_n_s32(127)), 23);
+
+    return vreinterpretq_f32_u32(vbicq_u32(vreinterpretq_u32_f32(vmulq_f32(p, vreinterpretq_f32_s32(e))), uflow));
+}
+#endif
+
+float ggml_max_row_f32(const float * x, size_t n) {
+    size_t i = 0;
+    float max = -INFINITY;
+#if defined(__AVX__)
+    if (n >= 8) {
+        __m256 max_vec = _mm256_loadu_ps(x);
+        for (i = 8; i + 7 < n; i += 8) {
+            max_vec = _mm256_max_ps(max_vec, _mm256_loadu_ps(x + i));
+        }
+        float tmp[8];
+        _mm256_storeu_ps(tmp, max_vec);
+        for (int j = 0; j < 8; ++j) {
+            max = MAX(max, tmp[j]);
+        }
+    }
+#elif defined(__ARM_NEON)
+    if (n >= 4) {
+        float32x4_t max_vec = vld1q_f32(x);
+        for (i = 4; i + 3 < n; i += 4) {
+            max_vec = vmaxq_f32(max_vec, vld1q_f32(x + i));
+        }
+        float tmp[4];
+        vst1q_f32(tmp, max_vec);
+        for (int j = 0; j < 4; ++j) {
+            max = MAX(max, tmp[j]);
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        max = MAX(max, x[i]);
+    }
+    return max;
+}
+
+float ggml_exp_row_f32(const float * x, float * y, float m, size_t n) {
+    size_t i = 0;
+    float sum = 0.0f;
+#if defined(__AVX2__) && defined(__FMA__)
+    {
+        const __m256 m_vec = _mm256_set1_ps(m);
+        __m256 sum_vec = _mm256_setzero_ps();
+        for (; i + 7 < n; i += 8) {
+            const __m256 y_vec = ggml_v_expf_neg(_mm256_sub_ps(_mm256_loadu_ps(x + i), m_vec));
+            _mm256_storeu_ps(y + i, y_vec);
+            sum_vec = _mm256_add_ps(sum_vec, y_vec);
+        }
+        float tmp[8];
+        _mm256_storeu_ps(tmp, sum_vec);
+        for (int j = 0; j < 8; ++j) {
+            sum += tmp[j];
+        }
+    }
+#elif defined(__ARM_NEON)
+    {
+        const float32x4_t m_vec = vdupq_n_f32(m);
+        float32x4_t sum_vec = vdupq_n_f32(0.0f);
+        for (; i + 3 < n; i += 4) {
+            const float32x4_t y_vec = ggml_v_expf_neg(vsubq_f32(vld1q_f32(x + i), m_vec));
+            vst1q_f32(y + i, y_vec);
+            sum_vec = vaddq_f32(sum_vec, y_vec);
+        }
+        float tmp[4];
+        vst1q_f32(tmp, sum_vec);
+        for (int j = 0; j < 4; ++j) {
+            sum += tmp[j];
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        y[i] = expf(x[i] - m);
+        sum += y[i];
+    }
+    return sum;
+}
+
+// insert element i into the top-k list, which is sorted by descending value - equal values keep the lower index first
+inline static void ggml_topk_insert(const float * x, int * idx, int * n_cur, int k, int i) {
+    int j = *n_cur < k ? (*n_cur)++ : k - 1;
+    for (; j > 0 && x[idx[j - 1]] < x[i]; --j) {
+        idx[j] = idx[j - 1];
+    }
+    idx[j] = i;
+}
+
+int ggml_topk_row_f32(const float * x, size_t n, int k, int * idx) {
+    int n_cur = 0;
+    if (k <= 0) {
+        return 0;
+    }
+
+    // threshold select: only the elements above the current k-th largest value reach the (scalar) insertion
+    float thr = -INFINITY;
+
+    size_t i = 0;
+#if defined(__AVX__)
+    for (; i + 7 < n; i += 8) {
+        if (_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(x + i), _mm256_set1_ps(thr), _CMP_GT_OQ)) == 0) {
+            continue;
+        }
+        for (size_t j = i; j < i + 8; ++j) {
+            if (x[j] > thr) {
+                ggml_topk_insert(x, idx, &n_cur, k, (int) j);
+                if (n_cur == k) {
+                    thr = x[idx[k - 1]];
+                }
+            }
+        }
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 3 < n; i += 4) {
+        const uint32x4_t gt = vcgtq_f32(vld1q_f32(x + i), vdupq_n_f32(thr));
+        const uint32x2_t gt2 = vorr_u32(vget_low_u32(gt), vget_high_u32(gt));
+        if ((vget_lane_u32(gt2, 0) | vget_lane_u32(gt2, 1)) == 0) {
+            continue;
+        }
+        for (size_t j = i; j < i + 4; ++j) {
+            if (x[j] > thr) {
+                ggml_topk_insert(x, idx, &n_cur, k, (int) j);
+                if (n_cur == k) {
+                    thr = x[idx[k - 1]];
+                }
+            }
+        }
+    }
+#endif
+    for (; i < n; ++i) {
+        if (x[i] > thr) {
+            ggml_topk_insert(x, idx, &n_cur, k, (int) i);
+            if (n_cur == k) {
+                thr = x[idx[k - 1]];
+            }
+        }
+    }
+
+    return n_cur;
+}
+
 //
 // timing
 //
@@ -3749,6 +3949,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "RELU",
     "GELU",
     "GELU_QUICK",
+    "ADD_GELU",
     "SILU",
     "SILU_BACK",
     "NORM",
@@ -3779,8 +3980,10 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "CLAMP",
     "CONV_1D",
     "CONV_2D",
+    "IM2COL_1D",
 
     "FLASH_ATTN",
+    "FLASH_ATTN_TILED",
     "FLASH_FF",
     "FLASH_ATTN_BACK",
     "WIN_PART",
@@ -3797,7 +4000,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "CROSS_ENTROPY_LOSS_BACK",
 };
 
-static_assert(GGML_OP_COUNT == 66, "GGML_OP_COUNT != 66");
+static_assert(GGML_OP_COUNT == 69, "GGML_OP_COUNT != 69");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -3827,6 +4030,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "relu(x)",
     "gelu(x)",
     "gelu_quick(x)",
+    "gelu(x+y)",
     "silu(x)",
     "silu_back(x)",
     "norm(x)",
@@ -3857,8 +4061,10 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "clamp(x)",
     "conv_1d(x)",
     "conv_2d(x)",
+    "im2col_1d(x)",
 
     "flash_attn(x)",
+    "flash_attn_tiled(x)",
     "flash_ff(x)",
     "flash_attn_back(x)",
     "win_part(x)",
@@ -3875,7 +4081,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "cross_entropy_loss_back(x,y)",
 };
 
-static_assert(GGML_OP_COUNT == 66, "GGML_OP_COUNT != 66");
+static_assert(GGML_OP_COUNT == 69, "GGML_OP_COUNT != 69");
 
 static_assert(sizeof(struct ggml_object)%GGML_MEM_ALIGN == 0, "ggml_object size must be a multiple of GGML_MEM_ALIGN");
 static_assert(sizeof(struct ggml_tensor)%GGML_MEM_ALIGN == 0, "ggml_tensor size must be a multiple of GGML_MEM_ALIGN");
@@ -3911,6 +4117,7 @@ static void ggml_setup_op_has_task_pass(void) {
         bool * p = GGML_OP_HAS_FINALIZE;
 
         p[GGML_OP_CROSS_ENTROPY_LOSS     ] = true;
+        p[GGML_OP_FLASH_ATTN_TILED       ] = true;
     }
 }
 
@@ -5860,6 +6067,32 @@ struct ggml_tensor * ggml_gelu_quick_inplace(
     return ggml_gelu_quick_impl(ctx, a, true);
 }
 
+// ggml_add_gelu
+
+struct ggml_tensor * ggml_add_gelu(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b) {
+    GGML_ASSERT(ggml_nelements(b) == a->ne[0]);
+    GGML_ASSERT(ggml_is_contiguous(b));
+
+    bool is_node = false;
+
+    if (a->grad || b->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+        is_node = true;
+    }
+
+    struct ggml_tensor * result = ggml_new_tensor(ctx, GGML_TYPE_F32, a->n_dims, a->ne);
+
+    result->op   = GGML_OP_ADD_GELU;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src0 = a;
+    result->src1 = b;
+
+    return result;
+}
+
 // ggml_silu
 
 struct ggml_tensor * ggml_silu_impl(
@@ -7194,6 +7427,47 @@ struct ggml_tensor* ggml_conv_2d(
 
 }
 
+// ggml_im2col_1d
+
+struct ggml_tensor * ggml_im2col_1d(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        int                   s0,
+        int                   p0) {
+    GGML_ASSERT(b->ne[3] == 1);
+    GGML_ASSERT(a->ne[1] == b->ne[1]);
+    GGML_ASSERT(a->type == GGML_TYPE_F16 || a->type == GGML_TYPE_F32);
+    bool is_node = false;
+
+    if (a->grad || b->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+        is_node = true;
+    }
+
+    const int64_t ne[4] = {
+        a->ne[0]*a->ne[1],
+        ggml_calc_conv_output_size(b->ne[0], a->ne[0], s0, p0, 1)*b->ne[2],
+        1, 1,
+    };
+    struct ggml_tensor * result = ggml_new_tensor(ctx, a->type, 2, ne);
+
+    ggml_scratch_save(ctx);
+    struct ggml_tensor * c = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 3);
+    ((int32_t *) c->data)[0] = a->ne[0];
+    ((int32_t *) c->data)[1] = s0;
+    ((int32_t *) c->data)[2] = p0;
+    ggml_scratch_load(ctx);
+
+    result->op     = GGML_OP_IM2COL_1D;
+    result->grad   = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src0   = b;
+    result->src1   = NULL;
+    result->opt[0] = c;
+
+    return result;
+}
+
 // ggml_conv_1d_ph
 
 struct ggml_tensor* ggml_conv_1d_ph(
@@ -7235,6 +7509,50 @@ struct ggml_tensor * ggml_flash_attn(
     return result;
 }
 
+// ggml_flash_attn_tiled
+
+struct ggml_tensor * ggml_flash_attn_tiled(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * q,
+        struct ggml_tensor  * k,
+        struct ggml_tensor  * v,
+        float                 scale) {
+    GGML_ASSERT(k->ne[0] == q->ne[0]);
+    GGML_ASSERT(k->ne[2] == q->ne[2] && v->ne[2] == q->ne[2]);
+    GGML_ASSERT(v->ne[0] == k->ne[1] && v->ne[1] == q->ne[0]);
+    GGML_ASSERT(k->ne[3] == q->ne[3] && v->ne[3] == q->ne[3]);
+    GGML_ASSERT(k->type == v->type);
+    GGML_ASSERT(k->type == GGML_TYPE_F16 || k->type == GGML_TYPE_F32);
+    GGML_ASSERT(q->type == GGML_TYPE_F32 || (q->type == GGML_TYPE_F16 && k->type == GGML_TYPE_F16));
+
+    bool is_node = false;
+
+    if (q->grad || k->grad || v->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+        is_node = true;
+    }
+
+    struct ggml_tensor * result = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, q->ne[0], q->ne[2], q->ne[1], q->ne[3]);
+
+    ggml_scratch_save(ctx);
+
+    struct ggml_tensor * b = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 1);
+
+    GGML_ASSERT(sizeof(float) == sizeof(int32_t));
+    (((float *) b->data)[0]) = scale;
+
+    ggml_scratch_load(ctx);
+
+    result->op   = GGML_OP_FLASH_ATTN_TILED;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src0 = q;
+    result->src1 = k;
+    result->opt[0] = v;
+    result->opt[1] = b;
+
+    return result;
+}
+
 // ggml_flash_ff
 
 struct ggml_tensor * ggml_flash_ff(
@@ -10118,6 +10436,65 @@ static void ggml_compute_forward_gelu_quick(
     }
 }
 
+// ggml_compute_forward_add_gelu
+
+static void ggml_compute_forward_add_gelu_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        struct ggml_tensor * dst) {
+    GGML_ASSERT(ggml_is_contiguous(dst));
+    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(src0->nb[0] == sizeof(float));
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nc = src0->ne[0];
+    const int nr = ggml_nrows(src0);
+
+    const float * b = (const float *) src1->data;
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int ir = ir0; ir < ir1; ir++) {
+        const int i3 = ir/(src0->ne[2]*src0->ne[1]);
+        const int i2 = (ir - i3*src0->ne[2]*src0->ne[1])/src0->ne[1];
+        const int i1 = (ir - i3*src0->ne[2]*src0->ne[1] - i2*src0->ne[1]);
+
+        float * dst_row = (float *) ((char *) dst->data + i3*dst->nb[3] + i2*dst->nb[2] + i1*dst->nb[1]);
+
+        ggml_vec_add_f32 (nc, dst_row, (float *) ((char *) src0->data + i3*src0->nb[3] + i2*src0->nb[2] + i1*src0->nb[1]), b);
+        ggml_vec_gelu_f32(nc, dst_row, dst_row);
+    }
+}
+
+static void ggml_compute_forward_add_gelu(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        struct ggml_tensor * dst) {
+    switch (src0->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_add_gelu_f32(params, src0, src1, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
 // ggml_compute_forward_silu
 
 static void ggml_compute_forward_silu_f32(
@@ -10565,9 +10942,11 @@ static bool ggml_compute_forward_mul_mat_use_blas(
     const int64_t ne0 = dst->ne[0];
     const int64_t ne1 = dst->ne[1];
 
+    // src0 and src1 can be strided views (e.g. permuted heads), as long as their rows are contiguous
     // TODO: find the optimal values for these
-    if (ggml_is_contiguous(src0) &&
-        ggml_is_contiguous(src1) &&
+    if (src0->nb[0] == ggml_type_size(src0->type) &&
+        src1->nb[0] == sizeof(float) && src1->nb[1] % sizeof(float) == 0 &&
+        src1->type == GGML_TYPE_F32 &&
         (ne0 >= 32 && ne1 >= 32 && ne10 >= 32)) {
 
         /*printf("BLAS: %d %d %d %d %d\n", ne0, ne1, ne10, ne00, ne01);*/
@@ -10596,7 +10975,7 @@ static void ggml_compute_forward_mul_mat_f32(
     assert(ne2  == ne12);
     assert(ne3  == ne13);
 
-    // we don't support permuted src0 or src1
+    // src0 and src1 rows must be contiguous, the other dimensions can be strided (e.g. permuted)
     assert(nb00 == sizeof(float));
     assert(nb10 == sizeof(float));
 
@@ -10645,8 +11024,8 @@ static void ggml_compute_forward_mul_mat_f32(
 
                 cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
                         ne11, ne01, ne10,
-                        1.0f,    y, ne10,
-                                 x, ne00,
+                        1.0f,    y, nb11/sizeof(float),
+                                 x, nb01/sizeof(float),
                         0.0f,    d, ne01);
             }
         }
@@ -10799,7 +11178,7 @@ static void ggml_compute_forward_mul_mat_f16_f32(
                 // zT = y * xT
                 cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
                         ne11, ne01, ne10,
-                        1.0f,    y, ne10,
+                        1.0f,    y, nb11/sizeof(float),
                                  x, ne00,
                         0.0f,    d, ne01);
             }
@@ -10811,7 +11190,18 @@ static void ggml_compute_forward_mul_mat_f16_f32(
     }
 #endif
 
+    // F16 src1 (e.g. the output of ggml_im2col_1d) is used in-place, without the single-threaded conversion
+    const bool src1_f16 = src1->type == GGML_TYPE_F16;
+
+    if (src1_f16) {
+        GGML_ASSERT(nb10 == sizeof(ggml_fp16_t));
+    }
+
     if (params->type == GGML_TASK_INIT) {
+        if (src1_f16) {
+            return;
+        }
+
         ggml_fp16_t * const wdata = params->wdata;
 
         size_t id = 0;
@@ -10836,7 +11226,7 @@ static void ggml_compute_forward_mul_mat_f16_f32(
 
     // fp16 -> half the size, so divide by 2
     // TODO: do not support transposed src1
-    assert(nb10/2 == sizeof(ggml_fp16_t));
+    assert(src1_f16 || nb10/2 == sizeof(ggml_fp16_t));
 
     // parallelize by src0 rows using ggml_vec_dot_f16
 
@@ -10866,12 +11256,21 @@ static void ggml_compute_forward_mul_mat_f16_f32(
         const int i3 = i03;
 
         ggml_fp16_t * src0_row = (ggml_fp16_t *) ((char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03));
-        ggml_fp16_t * src1_col =                                wdata + (       0 + i12*ne11 + i13*ne12*ne11)*ne00;
 
         float * dst_col = (float *) ((char *) dst->data + (i0*nb0 + 0*nb1 + i2*nb2 + i3*nb3));
 
-        for (int64_t ic = 0; ic < ne11; ++ic) {
-            ggml_vec_dot_f16(ne00, &dst_col[ic*ne0], src0_row, src1_col + ic*ne00);
+        if (src1_f16) {
+            char * src1_col = (char *) src1->data + i12*nb12 + i13*nb13;
+
+            for (int64_t ic = 0; ic < ne11; ++ic) {
+                ggml_vec_dot_f16(ne00, &dst_col[ic*ne0], src0_row, (ggml_fp16_t *) (src1_col + ic*nb11));
+            }
+        } else {
+            ggml_fp16_t * src1_col = wdata + (0 + i12*ne11 + i13*ne12*ne11)*ne00;
+
+            for (int64_t ic = 0; ic < ne11; ++ic) {
+                ggml_vec_dot_f16(ne00, &dst_col[ic*ne0], src0_row, src1_col + ic*ne00);
+            }
         }
     }
 
@@ -10911,7 +11310,7 @@ static void ggml_compute_forward_mul_mat_q_f32(
     vec_dot_q_t      const vec_dot_q          = quantize_fns[type].vec_dot_q;
     enum ggml_type   const vec_dot_type       = quantize_fns[type].vec_dot_type;
 
-    // we don't support permuted src0 or src1
+    // src0 and src1 rows must be contiguous, the other dimensions can be strided (e.g. permuted)
     GGML_ASSERT(nb00 == GGML_TYPE_SIZE[type]);
     GGML_ASSERT(nb10 == sizeof(float));
 
@@ -10975,7 +11374,7 @@ static void ggml_compute_forward_mul_mat_q_f32(
 
                 cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
                         ne11, ne01, ne10,
-                        1.0f,    y, ne10,
+                        1.0f,    y, nb11/sizeof(float),
                                  x, ne00,
                         0.0f,    d, ne01);
             }
@@ -13224,57 +13623,140 @@ static void ggml_compute_forward_conv_1d(
     };
 }
 
-// ggml_compute_forward_conv_2d_sk_p0
+// ggml_compute_forward_im2col_1d
 
-static void ggml_compute_forward_conv_2d_sk_p0_f16_f32(
+static void ggml_compute_forward_im2col_1d_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
-        const struct ggml_tensor * src1,
+        const struct ggml_tensor * opt0,
               struct ggml_tensor * dst) {
-    GGML_ASSERT(src0->type == GGML_TYPE_F16);
-    GGML_ASSERT(src1->type == GGML_TYPE_F32);
-    GGML_ASSERT( dst->type == GGML_TYPE_F32);
+    GGML_ASSERT(src0->type == GGML_TYPE_F32);
 
-    int64_t t0 = ggml_perf_time_us();
-    UNUSED(t0);
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
 
-    GGML_TENSOR_BINARY_OP_LOCALS;
+    const int32_t nk = ((const int32_t *)(opt0->data))[0];
+    const int32_t s0 = ((const int32_t *)(opt0->data))[1];
+    const int32_t p0 = ((const int32_t *)(opt0->data))[2];
 
     const int ith = params->ith;
     const int nth = params->nth;
 
-    const int nk0 = ne00;
-    const int nk1 = ne01;
+    const int64_t n  = src0->ne[0];
+    const int64_t nc = src0->ne[1];
 
-    // size of the convolution row - the kernel size unrolled across all channels
-    const int ew0 = nk0*nk1*ne02;
+    const size_t nb0 = src0->nb[0];
+    const size_t nb1 = src0->nb[1];
+    const size_t nb2 = src0->nb[2];
 
-    GGML_ASSERT(nb00 == sizeof(ggml_fp16_t));
-    GGML_ASSERT(nb10 == sizeof(float));
+    GGML_ASSERT(dst->ne[0] == nk*nc);
 
-    if (params->type == GGML_TASK_INIT) {
-        // TODO: fix this memset (wsize is overestimated)
-        memset(params->wdata, 0, params->wsize);
+    // output positions in dst, over all sequences of the batch
+    const int nr = dst->ne[1];
 
-        // prepare source data (src1)
-        {
-            ggml_fp16_t * const wdata = (ggml_fp16_t *) params->wdata + 0;
+    // output positions per sequence
+    const int nl = nr/src0->ne[2];
 
-            for (int i12 = 0; i12 < ne12; i12++) {
-                const float * const src = (float *)((char *) src1->data + i12*nb12);
-                ggml_fp16_t * dst_data = wdata;
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
 
-                for (int i1 = 0; i1 < ne1; i1++) {
-                    for (int i0 = 0; i0 < ne0; i0++) {
-                        for (int ik1 = 0; ik1 < nk1; ik1++) {
-                            for (int ik0 = 0; ik0 < nk0; ik0++) {
-                                dst_data[(i1*ne0 + i0)*ew0 + i12*(nk0*nk1) + ik1*nk0 + ik0] =
-                                    GGML_FP32_TO_FP16(src[(i1*nk1 + ik1)*ne10 + (i0*nk0 + ik0)]);
-                            }
-                        }
-                    }
-                }
-            }
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int ir = ir0; ir < ir1; ir++) {
+        char * dst_row = (char *) dst->data + ir*dst->nb[1];
+
+        const int ib = ir/nl;
+        const int il = ir - ib*nl;
+
+        const char * src = (const char *) src0->data + ib*nb2;
+
+        for (int64_t ic = 0; ic < nc; ic++) {
+            for (int32_t ik = 0; ik < nk; ik++) {
+                const int64_t i = (int64_t) il*s0 + ik - p0;
+
+                const float v = (i < 0 || i >= n) ? 0.0f : *(const float *) (src + i*nb0 + ic*nb1);
+
+                if (dst->type == GGML_TYPE_F16) {
+                    ((ggml_fp16_t *) dst_row)[ic*nk + ik] = GGML_FP32_TO_FP16(v);
+                } else {
+                    ((float *) dst_row)[ic*nk + ik] = v;
+                }
+            }
+        }
+    }
+}
+
+static void ggml_compute_forward_im2col_1d(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * opt0,
+              struct ggml_tensor * dst) {
+    switch (src0->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_im2col_1d_f32(params, src0, opt0, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
+// ggml_compute_forward_conv_2d_sk_p0
+
+static void ggml_compute_forward_conv_2d_sk_p0_f16_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+              struct ggml_tensor * dst) {
+    GGML_ASSERT(src0->type == GGML_TYPE_F16);
+    GGML_ASSERT(src1->type == GGML_TYPE_F32);
+    GGML_ASSERT( dst->type == GGML_TYPE_F32);
+
+    int64_t t0 = ggml_perf_time_us();
+    UNUSED(t0);
+
+    GGML_TENSOR_BINARY_OP_LOCALS;
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nk0 = ne00;
+    const int nk1 = ne01;
+
+    // size of the convolution row - the kernel size unrolled across all channels
+    const int ew0 = nk0*nk1*ne02;
+
+    GGML_ASSERT(nb00 == sizeof(ggml_fp16_t));
+    GGML_ASSERT(nb10 == sizeof(float));
+
+    if (params->type == GGML_TASK_INIT) {
+        // TODO: fix this memset (wsize is overestimated)
+        memset(params->wdata, 0, params->wsize);
+
+        // prepare source data (src1)
+        {
+            ggml_fp16_t * const wdata = (ggml_fp16_t *) params->wdata + 0;
+
+            for (int i12 = 0; i12 < ne12; i12++) {
+                const float * const src = (float *)((char *) src1->data + i12*nb12);
+                ggml_fp16_t * dst_data = wdata;
+
+                for (int i1 = 0; i1 < ne1; i1++) {
+                    for (int i0 = 0; i0 < ne0; i0++) {
+                        for (int ik1 = 0; ik1 < nk1; ik1++) {
+                            for (int ik0 = 0; ik0 < nk0; ik0++) {
+                                dst_data[(i1*ne0 + i0)*ew0 + i12*(nk0*nk1) + ik1*nk0 + ik0] =
+                                    GGML_FP32_TO_FP16(src[(i1*nk1 + ik1)*ne10 + (i0*nk0 + ik0)]);
+                            }
+                        }
+                    }
+                }
+            }
         }
 
         return;
@@ -13777,6 +14259,429 @@ static void ggml_compute_forward_flash_attn(
     }
 }
 
+// ggml_compute_forward_flash_attn_tiled
+
+// queries and keys processed per block
+#define GGML_FLASH_ATTN_TILE_Q  16
+#define GGML_FLASH_ATTN_TILE_KV 128
+
+// per-thread work buffer:
+//   S   [TILE_Q][TILE_KV] F32 - scores of the current block
+//   O   [TILE_Q][D]       F32 - unnormalized output accumulators
+//   SM  [TILE_Q]          F32 - running max of the scores
+//   SL  [TILE_Q]          F32 - running sum of the exponentials
+//   Q16 [TILE_Q][D]       F16 - queries converted to F16
+//   P16 [TILE_Q][TILE_KV] F16 - probabilities of the current block
+static size_t ggml_flash_attn_tiled_wsize(int64_t D) {
+    const size_t size =
+        sizeof(float)*(GGML_FLASH_ATTN_TILE_Q*(GGML_FLASH_ATTN_TILE_KV + D + 2)) +
+        sizeof(ggml_fp16_t)*(GGML_FLASH_ATTN_TILE_Q*(D + GGML_FLASH_ATTN_TILE_KV));
+
+    return ggml_up(size, CACHE_LINE_SIZE);
+}
+
+// computes exp(S[i] - max) in-place and returns the sum, using the same lookup table as the softmax
+inline static ggml_float ggml_flash_attn_tiled_exp(const int n, float * S, const float max) {
+    ggml_float sum = 0.0;
+
+    for (int i = 0; i < n; ++i) {
+        uint16_t scvt;
+        ggml_fp16_t s = GGML_FP32_TO_FP16(S[i] - max);
+        memcpy(&scvt, &s, sizeof(uint16_t));
+        S[i] = GGML_FP16_TO_FP32(table_exp_f16[scvt]);
+        sum += (ggml_float) S[i];
+    }
+
+    return sum;
+}
+
+// merges the partial results of the ns threads that split the keys of each of the nr blocks
+// the partial results of block ir are in the work buffers of the threads ir*ns ... ir*ns + ns - 1
+static void ggml_flash_attn_tiled_merge(
+        const struct ggml_compute_params * params,
+        const int64_t D,
+        const int64_t N,
+        const int64_t H,
+        const int64_t nr,
+        const int64_t ns,
+              struct ggml_tensor * dst) {
+    const int TQ  = GGML_FLASH_ATTN_TILE_Q;
+    const int TKV = GGML_FLASH_ATTN_TILE_KV;
+
+    const size_t  wsize = ggml_flash_attn_tiled_wsize(D);
+    const int64_t nqb   = (N + TQ - 1)/TQ;
+
+    for (int64_t ir = 0; ir < nr; ++ir) {
+        const int64_t ib  = ir/(nqb*H);
+        const int64_t ih  = ir/nqb - ib*H;
+        const int64_t iq0 = (ir - (ib*H + ih)*nqb)*TQ;
+        const int64_t nq  = MIN(TQ, N - iq0);
+
+        for (int64_t iq = 0; iq < nq; ++iq) {
+            float max = -INFINITY;
+
+            for (int64_t is = 0; is < ns; ++is) {
+                const float * SM = (const float *) ((const char *) params->wdata + (ir*ns + is)*wsize) + TQ*(TKV + D);
+
+                max = MAX(max, SM[iq]);
+            }
+
+            float * dst_row = (float *) ((char *) dst->data + ih*dst->nb[1] + (iq0 + iq)*dst->nb[2] + ib*dst->nb[3]);
+
+            ggml_vec_set_f32(D, dst_row, 0.0f);
+
+            ggml_float sum = 0.0;
+
+            for (int64_t is = 0; is < ns; ++is) {
+                float * O  = (float *) ((char *) params->wdata + (ir*ns + is)*wsize) + TQ*TKV;
+                float * SM = O  + TQ*D;
+                float * SL = SM + TQ;
+
+                const float ms = expf(SM[iq] - max);
+
+                ggml_vec_mad_f32(D, dst_row, O + iq*D, ms);
+                sum += (ggml_float) SL[iq]*ms;
+            }
+
+            assert(sum > 0.0);
+
+            ggml_vec_scale_f32(D, dst_row, (float) (1.0/sum));
+        }
+    }
+}
+
+static void ggml_compute_forward_flash_attn_tiled_f16(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const float scale,
+              struct ggml_tensor * dst) {
+    int64_t t0 = ggml_perf_time_us();
+    UNUSED(t0);
+
+    GGML_TENSOR_LOCALS(int64_t, neq, q,   ne);
+    GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb);
+    GGML_TENSOR_LOCALS(int64_t, nek, k,   ne);
+    GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb);
+    GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb);
+    GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb);
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t D = neq0;
+    const int64_t N = neq1;
+    const int64_t H = neq2;
+    const int64_t M = nek1;
+    const int64_t B = neq3;
+
+    GGML_ASSERT(nbq0 == ggml_type_size(q->type));
+    GGML_ASSERT(nbk0 == sizeof(ggml_fp16_t));
+    GGML_ASSERT(nbv0 == sizeof(ggml_fp16_t));
+    GGML_ASSERT(nb0  == sizeof(float));
+
+    if (params->type == GGML_TASK_INIT) {
+        return;
+    }
+
+    const int TQ  = GGML_FLASH_ATTN_TILE_Q;
+    const int TKV = GGML_FLASH_ATTN_TILE_KV;
+
+    // parallelize by blocks of q rows within a head
+    const int64_t nqb = (N + TQ - 1)/TQ;
+
+    // total blocks, over all heads of all batches
+    const int64_t nr = nqb*H*B;
+
+    // with fewer blocks than threads (e.g. the decoder cross-attention with N = 1), the keys of each block are split
+    // between ns threads, which leave their partial results in their work buffers for the FINALIZE pass
+    const int64_t nkb = (M + TKV - 1)/TKV;
+    const int64_t ns  = nr < nth ? MAX(1, MIN(nth/nr, nkb)) : 1;
+
+    if (params->type == GGML_TASK_FINALIZE) {
+        if (ns > 1) {
+            ggml_flash_attn_tiled_merge(params, D, N, H, nr, ns, dst);
+        }
+        return;
+    }
+
+    // blocks per thread
+    const int64_t dr = (nr + nth - 1)/nth;
+
+    // block range for this thread
+    const int64_t ir0 = ns > 1 ? ith/ns : dr*ith;
+    const int64_t ir1 = ns > 1 ? MIN(ir0 + 1, nr) : MIN(ir0 + dr, nr);
+
+    // key range for this thread
+    const int64_t is  = ns > 1 ? ith%ns : 0;
+    const int64_t ik1 = MIN(M, ((is + 1)*nkb/ns)*TKV);
+
+    float * S  = (float *) ((char *) params->wdata + ith*ggml_flash_attn_tiled_wsize(D));
+    float * O  = S  + TQ*TKV;
+    float * SM = O  + TQ*D;
+    float * SL = SM + TQ;
+
+    ggml_fp16_t * Q16 = (ggml_fp16_t *) (SL + TQ);
+    ggml_fp16_t * P16 = Q16 + TQ*D;
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t ib  = ir/(nqb*H);
+        const int64_t ih  = ir/nqb - ib*H;
+        const int64_t iq0 = (ir - (ib*H + ih)*nqb)*TQ;
+        const int64_t nq  = MIN(TQ, N - iq0);
+
+        for (int64_t iq = 0; iq < nq; ++iq) {
+            const char * q_row = (const char *) q->data + (iq0 + iq)*nbq1 + ih*nbq2 + ib*nbq3;
+
+            if (q->type == GGML_TYPE_F16) {
+                memcpy(Q16 + iq*D, q_row, D*sizeof(ggml_fp16_t));
+            } else {
+                ggml_fp32_to_fp16_row((const float *) q_row, Q16 + iq*D, D);
+            }
+
+            ggml_vec_set_f32(D, O + iq*D, 0.0f);
+
+            SM[iq] = -INFINITY;
+            SL[iq] = 0.0f;
+        }
+
+        for (int64_t ik0 = (is*nkb/ns)*TKV; ik0 < ik1; ik0 += TKV) {
+            const int nk = MIN(TKV, ik1 - ik0);
+
+            // S = K*Q^T for this block - each row of K is reused for all queries in the block
+            for (int ik = 0; ik < nk; ++ik) {
+                ggml_fp16_t * k_row = (ggml_fp16_t *) ((char *) k->data + (ik0 + ik)*nbk1 + ih*nbk2 + ib*nbk3);
+
+                for (int64_t iq = 0; iq < nq; ++iq) {
+                    ggml_vec_dot_f16(D, S + iq*TKV + ik, k_row, Q16 + iq*D);
+                }
+            }
+
+            // online softmax: rescale the accumulators if the running max changed
+            for (int64_t iq = 0; iq < nq; ++iq) {
+                float * SS = S + iq*TKV;
+
+                ggml_vec_scale_f32(nk, SS, scale);
+
+                float max = -INFINITY;
+                ggml_vec_max_f32(nk, &max, SS);
+
+                const float max_new = MAX(SM[iq], max);
+                const float ms = SM[iq] == -INFINITY ? 0.0f : expf(SM[iq] - max_new);
+
+                const ggml_float sum = ggml_flash_attn_tiled_exp(nk, SS, max_new);
+
+                for (int i = 0; i < nk; ++i) {
+                    P16[iq*TKV + i] = GGML_FP32_TO_FP16(SS[i]);
+                }
+
+                if (ms != 1.0f) {
+                    ggml_vec_scale_f32(D, O + iq*D, ms);
+                }
+
+                SM[iq] = max_new;
+                SL[iq] = SL[iq]*ms + sum;
+            }
+
+            // O += P*V - each row of V^T is reused for all queries in the block
+            for (int64_t id = 0; id < D; ++id) {
+                ggml_fp16_t * v_row = (ggml_fp16_t *) ((char *) v->data + ik0*nbv0 + id*nbv1 + ih*nbv2 + ib*nbv3);
+
+                for (int64_t iq = 0; iq < nq; ++iq) {
+                    float r;
+                    ggml_vec_dot_f16(nk, &r, v_row, P16 + iq*TKV);
+                    O[iq*D + id] += r;
+                }
+            }
+        }
+
+        // the partial results are merged by ggml_flash_attn_tiled_merge()
+        if (ns > 1) {
+            continue;
+        }
+
+        for (int64_t iq = 0; iq < nq; ++iq) {
+            float * dst_row = (float *) ((char *) dst->data + ih*nb1 + (iq0 + iq)*nb2 + ib*nb3);
+
+            assert(SL[iq] > 0.0f);
+
+            ggml_vec_cpy_f32  (D, dst_row, O + iq*D);
+            ggml_vec_scale_f32(D, dst_row, 1.0f/SL[iq]);
+        }
+    }
+}
+
+static void ggml_compute_forward_flash_attn_tiled_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const float scale,
+              struct ggml_tensor * dst) {
+    int64_t t0 = ggml_perf_time_us();
+    UNUSED(t0);
+
+    GGML_TENSOR_LOCALS(int64_t, neq, q,   ne);
+    GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb);
+    GGML_TENSOR_LOCALS(int64_t, nek, k,   ne);
+    GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb);
+    GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb);
+    GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb);
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t D = neq0;
+    const int64_t N = neq1;
+    const int64_t H = neq2;
+    const int64_t M = nek1;
+    const int64_t B = neq3;
+
+    GGML_ASSERT(nbq0 == sizeof(float));
+    GGML_ASSERT(nbk0 == sizeof(float));
+    GGML_ASSERT(nbv0 == sizeof(float));
+    GGML_ASSERT(nb0  == sizeof(float));
+
+    if (params->type == GGML_TASK_INIT) {
+        return;
+    }
+
+    const int TQ  = GGML_FLASH_ATTN_TILE_Q;
+    const int TKV = GGML_FLASH_ATTN_TILE_KV;
+
+    // parallelize by blocks of q rows within a head
+    const int64_t nqb = (N + TQ - 1)/TQ;
+
+    // total blocks, over all heads of all batches
+    const int64_t nr = nqb*H*B;
+
+    // with fewer blocks than threads (e.g. the decoder cross-attention with N = 1), the keys of each block are split
+    // between ns threads, which leave their partial results in their work buffers for the FINALIZE pass
+    const int64_t nkb = (M + TKV - 1)/TKV;
+    const int64_t ns  = nr < nth ? MAX(1, MIN(nth/nr, nkb)) : 1;
+
+    if (params->type == GGML_TASK_FINALIZE) {
+        if (ns > 1) {
+            ggml_flash_attn_tiled_merge(params, D, N, H, nr, ns, dst);
+        }
+        return;
+    }
+
+    // blocks per thread
+    const int64_t dr = (nr + nth - 1)/nth;
+
+    // block range for this thread
+    const int64_t ir0 = ns > 1 ? ith/ns : dr*ith;
+    const int64_t ir1 = ns > 1 ? MIN(ir0 + 1, nr) : MIN(ir0 + dr, nr);
+
+    // key range for this thread
+    const int64_t is  = ns > 1 ? ith%ns : 0;
+    const int64_t ik1 = MIN(M, ((is + 1)*nkb/ns)*TKV);
+
+    // same layout as the F16 version, the F16 parts of the buffer are not used
+    float * S  = (float *) ((char *) params->wdata + ith*ggml_flash_attn_tiled_wsize(D));
+    float * O  = S  + TQ*TKV;
+    float * SM = O  + TQ*D;
+    float * SL = SM + TQ;
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t ib  = ir/(nqb*H);
+        const int64_t ih  = ir/nqb - ib*H;
+        const int64_t iq0 = (ir - (ib*H + ih)*nqb)*TQ;
+        const int64_t nq  = MIN(TQ, N - iq0);
+
+        for (int64_t iq = 0; iq < nq; ++iq) {
+            ggml_vec_set_f32(D, O + iq*D, 0.0f);
+
+            SM[iq] = -INFINITY;
+            SL[iq] = 0.0f;
+        }
+
+        for (int64_t ik0 = (is*nkb/ns)*TKV; ik0 < ik1; ik0 += TKV) {
+            const int nk = MIN(TKV, ik1 - ik0);
+
+            for (int ik = 0; ik < nk; ++ik) {
+                float * k_row = (float *) ((char *) k->data + (ik0 + ik)*nbk1 + ih*nbk2 + ib*nbk3);
+
+                for (int64_t iq = 0; iq < nq; ++iq) {
+                    ggml_vec_dot_f32(D, S + iq*TKV + ik, k_row, (float *) ((char *) q->data + (iq0 + iq)*nbq1 + ih*nbq2 + ib*nbq3));
+                }
+            }
+
+            for (int64_t iq = 0; iq < nq; ++iq) {
+                float * SS = S + iq*TKV;
+
+                ggml_vec_scale_f32(nk, SS, scale);
+
+                float max = -INFINITY;
+                ggml_vec_max_f32(nk, &max, SS);
+
+                const float max_new = MAX(SM[iq], max);
+                const float ms = SM[iq] == -INFINITY ? 0.0f : expf(SM[iq] - max_new);
+
+                const ggml_float sum = ggml_flash_attn_tiled_exp(nk, SS, max_new);
+
+                if (ms != 1.0f) {
+                    ggml_vec_scale_f32(D, O + iq*D, ms);
+                }
+
+                SM[iq] = max_new;
+                SL[iq] = SL[iq]*ms + sum;
+            }
+
+            for (int64_t id = 0; id < D; ++id) {
+                float * v_row = (float *) ((char *) v->data + ik0*nbv0 + id*nbv1 + ih*nbv2 + ib*nbv3);
+
+                for (int64_t iq = 0; iq < nq; ++iq) {
+                    float r;
+                    ggml_vec_dot_f32(nk, &r, v_row, S + iq*TKV);
+                    O[iq*D + id] += r;
+                }
+            }
+        }
+
+        // the partial results are merged by ggml_flash_attn_tiled_merge()
+        if (ns > 1) {
+            continue;
+        }
+
+        for (int64_t iq = 0; iq < nq; ++iq) {
+            float * dst_row = (float *) ((char *) dst->data + ih*nb1 + (iq0 + iq)*nb2 + ib*nb3);
+
+            assert(SL[iq] > 0.0f);
+
+            ggml_vec_cpy_f32  (D, dst_row, O + iq*D);
+            ggml_vec_scale_f32(D, dst_row, 1.0f/SL[iq]);
+        }
+    }
+}
+
+static void ggml_compute_forward_flash_attn_tiled(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const struct ggml_tensor * opt0,
+        struct ggml_tensor * dst) {
+    const float scale = ((float *) opt0->data)[0];
+
+    switch (k->type) {
+        case GGML_TYPE_F16:
+            {
+                ggml_compute_forward_flash_attn_tiled_f16(params, q, k, v, scale, dst);
+            } break;
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_flash_attn_tiled_f32(params, q, k, v, scale, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
 // ggml_compute_forward_flash_ff
 
 static void ggml_compute_forward_flash_ff_f16(
@@ -15027,6 +15932,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_gelu_quick(params, tensor->src0, tensor);
             } break;
+        case GGML_OP_ADD_GELU:
+            {
+                ggml_compute_forward_add_gelu(params, tensor->src0, tensor->src1, tensor);
+            } break;
         case GGML_OP_SILU:
             {
                 ggml_compute_forward_silu(params, tensor->src0, tensor);
@@ -15139,6 +16048,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_conv_2d(params, tensor->src0, tensor->src1, tensor->opt[0], tensor);
             } break;
+        case GGML_OP_IM2COL_1D:
+            {
+                ggml_compute_forward_im2col_1d(params, tensor->src0, tensor->opt[0], tensor);
+            } break;
         case GGML_OP_FLASH_ATTN:
             {
                 const int32_t t = ggml_get_i32_1d(tensor->opt[1], 0);
@@ -15146,6 +16059,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
                 const bool masked = t != 0;
                 ggml_compute_forward_flash_attn(params, tensor->src0, tensor->src1, tensor->opt[0], masked, tensor);
             } break;
+        case GGML_OP_FLASH_ATTN_TILED:
+            {
+                ggml_compute_forward_flash_attn_tiled(params, tensor->src0, tensor->src1, tensor->opt[0], tensor->opt[1], tensor);
+            } break;
         case GGML_OP_FLASH_FF:
             {
                 ggml_compute_forward_flash_ff(params, tensor->src0, tensor->src1, tensor->opt[0], tensor->opt[1], tensor->opt[2], tensor);
@@ -15467,6 +16384,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ASSERT(false); // TODO: not implemented
             } break;
+        case GGML_OP_ADD_GELU:
+            {
+                GGML_ASSERT(false); // TODO: not implemented
+            } break;
         case GGML_OP_SILU:
             {
                 // necessary for llama
@@ -15839,6 +16760,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ASSERT(false); // TODO: not implemented
             } break;
+        case GGML_OP_IM2COL_1D:
+            {
+                GGML_ASSERT(false); // TODO: not implemented
+            } break;
         case GGML_OP_FLASH_ATTN:
             {
                 struct ggml_tensor * flash_grad = NULL;
@@ -15996,6 +16921,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
                             inplace);
                 }
             } break;
+        case GGML_OP_FLASH_ATTN_TILED:
+            {
+                GGML_ASSERT(false); // TODO: not implemented
+            } break;
         case GGML_OP_FLASH_FF:
             {
                 GGML_ASSERT(false); // not supported
@@ -16137,6 +17066,11 @@ struct ggml_cgraph ggml_build_forward(struct ggml_tensor * tensor) {
         /*.perf_runs    =*/ 0,
         /*.perf_cycles  =*/ 0,
         /*.perf_time_us =*/ 0,
+        /*.abort_callback      =*/ NULL,
+        /*.abort_callback_data =*/ NULL,
+        /*.thread_start        =*/ NULL,
+        /*.thread_wait         =*/ NULL,
+        /*.thread_data         =*/ NULL,
     };
 
     ggml_build_forward_impl(&result, tensor, false);
@@ -16319,6 +17253,16 @@ struct ggml_compute_state {
     struct ggml_compute_state_shared * shared;
 };
 
+static thread_ret_t ggml_graph_compute_thread(void * data);
+
+// helper thread of a graph on an external thread pool
+static void ggml_graph_compute_task(void * data) {
+    ggml_graph_compute_thread(data);
+
+    // the thread of the pool may run the tasks of other graphs
+    clear_numa_thread_affinity();
+}
+
 static void ggml_graph_compute_perf_stats_node(struct ggml_tensor * node, const struct ggml_compute_state_shared * st) {
     int64_t cycles_cur  = ggml_perf_cycles()  - st->perf_node_start_cycles;
     int64_t time_us_cur = ggml_perf_time_us() - st->perf_node_start_time_us;
@@ -16363,6 +17307,12 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
             while (++node_n < cgraph->n_nodes) {
                 GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, node_n, cgraph->n_nodes);
 
+                // aborted - all threads stop at the end of the graph
+                if (cgraph->abort_callback && cgraph->abort_callback(cgraph->abort_callback_data)) {
+                    node_n = cgraph->n_nodes;
+                    break;
+                }
+
                 struct ggml_tensor * node = cgraph->nodes[node_n];
 
                 state->shared->perf_node_start_cycles  = ggml_perf_cycles();
@@ -16508,6 +17458,7 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                 case GGML_OP_MUL:
                 case GGML_OP_GELU:
                 case GGML_OP_GELU_QUICK:
+                case GGML_OP_ADD_GELU:
                 case GGML_OP_SILU:
                 case GGML_OP_SILU_BACK:
                 case GGML_OP_NORM:
@@ -16544,7 +17495,9 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                         }
                         else
 #endif
-                        if (node->src0->type == GGML_TYPE_F16 && node->src1->type == GGML_TYPE_F32) {
+                        if (node->src0->type == GGML_TYPE_F16 && node->src1->type == GGML_TYPE_F16) {
+                            cur = 0; // src1 is used directly, no conversion needed
+                        } else if (node->src0->type == GGML_TYPE_F16 && node->src1->type == GGML_TYPE_F32) {
 #if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
                             if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
                                 node->n_tasks = 1; // TODO: this actually is doing nothing
@@ -16643,6 +17596,10 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
 
                         work_size = MAX(work_size, cur);
                     } break;
+                case GGML_OP_IM2COL_1D:
+                    {
+                        node->n_tasks = n_threads;
+                    } break;
                 case GGML_OP_CONV_2D:
                     {
                         node->n_tasks = n_threads;
@@ -16696,6 +17653,15 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                             cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
                         }
 
+                        work_size = MAX(work_size, cur);
+                    } break;
+                case GGML_OP_FLASH_ATTN_TILED:
+                    {
+                        node->n_tasks = n_threads;
+
+                        // fixed size per thread, independent of the number of keys
+                        const size_t cur = ggml_flash_attn_tiled_wsize(node->src0->ne[0])*node->n_tasks;
+
                         work_size = MAX(work_size, cur);
                     } break;
                 case GGML_OP_FLASH_FF:
@@ -16795,6 +17761,11 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                 .shared = &state_shared,
             };
 
+            if (cgraph->thread_start) {
+                cgraph->thread_start(cgraph->thread_data, ggml_graph_compute_task, &workers[j]);
+                continue;
+            }
+
             const int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
             GGML_ASSERT(rc == 0);
         }
@@ -16812,7 +17783,9 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
     clear_numa_thread_affinity();
 
     // join thread pool
-    if (n_threads > 1) {
+    if (n_threads > 1 && cgraph->thread_start) {
+        cgraph->thread_wait(cgraph->thread_data);
+    } else if (n_threads > 1) {
         for (int j = 1; j < n_threads; j++) {
             const int rc = ggml_thread_join(workers[j].thrd, NULL);
             GGML_ASSERT(rc == 0);
@@ -253,6 +253,15 @@ extern "C" {
     GGML_API void ggml_fp16_to_fp32_row(const ggml_fp16_t * x, float * y, size_t n);
     GGML_API void ggml_fp32_to_fp16_row(const float * x, ggml_fp16_t * y, size_t n);
 
+    // row helpers used for sampling
+    // ggml_exp_row_f32: y[i] = expf(x[i] - m) for x[i] <= m (0.0f for x[i] == -INFINITY), returns the sum of y
+    GGML_API float ggml_max_row_f32(const float * x, size_t n);
+    GGML_API float ggml_exp_row_f32(const float * x, float * y, float m, size_t n);
+
+    // indices of the k largest elements of x, sorted by descending value (lower index first for equal values)
+    // elements equal to -INFINITY are never selected - returns the number of written indices (<= k)
+    GGML_API int   ggml_topk_row_f32(const float * x, size_t n, int k, int * idx);
+
     struct ggml_object;
     struct ggml_context;
 
@@ -333,6 +342,7 @@ extern "C" {
         GGML_OP_RELU,
         GGML_OP_GELU,
         GGML_OP_GELU_QUICK,
+        GGML_OP_ADD_GELU,
         GGML_OP_SILU,
         GGML_OP_SILU_BACK,
         GGML_OP_NORM, // normalize
@@ -363,8 +373,10 @@ extern "C" {
         GGML_OP_CLAMP,
         GGML_OP_CONV_1D,
         GGML_OP_CONV_2D,
+        GGML_OP_IM2COL_1D,
 
         GGML_OP_FLASH_ATTN,
+        GGML_OP_FLASH_ATTN_TILED,
         GGML_OP_FLASH_FF,
         GGML_OP_FLASH_ATTN_BACK,
         GGML_OP_WIN_PART,
@@ -437,6 +449,9 @@ extern "C" {
 
     static const size_t GGML_TENSOR_SIZE = sizeof(struct ggml_tensor);
 
+    // task of a helper thread of ggml_graph_compute()
+    typedef void (*ggml_thread_task)(void * arg);
+
     // computation graph
     struct ggml_cgraph {
         int n_nodes;
@@ -454,6 +469,18 @@ extern "C" {
         int     perf_runs;
         int64_t perf_cycles;
         int64_t perf_time_us;
+
+        // called before each node - ggml_graph_compute() stops when it returns true, leaving the remaining nodes
+        // uncomputed (optional)
+        bool (*abort_callback)(void * data);
+        void * abort_callback_data;
+
+        // run the n_threads - 1 helper threads on an external thread pool instead of creating them for each graph
+        // (optional). thread_start must run task(arg) on a thread of the pool, concurrently with the calling thread and
+        // the other tasks of the graph - thread_wait returns once all the tasks started for the graph are done
+        void (*thread_start)(void * data, ggml_thread_task task, void * arg);
+        void (*thread_wait) (void * data);
+        void * thread_data;
     };
 
     // scratch buffer
@@ -808,6 +835,12 @@ extern "C" {
             struct ggml_context * ctx,
             struct ggml_tensor  * a);
 
+    // gelu(a + b), where b is a bias vector with a->ne[0] elements added to each row of a
+    GGML_API struct ggml_tensor * ggml_add_gelu(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b);
+
     GGML_API struct ggml_tensor * ggml_silu(
             struct ggml_context * ctx,
             struct ggml_tensor  * a);
@@ -851,6 +884,8 @@ extern "C" {
     // A: n columns, m rows
     // B: n columns, p rows  (i.e. we transpose it internally)
     // result is m columns, p rows
+    // A and B can be strided views (e.g. heads permuted with ggml_permute) as long as their rows are contiguous
+    // B can be F16 if A is F16
     GGML_API struct ggml_tensor * ggml_mul_mat(
             struct ggml_context * ctx,
             struct ggml_tensor  * a,
@@ -1161,6 +1196,21 @@ extern "C" {
             int                   s,
             int                   d);
 
+    // unfold the 1D input b [N, IC] into the columns needed to compute a 1D convolution with kernel a [K, IC, OC]
+    // as a single matrix multiplication:
+    //
+    //   result [K*IC, OL], result[ol][ic*K + k] = b[ol*s0 + k - p0][ic]
+    //
+    // the result has the type of a (F16 or F32), so that it can be multiplied directly with the kernel viewed as
+    // a [K*IC, OC] matrix. b can be non-contiguous (e.g. transposed)
+    // b can have a batch dimension [L, IC, B]: each sequence is padded separately and the result is [K*IC, OL*B]
+    GGML_API struct ggml_tensor * ggml_im2col_1d(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            int                   s0,  // stride
+            int                   p0); // padding
+
     GGML_API struct ggml_tensor * ggml_flash_attn(
             struct ggml_context * ctx,
             struct ggml_tensor  * q,
@@ -1168,6 +1218,19 @@ extern "C" {
             struct ggml_tensor  * v,
             bool                  masked);
 
+    // softmax(scale*k*q^T)*v, computed block-wise with an online softmax, i.e. without materializing k*q^T
+    // q: [D, N, H], k: [D, M, H], v: [M, D, H] (v is transposed, same as in ggml_flash_attn)
+    // q, k and v can be non-contiguous views (e.g. permuted), as long as their rows are contiguous
+    // k and v must have the same type (F16 or F32). q can be F16 only if k is F16
+    // the result is F32 [D, H, N], so it can be viewed as [D*H, N] without merging the heads with a copy
+    // all tensors can have a 4th (batch) dimension B of the same size, the result is then [D, H, N, B]
+    GGML_API struct ggml_tensor * ggml_flash_attn_tiled(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * q,
+            struct ggml_tensor  * k,
+            struct ggml_tensor  * v,
+            float                 scale);
+
     GGML_API struct ggml_tensor * ggml_flash_attn_back(
            struct ggml_context * ctx,
            struct ggml_tensor  * q,
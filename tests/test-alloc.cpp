@@ -0,0 +1,177 @@
+// Checks that whisper_full() does not allocate memory while decoding tokens
+//
+// The test model is extended in memory with zero-valued tensors, so that the decoder runs for real. The logits
+// filter callback steers the decoding and counts the heap allocations made since its previous invocation.
+//
+// usage: test-alloc <model-without-tensors>
+
+#include "whisper.h"
+#include "test-model.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+static std::atomic<int64_t> g_n_alloc(0);
+
+void * operator new(size_t size) {
+    g_n_alloc++;
+
+    void * ptr = malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+
+    return ptr;
+}
+
+void operator delete(void * ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void * ptr, size_t /*size*/) noexcept {
+    free(ptr);
+}
+
+struct alloc_stats {
+    int n_text;        // number of text tokens to force in each segment
+
+    int n_tokens_prev; // n_tokens of the previous callback invocation
+    int64_t n_alloc_prev;
+
+    int n_steps;       // number of measured decoding steps
+    int64_t n_alloc;   // allocations made during the measured steps
+};
+
+// force the sequence [ts(0), text x n_text, ts(1s), eot], with distinct finite logits for all other tokens so that
+// the beam-search candidates do not tie
+static void logits_filter_callback(
+        struct whisper_context * ctx,
+          struct whisper_state * /*state*/,
+      const whisper_token_data * tokens,
+                           int   n_tokens,
+                         float * logits,
+                          void * user_data) {
+    auto & stats = *(alloc_stats *) user_data;
+
+    const int64_t n_alloc = g_n_alloc;
+
+    // the first step of each segment follows the encoder and the prompt evaluation - do not measure it
+    if (n_tokens > 1 && stats.n_tokens_prev > 0) {
+        stats.n_steps++;
+        stats.n_alloc += n_alloc - stats.n_alloc_prev;
+    }
+
+    const int n_vocab = whisper_n_vocab(ctx);
+
+    const whisper_token token_beg = whisper_token_beg(ctx);
+    const whisper_token token_eot = whisper_token_eot(ctx);
+
+    whisper_token id = token_eot;
+    if (n_tokens == 0) {
+        id = token_beg;
+    } else if (n_tokens <= stats.n_text) {
+        id = 220 + n_tokens;
+    } else if (n_tokens == stats.n_text + 1) {
+        id = token_beg + 50;
+    }
+
+    const uint32_t seed = 2654435761u*(n_tokens + 1) + (n_tokens > 0 ? tokens[n_tokens - 1].id : 0);
+
+    for (int i = 0; i < n_vocab; ++i) {
+        const uint32_t h = (seed ^ (uint32_t) i)*2246822519u;
+        logits[i] = n_tokens > stats.n_text + 1 ? -INFINITY : -15.0f - 10.0f*(h >> 8)/float(1 << 24);
+    }
+
+    logits[id] = 0.0f;
+
+    stats.n_tokens_prev = n_tokens;
+    stats.n_alloc_prev  = g_n_alloc;
+}
+
+static bool run(struct whisper_context * ctx, const std::vector<float> & pcm, whisper_full_params wparams, const char * name) {
+    alloc_stats stats = { 40, 0, 0, 0, 0, };
+
+    wparams.print_progress   = false;
+    wparams.print_realtime   = false;
+    wparams.print_timestamps = false;
+
+    wparams.n_threads = 2;
+
+    wparams.logits_filter_callback           = logits_filter_callback;
+    wparams.logits_filter_callback_user_data = &stats;
+
+    if (whisper_full(ctx, wparams, pcm.data(), pcm.size()) != 0) {
+        fprintf(stderr, "%s: %s: failed to process audio\n", __func__, name);
+        return false;
+    }
+
+    printf("%s: %-12s: %5d decoding steps, %5d allocations\n", __func__, name, stats.n_steps, (int) stats.n_alloc);
+
+    if (stats.n_steps < stats.n_text) {
+        fprintf(stderr, "%s: %s: too few decoding steps (%d)\n", __func__, name, stats.n_steps);
+        return false;
+    }
+
+    if (stats.n_alloc != 0) {
+        fprintf(stderr, "%s: %s: %d heap allocations in the decoding loop\n", __func__, name, (int) stats.n_alloc);
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char ** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <model-without-tensors>\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<uint8_t> model;
+    if (!build_model(argv[1], model)) {
+        return 1;
+    }
+
+    struct whisper_context * ctx = whisper_init_from_buffer(model.data(), model.size());
+    if (ctx == nullptr) {
+        fprintf(stderr, "%s: failed to initialize whisper context\n", __func__);
+        return 1;
+    }
+
+    // 4 seconds of silence
+    const std::vector<float> pcm(4*WHISPER_SAMPLE_RATE, 0.0f);
+
+    bool ok = true;
+
+    {
+        whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+        wparams.temperature_inc = 0.0f;
+
+        ok = run(ctx, pcm, wparams, "greedy") && ok;
+    }
+
+    {
+        whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+        wparams.temperature     = 0.4f;
+        wparams.temperature_inc = 0.0f;
+        wparams.greedy.best_of  = 3;
+
+        ok = run(ctx, pcm, wparams, "sampling") && ok;
+    }
+
+    {
+        whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_BEAM_SEARCH);
+        wparams.temperature_inc        = 0.0f;
+        wparams.beam_search.beam_size  = 4;
+
+        ok = run(ctx, pcm, wparams, "beam-search") && ok;
+    }
+
+    whisper_free(ctx);
+
+    return ok ? 0 : 2;
+}
@@ -0,0 +1,118 @@
+// Test model for the tests that run the encoder and the decoder
+//
+// The test models in models/ have no tensors. build_model() appends zero-valued tensors of the right shapes to the
+// file, so that whisper_init_from_buffer() loads a model that runs for real - the logits are steered by the tests.
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+static void write_i32(std::vector<uint8_t> & buf, int32_t v) {
+    const uint8_t * p = (const uint8_t *) &v;
+    buf.insert(buf.end(), p, p + sizeof(v));
+}
+
+// append a zero-valued tensor record - ne in ggml order
+static void write_tensor(std::vector<uint8_t> & buf, const std::string & name, std::vector<int32_t> ne, int32_t ttype) {
+    write_i32(buf, ne.size());
+    write_i32(buf, name.size());
+    write_i32(buf, ttype);
+
+    size_t n = 1;
+    for (auto v : ne) {
+        write_i32(buf, v);
+        n *= v;
+    }
+
+    buf.insert(buf.end(), name.begin(), name.end());
+    buf.insert(buf.end(), n*(ttype == 0 ? 4 : 2), 0);
+}
+
+static bool build_model(const char * fname, std::vector<uint8_t> & buf) {
+    std::ifstream fin(fname, std::ios::binary);
+    if (!fin) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname);
+        return false;
+    }
+
+    buf.assign(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>());
+    if (buf.size() < 48) {
+        fprintf(stderr, "%s: invalid model file '%s'\n", __func__, fname);
+        return false;
+    }
+
+    int32_t hp[11];
+    memcpy(hp, buf.data() + 4, sizeof(hp));
+
+    const int n_vocab        = hp[0];
+    const int n_audio_ctx    = hp[1];
+    const int n_audio_state  = hp[2];
+    const int n_audio_layer  = hp[4];
+    const int n_text_ctx     = hp[5];
+    const int n_text_state   = hp[6];
+    const int n_text_layer   = hp[8];
+    const int n_mels         = hp[9];
+    const int wtype          = hp[10] == 0 ? 0 : 1;
+
+    if (hp[10] != 0 && hp[10] != 1) {
+        fprintf(stderr, "%s: unsupported ftype %d\n", __func__, hp[10]);
+        return false;
+    }
+
+    const auto write_block = [&](const std::string & prefix, const std::string & attn, int n) {
+        write_tensor(buf, prefix + attn + "_ln.weight",    { n },    0);
+        write_tensor(buf, prefix + attn + "_ln.bias",      { n },    0);
+        write_tensor(buf, prefix + attn + ".query.weight", { n, n }, wtype);
+        write_tensor(buf, prefix + attn + ".query.bias",   { n },    0);
+        write_tensor(buf, prefix + attn + ".key.weight",   { n, n }, wtype);
+        write_tensor(buf, prefix + attn + ".value.weight", { n, n }, wtype);
+        write_tensor(buf, prefix + attn + ".value.bias",   { n },    0);
+        write_tensor(buf, prefix + attn + ".out.weight",   { n, n }, wtype);
+        write_tensor(buf, prefix + attn + ".out.bias",     { n },    0);
+    };
+
+    const auto write_mlp = [&](const std::string & prefix, int n) {
+        write_tensor(buf, prefix + "mlp_ln.weight", { n },      0);
+        write_tensor(buf, prefix + "mlp_ln.bias",   { n },      0);
+        write_tensor(buf, prefix + "mlp.0.weight",  { n, 4*n }, wtype);
+        write_tensor(buf, prefix + "mlp.0.bias",    { 4*n },    0);
+        write_tensor(buf, prefix + "mlp.2.weight",  { 4*n, n }, wtype);
+        write_tensor(buf, prefix + "mlp.2.bias",    { n },      0);
+    };
+
+    write_tensor(buf, "encoder.positional_embedding", { n_audio_state, n_audio_ctx },          0);
+    write_tensor(buf, "encoder.conv1.weight",         { 3, n_mels, n_audio_state },        wtype);
+    write_tensor(buf, "encoder.conv1.bias",           { 1, n_audio_state },                    0);
+    write_tensor(buf, "encoder.conv2.weight",         { 3, n_audio_state, n_audio_state }, wtype);
+    write_tensor(buf, "encoder.conv2.bias",           { 1, n_audio_state },                    0);
+    write_tensor(buf, "encoder.ln_post.weight",       { n_audio_state },                       0);
+    write_tensor(buf, "encoder.ln_post.bias",         { n_audio_state },                       0);
+
+    for (int i = 0; i < n_audio_layer; ++i) {
+        const std::string prefix = "encoder.blocks." + std::to_string(i) + ".";
+
+        write_mlp  (prefix, n_audio_state);
+        write_block(prefix, "attn", n_audio_state);
+    }
+
+    write_tensor(buf, "decoder.positional_embedding",   { n_text_state, n_text_ctx },     0);
+    write_tensor(buf, "decoder.token_embedding.weight", { n_text_state, n_vocab },    wtype);
+    write_tensor(buf, "decoder.ln.weight",              { n_text_state },                 0);
+    write_tensor(buf, "decoder.ln.bias",                { n_text_state },                 0);
+
+    for (int i = 0; i < n_text_layer; ++i) {
+        const std::string prefix = "decoder.blocks." + std::to_string(i) + ".";
+
+        write_mlp  (prefix, n_text_state);
+        write_block(prefix, "attn",       n_text_state);
+        write_block(prefix, "cross_attn", n_text_state);
+    }
+
+    return true;
+}
@@ -0,0 +1,195 @@
+// Checks that the transcriptions of different priority classes make progress with the CPU scheduler and decode batching
+//
+// A batch transcription starts an interactive one in the middle of its decoding loop and waits for its encoder, so
+// that the leader of the next decode batch is of the batch class while the interactive transcription reserves all the
+// cores of the scheduler. The test fails if the two transcriptions do not finish in time.
+//
+// usage: test-sched <model-without-tensors>
+
+#include "whisper.h"
+#include "test-model.h"
+
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct sched_test {
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    bool interactive_start    = false; // the batch transcription is in its decoding loop
+    bool interactive_encoding = false; // the interactive transcription reserves its cores
+
+    int n_done = 0;
+};
+
+static const int n_text = 20;
+
+// force the sequence [ts(0), text x n_text, ts(1s), eot]
+static void force_tokens(struct whisper_context * ctx, int n_tokens, float * logits) {
+    const int n_vocab = whisper_n_vocab(ctx);
+
+    const whisper_token token_beg = whisper_token_beg(ctx);
+
+    whisper_token id = whisper_token_eot(ctx);
+    if (n_tokens == 0) {
+        id = token_beg;
+    } else if (n_tokens <= n_text) {
+        id = 220 + n_tokens;
+    } else if (n_tokens == n_text + 1) {
+        id = token_beg + 50;
+    }
+
+    for (int i = 0; i < n_vocab; ++i) {
+        logits[i] = -10.0f;
+    }
+
+    logits[id] = 0.0f;
+}
+
+static void logits_filter_batch(
+        struct whisper_context * ctx,
+          struct whisper_state * /*state*/,
+      const whisper_token_data * /*tokens*/,
+                           int   n_tokens,
+                         float * logits,
+                          void * user_data) {
+    auto & test = *(sched_test *) user_data;
+
+    force_tokens(ctx, n_tokens, logits);
+
+    if (n_tokens == n_text/2) {
+        std::unique_lock<std::mutex> lock(test.mutex);
+
+        if (!test.interactive_start) {
+            test.interactive_start = true;
+            test.cv.notify_all();
+
+            test.cv.wait_for(lock, std::chrono::seconds(10), [&]() { return test.interactive_encoding; });
+        }
+    }
+}
+
+static void logits_filter_interactive(
+        struct whisper_context * ctx,
+          struct whisper_state * /*state*/,
+      const whisper_token_data * /*tokens*/,
+                           int   n_tokens,
+                         float * logits,
+                          void * /*user_data*/) {
+    force_tokens(ctx, n_tokens, logits);
+}
+
+static bool encoder_begin_interactive(struct whisper_context * /*ctx*/, struct whisper_state * /*state*/, void * user_data) {
+    auto & test = *(sched_test *) user_data;
+
+    std::lock_guard<std::mutex> lock(test.mutex);
+
+    test.interactive_encoding = true;
+    test.cv.notify_all();
+
+    return true;
+}
+
+static void run(struct whisper_context * ctx, const std::vector<float> & pcm, whisper_priority priority, sched_test & test, int & ret) {
+    whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+    wparams.print_progress   = false;
+    wparams.print_realtime   = false;
+    wparams.print_timestamps = false;
+
+    wparams.n_threads       = 4;
+    wparams.temperature_inc = 0.0f;
+    wparams.priority        = priority;
+
+    if (priority == WHISPER_PRIORITY_BATCH) {
+        wparams.logits_filter_callback           = logits_filter_batch;
+        wparams.logits_filter_callback_user_data = &test;
+    } else {
+        wparams.logits_filter_callback           = logits_filter_interactive;
+        wparams.encoder_begin_callback           = encoder_begin_interactive;
+        wparams.encoder_begin_callback_user_data = &test;
+    }
+
+    struct whisper_state * state = whisper_init_state(ctx);
+
+    ret = state ? whisper_full_with_state(ctx, state, wparams, pcm.data(), pcm.size()) : -1;
+
+    whisper_free_state(state);
+
+    std::lock_guard<std::mutex> lock(test.mutex);
+
+    test.n_done++;
+    test.cv.notify_all();
+}
+
+int main(int argc, char ** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <model-without-tensors>\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<uint8_t> model;
+    if (!build_model(argv[1], model)) {
+        return 1;
+    }
+
+    struct whisper_context * ctx = whisper_init_from_buffer(model.data(), model.size());
+    if (ctx == nullptr) {
+        fprintf(stderr, "%s: failed to initialize whisper context\n", __func__);
+        return 1;
+    }
+
+    // each transcription wants all the cores, the leader of a batch does not wait for the other states
+    whisper_cpu_scheduler_set(4);
+    whisper_decode_batching_set(ctx, 8, 0);
+
+    // 4 seconds of silence
+    const std::vector<float> pcm(4*WHISPER_SAMPLE_RATE, 0.0f);
+
+    sched_test test;
+
+    int ret_batch       = 0;
+    int ret_interactive = 0;
+
+    std::thread batch(run, ctx, std::cref(pcm), WHISPER_PRIORITY_BATCH, std::ref(test), std::ref(ret_batch));
+
+    std::thread interactive([&]() {
+        {
+            std::unique_lock<std::mutex> lock(test.mutex);
+            test.cv.wait(lock, [&]() { return test.interactive_start; });
+        }
+
+        run(ctx, pcm, WHISPER_PRIORITY_INTERACTIVE, test, ret_interactive);
+    });
+
+    {
+        std::unique_lock<std::mutex> lock(test.mutex);
+
+        if (!test.cv.wait_for(lock, std::chrono::seconds(120), [&]() { return test.n_done == 2; })) {
+            fprintf(stderr, "%s: the transcriptions did not finish in time\n", __func__);
+            fflush(stderr);
+
+            // the threads are blocked, do not wait for them
+            std::_Exit(2);
+        }
+    }
+
+    batch.join();
+    interactive.join();
+
+    const auto stats = whisper_decode_batching_get_stats(ctx);
+
+    printf("%s: batch %d, interactive %d, %d decode batches, %d steps\n", __func__,
+            ret_batch, ret_interactive, (int) stats.n_graphs, (int) stats.n_steps);
+
+    whisper_cpu_scheduler_set(-1);
+    whisper_free(ctx);
+
+    return ret_batch == 0 && ret_interactive == 0 ? 0 : 2;
+}
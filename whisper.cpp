@@ -11,15 +11,24 @@
 #include "ggml.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #define _USE_MATH_DEFINES
 #include <cmath>
 #include <cstdio>
 #include <cstdarg>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <system_error>
 #include <thread>
 #include <vector>
 #include <regex>
@@ -111,10 +120,14 @@ static void byteswap_tensor(ggml_tensor * tensor) {
 #define WHISPER_PRINT_DEBUG(...)
 #endif
 
-//#define WHISPER_USE_FLASH_ATTN
 //#define WHISPER_USE_FLASH_FF
 #define WHISPER_MAX_DECODERS 16
 
+#define WHISPER_MAX_ENCODE_BATCH 16 // max windows per encoder graph of whisper_full_batch(), limited by GGML_MAX_NODES
+#define WHISPER_MAX_DECODE_BATCH 32 // max single-token steps per decoder graph of the decode batching, see whisper_decode_batch_max()
+
+#define WHISPER_SAMPLE_BLOCK 64 // number of tokens per block of the sampling CDF
+
 #define WHISPER_USE_SCRATCH
 #define WHISPER_MAX_SCRATCH_BUFFERS 16
 
@@ -240,6 +253,15 @@ static const std::map<e_model, size_t> MEM_REQ_SCRATCH0 = {
     { MODEL_LARGE,   198ull*MB },
 };
 
+// scratch0 with ggml_flash_attn_tiled: the KQ matrices of the encoder self-attention are never materialized
+static const std::map<e_model, size_t> MEM_REQ_SCRATCH0_TILED = {
+    { MODEL_TINY,     12ull*MB },
+    { MODEL_BASE,     16ull*MB },
+    { MODEL_SMALL,    24ull*MB },
+    { MODEL_MEDIUM,   32ull*MB },
+    { MODEL_LARGE,    40ull*MB },
+};
+
 static const std::map<e_model, size_t> MEM_REQ_SCRATCH1 = {
     { MODEL_TINY,     18ull*MB },
     { MODEL_BASE,     24ull*MB },
@@ -399,11 +421,22 @@ struct whisper_vocab {
     id token_not        = 50362; // no timestamps
     id token_beg        = 50363; // begin timestamps
 
+    // tokens suppressed by whisper_full_params.suppress_non_speech_tokens (sorted)
+    std::vector<id> token_non_speech;
+
     bool is_multilingual() const {
         return n_vocab == 51865;
     }
 };
 
+// ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
+static const std::vector<std::string> non_speech_tokens = {
+    "\"", "#", "(", ")", "*", "+", "/", ":", ";", "<", "=", ">", "@", "[", "\\", "]", "^",
+    "_", "`", "{", "|", "}", "~", "「", "」", "『", "』", "<<", ">>", "<<<", ">>>", "--",
+    "---", "-(", "-[", "('", "(\"", "((", "))", "(((", ")))", "[[", "]]", "{{", "}}", "♪♪",
+    "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
+};
+
 struct whisper_segment {
     int64_t t0;
     int64_t t1;
@@ -413,6 +446,8 @@ struct whisper_segment {
     std::vector<whisper_token_data> tokens;
 
     bool speaker_turn_next;
+
+    float no_speech_prob;
 };
 
 // medium
@@ -559,6 +594,10 @@ struct whisper_model {
     struct ggml_tensor * e_conv_2_w;
     struct ggml_tensor * e_conv_2_b;
 
+    // encoder.conv1 / encoder.conv2 weights prepacked as [3*n_in, n_out] GEMM operands (views, no extra memory)
+    struct ggml_tensor * e_conv_1_w_packed;
+    struct ggml_tensor * e_conv_2_w_packed;
+
     // encoder.ln_post
     struct ggml_tensor * e_ln_w;
     struct ggml_tensor * e_ln_b;
@@ -619,7 +658,95 @@ struct whisper_decoder {
     std::vector<float> logits;
     std::vector<float> logprobs;
 
-    std::vector<whisper_token> tokens_tmp; // used for whisper_decode calls
+    // the tokens to compute the logits for in the next whisper_decode, when the logit filters mask most of the vocabulary
+    std::vector<whisper_token> logits_id;
+};
+
+// a single-token decoder step, evaluated by the decode batching together with the steps of other decoders and states
+struct whisper_decode_step {
+    struct whisper_state * state;
+    whisper_decoder      * decoder;
+
+    whisper_token token;
+    int           n_past;
+
+    float * logits; // [n_vocab] output
+
+    bool done;
+    bool ok;
+};
+
+// beam-search candidate
+// refers to the sequence snapshot of its source decoder instead of carrying a copy of the sequence
+struct whisper_beam_candidate {
+    int decoder_idx;
+    int seek_delta;
+
+    bool has_ts;
+
+    whisper_token_data token;
+
+    double sum_logprobs_all; // sum_logprobs_all of the source sequence + token.plog
+};
+
+// a speech region of the spectrogram, found by the voice activity detection
+struct whisper_vad_region {
+    int64_t t_packed; // start in the packed spectrogram (frames)
+    int64_t t_orig;   // start in the original spectrogram (frames)
+    int64_t n;        // length (frames)
+};
+
+// a thread that runs the jobs given to it one at a time - kept by a fallback state for the windows of its parent state
+struct whisper_cpu_scheduler_scope;
+
+struct whisper_worker {
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    std::function<void()> job;
+
+    bool busy = false;
+    bool stop = false;
+
+    std::thread thread;
+
+    whisper_worker() : thread([this]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv.wait(lock, [&]() { return busy || stop; });
+            if (!busy) {
+                return;
+            }
+
+            lock.unlock();
+            job();
+            lock.lock();
+
+            busy = false;
+            cv.notify_all();
+        }
+    }) {}
+
+    ~whisper_worker() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_all();
+        thread.join();
+    }
+
+    void run(std::function<void()> fn) {
+        std::lock_guard<std::mutex> lock(mutex);
+        job  = std::move(fn);
+        busy = true;
+        cv.notify_all();
+    }
+
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() { return !busy; });
+    }
 };
 
 struct whisper_state {
@@ -633,12 +760,44 @@ struct whisper_state {
     int32_t n_decode = 0; // number of decoder calls
     int32_t n_fail_p = 0; // number of logprob threshold failures
     int32_t n_fail_h = 0; // number of entropy threshold failures
+    int32_t n_nosp   = 0; // number of windows skipped without speech
+
+    // speculative decoding
+    int64_t t_draft_us     = 0;
+    int32_t n_draft        = 0; // number of drafted tokens
+    int32_t n_draft_accept = 0; // number of drafted tokens accepted by the main model
+
+    // model cascade
+    int64_t t_cascade_us        = 0;
+    int32_t n_cascade           = 0; // number of windows decoded with a cascade
+    int32_t n_cascade_escalated = 0; // number of windows decoded again with the larger model
+
+    // voice activity detection
+    int64_t t_vad_us        = 0;
+    int64_t n_vad_frames    = 0; // number of analysed spectrogram frames
+    int64_t n_vad_speech    = 0; // number of spectrogram frames kept for decoding
+
+    // performance records of the windows of the last whisper_full() call, see whisper_window_timings_begin()
+    std::vector<whisper_window_timings> windows;
+    whisper_window_timings window = {}; // window being decoded
+    int64_t t_window_start_us = 0;      // 0 - not in a window
+    int64_t t_encode_batch_us = 0;      // share of the state of the last evaluation of the batched encoder
+
+    // speech regions of the spectrogram of the last whisper_full() call (empty = voice activity detection disabled)
+    std::vector<whisper_vad_region> vad_regions;
 
     // cross-attention KV cache for the decoders
     // shared between all decoders
     whisper_kv_cache kv_cross;
     whisper_mel mel;
 
+    // speech regions of mel packed by whisper_vad_pack_mel(), encoded instead of mel during the transcription
+    whisper_mel mel_vad;
+    bool use_mel_vad = false;
+
+    // mel offset of the window for which whisper_full_batch() has already computed kv_cross (-1 if none)
+    int kv_cross_seek = -1;
+
     whisper_decoder decoders[WHISPER_MAX_DECODERS] = {};
 
     // memory buffers used by encode / decode contexts
@@ -646,19 +805,75 @@ struct whisper_state {
     std::vector<uint8_t> buf_scratch[WHISPER_MAX_SCRATCH_BUFFERS];
 
     int    buf_last = 0;
-    size_t buf_max_size[WHISPER_MAX_SCRATCH_BUFFERS] = { 0 };
+    size_t buf_max_size    [WHISPER_MAX_SCRATCH_BUFFERS] = { 0 }; // since the start of the current window
+    size_t buf_max_size_all[WHISPER_MAX_SCRATCH_BUFFERS] = { 0 }; // before the current window
 
     // decode output (2-dimensional array: [n_tokens][n_vocab])
     std::vector<float> logits;
 
+    // probability of the <|nospeech|> token at the first decoding step of the current window
+    float no_speech_prob = 0.0f;
+
     std::vector<whisper_segment> result_all;
     std::vector<whisper_token>   prompt_past;
 
     // work container used to avoid memory allocations
     std::vector<std::pair<double, whisper_vocab::id>> logits_id;
 
+    // sampling work containers
+    std::vector<whisper_token> topk_id;     // indices of the top-k logits
+    std::vector<float>         probs_block; // sums of probs over blocks of tokens, used to walk the CDF
+
+    // decoding arena used by whisper_full() - sized on first use and reused for all following windows and tokens,
+    // so that the decoding loop does not allocate once it has reached a steady state
+    std::vector<float>         temperatures;
+    std::vector<whisper_token> prompt;
+    std::vector<whisper_token> prompt_init;
+    std::vector<whisper_token> prompt_tokens; // tokenized initial prompt
+
+    // beam-search: snapshots of the KV caches and of the sequences of all decoders + the candidates of the current step
+    std::vector<uint8_t>                kv_swap; // [n_decoders][k, v]
+    std::vector<whisper_sequence>       seq_swap;
+    std::vector<whisper_beam_candidate> beam_candidates;
+    std::vector<whisper_token_data>     tokens_topk;
+
+    std::string text; // text of the segment being assembled
+
+    // the provisional text tokens of the window being decoded, as sent to params.new_token_callback
+    std::vector<whisper_token_data> stream_tokens;
+
+    // speculative decoding: the tokens fed to the draft decoder after the prompt + the tokens of the last verification
+    // pass of the main model, [last sampled token, drafted tokens...], whose logits are rows of the logits buffer
+    std::vector<whisper_token> draft_past;
+    std::vector<whisper_token> draft_verify;
+    int draft_verify_i = 0; // next row of the verification logits to use
+
     mutable std::mt19937 rng; // used for sampling at t > 0.0
 
+    // decode batching: the steps of the active decoders of the current token and their logits ([n_steps][n_vocab])
+    std::vector<whisper_decode_step> decode_steps;
+    std::vector<float>               decode_logits;
+
+    // parallel temperature fallback - states that decode the next temperatures of a window, see whisper_full_window()
+    std::vector<whisper_state *> fallback_states;
+    std::atomic<bool> fallback_cancel = { false };
+    std::unique_ptr<whisper_worker> fallback_worker; // of a fallback state, decodes its temperature
+
+    // early stop of whisper_full() - params.abort_callback and params.deadline_ms, see whisper_full_stopped()
+    // the fallback states and the state of the cascade model use the stop of the state that they decode for
+    whisper_abort_callback abort_callback = nullptr;
+    void * abort_callback_user_data = nullptr;
+    int64_t t_deadline_us = 0; // 0 - no deadline
+    bool stop_check = false;   // whisper_full() is running
+    whisper_state * stop_parent = nullptr;
+    std::atomic<int> stop_reason = { WHISPER_STOP_NONE };
+
+    // priority class of the graphs of the state with the CPU scheduler
+    whisper_priority priority = WHISPER_PRIORITY_NORMAL;
+
+    // the reservation of the running transcription - its graphs use the scheduler of the reservation
+    const whisper_cpu_scheduler_scope * sched_scope = nullptr;
+
     int lang_id = 0; // english by default
 
     std::string path_model; // populated by whisper_init_from_file()
@@ -679,6 +894,9 @@ struct whisper_state {
     // [EXPERIMENTAL] speed-up techniques
     int32_t exp_n_audio_ctx = 0; // 0 - use default
 
+    // use ggml_flash_attn_tiled for the encoder self-attention and the cross-attention
+    bool use_flash_attn = false;
+
     void use_buf(struct ggml_context * ctx, int i) {
 #if defined(WHISPER_USE_SCRATCH)
         size_t last_size = 0;
@@ -701,9 +919,14 @@ struct whisper_state {
 #endif
     }
 
+    // the spectrogram of the encoder
+    const whisper_mel & get_mel() const {
+        return use_mel_vad ? mel_vad : mel;
+    }
+
     size_t get_buf_max_mem(int i) const {
 #if defined(WHISPER_USE_SCRATCH)
-        return buf_max_size[i];
+        return std::max(buf_max_size[i], buf_max_size_all[i]);
 #else
         (void) i;
         return 0;
@@ -722,6 +945,23 @@ struct whisper_context {
     whisper_vocab vocab;
     whisper_state * state = nullptr;
 
+    // idle states for whisper_state_acquire()
+    std::mutex                   pool_mutex;
+    std::vector<whisper_state *> pool;
+    int                          pool_n_max = 4;
+    whisper_state_pool_stats     pool_stats = {};
+
+    // decode batching - the pending steps of all the states that decode with this context, see whisper_decode_batch()
+    std::mutex                          batch_mutex;
+    std::condition_variable             batch_cv;
+    std::vector<whisper_decode_step *>  batch_pending;
+    std::vector<whisper_decode_step *>  batch_steps;
+    bool                                batch_busy     = false; // a thread is evaluating a batch
+    int                                 batch_n_active = 0;     // states in their decoding loop
+    int                                 batch_n_max    = 0;     // 0 - disabled
+    int                                 batch_wait_us  = 0;
+    whisper_decode_batching_stats       batch_stats = {};
+
     std::string path_model; // populated by whisper_init_from_file()
 };
 
@@ -1030,6 +1270,28 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
                 vocab.id_to_token[i] = word;
             }
         }
+
+        // resolve the non-speech tokens once, so that the logits filters do not have to look up strings
+        {
+            const auto add_non_speech = [&](const std::string & token) {
+                const auto it = vocab.token_to_id.find(token);
+                if (it != vocab.token_to_id.end()) {
+                    vocab.token_non_speech.push_back(it->second);
+                }
+            };
+
+            for (const std::string & token : non_speech_tokens) {
+                add_non_speech(token);
+                add_non_speech(" " + token);
+            }
+
+            // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
+            add_non_speech(" -");
+            add_non_speech(" '");
+
+            std::sort(vocab.token_non_speech.begin(), vocab.token_non_speech.end());
+            vocab.token_non_speech.erase(std::unique(vocab.token_non_speech.begin(), vocab.token_non_speech.end()), vocab.token_non_speech.end());
+        }
     }
 
     size_t ctx_size = 0;
@@ -1142,7 +1404,7 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             ctx_size += n_text_layer*(             n_text_state*ggml_type_sizef(GGML_TYPE_F32)); // cross_attn_ln_1_b
         }
 
-        ctx_size += (15 + 15*n_audio_layer + 24*n_text_layer)*512; // object overhead
+        ctx_size += (17 + 15*n_audio_layer + 24*n_text_layer)*512; // object overhead
 
         log("%s: model ctx     = %7.2f MB\n", __func__, ctx_size/(1024.0*1024.0));
     }
@@ -1196,6 +1458,18 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             model.e_ln_w     = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state);
             model.e_ln_b     = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state);
 
+            // the conv kernels [3, n_in, n_out] are already laid out as the rows of a [3*n_in, n_out] matrix that
+            // matches the columns produced by ggml_im2col_1d, so the packed weights are just views of the loaded data
+            // we detach them from the graph so that they are treated as leafs (i.e. regular weights) by the encoder
+            model.e_conv_1_w_packed = ggml_reshape_2d(ctx, model.e_conv_1_w, 3*n_mels,        n_audio_state);
+            model.e_conv_2_w_packed = ggml_reshape_2d(ctx, model.e_conv_2_w, 3*n_audio_state, n_audio_state);
+
+            for (auto * t : { model.e_conv_1_w_packed, model.e_conv_2_w_packed }) {
+                t->op   = GGML_OP_NONE;
+                t->src0 = nullptr;
+                t->src1 = nullptr;
+            }
+
             // map by name
             model.tensors["encoder.positional_embedding"] = model.e_pe;
 
@@ -1439,256 +1713,624 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
     return true;
 }
 
-// evaluate the encoder with the given state
-//
-// given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
-// part of the transformer model and returns the encoded features
-//
-//   - wctx:      the model
-//   - wstate:     the state of the encoder
-//   - n_threads:  number of threads to use
-//   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
+// process-wide CPU scheduler, see whisper_cpu_scheduler_set()
+// the cores of the budget are granted to the graphs, whose helper threads run on a pool of n_cores - 1 threads. a graph
+// is granted at least one core, the calling thread, so the helper threads in use never exceed the size of the pool
 //
-static bool whisper_encode_internal(
-        whisper_context & wctx,
-          whisper_state & wstate,
-              const int   mel_offset,
-              const int   n_threads){
+// the cores wanted by the running transcriptions of a class are reserved for it: the graphs of the lower classes only
+// get the cores that are left, so that they do not take the core of a transcription between two of its graphs. the
+// reservation is lifted while the transcription waits for a decode batch (whisper_decode_batch), whose leader may be of
+// a lower class
+struct whisper_cpu_scheduler {
+    int n_cores = 0;
+    int n_free  = 0;
 
-    const int64_t t_start_us = ggml_time_us();
+    int n_want[WHISPER_PRIORITY_COUNT] = {}; // cores wanted by the running transcriptions of each class
+    int n_held[WHISPER_PRIORITY_COUNT] = {}; // cores held by the graphs of each class
 
-    const auto & model   = wctx.model;
-    const auto & mel_inp = wstate.mel;
-    const auto & hparams = model.hparams;
+    std::mutex              mutex;
+    std::condition_variable cv;
 
-    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
-    const int n_state = hparams.n_audio_state;
-    const int n_head  = hparams.n_audio_head;
-    const int n_layer = hparams.n_audio_layer;
+    // the graphs waiting for a core, served by class, then in the order of their tickets
+    int      n_waiting   [WHISPER_PRIORITY_COUNT] = {};
+    uint64_t ticket_next [WHISPER_PRIORITY_COUNT] = {};
+    uint64_t ticket_serve[WHISPER_PRIORITY_COUNT] = {};
 
-    const int n_mels = hparams.n_mels;
-    assert(mel_inp.n_mel == n_mels);
+    whisper_cpu_scheduler_stats stats = {};
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.buf_compute.size(),
-        /*.mem_buffer =*/ wstate.buf_compute.data(),
-        /*.no_alloc   =*/ false,
-    };
+    // thread pool
+    struct task {
+        ggml_thread_task fn;
+        void           * arg;
 
-    struct ggml_context * ctx0 = ggml_init(params);
+        struct whisper_graph_threads * graph;
+    };
 
-    wstate.use_buf(ctx0, 0);
+    std::mutex               pool_mutex;
+    std::condition_variable  pool_cv;
+    std::deque<task>         pool_tasks;
+    std::vector<std::thread> pool_threads;
 
-    struct ggml_tensor * mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
-    assert(mel->type == GGML_TYPE_F32);
-    {
-        float * dst = (float *) mel->data;
-        memset(dst, 0, ggml_nbytes(mel));
+    bool pool_stop = false;
 
-        const int i0 = std::min(mel_offset, mel_inp.n_len);
-        const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
+    // destroyed with the last reference - no graph is running on the pool anymore
+    ~whisper_cpu_scheduler() {
+        {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            pool_stop = true;
+        }
+        pool_cv.notify_all();
 
-        for (int j = 0; j < mel_inp.n_mel; ++j) {
-            for (int i = i0; i < i1; ++i) {
-                dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
-            }
+        for (auto & thread : pool_threads) {
+            thread.join();
         }
     }
+};
 
-    struct ggml_tensor * cur;
+// the helper threads of a graph on the pool of the scheduler
+struct whisper_graph_threads {
+    whisper_cpu_scheduler * sched;
 
-#ifndef WHISPER_USE_COREML
-    const bool use_coreml = false;
-#else
-    const bool use_coreml = wstate.ctx_coreml != nullptr;
-#endif
+    std::mutex              mutex;
+    std::condition_variable cv;
 
-#ifndef WHISPER_USE_OPENVINO
-    const bool use_openvino = false;
-#else
-    const bool use_openvino = wstate.ctx_openvino != nullptr;
-#endif
+    int n_running = 0;
+};
 
-    if (!use_coreml && !use_openvino) {
-        // convolution + gelu
-        {
-            wstate.use_buf(ctx0, 1);
+// the transcriptions and the graphs hold a reference to the scheduler that they use, so that whisper_cpu_scheduler_set()
+// can replace it while they run
+static std::mutex                             g_cpu_scheduler_mutex;
+static std::shared_ptr<whisper_cpu_scheduler> g_cpu_scheduler;
 
-            cur = ggml_conv_1d_ph(ctx0, model.e_conv_1_w, mel, 1, 1);
-            cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0,
-                        model.e_conv_1_b,
-                        cur),
-                    cur);
+static std::shared_ptr<whisper_cpu_scheduler> whisper_cpu_scheduler_get() {
+    std::lock_guard<std::mutex> lock(g_cpu_scheduler_mutex);
+    return g_cpu_scheduler;
+}
 
-            cur = ggml_gelu(ctx0, cur);
+static void whisper_cpu_scheduler_worker(whisper_cpu_scheduler * sched) {
+    while (true) {
+        whisper_cpu_scheduler::task task;
 
-            wstate.use_buf(ctx0, 0);
+        {
+            std::unique_lock<std::mutex> lock(sched->pool_mutex);
+            sched->pool_cv.wait(lock, [&]() { return sched->pool_stop || !sched->pool_tasks.empty(); });
 
-            cur = ggml_conv_1d_ph(ctx0, model.e_conv_2_w, cur, 2, 1);
-            cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0,
-                        model.e_conv_2_b,
-                        cur),
-                    cur);
+            if (sched->pool_tasks.empty()) {
+                return;
+            }
 
-            cur = ggml_gelu(ctx0, cur);
+            task = sched->pool_tasks.front();
+            sched->pool_tasks.pop_front();
         }
 
-        wstate.use_buf(ctx0, 3);
-
-        // ===================================================================
-        // NOTE: experimenting with partial evaluation of the encoder (ignore)
-        //static int iter = -1;
-        //const int n_iter = 1500/n_ctx;
-
-        //iter = (iter + 1) % n_iter;
+        task.fn(task.arg);
 
-        //if (iter == 0) {
-        //    memset(model.memory_cross_k->data, 0, ggml_nbytes(model.memory_cross_k));
-        //    memset(model.memory_cross_v->data, 0, ggml_nbytes(model.memory_cross_v));
-        //}
+        // notify under the lock - the graph is gone as soon as thread_wait returns
+        std::lock_guard<std::mutex> lock(task.graph->mutex);
+        if (--task.graph->n_running == 0) {
+            task.graph->cv.notify_all();
+        }
+    }
+}
 
-        static int iter = 0;
+static void whisper_graph_thread_start(void * data, ggml_thread_task fn, void * arg) {
+    auto * graph = (whisper_graph_threads *) data;
+    auto * sched = graph->sched;
 
-        const size_t e_pe_stride = model.e_pe->ne[0]*ggml_element_size(model.e_pe);
-        const size_t e_pe_offset = model.e_pe->ne[0]*ggml_element_size(model.e_pe)*n_ctx*iter;
+    {
+        std::lock_guard<std::mutex> lock(graph->mutex);
+        graph->n_running++;
+    }
 
-        struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
+    {
+        std::lock_guard<std::mutex> lock(sched->pool_mutex);
+        sched->pool_tasks.push_back({ fn, arg, graph });
+    }
 
-        cur = ggml_add(ctx0, e_pe, ggml_transpose(ctx0, cur));
+    sched->pool_cv.notify_one();
+}
 
-        // ===================================================================
+static void whisper_graph_thread_wait(void * data) {
+    auto * graph = (whisper_graph_threads *) data;
 
-        // original:
-        //cur = ggml_add(ctx0, model.e_pe, ggml_transpose(ctx0, cur));
+    std::unique_lock<std::mutex> lock(graph->mutex);
+    graph->cv.wait(lock, [&]() { return graph->n_running == 0; });
+}
 
-        struct ggml_tensor * inpL = cur;
+// wait for a free core and take up to n_threads of the free cores
+static int whisper_cpu_scheduler_acquire(whisper_cpu_scheduler & sched, whisper_priority priority, int n_threads) {
+    const int p = priority;
 
-        for (int il = 0; il < n_layer; ++il) {
-            const auto & layer = model.layers_encoder[il];
+    std::unique_lock<std::mutex> lock(sched.mutex);
 
-            // norm
-            {
-                wstate.use_buf(ctx0, 0);
+    const uint64_t ticket = sched.ticket_next[p]++;
+    sched.n_waiting[p]++;
 
-                cur = ggml_norm(ctx0, inpL);
+    // the free cores that are not reserved for the higher classes
+    auto n_avail = [&]() {
+        int n = sched.n_free;
+        for (int q = 0; q < p; ++q) {
+            n -= std::max(0, sched.n_want[q] - sched.n_held[q]);
+        }
+        return n;
+    };
 
-                // cur = ln_0_w*cur + ln_0_b
-                cur = ggml_add(ctx0,
-                        ggml_mul(ctx0,
-                            ggml_repeat(ctx0, layer.attn_ln_0_w, cur),
-                            cur),
-                        ggml_repeat(ctx0, layer.attn_ln_0_b, cur));
+    auto ready = [&]() {
+        if (sched.ticket_serve[p] != ticket) {
+            return false;
+        }
+        for (int q = 0; q < p; ++q) {
+            if (sched.n_waiting[q] > 0) {
+                return false;
             }
+        }
+        return n_avail() > 0;
+    };
 
-            // self-attention
-            {
-                wstate.use_buf(ctx0, 1);
+    if (!ready()) {
+        const int64_t t_start_us = ggml_time_us();
 
-                struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
-                        layer.attn_q_w,
-                        cur);
+        sched.cv.wait(lock, ready);
 
-                Qcur = ggml_add(ctx0,
-                        ggml_repeat(ctx0,
-                            layer.attn_q_b,
-                            Qcur),
-                        Qcur);
+        sched.stats.n_waits  [p]++;
+        sched.stats.t_wait_us[p] += ggml_time_us() - t_start_us;
+    }
 
-                //Qcur = ggml_scale_inplace(ctx0, Qcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
+    sched.n_waiting[p]--;
+    sched.ticket_serve[p]++;
 
-                // note: no bias for Key
-                struct ggml_tensor * Kcur = ggml_mul_mat(ctx0,
-                        layer.attn_k_w,
-                        cur);
+    const int n = std::min(std::max(1, n_threads), n_avail());
 
-                //Kcur = ggml_scale_inplace(ctx0, Kcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
+    sched.n_free    -= n;
+    sched.n_held[p] += n;
 
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
-                        layer.attn_v_w,
-                        cur);
+    sched.stats.n_graphs [p]++;
+    sched.stats.n_threads[p] += n;
 
-                Vcur = ggml_add(ctx0,
-                        ggml_repeat(ctx0,
-                            layer.attn_v_b,
-                            Vcur),
-                        Vcur);
+    // the next graph of the class, or of a lower class, may take the remaining cores
+    sched.cv.notify_all();
 
-                // ------
+    return n;
+}
 
-                wstate.use_buf(ctx0, 0);
+static void whisper_cpu_scheduler_release(whisper_cpu_scheduler & sched, whisper_priority priority, int n) {
+    std::lock_guard<std::mutex> lock(sched.mutex);
 
-#ifdef WHISPER_USE_FLASH_ATTN
-                struct ggml_tensor * Q =
-                    ggml_permute(ctx0,
-                            ggml_cpy(ctx0,
-                                Qcur,
-                                ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
-                            0, 2, 1, 3);
+    sched.n_free           += n;
+    sched.n_held[priority] -= n;
+    sched.cv.notify_all();
+}
 
-                struct ggml_tensor * K =
-                    ggml_permute(ctx0,
-                            ggml_cpy(ctx0,
-                                Kcur,
-                                ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
-                            0, 2, 1, 3);
+// reserves the cores of a transcription for its class for its lifetime
+// the graphs of the states, and of the states that they decode with, run on the scheduler of the reservation
+struct whisper_cpu_scheduler_scope {
+    std::shared_ptr<whisper_cpu_scheduler> sched;
 
-                struct ggml_tensor * V =
-                    ggml_cpy(ctx0,
-                            ggml_permute(ctx0,
-                                ggml_reshape_3d(ctx0,
-                                    Vcur,
-                                    n_state/n_head, n_head, n_ctx),
-                                1, 2, 0, 3),
-                            ggml_new_tensor_3d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head));
+    std::vector<whisper_state *> states;
 
-                struct ggml_tensor * KQV = ggml_flash_attn(ctx0, Q, K, V, false);
-#else
-                struct ggml_tensor * Q =
-                    ggml_permute(ctx0,
-                            ggml_cpy(ctx0,
-                                Qcur,
-                                ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, n_ctx)),
-                            0, 2, 1, 3);
+    whisper_priority priority;
+    int n_want;
 
-                struct ggml_tensor * K =
-                    ggml_permute(ctx0,
-                            ggml_cpy(ctx0,
-                                Kcur,
-                                ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
-                            0, 2, 1, 3);
+    mutable int n_suspended = 0; // states waiting for a decode batch, guarded by sched->mutex
 
-                // K * Q
-                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+    whisper_cpu_scheduler_scope(whisper_state * const * states, int n_states, whisper_priority priority, int n_threads)
+        : sched(whisper_cpu_scheduler_get()), states(states, states + n_states), priority(priority), n_want(0) {
+        for (auto * state : this->states) {
+            state->sched_scope = this;
+        }
 
-                struct ggml_tensor * KQ_scaled =
-                    ggml_scale_inplace(ctx0,
-                            KQ,
-                            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
-                            );
+        if (sched) {
+            std::lock_guard<std::mutex> lock(sched->mutex);
 
-                struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_scaled);
+            n_want = std::min(std::max(1, n_threads), sched->n_cores);
+            sched->n_want[priority] += n_want;
+        }
+    }
 
-                struct ggml_tensor * V =
-                    ggml_cpy(ctx0,
-                            ggml_permute(ctx0,
-                                ggml_reshape_3d(ctx0,
-                                    Vcur,
-                                    n_state/n_head, n_head, n_ctx),
-                                1, 2, 0, 3),
-                            ggml_new_tensor_3d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head)
-                            );
+    ~whisper_cpu_scheduler_scope() {
+        for (auto * state : states) {
+            state->sched_scope = nullptr;
 
-                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+            for (auto * fstate : state->fallback_states) {
+                fstate->sched_scope = nullptr;
+            }
+        }
+
+        if (sched) {
+            std::lock_guard<std::mutex> lock(sched->mutex);
+
+            sched->n_want[priority] -= n_want;
+            sched->cv.notify_all();
+        }
+    }
+
+    // the states of the transcription may wait in parallel (fallback states)
+    void suspend() const {
+        if (sched) {
+            std::lock_guard<std::mutex> lock(sched->mutex);
+
+            if (n_suspended++ == 0) {
+                sched->n_want[priority] -= n_want;
+                sched->cv.notify_all();
+            }
+        }
+    }
+
+    void resume() const {
+        if (sched) {
+            std::lock_guard<std::mutex> lock(sched->mutex);
+
+            if (--n_suspended == 0) {
+                sched->n_want[priority] += n_want;
+            }
+        }
+    }
+};
+
+// lifts the reservation of the transcription of a state for its lifetime
+struct whisper_cpu_scheduler_suspend {
+    const whisper_cpu_scheduler_scope * scope;
+
+    whisper_cpu_scheduler_suspend(const whisper_state & state) : scope(state.sched_scope) {
+        if (scope) {
+            scope->suspend();
+        }
+    }
+
+    ~whisper_cpu_scheduler_suspend() {
+        if (scope) {
+            scope->resume();
+        }
+    }
+};
+
+// the scheduler of the running transcription of the state, the current one outside of whisper_full()
+static std::shared_ptr<whisper_cpu_scheduler> whisper_state_scheduler(const whisper_state & state) {
+    return state.sched_scope ? state.sched_scope->sched : whisper_cpu_scheduler_get();
+}
+
+// compute the graph, on the cores of the CPU scheduler when it is enabled
+static void whisper_graph_compute(
+        struct ggml_context * ctx0,
+        struct ggml_cgraph  & gf,
+  const whisper_state       & wstate,
+           whisper_priority   priority) {
+    const auto sched = whisper_state_scheduler(wstate);
+
+    if (sched == nullptr) {
+        ggml_graph_compute(ctx0, &gf);
+        return;
+    }
+
+    gf.n_threads = whisper_cpu_scheduler_acquire(*sched, priority, gf.n_threads);
+
+    whisper_graph_threads threads;
+    threads.sched = sched.get();
+
+    gf.thread_start = whisper_graph_thread_start;
+    gf.thread_wait  = whisper_graph_thread_wait;
+    gf.thread_data  = &threads;
+
+    ggml_graph_compute(ctx0, &gf);
+
+    whisper_cpu_scheduler_release(*sched, priority, gf.n_threads);
+}
+
+// check whether the transcription of the state has to stop early: params.abort_callback or params.deadline_ms
+// the first reason found is kept until the next whisper_full() call of the state
+static bool whisper_full_stopped(whisper_state & state) {
+    whisper_state & s = state.stop_parent ? *state.stop_parent : state;
+
+    if (!s.stop_check) {
+        return false;
+    }
+
+    if (s.stop_reason != WHISPER_STOP_NONE) {
+        return true;
+    }
+
+    if (s.t_deadline_us > 0 && ggml_time_us() >= s.t_deadline_us) {
+        s.stop_reason = WHISPER_STOP_DEADLINE;
+        return true;
+    }
+
+    if (s.abort_callback && s.abort_callback(s.abort_callback_user_data)) {
+        s.stop_reason = WHISPER_STOP_ABORT;
+        return true;
+    }
+
+    return false;
+}
+
+static whisper_stop_reason whisper_state_stop_reason(const whisper_state & state) {
+    const whisper_state & s = state.stop_parent ? *state.stop_parent : state;
+
+    return (whisper_stop_reason) s.stop_reason.load();
+}
+
+// ggml abort callback of the graphs of a single state - stops the graph between two nodes
+static bool whisper_graph_abort(void * data) {
+    return whisper_full_stopped(*(whisper_state *) data);
+}
+
+// make sure that scratch0 can hold the KQ matrices of the attention, which are materialized without
+// ggml_flash_attn_tiled. the buffer only grows, so it is done before building the graph
+static void whisper_reserve_scratch(whisper_state & wstate, e_model type, bool use_flash_attn) {
+    const size_t size = use_flash_attn ? MEM_REQ_SCRATCH0_TILED.at(type) : MEM_REQ_SCRATCH0.at(type);
+
+    if (wstate.buf_scratch[0].size() < size) {
+        wstate.buf_scratch[0].resize(size);
+    }
+}
+
+// evaluate the encoder for a batch of states
+//
+// given audio recordings (more specifically, their log mel spectrograms), runs forward pass of the encoder
+// part of the transformer model and stores the encoded features in the cross-attention KV cache of each state
+//
+// the windows of the states are stacked along the time axis, so that every matrix multiplication of the layers is
+// done once for the whole batch. only the self-attention is evaluated per window. the graph is built in the
+// buffers of the first state, so the batch must not be larger than a full window: n_batch*n_ctx <= n_audio_ctx
+//
+//   - wctx:       the model
+//   - wstates:    the states of the encoder, with the same exp_n_audio_ctx and use_flash_attn
+//   - n_batch:    number of states
+//   - mel_offset: offset in the mel spectrograms (i.e. audio offset)
+//   - n_threads:  number of threads to use
+//
+static bool whisper_encode_batch_internal(
+        whisper_context & wctx,
+  whisper_state * const * wstates,
+              const int   n_batch,
+              const int   mel_offset,
+              const int   n_threads){
+
+    const int64_t t_start_us = ggml_time_us();
+
+    auto & wstate = *wstates[0];
+
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    whisper_reserve_scratch(wstate, model.type, wstate.use_flash_attn);
+
+    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+    const int n_state = hparams.n_audio_state;
+    const int n_head  = hparams.n_audio_head;
+    const int n_layer = hparams.n_audio_layer;
+
+    const int n_mels = hparams.n_mels;
+
+    assert(n_batch*n_ctx <= hparams.n_audio_ctx);
+
+    for (int ib = 0; ib < n_batch; ++ib) {
+        wstates[ib]->kv_cross_seek = -1;
+    }
+
+#ifndef WHISPER_USE_COREML
+    const bool use_coreml = false;
+#else
+    const bool use_coreml = wstate.ctx_coreml != nullptr;
 #endif
-                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
+#ifndef WHISPER_USE_OPENVINO
+    const bool use_openvino = false;
+#else
+    const bool use_openvino = wstate.ctx_openvino != nullptr;
+#endif
+
+    // the external encoders process one window at a time
+    if ((use_coreml || use_openvino) && n_batch > 1) {
+        for (int ib = 0; ib < n_batch; ++ib) {
+            if (!whisper_encode_batch_internal(wctx, wstates + ib, 1, mel_offset, n_threads)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wstate.buf_compute.size(),
+        /*.mem_buffer =*/ wstate.buf_compute.data(),
+        /*.no_alloc   =*/ false,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    wstate.use_buf(ctx0, 0);
+
+    struct ggml_tensor * mel = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels, n_batch);
+    assert(mel->type == GGML_TYPE_F32);
+    {
+        float * dst = (float *) mel->data;
+        memset(dst, 0, ggml_nbytes(mel));
+
+        for (int ib = 0; ib < n_batch; ++ib) {
+            const auto & mel_inp = wstates[ib]->get_mel();
+            assert(mel_inp.n_mel == n_mels);
+
+            const int i0 = std::min(mel_offset, mel_inp.n_len);
+            const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
+
+            for (int j = 0; j < mel_inp.n_mel; ++j) {
+                for (int i = i0; i < i1; ++i) {
+                    dst[(ib*n_mels + j)*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
+                }
+            }
+        }
+    }
+
+    struct ggml_tensor * cur;
+
+    if (!use_coreml && !use_openvino) {
+        // convolution + gelu
+        // each convolution is computed as im2col + matrix multiplication with the prepacked kernel, followed by
+        // a fused bias + GELU. the result is [n_state, n_ctx*n_batch], i.e. already in the layout used by the layers
+        // below. im2col pads each window of the batch separately
+        {
+            wstate.use_buf(ctx0, 1);
+
+            cur = ggml_im2col_1d(ctx0, model.e_conv_1_w, mel, 1, 1);
+            cur = ggml_mul_mat  (ctx0, model.e_conv_1_w_packed, cur);
+            cur = ggml_add_gelu (ctx0, cur, model.e_conv_1_b);
+
+            wstate.use_buf(ctx0, 0);
+
+            cur = ggml_im2col_1d(ctx0, model.e_conv_2_w, ggml_transpose(ctx0, ggml_reshape_3d(ctx0, cur, n_state, 2*n_ctx, n_batch)), 2, 1);
+            cur = ggml_mul_mat  (ctx0, model.e_conv_2_w_packed, cur);
+            cur = ggml_add_gelu (ctx0, cur, model.e_conv_2_b);
+        }
+
+        wstate.use_buf(ctx0, 3);
+
+        // ===================================================================
+        // NOTE: experimenting with partial evaluation of the encoder (ignore)
+        //static int iter = -1;
+        //const int n_iter = 1500/n_ctx;
+
+        //iter = (iter + 1) % n_iter;
+
+        //if (iter == 0) {
+        //    memset(model.memory_cross_k->data, 0, ggml_nbytes(model.memory_cross_k));
+        //    memset(model.memory_cross_v->data, 0, ggml_nbytes(model.memory_cross_v));
+        //}
+
+        static int iter = 0;
+
+        const size_t e_pe_stride = model.e_pe->ne[0]*ggml_element_size(model.e_pe);
+        const size_t e_pe_offset = model.e_pe->ne[0]*ggml_element_size(model.e_pe)*n_ctx*iter;
+
+        struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
+
+        if (n_batch == 1) {
+            cur = ggml_add(ctx0, e_pe, cur);
+        } else {
+            // the repeated embedding goes to buf 1, which is free once the second convolution has been computed
+            wstate.use_buf(ctx0, 1);
+
+            struct ggml_tensor * e_pe_rep = ggml_repeat(ctx0, e_pe, cur);
+
+            wstate.use_buf(ctx0, 3);
+
+            // cur first, so that the convolutions are evaluated before the repeat
+            cur = ggml_add(ctx0, cur, e_pe_rep);
+        }
+
+        // ===================================================================
+
+        // original:
+        //cur = ggml_add(ctx0, model.e_pe, ggml_transpose(ctx0, cur));
+
+        struct ggml_tensor * inpL = cur;
+
+        for (int il = 0; il < n_layer; ++il) {
+            const auto & layer = model.layers_encoder[il];
+
+            // norm
+            {
+                wstate.use_buf(ctx0, 0);
+
+                cur = ggml_norm(ctx0, inpL);
+
+                // cur = ln_0_w*cur + ln_0_b
+                cur = ggml_add(ctx0,
+                        ggml_mul(ctx0,
+                            ggml_repeat(ctx0, layer.attn_ln_0_w, cur),
+                            cur),
+                        ggml_repeat(ctx0, layer.attn_ln_0_b, cur));
+            }
+
+            // self-attention
+            {
                 wstate.use_buf(ctx0, 1);
 
-                cur = ggml_cpy(ctx0,
-                        KQV_merged,
-                        ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx));
+                struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
+                        layer.attn_q_w,
+                        cur);
+
+                Qcur = ggml_add(ctx0,
+                        ggml_repeat(ctx0,
+                            layer.attn_q_b,
+                            Qcur),
+                        Qcur);
+
+                //Qcur = ggml_scale_inplace(ctx0, Qcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
+
+                // note: no bias for Key
+                struct ggml_tensor * Kcur = ggml_mul_mat(ctx0,
+                        layer.attn_k_w,
+                        cur);
+
+                //Kcur = ggml_scale_inplace(ctx0, Kcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
+
+                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
+                        layer.attn_v_w,
+                        cur);
+
+                Vcur = ggml_add(ctx0,
+                        ggml_repeat(ctx0,
+                            layer.attn_v_b,
+                            Vcur),
+                        Vcur);
+
+                // ------
+
+                wstate.use_buf(ctx0, 0);
+
+                // Q is read in-place from the output of the projection through a head-major view
+                // the windows of the batch are the 4th dimension, so that the attention stays within each window
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_reshape_4d(ctx0, Qcur, n_state/n_head, n_head, n_ctx, n_batch),
+                            0, 2, 1, 3);
+
+                // K and V are written once, directly in the head-major layout in which they are read:
+                // K as [n_state/n_head, n_ctx, n_head] and V transposed as [n_ctx, n_state/n_head, n_head]
+                struct ggml_tensor * K =
+                    ggml_cpy(ctx0,
+                            ggml_permute(ctx0,
+                                ggml_reshape_4d(ctx0, Kcur, n_state/n_head, n_head, n_ctx, n_batch),
+                                0, 2, 1, 3),
+                            ggml_new_tensor_4d(ctx0, wctx.itype, n_state/n_head, n_ctx, n_head, n_batch));
+
+                struct ggml_tensor * V =
+                    ggml_cpy(ctx0,
+                            ggml_permute(ctx0,
+                                ggml_reshape_4d(ctx0, Vcur, n_state/n_head, n_head, n_ctx, n_batch),
+                                1, 2, 0, 3),
+                            ggml_new_tensor_4d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head, n_batch));
+
+                if (wstate.use_flash_attn) {
+                    // Q is still read from buf 1, so the result goes to buf 2, which is free until the residual below
+                    wstate.use_buf(ctx0, 2);
+
+                    // the heads are already merged in the result - no need for a copy
+                    cur = ggml_reshape_2d(ctx0,
+                            ggml_flash_attn_tiled(ctx0, Q, K, V, 1.0f/sqrtf(float(n_state)/n_head)),
+                            n_state, n_ctx*n_batch);
+                } else {
+                    // K * Q
+                    struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+
+                    struct ggml_tensor * KQ_scaled =
+                        ggml_scale_inplace(ctx0,
+                                KQ,
+                                ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
+                                );
+
+                    struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_scaled);
+
+                    struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+
+                    struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+                    wstate.use_buf(ctx0, 1);
+
+                    cur = ggml_cpy(ctx0,
+                            KQV_merged,
+                            ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx*n_batch));
+                }
             }
 
             // projection
@@ -1735,7 +2377,7 @@ static bool whisper_encode_internal(
                 wstate.use_buf(ctx0, 0);
 
                 cur = ggml_flash_ff(ctx0,
-                        ggml_cpy(ctx0, cur, ggml_new_tensor_2d(ctx0, wstate.itype, n_state, n_ctx)),
+                        ggml_cpy(ctx0, cur, ggml_new_tensor_2d(ctx0, wstate.itype, n_state, n_ctx*n_batch)),
                         layer.mlp_0_w, layer.mlp_0_b, layer.mlp_1_w, layer.mlp_1_b);
 #else
                 wstate.use_buf(ctx0, 0);
@@ -1801,8 +2443,14 @@ static bool whisper_encode_internal(
             struct ggml_cgraph gf = {};
             gf.n_threads = n_threads;
 
+            // a batch is shared by several transcriptions, it is never aborted
+            if (n_batch == 1) {
+                gf.abort_callback      = whisper_graph_abort;
+                gf.abort_callback_data = &wstate;
+            }
+
             ggml_build_forward_expand(&gf, cur);
-            ggml_graph_compute(ctx0, &gf);
+            whisper_graph_compute(ctx0, gf, wstate, wstate.priority);
 
             //ggml_graph_print(&gf);
         }
@@ -1847,6 +2495,11 @@ static bool whisper_encode_internal(
         struct ggml_cgraph gf = {};
         gf.n_threads = n_threads;
 
+        if (n_batch == 1) {
+            gf.abort_callback      = whisper_graph_abort;
+            gf.abort_callback_data = &wstate;
+        }
+
         // TODO: hack to disconnect the encoded features from the previous graph
         cur->op = GGML_OP_NONE;
         cur->src0 = nullptr;
@@ -1877,18 +2530,25 @@ static bool whisper_encode_internal(
 
             wstate.use_buf(ctx0, -1);
 
-            Vcross = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcross, n_state, n_ctx));
+            // scatter the windows of the batch to the cache of their state
+            for (int ib = 0; ib < n_batch; ++ib) {
+                auto & kv_cross = wstates[ib]->kv_cross;
 
-            struct ggml_tensor * k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx, (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx));
-            struct ggml_tensor * v = ggml_view_2d(ctx0, wstate.kv_cross.v, n_ctx, n_state,
-                    (   n_ctx)*ggml_element_size(wstate.kv_cross.v),
-                    (il*n_ctx)*ggml_element_size(wstate.kv_cross.v)*n_state);
+                struct ggml_tensor * Kcross_b = ggml_view_2d(ctx0, Kcross, n_state, n_ctx, Kcross->nb[1], ib*n_ctx*Kcross->nb[1]);
+                struct ggml_tensor * Vcross_b = ggml_transpose(ctx0,
+                        ggml_view_2d(ctx0, Vcross, n_state, n_ctx, Vcross->nb[1], ib*n_ctx*Vcross->nb[1]));
 
-            ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcross, k));
-            ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcross, v));
-        }
+                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_cross.k, n_state*n_ctx, (ggml_element_size(kv_cross.k)*n_state)*(il*n_ctx));
+                struct ggml_tensor * v = ggml_view_2d(ctx0, kv_cross.v, n_ctx, n_state,
+                        (   n_ctx)*ggml_element_size(kv_cross.v),
+                        (il*n_ctx)*ggml_element_size(kv_cross.v)*n_state);
 
-        ggml_graph_compute(ctx0, &gf);
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcross_b, k));
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcross_b, v));
+            }
+        }
+
+        whisper_graph_compute(ctx0, gf, wstate, wstate.priority);
         //ggml_graph_print(&gf);
     }
 
@@ -1903,12 +2563,41 @@ static bool whisper_encode_internal(
 
     ggml_free(ctx0);
 
-    wstate.t_encode_us += ggml_time_us() - t_start_us;
-    wstate.n_encode++;
+    // stopped in the middle of the graphs - the cross-attention KV cache is incomplete
+    if (n_batch == 1 && whisper_full_stopped(wstate)) {
+        return false;
+    }
+
+    // the time is shared evenly between the states of the batch
+    const int64_t t_encode_us = (ggml_time_us() - t_start_us)/n_batch;
+
+    for (int ib = 0; ib < n_batch; ++ib) {
+        wstates[ib]->t_encode_us += t_encode_us;
+        wstates[ib]->n_encode++;
+
+        wstates[ib]->t_encode_batch_us = t_encode_us;
+    }
 
     return true;
 }
 
+// evaluate the encoder with the given state
+//
+//   - wctx:       the model
+//   - wstate:     the state of the encoder
+//   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
+//   - n_threads:  number of threads to use
+//
+static bool whisper_encode_internal(
+        whisper_context & wctx,
+          whisper_state & wstate,
+              const int   mel_offset,
+              const int   n_threads) {
+    whisper_state * wstates[1] = { &wstate };
+
+    return whisper_encode_batch_internal(wctx, wstates, 1, mel_offset, n_threads);
+}
+
 // evaluate the decoder
 //
 // given text prompt + audio features -> computes the logits for the next token
@@ -1918,6 +2607,9 @@ static bool whisper_encode_internal(
 //   - tokens:     text prompt
 //   - n_tokens:   number of tokens in the prompt
 //   - n_past:     number of past tokens to prefix the prompt with
+//   - logits_all: compute the logits for all N tokens instead of only the last one. the self-attention is then
+//                 evaluated separately for each token, so that the logits are identical to those of N
+//                 single-token evaluations (used to verify drafted tokens)
 //
 static bool whisper_decode_internal(
         whisper_context & wctx,
@@ -1926,12 +2618,16 @@ static bool whisper_decode_internal(
     const whisper_token * tokens,
               const int   n_tokens,
               const int   n_past,
-              const int   n_threads) {
+              const int   n_threads,
+             const bool   logits_all = false,
+    const std::vector<whisper_token> * logits_id = nullptr) {
     const int64_t t_start_us = ggml_time_us();
 
     const auto & model   = wctx.model;
     const auto & hparams = model.hparams;
 
+    whisper_reserve_scratch(wstate, model.type, wstate.use_flash_attn);
+
     auto & kv_self = decoder.kv_self;
 
     WHISPER_ASSERT(!!kv_self.ctx);
@@ -2042,13 +2738,10 @@ static bool whisper_decode_internal(
 
             // ------
 
-            wstate.use_buf(ctx0, 0);
-
+            // Q is read in-place from the output of the projection through a head-major view
             struct ggml_tensor * Q =
                 ggml_permute(ctx0,
-                        ggml_cpy(ctx0,
-                            Qcur,
-                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, N)),
+                        ggml_reshape_3d(ctx0, Qcur, n_state/n_head, n_head, N),
                         0, 2, 1, 3);
 
             struct ggml_tensor * K =
@@ -2060,33 +2753,60 @@ static bool whisper_decode_internal(
 
             wstate.use_buf(ctx0, 1);
 
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+            if (logits_all && N > 1) {
+                // the masked KQ rows of the batched evaluation have trailing zeros that change the summation order of
+                // the KQV dot products - attend over the n_past + i + 1 visible positions only, as a single-token
+                // evaluation would
+                cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N);
 
-            //struct ggml_tensor * KQ_scaled =
-            //    ggml_scale_inplace(ctx0,
-            //            KQ,
-            //            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
-            //            );
+                for (int i = 0; i < N; ++i) {
+                    struct ggml_tensor * Qi = ggml_view_3d(ctx0, Q, Q->ne[0], 1, Q->ne[2], Q->nb[1], Q->nb[2], i*Q->nb[1]);
+                    struct ggml_tensor * Ki = ggml_view_3d(ctx0, K, K->ne[0], n_past + i + 1, K->ne[2], K->nb[1], K->nb[2], 0);
 
-            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf_inplace(ctx0, KQ, n_past);
+                    struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, ggml_mul_mat(ctx0, Ki, Qi));
 
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_masked);
+                    struct ggml_tensor * Vi =
+                        ggml_view_3d(ctx0, kv_self.v,
+                                n_past + i + 1, n_state/n_head, n_head,
+                                n_ctx*ggml_element_size(kv_self.v),
+                                n_ctx*ggml_element_size(kv_self.v)*n_state/n_head,
+                                il*n_ctx*ggml_element_size(kv_self.v)*n_state);
 
-            struct ggml_tensor * V =
-                ggml_view_3d(ctx0, kv_self.v,
-                        n_past + N, n_state/n_head, n_head,
-                        n_ctx*ggml_element_size(kv_self.v),
-                        n_ctx*ggml_element_size(kv_self.v)*n_state/n_head,
-                        il*n_ctx*ggml_element_size(kv_self.v)*n_state);
+                    struct ggml_tensor * KQV = ggml_mul_mat(ctx0, Vi, KQ_soft_max);
+
+                    ggml_build_forward_expand(&gf, ggml_cpy(ctx0,
+                                ggml_permute(ctx0, KQV, 0, 2, 1, 3),
+                                ggml_view_1d(ctx0, cur, n_state, i*cur->nb[1])));
+                }
+            } else {
+                // K * Q
+                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+
+                //struct ggml_tensor * KQ_scaled =
+                //    ggml_scale_inplace(ctx0,
+                //            KQ,
+                //            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
+                //            );
+
+                struct ggml_tensor * KQ_masked = ggml_diag_mask_inf_inplace(ctx0, KQ, n_past);
+
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_masked);
+
+                struct ggml_tensor * V =
+                    ggml_view_3d(ctx0, kv_self.v,
+                            n_past + N, n_state/n_head, n_head,
+                            n_ctx*ggml_element_size(kv_self.v),
+                            n_ctx*ggml_element_size(kv_self.v)*n_state/n_head,
+                            il*n_ctx*ggml_element_size(kv_self.v)*n_state);
 
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
 
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
-            cur = ggml_cpy(ctx0,
-                    KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N));
+                cur = ggml_cpy(ctx0,
+                        KQV_merged,
+                        ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N));
+            }
         }
 
         // projection
@@ -2162,37 +2882,43 @@ static bool whisper_decode_internal(
 
             // ------
 
+            // Q and K are read in-place through head-major views
             struct ggml_tensor * Q =
                 ggml_permute(ctx0,
-                        ggml_cpy(ctx0,
-                            Qcur,
-                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, N)),
+                        ggml_reshape_3d(ctx0, Qcur, n_state/n_head, n_head, N),
                         0, 2, 1, 3);
 
             struct ggml_tensor * K = ggml_permute(ctx0, Kcross, 0, 2, 1, 3);
 
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+            if (wstate.use_flash_attn) {
+                // Q and Kcross are already scaled
+                cur = ggml_reshape_2d(ctx0,
+                        ggml_flash_attn_tiled(ctx0, Q, K, V, 1.0f),
+                        n_state, N);
+            } else {
+                // K * Q
+                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
 
-            //struct ggml_tensor * KQ_scaled =
-            //    ggml_scale_inplace(ctx0,
-            //            KQ,
-            //            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
-            //            );
+                //struct ggml_tensor * KQ_scaled =
+                //    ggml_scale_inplace(ctx0,
+                //            KQ,
+                //            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
+                //            );
 
-            // no masking for cross-attention
-            //struct ggml_tensor * KQ_masked = ggml_diag_mask_inf_inplace(ctx0, KQ_scaled, n_past);
+                // no masking for cross-attention
+                //struct ggml_tensor * KQ_masked = ggml_diag_mask_inf_inplace(ctx0, KQ_scaled, n_past);
 
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ);
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ);
 
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
 
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
-            // cur = KQV_merged.contiguous().view(n_state, N)
-            cur = ggml_cpy(ctx0,
-                    KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N));
+                // cur = KQV_merged.contiguous().view(n_state, N)
+                cur = ggml_cpy(ctx0,
+                        KQV_merged,
+                        ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N));
+            }
         }
 
         // projection
@@ -2291,28 +3017,74 @@ static bool whisper_decode_internal(
 
     wstate.use_buf(ctx0, 0);
 
-    // compute logits only for the last token
-    // comment this line to compute logits for all N tokens
-    // might be useful in the future
-    cur = ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], (cur->ne[1] - 1)*cur->nb[1]);
+    // compute logits only for the last token, unless requested for all N tokens
+    if (!logits_all) {
+        cur = ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], (cur->ne[1] - 1)*cur->nb[1]);
+    }
+
+    struct ggml_tensor * logits = nullptr;
 
-    struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
+    if (logits_id && !logits_all) {
+        // compute the logits only for the rows of d_te in logits_id
+        // the hidden state is computed first, so that its scratch buffers can be reused for the gathered rows
+        ggml_build_forward_expand(&gf, cur);
+
+        wstate.use_buf(ctx0, -1);
+
+        struct ggml_tensor * ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, logits_id->size());
+        memcpy(ids->data, logits_id->data(), logits_id->size()*ggml_element_size(ids));
+
+        wstate.use_buf(ctx0, 0);
+
+        struct ggml_tensor * rows = ggml_get_rows(ctx0, model.d_te, ids);
+
+        // convert back to F16, so that the logits are the same as the ones of the full projection
+        // quantized rows stay dequantized
+        if (model.d_te->type == GGML_TYPE_F16) {
+            wstate.use_buf(ctx0, 2);
+
+            rows = ggml_cpy(ctx0, rows, ggml_new_tensor_2d(ctx0, GGML_TYPE_F16, n_state, logits_id->size()));
+        }
+
+        wstate.use_buf(ctx0, -1);
+
+        logits = ggml_mul_mat(ctx0, rows, cur);
+    } else {
+        logits = ggml_mul_mat(ctx0, model.d_te, cur);
+    }
 
     wstate.use_buf(ctx0, -1);
 
     // run the computation
     {
+        gf.abort_callback      = whisper_graph_abort;
+        gf.abort_callback_data = &wstate;
+
         ggml_build_forward_expand(&gf, logits);
-        ggml_graph_compute       (ctx0, &gf);
+        whisper_graph_compute    (ctx0, gf, wstate, wstate.priority);
     }
 
-    // extract logits for all N tokens
-    //logits_out.resize(N*n_vocab);
-    //memcpy(logits_out.data(), ggml_get_data(logits), sizeof(float)*N*n_vocab);
+    if (whisper_full_stopped(wstate)) {
+        ggml_free(ctx0);
+        return false;
+    }
+
+    // extract the logits - [N][n_vocab] or [1][n_vocab]
+    if (logits_id && !logits_all) {
+        const float * data = ggml_get_data_f32(logits);
+
+        logits_out.resize(n_vocab);
+        std::fill(logits_out.begin(), logits_out.end(), -INFINITY);
 
-    // extract logits only for the last token
-    logits_out.resize(n_vocab);
-    memcpy(logits_out.data(), ggml_get_data(logits), sizeof(float)*n_vocab);
+        for (int i = 0; i < (int) logits_id->size(); ++i) {
+            logits_out[(*logits_id)[i]] = data[i];
+        }
+    } else {
+        const int n_out = logits_all ? N : 1;
+
+        logits_out.resize(n_out*n_vocab);
+        memcpy(logits_out.data(), ggml_get_data(logits), sizeof(float)*n_out*n_vocab);
+    }
 
     if (N > 1) {
         //printf("%s: used_mem = %f MB, %f MB, %f MB %f MB %f MB\n", __func__,
@@ -2331,1752 +3103,4274 @@ static bool whisper_decode_internal(
     return true;
 }
 
-//  500 -> 00:05.000
-// 6000 -> 01:00.000
-static std::string to_timestamp(int64_t t, bool comma = false) {
-    int64_t msec = t * 10;
-    int64_t hr = msec / (1000 * 60 * 60);
-    msec = msec - hr * (1000 * 60 * 60);
-    int64_t min = msec / (1000 * 60);
-    msec = msec - min * (1000 * 60);
-    int64_t sec = msec / 1000;
-    msec = msec - sec * 1000;
-
-    char buf[32];
-    snprintf(buf, sizeof(buf), "%02d:%02d:%02d%s%03d", (int) hr, (int) min, (int) sec, comma ? "," : ".", (int) msec);
+// max number of single-token steps in a decoder graph of the decode batching
+// each step adds its own attention nodes to every layer of the graph, which is limited to GGML_MAX_NODES
+static int whisper_decode_batch_max(const whisper_context & wctx) {
+    const int n_layer = wctx.model.hparams.n_text_layer;
 
-    return std::string(buf);
+    return std::max(1, std::min(WHISPER_MAX_DECODE_BATCH, (GGML_MAX_NODES - 48*n_layer - 32)/(34*n_layer)));
 }
 
-#define SIN_COS_N_COUNT WHISPER_N_FFT
-static float sin_vals[SIN_COS_N_COUNT];
-static float cos_vals[SIN_COS_N_COUNT];
+// evaluate single-token decoder steps of several sequences in a single graph
+//
+// the steps can belong to different decoders and states: each step attends to the self-attention cache of its decoder
+// and to the cross-attention cache of its state, while the projections, the feed-forward layers and the logits of all
+// the steps are computed with single matrix multiplications. the logits are identical to those of whisper_decode_internal()
+// for each step. the graph is built in the buffers of the state of the first step
+//
+//   - steps:     the steps, the logits of each step are written to step.logits
+//   - n_steps:   number of steps, at most whisper_decode_batch_max()
+//   - n_threads: number of threads to use
+//
+static bool whisper_decode_batch_internal(
+            whisper_context & wctx,
+  whisper_decode_step * const * steps,
+                    const int   n_steps,
+                    const int   n_threads) {
+    const int64_t t_start_us = ggml_time_us();
 
-// In FFT, we frequently use sine and cosine operations with the same values. 
-// We can use precalculated values to speed up the process.
-static void fill_sin_cos_table() {
-    static bool is_filled = false;
-    if (is_filled) return;
-    for (int i = 0; i < SIN_COS_N_COUNT; i++) {
-        double theta = (2*M_PI*i)/SIN_COS_N_COUNT;
-        sin_vals[i] = sinf(theta);
-        cos_vals[i] = cosf(theta);
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    auto & wstate = *steps[0]->state;
+
+    // the cross-attention of each step follows the setting of its own state
+    for (int s = 0; s < n_steps; ++s) {
+        whisper_reserve_scratch(wstate, model.type, steps[s]->state->use_flash_attn);
     }
-    is_filled = true;
-}
 
-// naive Discrete Fourier Transform
-// input is real-valued
-// output is complex-valued
-static void dft(const std::vector<float> & in, std::vector<float> & out) {
-    int N = in.size();
+    const int n_vocab = hparams.n_vocab;
 
-    out.resize(N*2);
-    const int sin_cos_step = SIN_COS_N_COUNT / N;
+    const int n_ctx   = hparams.n_text_ctx;
+    const int n_state = hparams.n_text_state;
+    const int n_head  = hparams.n_text_head;
+    const int n_layer = hparams.n_text_layer;
 
-    for (int k = 0; k < N; k++) {
-        float re = 0;
-        float im = 0;
+    const int S = n_steps;
 
-        for (int n = 0; n < N; n++) {
-            int idx = (k * n * sin_cos_step) % (SIN_COS_N_COUNT); // t = 2*M_PI*k*n/N
-            re += in[n]*cos_vals[idx]; // cos(t)
-            im -= in[n]*sin_vals[idx]; // sin(t)
-        }
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wstate.buf_compute.size(),
+        /*.mem_buffer =*/ wstate.buf_compute.data(),
+        /*.no_alloc   =*/ false,
+    };
 
-        out[k*2 + 0] = re;
-        out[k*2 + 1] = im;
-    }
-}
+    struct ggml_context * ctx0 = ggml_init(params);
 
-// Cooley-Tukey FFT
-// poor man's implementation - use something better
-// input is real-valued
-// output is complex-valued
-static void fft(const std::vector<float> & in, std::vector<float> & out) {
-    out.resize(in.size()*2);
+    struct ggml_cgraph gf = {};
+    gf.n_threads = n_threads;
 
-    int N = in.size();
+    struct ggml_tensor * embd     = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, S);
+    struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, S);
 
-    if (N == 1) {
-        out[0] = in[0];
-        out[1] = 0;
-        return;
+    for (int s = 0; s < S; ++s) {
+        ((int32_t *) embd->data)[s]     = steps[s]->token;
+        ((int32_t *) position->data)[s] = steps[s]->n_past;
     }
 
-    if (N%2 == 1) {
-        dft(in, out);
-        return;
-    }
+    wstate.use_buf(ctx0, 3);
 
-    std::vector<float> even;
-    std::vector<float> odd;
+    // token encoding + position encoding
+    struct ggml_tensor * cur =
+        ggml_add(ctx0,
+                ggml_get_rows(ctx0, model.d_te, embd),
+                ggml_get_rows(ctx0, model.d_pe, position));
 
-    even.reserve(N/2);
-    odd.reserve(N/2);
+    struct ggml_tensor * inpL = cur;
 
-    for (int i = 0; i < N; i++) {
-        if (i % 2 == 0) {
-            even.push_back(in[i]);
-        } else {
-            odd.push_back(in[i]);
+    for (int il = 0; il < n_layer; ++il) {
+        const auto & layer = model.layers_decoder[il];
+
+        // norm
+        {
+            wstate.use_buf(ctx0, 0);
+
+            cur = ggml_norm(ctx0, inpL);
+
+            // cur = ln_0_w*cur + ln_0_b
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0,
+                        ggml_repeat(ctx0, layer.attn_ln_0_w, cur),
+                        cur),
+                    ggml_repeat(ctx0, layer.attn_ln_0_b, cur));
         }
-    }
 
-    std::vector<float> even_fft;
-    std::vector<float> odd_fft;
+        // self-attention
+        {
+            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
+                    layer.attn_q_w,
+                    cur);
 
-    fft(even, even_fft);
-    fft(odd, odd_fft);
+            Qcur = ggml_add(ctx0,
+                    ggml_repeat(ctx0,
+                        layer.attn_q_b,
+                        Qcur),
+                    Qcur);
 
-    const int sin_cos_step = SIN_COS_N_COUNT / N;
-    for (int k = 0; k < N/2; k++) {
-        int idx = k * sin_cos_step; // t = 2*M_PI*k/N
-        float re = cos_vals[idx]; // cos(t)
-        float im = -sin_vals[idx]; // sin(t)
+            Qcur = ggml_scale_inplace(ctx0, Qcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
 
-        float re_odd = odd_fft[2*k + 0];
-        float im_odd = odd_fft[2*k + 1];
+            // note: no bias for Key
+            struct ggml_tensor * Kcur = ggml_mul_mat(ctx0,
+                    layer.attn_k_w,
+                    cur);
 
-        out[2*k + 0] = even_fft[2*k + 0] + re*re_odd - im*im_odd;
-        out[2*k + 1] = even_fft[2*k + 1] + re*im_odd + im*re_odd;
+            Kcur = ggml_scale_inplace(ctx0, Kcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
 
-        out[2*(k + N/2) + 0] = even_fft[2*k + 0] - re*re_odd + im*im_odd;
-        out[2*(k + N/2) + 1] = even_fft[2*k + 1] - re*im_odd - im*re_odd;
-    }
-}
+            struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
+                    layer.attn_v_w,
+                    cur);
 
-static bool hann_window(int length, bool periodic, std::vector<float> & output) {
-    if (output.size() < length) {
-        output.resize(length);
-    }
-    int offset = -1;
-    if (periodic) {
-        offset = 0;
-    }
-    for (int i = 0; i < length; i++) {
-        output[i] = 0.5*(1.0 - cosf((2.0*M_PI*i)/(length + offset)));
-    }
+            Vcur = ggml_add(ctx0,
+                    ggml_repeat(ctx0,
+                        layer.attn_v_b,
+                        Vcur),
+                    Vcur);
 
-    return true;
-}
+            wstate.use_buf(ctx0, 1);
 
-static void log_mel_spectrogram_worker_thread(int ith, const std::vector<float> & hann, const std::vector<float> & samples,
-                                              int n_samples, int frame_size, int frame_step, int n_threads,
-                                              const whisper_filters & filters, whisper_mel & mel) {
-    std::vector<float> fft_in(frame_size, 0.0);
-    std::vector<float> fft_out(2 * frame_step);
-    // make sure n_fft == 1 + (WHISPER_N_FFT / 2), bin_0 to bin_nyquist
-    int n_fft = 1 + (frame_size / 2);
-    int i = ith;
+            cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, S);
 
-    // calculate FFT only when fft_in are not all zero
-    for (; i < std::min(n_samples / frame_step + 1, mel.n_len); i += n_threads) {
-        const int offset = i * frame_step;
+            for (int s = 0; s < S; ++s) {
+                auto & kv_self = steps[s]->decoder->kv_self;
 
-        // apply Hanning window (~10% faster)
+                const int n_past = steps[s]->n_past;
+
+                // store key and value to the memory of the decoder of the step
+                {
+                    struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, n_state, (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + n_past));
+                    struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, 1, n_state,
+                            (   n_ctx)*ggml_element_size(kv_self.v),
+                            (il*n_ctx)*ggml_element_size(kv_self.v)*n_state + n_past*ggml_element_size(kv_self.v));
+
+                    ggml_build_forward_expand(&gf, ggml_cpy(ctx0, ggml_view_1d(ctx0, Kcur, n_state, s*Kcur->nb[1]), k));
+                    ggml_build_forward_expand(&gf, ggml_cpy(ctx0,
+                                ggml_transpose(ctx0, ggml_view_2d(ctx0, Vcur, n_state, 1, Vcur->nb[1], s*Vcur->nb[1])), v));
+                }
+
+                // a single token attends to all the n_past + 1 positions - no mask
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_reshape_3d(ctx0, ggml_view_1d(ctx0, Qcur, n_state, s*Qcur->nb[1]), n_state/n_head, n_head, 1),
+                            0, 2, 1, 3);
+
+                struct ggml_tensor * K =
+                    ggml_permute(ctx0,
+                            ggml_reshape_3d(ctx0,
+                                ggml_view_1d(ctx0, kv_self.k, (n_past + 1)*n_state, il*n_ctx*ggml_element_size(kv_self.k)*n_state),
+                                n_state/n_head, n_head, n_past + 1),
+                            0, 2, 1, 3);
+
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, ggml_mul_mat(ctx0, K, Q));
+
+                struct ggml_tensor * V =
+                    ggml_view_3d(ctx0, kv_self.v,
+                            n_past + 1, n_state/n_head, n_head,
+                            n_ctx*ggml_element_size(kv_self.v),
+                            n_ctx*ggml_element_size(kv_self.v)*n_state/n_head,
+                            il*n_ctx*ggml_element_size(kv_self.v)*n_state);
+
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0,
+                            ggml_permute(ctx0, KQV, 0, 2, 1, 3),
+                            ggml_view_1d(ctx0, cur, n_state, s*cur->nb[1])));
+            }
+        }
+
+        // projection
+        {
+            wstate.use_buf(ctx0, 0);
+
+            cur = ggml_mul_mat(ctx0,
+                    layer.attn_ln_1_w,
+                    cur);
+
+            wstate.use_buf(ctx0, 1);
+
+            cur = ggml_add(ctx0,
+                    ggml_repeat(ctx0, layer.attn_ln_1_b, cur),
+                    cur);
+        }
+
+        wstate.use_buf(ctx0, 2);
+
+        // add the input
+        struct ggml_tensor * inpCA = ggml_add(ctx0, cur, inpL);
+
+        // norm
+        {
+            wstate.use_buf(ctx0, 0);
+
+            cur = ggml_norm(ctx0, inpCA); // note: we use inpCA here
+
+            // cur = ln_0_w*cur + ln_0_b
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0,
+                        ggml_repeat(ctx0, layer.cross_attn_ln_0_w, cur),
+                        cur),
+                    ggml_repeat(ctx0, layer.cross_attn_ln_0_b, cur));
+        }
+
+        // cross-attention
+        {
+            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
+                    layer.cross_attn_q_w,
+                    cur);
+
+            Qcur = ggml_add(ctx0,
+                    ggml_repeat(ctx0,
+                        layer.cross_attn_q_b,
+                        Qcur),
+                    Qcur);
+
+            Qcur = ggml_scale_inplace(ctx0, Qcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
+
+            wstate.use_buf(ctx0, 1);
+
+            cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, S);
+
+            for (int s = 0; s < S; ++s) {
+                const auto & sstate   = *steps[s]->state;
+                const auto & kv_cross = sstate.kv_cross;
+
+                const int M = sstate.exp_n_audio_ctx > 0 ? sstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+
+                // Kcross is already scaled
+                struct ggml_tensor * K =
+                    ggml_permute(ctx0,
+                            ggml_reshape_3d(ctx0,
+                                ggml_view_1d(ctx0, kv_cross.k, M*n_state, il*M*ggml_element_size(kv_cross.k)*n_state),
+                                n_state/n_head, n_head, M),
+                            0, 2, 1, 3);
+
+                struct ggml_tensor * V =
+                    ggml_view_3d(ctx0, kv_cross.v,
+                            M, n_state/n_head, n_head,
+                            M*ggml_element_size(kv_cross.v),
+                            M*ggml_element_size(kv_cross.v)*n_state/n_head,
+                            il*M*ggml_element_size(kv_cross.v)*n_state);
+
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_reshape_3d(ctx0, ggml_view_1d(ctx0, Qcur, n_state, s*Qcur->nb[1]), n_state/n_head, n_head, 1),
+                            0, 2, 1, 3);
+
+                struct ggml_tensor * KQV_merged = nullptr;
+
+                if (sstate.use_flash_attn) {
+                    // Q and Kcross are already scaled
+                    KQV_merged = ggml_reshape_1d(ctx0, ggml_flash_attn_tiled(ctx0, Q, K, V, 1.0f), n_state);
+                } else {
+                    // no masking for cross-attention
+                    struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, ggml_mul_mat(ctx0, K, Q));
+
+                    struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+
+                    KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                }
+
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0,
+                            KQV_merged,
+                            ggml_view_1d(ctx0, cur, n_state, s*cur->nb[1])));
+            }
+        }
+
+        // projection
+        {
+            wstate.use_buf(ctx0, 0);
+
+            cur = ggml_mul_mat(ctx0,
+                    layer.cross_attn_ln_1_w,
+                    cur);
+
+            wstate.use_buf(ctx0, 1);
+
+            cur = ggml_add(ctx0,
+                    ggml_repeat(ctx0, layer.cross_attn_ln_1_b, cur),
+                    cur);
+        }
+
+        wstate.use_buf(ctx0, 2);
+
+        // add the input
+        cur = ggml_add(ctx0, cur, inpCA);
+
+        struct ggml_tensor * inpFF = cur;
+
+        // feed-forward network
+        {
+            // norm
+            {
+                wstate.use_buf(ctx0, 0);
+
+                cur = ggml_norm(ctx0, inpFF);
+
+                wstate.use_buf(ctx0, 1);
+
+                // cur = mlp_ln_w*cur + mlp_ln_b
+                cur = ggml_add(ctx0,
+                        ggml_mul(ctx0,
+                            ggml_repeat(ctx0, layer.mlp_ln_w, cur),
+                            cur),
+                        ggml_repeat(ctx0, layer.mlp_ln_b, cur));
+            }
+
+            wstate.use_buf(ctx0, 0);
+
+            // fully connected
+            cur = ggml_mul_mat(ctx0,
+                    layer.mlp_0_w,
+                    cur);
+
+            wstate.use_buf(ctx0, 1);
+
+            cur = ggml_add(ctx0,
+                    ggml_repeat(ctx0, layer.mlp_0_b, cur),
+                    cur);
+
+            wstate.use_buf(ctx0, 0);
+
+            // GELU activation
+            cur = ggml_gelu(ctx0, cur);
+
+            wstate.use_buf(ctx0, 1);
+
+            // projection
+            cur = ggml_mul_mat(ctx0,
+                    layer.mlp_1_w,
+                    cur);
+
+            wstate.use_buf(ctx0, 0);
+
+            cur = ggml_add(ctx0,
+                    ggml_repeat(ctx0, layer.mlp_1_b, cur),
+                    cur);
+        }
+
+        wstate.use_buf(ctx0, 3);
+
+        inpL = ggml_add(ctx0, cur, inpFF);
+    }
+
+    cur = inpL;
+
+    // norm
+    {
+        wstate.use_buf(ctx0, 0);
+
+        cur = ggml_norm(ctx0, cur);
+
+        wstate.use_buf(ctx0, 1);
+
+        cur = ggml_add(ctx0,
+                ggml_mul(ctx0,
+                    ggml_repeat(ctx0, model.d_ln_w, cur),
+                    cur),
+                ggml_repeat(ctx0, model.d_ln_b, cur));
+    }
+
+    wstate.use_buf(ctx0, -1);
+
+    struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
+
+    // the batch runs with the highest priority of its states
+    whisper_priority priority = WHISPER_PRIORITY_BATCH;
+    for (int k = 0; k < S; ++k) {
+        priority = std::min(priority, steps[k]->state->priority);
+    }
+
+    // run the computation
+    {
+        ggml_build_forward_expand(&gf, logits);
+        whisper_graph_compute    (ctx0, gf, *steps[0]->state, priority);
+    }
+
+    // extract the logits - [S][n_vocab]
+    for (int s = 0; s < S; ++s) {
+        memcpy(steps[s]->logits, (const float *) ggml_get_data(logits) + s*n_vocab, sizeof(float)*n_vocab);
+    }
+
+    ggml_free(ctx0);
+
+    // the time of the graph is shared by the states of the steps
+    const int64_t t_step_us = (ggml_time_us() - t_start_us)/S;
+
+    for (int s = 0; s < S; ++s) {
+        steps[s]->state->t_decode_us += t_step_us;
+        steps[s]->state->n_decode++;
+    }
+
+    return true;
+}
+
+// evaluate the steps of the calling state together with the pending steps of the other states of the context
+//
+// the first thread that finds no batch in progress becomes the leader: it waits up to batch_wait_us for the other states
+// in their decoding loop to submit their steps, evaluates the oldest pending steps with whisper_decode_batch_internal()
+// and hands over to the next leader. the other threads wait until all their steps have been evaluated. states join and
+// leave the batches between two steps (see whisper_decode_batch_session)
+//
+// the batch in progress may not contain the steps of the calling state, so its CPU scheduler reservation is lifted until
+// the steps are done: a leader of a lower class would otherwise wait for the cores reserved by the waiting states
+static bool whisper_decode_batch(
+        whisper_context & wctx,
+    whisper_decode_step * steps,
+                    int   n_steps,
+                    int   n_threads) {
+    const whisper_cpu_scheduler_suspend sched_suspend(*steps[0].state);
+
+    std::unique_lock<std::mutex> lock(wctx.batch_mutex);
+
+    for (int i = 0; i < n_steps; ++i) {
+        steps[i].done = false;
+        steps[i].ok   = false;
+
+        wctx.batch_pending.push_back(&steps[i]);
+    }
+
+    wctx.batch_cv.notify_all();
+
+    const int n_batch_max = std::max(1, std::min(wctx.batch_n_max, whisper_decode_batch_max(wctx)));
+
+    // number of states with pending steps - the steps of a state are submitted together
+    const auto n_pending_states = [&]() {
+        int n = 0;
+        for (int i = 0; i < (int) wctx.batch_pending.size(); ++i) {
+            if (i == 0 || wctx.batch_pending[i]->state != wctx.batch_pending[i - 1]->state) {
+                ++n;
+            }
+        }
+        return n;
+    };
+
+    while (!steps[n_steps - 1].done) {
+        if (wctx.batch_busy || wctx.batch_pending.empty()) {
+            wctx.batch_cv.wait(lock);
+            continue;
+        }
+
+        wctx.batch_busy = true;
+
+        const auto t_end = std::chrono::steady_clock::now() + std::chrono::microseconds(wctx.batch_wait_us);
+
+        while ((int) wctx.batch_pending.size() < n_batch_max && n_pending_states() < wctx.batch_n_active) {
+            if (wctx.batch_cv.wait_until(lock, t_end) == std::cv_status::timeout) {
+                break;
+            }
+        }
+
+        auto & batch = wctx.batch_steps;
+
+        const int n_batch = std::min(n_batch_max, (int) wctx.batch_pending.size());
+
+        batch.assign(wctx.batch_pending.begin(), wctx.batch_pending.begin() + n_batch);
+        wctx.batch_pending.erase(wctx.batch_pending.begin(), wctx.batch_pending.begin() + n_batch);
+
+        lock.unlock();
+
+        const bool ok = whisper_decode_batch_internal(wctx, batch.data(), n_batch, n_threads);
+
+        lock.lock();
+
+        for (auto * step : batch) {
+            step->ok   = ok;
+            step->done = true;
+        }
+
+        wctx.batch_stats.n_graphs++;
+        wctx.batch_stats.n_steps += n_batch;
+
+        wctx.batch_busy = false;
+        wctx.batch_cv.notify_all();
+    }
+
+    for (int i = 0; i < n_steps; ++i) {
+        if (!steps[i].ok) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// a state in its decoding loop - the leaders of the decode batching wait for the steps of all the active states
+struct whisper_decode_batch_session {
+    whisper_context & wctx;
+
+    bool enabled;
+
+    whisper_decode_batch_session(whisper_context & wctx, bool use) : wctx(wctx) {
+        std::lock_guard<std::mutex> lock(wctx.batch_mutex);
+
+        enabled = use && wctx.batch_n_max > 0;
+        if (enabled) {
+            wctx.batch_n_active++;
+        }
+    }
+
+    ~whisper_decode_batch_session() {
+        if (enabled) {
+            std::lock_guard<std::mutex> lock(wctx.batch_mutex);
+
+            wctx.batch_n_active--;
+            wctx.batch_cv.notify_all();
+        }
+    }
+};
+
+//  500 -> 00:05.000
+// 6000 -> 01:00.000
+static std::string to_timestamp(int64_t t, bool comma = false) {
+    int64_t msec = t * 10;
+    int64_t hr = msec / (1000 * 60 * 60);
+    msec = msec - hr * (1000 * 60 * 60);
+    int64_t min = msec / (1000 * 60);
+    msec = msec - min * (1000 * 60);
+    int64_t sec = msec / 1000;
+    msec = msec - sec * 1000;
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%02d:%02d:%02d%s%03d", (int) hr, (int) min, (int) sec, comma ? "," : ".", (int) msec);
+
+    return std::string(buf);
+}
+
+#define SIN_COS_N_COUNT WHISPER_N_FFT
+static float sin_vals[SIN_COS_N_COUNT];
+static float cos_vals[SIN_COS_N_COUNT];
+
+// In FFT, we frequently use sine and cosine operations with the same values. 
+// We can use precalculated values to speed up the process.
+static void fill_sin_cos_table() {
+    static bool is_filled = false;
+    if (is_filled) return;
+    for (int i = 0; i < SIN_COS_N_COUNT; i++) {
+        double theta = (2*M_PI*i)/SIN_COS_N_COUNT;
+        sin_vals[i] = sinf(theta);
+        cos_vals[i] = cosf(theta);
+    }
+    is_filled = true;
+}
+
+// naive Discrete Fourier Transform
+// input is real-valued
+// output is complex-valued
+static void dft(const std::vector<float> & in, std::vector<float> & out) {
+    int N = in.size();
+
+    out.resize(N*2);
+    const int sin_cos_step = SIN_COS_N_COUNT / N;
+
+    for (int k = 0; k < N; k++) {
+        float re = 0;
+        float im = 0;
+
+        for (int n = 0; n < N; n++) {
+            int idx = (k * n * sin_cos_step) % (SIN_COS_N_COUNT); // t = 2*M_PI*k*n/N
+            re += in[n]*cos_vals[idx]; // cos(t)
+            im -= in[n]*sin_vals[idx]; // sin(t)
+        }
+
+        out[k*2 + 0] = re;
+        out[k*2 + 1] = im;
+    }
+}
+
+// Cooley-Tukey FFT
+// poor man's implementation - use something better
+// input is real-valued
+// output is complex-valued
+static void fft(const std::vector<float> & in, std::vector<float> & out) {
+    out.resize(in.size()*2);
+
+    int N = in.size();
+
+    if (N == 1) {
+        out[0] = in[0];
+        out[1] = 0;
+        return;
+    }
+
+    if (N%2 == 1) {
+        dft(in, out);
+        return;
+    }
+
+    std::vector<float> even;
+    std::vector<float> odd;
+
+    even.reserve(N/2);
+    odd.reserve(N/2);
+
+    for (int i = 0; i < N; i++) {
+        if (i % 2 == 0) {
+            even.push_back(in[i]);
+        } else {
+            odd.push_back(in[i]);
+        }
+    }
+
+    std::vector<float> even_fft;
+    std::vector<float> odd_fft;
+
+    fft(even, even_fft);
+    fft(odd, odd_fft);
+
+    const int sin_cos_step = SIN_COS_N_COUNT / N;
+    for (int k = 0; k < N/2; k++) {
+        int idx = k * sin_cos_step; // t = 2*M_PI*k/N
+        float re = cos_vals[idx]; // cos(t)
+        float im = -sin_vals[idx]; // sin(t)
+
+        float re_odd = odd_fft[2*k + 0];
+        float im_odd = odd_fft[2*k + 1];
+
+        out[2*k + 0] = even_fft[2*k + 0] + re*re_odd - im*im_odd;
+        out[2*k + 1] = even_fft[2*k + 1] + re*im_odd + im*re_odd;
+
+        out[2*(k + N/2) + 0] = even_fft[2*k + 0] - re*re_odd + im*im_odd;
+        out[2*(k + N/2) + 1] = even_fft[2*k + 1] - re*im_odd - im*re_odd;
+    }
+}
+
+static bool hann_window(int length, bool periodic, std::vector<float> & output) {
+    if (output.size() < length) {
+        output.resize(length);
+    }
+    int offset = -1;
+    if (periodic) {
+        offset = 0;
+    }
+    for (int i = 0; i < length; i++) {
+        output[i] = 0.5*(1.0 - cosf((2.0*M_PI*i)/(length + offset)));
+    }
+
+    return true;
+}
+
+static void log_mel_spectrogram_worker_thread(int ith, const std::vector<float> & hann, const std::vector<float> & samples,
+                                              int n_samples, int frame_size, int frame_step, int n_threads,
+                                              const whisper_filters & filters, whisper_mel & mel) {
+    std::vector<float> fft_in(frame_size, 0.0);
+    std::vector<float> fft_out(2 * frame_step);
+    // make sure n_fft == 1 + (WHISPER_N_FFT / 2), bin_0 to bin_nyquist
+    int n_fft = 1 + (frame_size / 2);
+    int i = ith;
+
+    // calculate FFT only when fft_in are not all zero
+    for (; i < std::min(n_samples / frame_step + 1, mel.n_len); i += n_threads) {
+        const int offset = i * frame_step;
+
+        // apply Hanning window (~10% faster)
         for (int j = 0; j < std::min(frame_size, n_samples - offset); j++) {
             fft_in[j] = hann[j] * samples[offset + j];
         }
-        // fill the rest with zeros
-        if (n_samples - offset < frame_size) {
-            std::fill(fft_in.begin() + (n_samples - offset), fft_in.end(), 0.0);
+        // fill the rest with zeros
+        if (n_samples - offset < frame_size) {
+            std::fill(fft_in.begin() + (n_samples - offset), fft_in.end(), 0.0);
+        }
+
+        // FFT
+        fft(fft_in, fft_out);
+
+        // Calculate modulus^2 of complex numbers
+        // Use pow(fft_out[2 * j + 0], 2) + pow(fft_out[2 * j + 1], 2) causes inference quality problem? Interesting.
+        for (int j = 0; j < frame_size; j++) {
+            fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
+        }
+
+        // mel spectrogram
+        for (int j = 0; j < mel.n_mel; j++) {
+            double sum = 0.0;
+
+            // unroll loop (suggested by GH user @lunixbochs)
+            int k = 0;
+            for (k = 0; k < n_fft - 3; k += 4) {
+                sum +=
+                        fft_out[k + 0] * filters.data[j * n_fft + k + 0] +
+                        fft_out[k + 1] * filters.data[j * n_fft + k + 1] +
+                        fft_out[k + 2] * filters.data[j * n_fft + k + 2] +
+                        fft_out[k + 3] * filters.data[j * n_fft + k + 3];
+            }
+
+            // handle n_fft remainder
+            for (; k < n_fft; k++) {
+                sum += fft_out[k] * filters.data[j * n_fft + k];
+            }
+
+            sum = log10(std::max(sum, 1e-10));
+
+            mel.data[j * mel.n_len + i] = sum;
+        }
+    }
+
+    // Otherwise fft_out are all zero
+    double sum = log10(1e-10);
+    for (; i < mel.n_len; i += n_threads) {
+        for (int j = 0; j < mel.n_mel; j++) {
+            mel.data[j * mel.n_len + i] = sum;
+        }
+    }
+}
+
+// ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L110-L157
+static bool log_mel_spectrogram(
+              whisper_state & wstate,
+              const float * samples,
+              const int   n_samples,
+              const int   /*sample_rate*/,
+              const int   frame_size,
+              const int   frame_step,
+              const int   n_mel,
+              const int   n_threads,
+              const whisper_filters & filters,
+              const bool   debug,
+              whisper_mel & mel) {
+    const int64_t t_start_us = ggml_time_us();
+
+    // Hanning window (Use cosf to eliminate difference)
+    // ref: https://pytorch.org/docs/stable/generated/torch.hann_window.html
+    // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L147
+    std::vector<float> hann;
+    hann_window(frame_size, true, hann);
+
+
+    // Calculate the length of padding
+    int64_t stage_1_pad = WHISPER_SAMPLE_RATE * 30;
+    int64_t stage_2_pad = frame_size / 2;
+
+    // Initialize a vector and copy data from C array to it.
+    std::vector<float> samples_padded;
+    samples_padded.resize(n_samples + stage_1_pad + stage_2_pad * 2);
+    std::copy(samples, samples + n_samples, samples_padded.begin() + stage_2_pad);
+
+    // pad 30 seconds of zeros at the end of audio (480,000 samples) + reflective pad 200 samples at the end of audio
+    std::fill(samples_padded.begin() + n_samples + stage_2_pad, samples_padded.begin() + n_samples + stage_1_pad + 2 * stage_2_pad, 0);
+
+    // reflective pad 200 samples at the beginning of audio
+    std::reverse_copy(samples + 1, samples + 1 + stage_2_pad, samples_padded.begin());
+
+    mel.n_mel     = n_mel;
+    // https://github.com/pytorch/pytorch/blob/main/aten/src/ATen/native/SpectralOps.cpp#L936
+    // Calculate number of frames + remove the last frame
+    mel.n_len     = (samples_padded.size() - frame_size) / frame_step;
+    // Calculate semi-padded sample length to ensure compatibility
+    mel.n_len_org = 1 + (n_samples + stage_2_pad - frame_size) / frame_step;
+    mel.data.resize(mel.n_mel * mel.n_len);
+
+
+    {
+        std::vector<std::thread> workers(n_threads - 1);
+        for (int iw = 0; iw < n_threads - 1; ++iw) {
+            workers[iw] = std::thread(
+                    log_mel_spectrogram_worker_thread, iw + 1, std::cref(hann), samples_padded,
+                    n_samples + stage_2_pad, frame_size, frame_step, n_threads,
+                    std::cref(filters), std::ref(mel));
+        }
+
+        // main thread
+        log_mel_spectrogram_worker_thread(0, hann, samples_padded, n_samples + stage_2_pad, frame_size, frame_step, n_threads, filters, mel);
+
+        for (int iw = 0; iw < n_threads - 1; ++iw) {
+            workers[iw].join();
+        }
+    }
+
+    // clamping and normalization
+    double mmax = -1e20;
+    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
+        if (mel.data[i] > mmax) {
+            mmax = mel.data[i];
+        }
+    }
+
+    mmax -= 8.0;
+
+    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
+        if (mel.data[i] < mmax) {
+            mel.data[i] = mmax;
+        }
+
+        mel.data[i] = (mel.data[i] + 4.0)/4.0;
+    }
+
+    wstate.t_mel_us += ggml_time_us() - t_start_us;
+
+    // Dump log_mel_spectrogram
+    if (debug) {
+        std::ofstream outFile("log_mel_spectrogram.json");
+        outFile << "[";
+        for (uint64_t i = 0; i < mel.data.size() - 1; i++) {
+            outFile << mel.data[i] << ", ";
+        }
+        outFile << mel.data[mel.data.size() - 1] << "]";
+        outFile.close();
+    }
+
+    return true;
+}
+
+// split text into tokens
+//
+// ref: https://github.com/openai/gpt-2/blob/a74da5d99abaaba920de8131d64da2862a8f213b/src/encoder.py#L53
+//
+// Regex (Python):
+// r"""'s|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+"""
+//
+// Regex (C++):
+// R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)"
+//
+static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
+    std::vector<std::string> words;
+
+    // first split the text into words
+    {
+        std::string str = text;
+        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
+
+        std::regex re(pat);
+        std::smatch m;
+
+        while (std::regex_search(str, m, re)) {
+            for (auto x : m) {
+                words.push_back(x);
+            }
+            str = m.suffix();
+        }
+    }
+
+    // find the longest tokens that form the words:
+    std::vector<whisper_vocab::id> tokens;
+    for (const auto & word : words) {
+        if (word.empty()) continue;
+
+        int i = 0;
+        int n = word.size();
+        while (i < n) {
+            int j = n;
+            bool found = false;
+            while (j > i) {
+                auto sub = word.substr(i, j-i);
+                auto it = vocab.token_to_id.find(sub);
+                if (it != vocab.token_to_id.end()) {
+                    tokens.push_back(it->second);
+                    i = j;
+                    found = true;
+                    break;
+                }
+                --j;
+            }
+            if (!found) {
+                log("unknown token\n");
+                ++i;
+            }
+        }
+    }
+
+    return tokens;
+}
+
+//
+// interface implementation
+//
+
+#ifdef WHISPER_USE_COREML
+// replace .bin with -encoder.mlmodelc
+static std::string whisper_get_coreml_path_encoder(std::string path_bin) {
+    auto pos = path_bin.rfind('.');
+    if (pos != std::string::npos) {
+        path_bin = path_bin.substr(0, pos);
+    }
+
+    // match "-qx_x"
+    pos = path_bin.rfind('-');
+    if (pos != std::string::npos) {
+        auto sub = path_bin.substr(pos);
+        if (sub.size() == 5 && sub[1] == 'q' && sub[3] == '_') {
+            path_bin = path_bin.substr(0, pos);
+        }
+    }
+
+    path_bin += "-encoder.mlmodelc";
+
+    return path_bin;
+}
+#endif
+
+#ifdef WHISPER_USE_OPENVINO
+// replace .bin with-encoder-openvino.xml
+static std::string whisper_openvino_get_path_encoder(std::string path_bin) {
+    auto pos = path_bin.rfind('.');
+    if (pos != std::string::npos) {
+        path_bin = path_bin.substr(0, pos);
+    }
+
+    path_bin += "-encoder-openvino.xml";
+
+    return path_bin;
+}
+
+static std::string whisper_openvino_get_path_cache(std::string path_bin) {
+    auto pos = path_bin.rfind('.');
+    if (pos != std::string::npos) {
+        path_bin = path_bin.substr(0, pos);
+    }
+
+    path_bin += "-encoder-openvino-cache";
+
+    return path_bin;
+}
+#endif
+
+// with_kv_cross = false: the state gets no cross-attention KV cache of its own and uses the one of another state,
+// see the fallback states of whisper_full_window()
+static struct whisper_state * whisper_init_state_impl(whisper_context * ctx, bool with_kv_cross) {
+    fill_sin_cos_table();
+    whisper_state * state = new whisper_state;
+
+    const size_t scale = ctx->model.hparams.ftype ? 1 : 2;
+
+    if (!kv_cache_init(ctx->model.hparams, scale * MEM_REQ_KV_SELF.at(ctx->model.type), state->decoders[0].kv_self, ctx->itype, ctx->model.hparams.n_text_ctx)) {
+        log("%s: kv_cache_init() failed for self-attention cache\n", __func__);
+        delete state;
+        return nullptr;
+    }
+
+    {
+        const size_t memory_size = ggml_nbytes(state->decoders[0].kv_self.k) + ggml_nbytes(state->decoders[0].kv_self.v);
+        log("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
+    }
+
+    if (with_kv_cross) {
+        if (!kv_cache_init(ctx->model.hparams, scale * MEM_REQ_KV_CROSS.at(ctx->model.type), state->kv_cross, ctx->itype, ctx->model.hparams.n_audio_ctx)) {
+            log("%s: kv_cache_init() failed for cross-attention cache\n", __func__);
+            delete state;
+            return nullptr;
+        }
+
+        const size_t memory_size = ggml_nbytes(state->kv_cross.k) + ggml_nbytes(state->kv_cross.v);
+        log("%s: kv cross size = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
+    }
+
+#ifdef WHISPER_USE_COREML
+    const auto path_coreml = whisper_get_coreml_path_encoder(ctx->path_model);
+
+    log("%s: loading Core ML model from '%s'\n", __func__, path_coreml.c_str());
+    log("%s: first run on a device may take a while ...\n", __func__);
+
+    state->ctx_coreml = whisper_coreml_init(path_coreml.c_str());
+    if (!state->ctx_coreml) {
+        log("%s: failed to load Core ML model from '%s'\n", __func__, path_coreml.c_str());
+#ifndef WHISPER_COREML_ALLOW_FALLBACK
+        return nullptr;
+#endif
+    } else {
+        log("%s: Core ML model loaded\n", __func__);
+    }
+#endif
+
+    state->logits.reserve(ctx->vocab.n_vocab * ctx->model.hparams.n_text_ctx);
+
+    state->logits_id.reserve(ctx->model.hparams.n_vocab);
+
+    state->probs_block.reserve(ctx->vocab.n_vocab/WHISPER_SAMPLE_BLOCK + 1);
+
+    state->decode_steps.reserve(WHISPER_MAX_DECODERS);
+
+    // TAGS: WHISPER_DECODER_INIT
+    state->decoders[0].sequence.tokens.reserve(ctx->model.hparams.n_text_ctx);
+
+    state->decoders[0].probs.reserve(ctx->vocab.n_vocab);
+    state->decoders[0].logits.reserve(ctx->vocab.n_vocab);
+    state->decoders[0].logprobs.reserve(ctx->vocab.n_vocab);
+    state->decoders[0].logits_id.reserve(ctx->vocab.n_vocab);
+
+    state->prompt.reserve(ctx->model.hparams.n_text_ctx);
+    state->prompt_init.reserve(3);
+
+    state->buf_compute.resize(scale * std::max(MEM_REQ_ENCODE.at(ctx->model.type), MEM_REQ_DECODE.at(ctx->model.type)));
+
+    // grown to MEM_REQ_SCRATCH0 by whisper_reserve_scratch() when a graph without the tiled attention is built
+    state->buf_scratch[0].resize(MEM_REQ_SCRATCH0_TILED.at(ctx->model.type));
+    state->buf_scratch[1].resize(MEM_REQ_SCRATCH1.at(ctx->model.type));
+    state->buf_scratch[2].resize(MEM_REQ_SCRATCH2.at(ctx->model.type));
+    state->buf_scratch[3].resize(MEM_REQ_SCRATCH3.at(ctx->model.type));
+
+    state->rng = std::mt19937(0);
+
+    return state;
+}
+
+struct whisper_state * whisper_init_state(whisper_context * ctx) {
+    return whisper_init_state_impl(ctx, true);
+}
+
+int whisper_ctx_init_openvino_encoder(
+        struct whisper_context * ctx,
+                    const char * model_path,
+                    const char * device,
+                    const char * cache_dir) {
+#ifndef WHISPER_USE_OPENVINO
+    (void)(ctx);
+    (void)(model_path);
+    (void)(device);
+    (void)(cache_dir);
+
+    return 1;
+#else
+    if (!model_path && ctx->path_model.empty()) {
+        log("%s: model_path is nullptr, and ctx has no model_path set.\n", __func__);
+        return 1;
+    }
+
+    std::string path_encoder;
+    if (!model_path) {
+        //if model_path is not set, attempt to find it in the same directory as ggml-<model>.bin model
+        path_encoder = whisper_openvino_get_path_encoder(ctx->path_model);
+    } else {
+        path_encoder = model_path;
+    }
+
+    std::string path_cache;
+    if (!cache_dir) {
+        //if cache_dir is not set, set it as a dir residing next to ggml-<model>.bin
+        path_cache = whisper_openvino_get_path_cache(ctx->path_model);
+    } else {
+        path_cache = cache_dir;
+    }
+
+    log("%s: loading OpenVINO model from '%s'\n", __func__, path_encoder.c_str());
+    log("%s: first run on a device may take a while ...\n", __func__);
+
+    ctx->state->ctx_openvino = whisper_openvino_init(path_encoder.c_str(), device, path_cache.c_str());
+    if (!ctx->state->ctx_openvino) {
+        log("%s: failed to init OpenVINO encoder from '%s'\n", __func__, path_encoder.c_str());
+        return 1;
+    } else {
+        log("%s: OpenVINO model loaded\n", __func__);
+    }
+
+    return 0;
+#endif
+}
+
+struct whisper_context * whisper_init_from_file_no_state(const char * path_model) {
+
+    log("%s: loading model from '%s'\n", __func__, path_model);
+
+    auto fin = std::ifstream(path_model, std::ios::binary);
+    if (!fin) {
+        log("%s: failed to open '%s'\n", __func__, path_model);
+        return nullptr;
+    }
+
+    whisper_model_loader loader = {};
+
+    loader.context = &fin;
+
+    loader.read = [](void * ctx, void * output, size_t read_size) {
+        std::ifstream * fin = (std::ifstream*)ctx;
+        fin->read((char *)output, read_size);
+        return read_size;
+    };
+
+    loader.eof = [](void * ctx) {
+        std::ifstream * fin = (std::ifstream*)ctx;
+        return fin->eof();
+    };
+
+    loader.close = [](void * ctx) {
+        std::ifstream * fin = (std::ifstream*)ctx;
+        fin->close();
+    };
+
+    auto ctx = whisper_init_no_state(&loader);
+
+    if (ctx) {
+        ctx->path_model = path_model;
+    }
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init_from_buffer_no_state(void * buffer, size_t buffer_size) {
+    struct buf_context {
+        uint8_t* buffer;
+        size_t size;
+        size_t current_offset;
+    };
+
+    buf_context ctx = { reinterpret_cast<uint8_t*>(buffer), buffer_size, 0 };
+
+    log("%s: loading model from buffer\n", __func__);
+
+    whisper_model_loader loader = {};
+
+    loader.context = &ctx;
+
+    loader.read = [](void * ctx, void * output, size_t read_size) {
+        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
+
+        size_t size_to_copy = buf->current_offset + read_size < buf->size ? read_size : buf->size - buf->current_offset;
+
+        memcpy(output, buf->buffer + buf->current_offset, size_to_copy);
+        buf->current_offset += size_to_copy;
+
+        return size_to_copy;
+    };
+
+    loader.eof = [](void * ctx) {
+        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
+
+        return buf->current_offset >= buf->size;
+    };
+
+    loader.close = [](void * /*ctx*/) { };
+
+    return whisper_init_no_state(&loader);
+}
+
+struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loader) {
+    ggml_time_init();
+
+    whisper_context * ctx = new whisper_context;
+
+    if (!whisper_model_load(loader, *ctx)) {
+        loader->close(loader->context);
+        log("%s: failed to load model\n", __func__);
+        delete ctx;
+        return nullptr;
+    }
+
+    loader->close(loader->context);
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init_from_file(const char * path_model) {
+    whisper_context * ctx = whisper_init_from_file_no_state(path_model);
+    if (!ctx) {
+        return nullptr;
+    }
+
+    ctx->state = whisper_init_state(ctx);
+    if (!ctx->state) {
+        whisper_free(ctx);
+        return nullptr;
+    }
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init_from_buffer(void * buffer, size_t buffer_size) {
+    whisper_context * ctx = whisper_init_from_buffer_no_state(buffer, buffer_size);
+    if (!ctx) {
+        return nullptr;
+    }
+
+    ctx->state = whisper_init_state(ctx);
+    if (!ctx->state) {
+        whisper_free(ctx);
+        return nullptr;
+    }
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init(struct whisper_model_loader * loader) {
+    whisper_context * ctx = whisper_init_no_state(loader);
+    if (!ctx) {
+        return nullptr;
+    }
+
+    ctx->state = whisper_init_state(ctx);
+    if (!ctx->state) {
+        whisper_free(ctx);
+        return nullptr;
+    }
+
+    return ctx;
+}
+
+void whisper_free_state(struct whisper_state * state)
+{
+    if (state) {
+        for (auto * fstate : state->fallback_states) {
+            whisper_free_state(fstate);
+        }
+
+        kv_cache_free(state->kv_cross);
+
+        for (int i = 0; i < WHISPER_MAX_DECODERS; ++i) {
+            kv_cache_free(state->decoders[i].kv_self);
+        }
+
+#ifdef WHISPER_USE_COREML
+        if (state->ctx_coreml != nullptr) {
+            whisper_coreml_free(state->ctx_coreml);
+            state->ctx_coreml = nullptr;
+        }
+#endif
+
+#ifdef WHISPER_USE_OPENVINO
+        if (state->ctx_openvino != nullptr) {
+            whisper_openvino_free(state->ctx_openvino);
+            state->ctx_openvino = nullptr;
+        }
+#endif
+
+        delete state;
+    }
+}
+
+void whisper_free(struct whisper_context * ctx) {
+    if (ctx) {
+        if (ctx->model.ctx) {
+            ggml_free(ctx->model.ctx);
+        }
+        if (ctx->model.buf) {
+            delete ctx->model.buf;
+        }
+
+        whisper_free_state(ctx->state);
+
+        for (auto * state : ctx->pool) {
+            whisper_free_state(state);
+        }
+
+        delete ctx;
+    }
+}
+
+void whisper_free_params(struct whisper_full_params * params) {
+    if (params) {
+        delete params;
+    }
+}
+
+struct whisper_state * whisper_get_state(struct whisper_context * ctx) {
+    return ctx->state;
+}
+
+// the counters of whisper_get_timings_from_state()
+static void whisper_state_reset_timings(whisper_state & state) {
+    state.t_sample_us = 0;
+    state.t_encode_us = 0;
+    state.t_decode_us = 0;
+    state.t_mel_us    = 0;
+
+    state.n_sample = 0;
+    state.n_encode = 0;
+    state.n_decode = 0;
+    state.n_fail_p = 0;
+    state.n_fail_h = 0;
+    state.n_nosp   = 0;
+
+    state.t_draft_us     = 0;
+    state.n_draft        = 0;
+    state.n_draft_accept = 0;
+
+    state.t_cascade_us        = 0;
+    state.n_cascade           = 0;
+    state.n_cascade_escalated = 0;
+
+    state.t_vad_us     = 0;
+    state.n_vad_frames = 0;
+    state.n_vad_speech = 0;
+
+    for (int i = 0; i < WHISPER_MAX_SCRATCH_BUFFERS; ++i) {
+        state.buf_max_size[i]     = 0;
+        state.buf_max_size_all[i] = 0;
+    }
+}
+
+// bring a state back to the condition of a new one, keeping its allocations
+static void whisper_state_reset(whisper_state & state) {
+    whisper_state_reset_timings(state);
+
+    state.vad_regions.clear();
+    state.windows.clear();
+
+    for (int i = 0; i < WHISPER_MAX_DECODERS; ++i) {
+        state.decoders[i].kv_self.n = 0;
+    }
+
+    state.no_speech_prob = 0.0f;
+
+    state.result_all.clear();
+    state.prompt_past.clear();
+    state.draft_past.clear();
+    state.draft_verify.clear();
+    state.draft_verify_i = 0;
+
+    state.rng = std::mt19937(0);
+
+    state.lang_id = 0;
+
+    state.t_beg  = 0;
+    state.t_last = 0;
+
+    state.exp_n_audio_ctx = 0;
+
+    // the audio of the previous user - a call with n_samples == 0 must not transcribe it again
+    state.mel.n_len     = 0;
+    state.mel.n_len_org = 0;
+    state.mel.data.clear();
+
+    state.mel_vad.data.clear();
+    state.use_mel_vad = false;
+
+    state.energy.clear();
+
+    state.kv_cross_seek = -1;
+
+    state.stop_reason = WHISPER_STOP_NONE;
+    state.sched_scope = nullptr;
+
+    // the RNGs and counters of the parallel fallback
+    for (auto * fstate : state.fallback_states) {
+        whisper_state_reset(*fstate);
+    }
+}
+
+struct whisper_state * whisper_state_acquire(struct whisper_context * ctx) {
+    {
+        std::lock_guard<std::mutex> lock(ctx->pool_mutex);
+
+        if (!ctx->pool.empty()) {
+            whisper_state * state = ctx->pool.back();
+            ctx->pool.pop_back();
+
+            ctx->pool_stats.n_idle--;
+            ctx->pool_stats.n_active++;
+            ctx->pool_stats.n_reuse++;
+
+            return state;
+        }
+    }
+
+    // allocate outside of the lock
+    whisper_state * state = whisper_init_state(ctx);
+    if (state == nullptr) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(ctx->pool_mutex);
+
+    ctx->pool_stats.n_active++;
+    ctx->pool_stats.n_alloc++;
+
+    return state;
+}
+
+void whisper_state_release(struct whisper_context * ctx, struct whisper_state * state) {
+    if (state == nullptr) {
+        return;
+    }
+
+    if (state == ctx->state) {
+        log("%s: the default state of the context cannot be released\n", __func__);
+        return;
+    }
+
+    whisper_state_reset(*state);
+
+    {
+        std::lock_guard<std::mutex> lock(ctx->pool_mutex);
+
+        ctx->pool_stats.n_active--;
+
+        if ((int) ctx->pool.size() < ctx->pool_n_max) {
+            ctx->pool.push_back(state);
+            ctx->pool_stats.n_idle++;
+
+            return;
+        }
+
+        ctx->pool_stats.n_free++;
+    }
+
+    whisper_free_state(state);
+}
+
+void whisper_state_pool_set_max(struct whisper_context * ctx, int n_max) {
+    std::vector<whisper_state *> excess;
+
+    {
+        std::lock_guard<std::mutex> lock(ctx->pool_mutex);
+
+        ctx->pool_n_max = std::max(0, n_max);
+
+        while ((int) ctx->pool.size() > ctx->pool_n_max) {
+            excess.push_back(ctx->pool.back());
+            ctx->pool.pop_back();
+
+            ctx->pool_stats.n_idle--;
+            ctx->pool_stats.n_free++;
+        }
+    }
+
+    for (auto * state : excess) {
+        whisper_free_state(state);
+    }
+}
+
+struct whisper_state_pool_stats whisper_state_pool_get_stats(struct whisper_context * ctx) {
+    std::lock_guard<std::mutex> lock(ctx->pool_mutex);
+
+    return ctx->pool_stats;
+}
+
+void whisper_decode_batching_set(struct whisper_context * ctx, int n_batch_max, int wait_us) {
+    std::lock_guard<std::mutex> lock(ctx->batch_mutex);
+
+    ctx->batch_n_max   = std::max(0, n_batch_max);
+    ctx->batch_wait_us = std::max(0, wait_us);
+}
+
+struct whisper_decode_batching_stats whisper_decode_batching_get_stats(struct whisper_context * ctx) {
+    std::lock_guard<std::mutex> lock(ctx->batch_mutex);
+
+    return ctx->batch_stats;
+}
+
+int whisper_cpu_scheduler_set(int n_cores) {
+    std::shared_ptr<whisper_cpu_scheduler> sched;
+
+    if (n_cores >= 0) {
+        if (n_cores == 0) {
+            n_cores = std::max(1, (int) std::thread::hardware_concurrency());
+        }
+
+        sched = std::make_shared<whisper_cpu_scheduler>();
+
+        sched->n_cores = n_cores;
+        sched->n_free  = n_cores;
+
+        sched->stats.n_cores = n_cores;
+
+        for (int i = 0; i < n_cores - 1; ++i) {
+            sched->pool_threads.emplace_back(whisper_cpu_scheduler_worker, sched.get());
+        }
+    }
+
+    // the previous scheduler is destroyed once the transcriptions and graphs that use it are done
+    {
+        std::lock_guard<std::mutex> lock(g_cpu_scheduler_mutex);
+        std::swap(g_cpu_scheduler, sched);
+    }
+
+    return std::max(0, n_cores);
+}
+
+struct whisper_cpu_scheduler_stats whisper_cpu_scheduler_get_stats(void) {
+    const auto sched = whisper_cpu_scheduler_get();
+
+    if (sched == nullptr) {
+        return {};
+    }
+
+    std::lock_guard<std::mutex> lock(sched->mutex);
+
+    return sched->stats;
+}
+
+int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
+    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, false, state->mel)) {
+        log("%s: failed to compute mel spectrogram\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
+    return whisper_pcm_to_mel_with_state(ctx, ctx->state, samples, n_samples, n_threads);
+}
+
+// same as whisper_pcm_to_mel, but applies a Phase Vocoder to speed up the audio x2 (PV without phase lock is not good)
+int whisper_pcm_to_mel_phase_vocoder_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
+    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, 2 * WHISPER_N_FFT, 2 * WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, false, state->mel)) {
+        log("%s: failed to compute mel spectrogram\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+// same as whisper_pcm_to_mel, but applies a Phase Vocoder to speed up the audio x2 (PV without phase lock is not good)
+int whisper_pcm_to_mel_phase_vocoder(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
+    return whisper_pcm_to_mel_phase_vocoder_with_state(ctx, ctx->state, samples, n_samples, n_threads);
+}
+
+// same as whisper_pcm_to_mel, but applies WSOLA to speed up the audio x2
+// TODO
+
+// same as whisper_pcm_to_mel, but applies HPTSM to speed up the audio x2
+// TODO
+
+// same as whisper_pcm_to_mel, but applies PV (with phase lock) to speed up the audio x2
+// TODO
+
+int whisper_set_mel_with_state(
+        struct whisper_context * /*ctx*/,
+          struct whisper_state * state,
+                   const float * data,
+                           int   n_len,
+                           int   n_mel) {
+    if (n_mel != WHISPER_N_MEL) {
+        log("%s: invalid number of mel bands: %d (expected %d)\n", __func__, n_mel, WHISPER_N_MEL);
+        return -1;
+    }
+
+    state->mel.n_len     = n_len;
+    state->mel.n_len_org = n_len;
+    state->mel.n_mel     = n_mel;
+
+    state->mel.data.resize(n_len*n_mel);
+    memcpy(state->mel.data.data(), data, n_len*n_mel*sizeof(float));
+
+    return 0;
+}
+
+int whisper_set_mel(
+        struct whisper_context * ctx,
+        const float * data,
+        int n_len,
+        int n_mel) {
+    return whisper_set_mel_with_state(ctx, ctx->state, data, n_len, n_mel);
+}
+
+int whisper_encode_with_state(struct whisper_context * ctx, struct whisper_state * state, int offset, int n_threads) {
+    if (!whisper_encode_internal(*ctx, *state, offset, n_threads)) {
+        if (!whisper_full_stopped(*state)) {
+            log("%s: failed to eval\n", __func__);
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+int whisper_encode(struct whisper_context * ctx, int offset, int n_threads) {
+    if (!whisper_encode_internal(*ctx, *ctx->state, offset, n_threads)) {
+        log("%s: failed to eval\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+int whisper_decode_with_state(struct whisper_context * ctx, struct whisper_state * state, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
+    const int selected_decoder_id = 0;
+
+    if (!whisper_decode_internal(*ctx, *state, state->decoders[selected_decoder_id], tokens, n_tokens, n_past, n_threads)) {
+        if (!whisper_full_stopped(*state)) {
+            log("%s: failed to eval\n", __func__);
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
+int whisper_decode(struct whisper_context * ctx, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
+    // TODO: add selected_decoder_id to state
+    const int selected_decoder_id = 0;
+
+    if (ctx->state == nullptr) {
+        log("%s: ERROR state was not loaded.\n", __func__);
+        return false;
+    }
+
+    if (!whisper_decode_internal(*ctx, *ctx->state, ctx->state->decoders[selected_decoder_id], tokens, n_tokens, n_past, n_threads)) {
+        log("%s: failed to eval\n", __func__);
+        return 1;
+    }
+
+    return 0;
+}
+
+int whisper_tokenize(struct whisper_context * ctx, const char * text, whisper_token * tokens, int n_max_tokens) {
+    const auto res = tokenize(ctx->vocab, text);
+
+    if (n_max_tokens < (int) res.size()) {
+        log("%s: too many resulting tokens: %d (max %d)\n", __func__, (int) res.size(), n_max_tokens);
+        return -1;
+    }
+
+    for (int i = 0; i < (int) res.size(); i++) {
+        tokens[i] = res[i];
+    }
+
+    return res.size();
+}
+
+int whisper_lang_max_id() {
+    auto max_id = 0;
+    for (const auto & kv : g_lang) {
+        max_id = std::max(max_id, kv.second.first);
+    }
+
+    return max_id;
+}
+
+int whisper_lang_id(const char * lang) {
+    if (!g_lang.count(lang)) {
+        for (const auto & kv : g_lang) {
+            if (kv.second.second == lang) {
+                return kv.second.first;
+            }
+        }
+
+        log("%s: unknown language '%s'\n", __func__, lang);
+        return -1;
+    }
+    return g_lang.at(lang).first;
+}
+
+const char * whisper_lang_str(int id) {
+    for (const auto & kv : g_lang) {
+        if (kv.second.first == id) {
+            return kv.first.c_str();
+        }
+    }
+
+    log("%s: unknown language id %d\n", __func__, id);
+    return nullptr;
+}
+
+int whisper_lang_auto_detect_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                           int   offset_ms,
+                           int   n_threads,
+                         float * lang_probs) {
+    const int seek = offset_ms/10;
+
+    if (seek < 0) {
+        log("%s: offset %dms is before the start of the audio\n", __func__, offset_ms);
+        return -1;
+    }
+
+    if (seek >= state->get_mel().n_len_org) {
+        log("%s: offset %dms is past the end of the audio (%dms)\n", __func__, offset_ms, state->get_mel().n_len_org*10);
+        return -2;
+    }
+
+    // run the encoder, unless whisper_full_batch() already did - the cache is then kept for the transcription
+    if (state->kv_cross_seek != seek && whisper_encode_with_state(ctx, state, seek, n_threads) != 0) {
+        if (!whisper_full_stopped(*state)) {
+            log("%s: failed to encode\n", __func__);
+        }
+        return -6;
+    }
+
+    const std::vector<whisper_token> prompt = { whisper_token_sot(ctx) };
+
+    if (whisper_decode_with_state(ctx, state, prompt.data(), prompt.size(), 0, n_threads) != 0) {
+        if (!whisper_full_stopped(*state)) {
+            log("%s: failed to decode\n", __func__);
+        }
+        return -7;
+    }
+
+    auto & logits_id = state->logits_id;
+    logits_id.clear();
+
+    for (const auto & kv : g_lang) {
+        const auto token_lang = whisper_token_lang(ctx, kv.second.first);
+        logits_id.emplace_back(state->logits[token_lang], kv.second.first);
+    }
+
+    // sort descending
+    {
+        using pair_type = std::remove_reference<decltype(logits_id)>::type::value_type;
+        std::sort(logits_id.begin(), logits_id.end(), [](const pair_type & a, const pair_type & b) {
+            return a.first > b.first;
+        });
+    }
+
+    // softmax
+    {
+        const auto max = logits_id[0].first;
+
+        double sum = 0.0f;
+        for (auto & kv : logits_id) {
+            kv.first = exp(kv.first - max);
+            sum += kv.first;
+        }
+
+        for (auto & kv : logits_id) {
+            kv.first /= sum;
+        }
+    }
+
+    {
+        for (const auto & prob : logits_id) {
+            if (lang_probs) {
+                lang_probs[prob.second] = prob.first;
+            }
+
+            //printf("%s: lang %2d (%3s): %f\n", __func__, prob.second, whisper_lang_str(prob.second), prob.first);
+        }
+    }
+
+    return logits_id[0].second;
+}
+
+int whisper_lang_auto_detect(
+        struct whisper_context * ctx,
+                           int   offset_ms,
+                           int   n_threads,
+                         float * lang_probs) {
+    return whisper_lang_auto_detect_with_state(ctx, ctx->state, offset_ms, n_threads, lang_probs);
+}
+
+int whisper_model_n_vocab(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_vocab;
+}
+
+int whisper_model_n_audio_ctx(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_ctx;
+}
+
+int whisper_model_n_audio_state(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_state;
+}
+
+int whisper_model_n_audio_head(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_head;
+}
+
+int whisper_model_n_audio_layer(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_layer;
+}
+
+int whisper_model_n_text_ctx(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_ctx;
+}
+
+int whisper_model_n_text_state(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_state;
+}
+
+int whisper_model_n_text_head(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_head;
+}
+
+int whisper_model_n_text_layer(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_layer;
+}
+
+int whisper_model_n_mels(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_mels;
+}
+
+int whisper_model_ftype(struct whisper_context * ctx) {
+    return ctx->model.hparams.ftype;
+}
+
+int whisper_model_type(struct whisper_context * ctx) {
+    return ctx->model.type;
+}
+
+const char *whisper_model_type_readable(struct whisper_context * ctx) {
+    switch (ctx->model.type) {
+    case e_model::MODEL_TINY:
+        return "tiny";
+    case e_model::MODEL_BASE:
+        return "base";
+    case e_model::MODEL_SMALL:
+        return "small";
+    case e_model::MODEL_MEDIUM:
+        return "medium";
+    case e_model::MODEL_LARGE:
+        return "large";
+    default:
+        return "unknown";
+    }
+}
+
+int whisper_n_len_from_state(struct whisper_state * state) {
+    return state->mel.n_len_org;
+}
+
+int whisper_n_len(struct whisper_context * ctx) {
+    return ctx->state->mel.n_len_org;
+}
+
+int whisper_n_vocab(struct whisper_context * ctx) {
+    return ctx->vocab.n_vocab;
+}
+
+int whisper_n_text_ctx(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_ctx;
+}
+
+int whisper_n_audio_ctx(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_ctx;
+}
+
+int whisper_is_multilingual(struct whisper_context * ctx) {
+    return ctx->vocab.is_multilingual() ? 1 : 0;
+}
+
+float * whisper_get_logits(struct whisper_context * ctx) {
+    return ctx->state->logits.data();
+}
+
+float * whisper_get_logits_from_state(struct whisper_state * state) {
+    return state->logits.data();
+}
+
+const char * whisper_token_to_str(struct whisper_context * ctx, whisper_token token) {
+    return ctx->vocab.id_to_token.at(token).c_str();
+}
+
+whisper_token whisper_token_eot(struct whisper_context * ctx) {
+    return ctx->vocab.token_eot;
+}
+
+whisper_token whisper_token_sot(struct whisper_context * ctx) {
+    return ctx->vocab.token_sot;
+}
+
+whisper_token whisper_token_solm(struct whisper_context * ctx) {
+    return ctx->vocab.token_solm;
+}
+
+whisper_token whisper_token_prev(struct whisper_context * ctx) {
+    return ctx->vocab.token_prev;
+}
+
+whisper_token whisper_token_nosp(struct whisper_context * ctx) {
+    return ctx->vocab.token_nosp;
+}
+
+whisper_token whisper_token_not(struct whisper_context * ctx) {
+    return ctx->vocab.token_not;
+}
+
+whisper_token whisper_token_beg(struct whisper_context * ctx) {
+    return ctx->vocab.token_beg;
+}
+
+whisper_token whisper_token_lang(struct whisper_context * ctx, int lang_id) {
+    return whisper_token_sot(ctx) + 1 + lang_id;
+}
+
+whisper_token whisper_token_translate(struct whisper_context * ctx) {
+    return ctx->vocab.token_translate;
+}
+
+whisper_token whisper_token_transcribe(struct whisper_context * ctx) {
+    return ctx->vocab.token_transcribe;
+}
+
+struct whisper_timings whisper_get_timings(struct whisper_context * ctx) {
+    if (ctx->state == nullptr) {
+        whisper_timings timings = {};
+        timings.t_load_us = ctx->t_load_us;
+
+        return timings;
+    }
+
+    return whisper_get_timings_from_state(ctx, ctx->state);
+}
+
+struct whisper_timings whisper_get_timings_from_state(struct whisper_context * ctx, struct whisper_state * state) {
+    whisper_timings timings = {};
+
+    timings.t_load_us    = ctx->t_load_us;
+    timings.t_mel_us     = state->t_mel_us;
+    timings.t_vad_us     = state->t_vad_us;
+    timings.t_encode_us  = state->t_encode_us;
+    timings.t_decode_us  = state->t_decode_us;
+    timings.t_sample_us  = state->t_sample_us;
+    timings.t_draft_us   = state->t_draft_us;
+    timings.t_cascade_us = state->t_cascade_us;
+
+    timings.n_encode            = state->n_encode;
+    timings.n_decode            = state->n_decode;
+    timings.n_sample            = state->n_sample;
+    timings.n_fail_p            = state->n_fail_p;
+    timings.n_fail_h            = state->n_fail_h;
+    timings.n_nosp              = state->n_nosp;
+    timings.n_draft             = state->n_draft;
+    timings.n_draft_accept      = state->n_draft_accept;
+    timings.n_cascade           = state->n_cascade;
+    timings.n_cascade_escalated = state->n_cascade_escalated;
+    timings.n_vad_frames        = state->n_vad_frames;
+    timings.n_vad_speech        = state->n_vad_speech;
+
+    for (int i = 0; i < WHISPER_MAX_SCRATCH_BUFFERS; ++i) {
+        timings.mem_scratch += state->get_buf_max_mem(i);
+    }
+
+    return timings;
+}
+
+void whisper_print_timings(struct whisper_context * ctx) {
+    const int64_t t_end_us = ggml_time_us();
+
+    const whisper_timings t = whisper_get_timings(ctx);
+
+    log("\n");
+    log("%s:     load time = %8.2f ms\n", __func__, t.t_load_us / 1000.0f);
+    if (ctx->state != nullptr) {
+
+        const int32_t n_sample = std::max(1, t.n_sample);
+        const int32_t n_encode = std::max(1, t.n_encode);
+        const int32_t n_decode = std::max(1, t.n_decode);
+
+        log("%s:     fallbacks = %3d p / %3d h\n", __func__, t.n_fail_p, t.n_fail_h);
+        if (t.n_nosp > 0) {
+            log("%s:     no speech = %3d windows skipped\n", __func__, t.n_nosp);
+        }
+        log("%s:      mel time = %8.2f ms\n", __func__, t.t_mel_us / 1000.0f);
+        log("%s:   sample time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * t.t_sample_us, n_sample, 1e-3f * t.t_sample_us / n_sample);
+        log("%s:   encode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * t.t_encode_us, n_encode, 1e-3f * t.t_encode_us / n_encode);
+        log("%s:   decode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * t.t_decode_us, n_decode, 1e-3f * t.t_decode_us / n_decode);
+        if (t.n_draft > 0) {
+            log("%s:    draft time = %8.2f ms / %5d tokens (%5.1f%% accepted)\n", __func__, 1e-3f * t.t_draft_us, t.n_draft, 100.0f * t.n_draft_accept / t.n_draft);
+        }
+        if (t.n_cascade > 0) {
+            log("%s:  cascade time = %8.2f ms / %5d windows (%5.1f%% escalated)\n", __func__, 1e-3f * t.t_cascade_us, t.n_cascade, 100.0f * t.n_cascade_escalated / t.n_cascade);
+        }
+        if (t.n_vad_frames > 0) {
+            log("%s:      vad time = %8.2f ms / %5.1f s of audio (%5.1f%% speech)\n", __func__, 1e-3f * t.t_vad_us, 0.01f * t.n_vad_frames, 100.0f * t.n_vad_speech / t.n_vad_frames);
+        }
+        if (t.mem_scratch > 0) {
+            log("%s:   scratch mem = %8.2f MB peak\n", __func__, t.mem_scratch / 1024.0 / 1024.0);
+        }
+    }
+    log("%s:    total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0f);
+}
+
+void whisper_reset_timings(struct whisper_context * ctx) {
+    if (ctx->state != nullptr) {
+        whisper_state_reset_timings(*ctx->state);
+    }
+}
+
+static int whisper_has_coreml(void) {
+#ifdef WHISPER_USE_COREML
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+static int whisper_has_openvino(void) {
+#ifdef WHISPER_USE_OPENVINO
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+const char * whisper_print_system_info(void) {
+    static std::string s;
+
+    s  = "";
+    s += "AVX = "       + std::to_string(ggml_cpu_has_avx())       + " | ";
+    s += "AVX2 = "      + std::to_string(ggml_cpu_has_avx2())      + " | ";
+    s += "AVX512 = "    + std::to_string(ggml_cpu_has_avx512())    + " | ";
+    s += "FMA = "       + std::to_string(ggml_cpu_has_fma())       + " | ";
+    s += "NEON = "      + std::to_string(ggml_cpu_has_neon())      + " | ";
+    s += "ARM_FMA = "   + std::to_string(ggml_cpu_has_arm_fma())   + " | ";
+    s += "F16C = "      + std::to_string(ggml_cpu_has_f16c())      + " | ";
+    s += "FP16_VA = "   + std::to_string(ggml_cpu_has_fp16_va())   + " | ";
+    s += "WASM_SIMD = " + std::to_string(ggml_cpu_has_wasm_simd()) + " | ";
+    s += "BLAS = "      + std::to_string(ggml_cpu_has_blas())      + " | ";
+    s += "SSE3 = "      + std::to_string(ggml_cpu_has_sse3())      + " | ";
+    s += "SSSE3 = "     + std::to_string(ggml_cpu_has_ssse3())     + " | ";
+    s += "VSX = "       + std::to_string(ggml_cpu_has_vsx())       + " | ";
+    s += "COREML = "    + std::to_string(whisper_has_coreml())     + " | ";
+    s += "OPENVINO = "  + std::to_string(whisper_has_openvino())   + " | ";
+
+    return s.c_str();
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+struct whisper_full_params * whisper_full_default_params_by_ref(enum whisper_sampling_strategy strategy) {
+    struct whisper_full_params params = whisper_full_default_params(strategy);
+
+    struct whisper_full_params* result = new whisper_full_params();
+    *result = params;
+    return result;
+}
+
+struct whisper_full_params whisper_full_default_params(enum whisper_sampling_strategy strategy) {
+    struct whisper_full_params result = {
+        /*.strategy          =*/ strategy,
+
+        /*.n_threads         =*/ std::min(4, (int32_t) std::thread::hardware_concurrency()),
+        /*.n_max_text_ctx    =*/ 16384,
+        /*.offset_ms         =*/ 0,
+        /*.duration_ms       =*/ 0,
+
+        /*.translate         =*/ false,
+        /*.no_context        =*/ true,
+        /*.single_segment    =*/ false,
+        /*.print_special     =*/ false,
+        /*.print_progress    =*/ true,
+        /*.print_realtime    =*/ false,
+        /*.print_timestamps  =*/ true,
+
+        /*.token_timestamps  =*/ false,
+        /*.thold_pt          =*/ 0.01f,
+        /*.thold_ptsum       =*/ 0.01f,
+        /*.max_len           =*/ 0,
+        /*.split_on_word     =*/ false,
+        /*.max_tokens        =*/ 0,
+
+        /*.speed_up          =*/ false,
+        /*.debug_mode        =*/ false,
+        /*.audio_ctx         =*/ 0,
+        /*.flash_attn        =*/ false,
+
+        /*.tdrz_enable       =*/ false,
+
+        /*.initial_prompt    =*/ nullptr,
+        /*.prompt_tokens     =*/ nullptr,
+        /*.prompt_n_tokens   =*/ 0,
+
+        /*.language          =*/ "en",
+        /*.detect_language   =*/ false,
+
+        /*.suppress_blank    =*/ true,
+        /*.suppress_non_speech_tokens =*/ false,
+
+        /*.temperature       =*/  0.0f,
+        /*.max_initial_ts    =*/  1.0f,
+        /*.length_penalty    =*/ -1.0f,
+
+        /*.temperature_inc   =*/  0.4f,
+        /*.entropy_thold     =*/  2.4f,
+        /*.logprob_thold     =*/ -1.0f,
+        /*.no_speech_thold   =*/  0.6f,
+
+        /*.n_fallback_parallel =*/ 0,
+
+        /*.greedy            =*/ {
+            /*.best_of   =*/ -1,
+        },
+
+        /*.beam_search      =*/ {
+            /*.beam_size =*/ -1,
+
+            /*.patience  =*/ -1.0f,
+        },
+
+        /*.speculative      =*/ {
+            /*.ctx_draft =*/ nullptr,
+            /*.n_draft   =*/ 4,
+        },
+
+        /*.cascade          =*/ {
+            /*.ctx_large     =*/ nullptr,
+            /*.logprob_thold =*/ -0.5f,
+            /*.entropy_thold =*/  2.8f,
+            /*.token_p_thold =*/  0.0f,
+        },
+
+        /*.vad              =*/ {
+            /*.enable         =*/ false,
+            /*.thold          =*/ 10.0f,
+            /*.flatness_thold =*/ -6.0f,
+            /*.min_speech_ms  =*/ 250,
+            /*.min_silence_ms =*/ 300,
+            /*.pad_ms         =*/ 200,
+        },
+
+        /*.constraint       =*/ {
+            /*.tokens      =*/ nullptr,
+            /*.n_tokens    =*/ nullptr,
+            /*.n_sequences =*/ 0,
+        },
+
+        /*.parallel         =*/ {
+            /*.n_chunks   =*/ 0,
+            /*.search_ms  =*/ 2000,
+            /*.overlap_ms =*/ 0,
+        },
+
+        /*.new_segment_callback           =*/ nullptr,
+        /*.new_segment_callback_user_data =*/ nullptr,
+
+        /*.new_token_callback           =*/ nullptr,
+        /*.new_token_callback_user_data =*/ nullptr,
+
+        /*.progress_callback           =*/ nullptr,
+        /*.progress_callback_user_data =*/ nullptr,
+
+        /*.encoder_begin_callback           =*/ nullptr,
+        /*.encoder_begin_callback_user_data =*/ nullptr,
+
+        /*.logits_filter_callback           =*/ nullptr,
+        /*.logits_filter_callback_user_data =*/ nullptr,
+
+        /*.abort_callback                   =*/ nullptr,
+        /*.abort_callback_user_data         =*/ nullptr,
+
+        /*.deadline_ms                      =*/ 0,
+
+        /*.priority                         =*/ WHISPER_PRIORITY_NORMAL,
+    };
+
+    switch (strategy) {
+        case WHISPER_SAMPLING_GREEDY:
+            {
+                result.greedy = {
+                    /*.best_of   =*/ 2, // TODO: increase to 5 when we speed-up batch decoding
+                };
+            } break;
+        case WHISPER_SAMPLING_BEAM_SEARCH:
+            {
+                result.beam_search = {
+                    /*.beam_size =*/ 2, // TODO: increase to 5 when we speed-up batch decoding
+
+                    /*.patience  =*/ -1.0f,
+                };
+            } break;
+    }
+
+    return result;
+}
+
+// forward declarations
+static std::vector<float> get_signal_energy(const float * signal, int n_samples, int n_samples_per_half_window);
+static void whisper_exp_compute_token_level_timestamps(
+        struct whisper_context & ctx,
+          struct whisper_state & state,
+                           int   i_segment,
+                         float   thold_pt,
+                         float   thold_ptsum);
+
+static inline bool should_split_on_word(const char * txt, bool split_on_word) {
+    if (!split_on_word) return true;
+
+    return txt[0] == ' ';
+}
+
+// wrap the last segment to max_len characters
+// returns the number of new segments
+static int whisper_wrap_segment(struct whisper_context & ctx, struct whisper_state & state, int max_len, bool split_on_word) {
+    auto segment = state.result_all.back();
+
+    int res = 1;
+    int acc = 0;
+
+    std::string text;
+
+    for (int i = 0; i < (int) segment.tokens.size(); i++) {
+        const auto & token = segment.tokens[i];
+        if (token.id >= whisper_token_eot(&ctx)) {
+            continue;
+        }
+
+        const auto txt = whisper_token_to_str(&ctx, token.id);
+        const int cur = strlen(txt);
+
+        if (acc + cur > max_len && i > 0 && should_split_on_word(txt, split_on_word)) {
+            state.result_all.back().text = std::move(text);
+            state.result_all.back().t1 = token.t0;
+            state.result_all.back().tokens.resize(i);
+            state.result_all.back().speaker_turn_next = false;
+
+            state.result_all.push_back({});
+            state.result_all.back().t0 = token.t0;
+            state.result_all.back().t1 = segment.t1;
+
+            // add tokens [i, end] to the new segment
+            state.result_all.back().tokens.insert(
+                state.result_all.back().tokens.end(),
+                    segment.tokens.begin() + i,
+                    segment.tokens.end());
+
+            state.result_all.back().speaker_turn_next = segment.speaker_turn_next;
+            state.result_all.back().no_speech_prob    = segment.no_speech_prob;
+
+            acc = 0;
+            text = "";
+
+            segment = state.result_all.back();
+            i = -1;
+
+            res++;
+        } else {
+            acc += cur;
+            text += txt;
+        }
+    }
+
+    state.result_all.back().text = std::move(text);
+
+    return res;
+}
+
+// constrained decoding: check that the sequences of params.constraint are not empty and contain only text tokens
+// the ids index the logits directly
+static bool whisper_constraint_is_valid(
+        const struct whisper_full_params & params,
+                             whisper_token   token_eot) {
+    if (params.constraint.n_sequences <= 0) {
+        return true;
+    }
+
+    if (params.constraint.tokens == nullptr || params.constraint.n_tokens == nullptr) {
+        return false;
+    }
+
+    for (int k = 0; k < params.constraint.n_sequences; ++k) {
+        const whisper_token * seq = params.constraint.tokens[k];
+        const int n_seq = params.constraint.n_tokens[k];
+
+        if (seq == nullptr || n_seq <= 0) {
+            return false;
+        }
+
+        for (int i = 0; i < n_seq; ++i) {
+            if (seq[i] < 0 || seq[i] >= token_eot) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// constrained decoding: check if the text tokens decoded so far are the first tokens of the token sequence seq
+// returns the number of decoded text tokens, or -1 if they do not match
+static int whisper_constraint_match(
+        const whisper_token * seq,
+                        int   n_seq,
+        const std::vector<whisper_token_data> & tokens,
+              whisper_token   token_eot) {
+    int n = 0;
+
+    for (const auto & token : tokens) {
+        if (token.id >= token_eot) {
+            continue;
+        }
+
+        if (n >= n_seq || seq[n] != token.id) {
+            return -1;
+        }
+
+        ++n;
+    }
+
+    return n;
+}
+
+// constrained decoding: check if the decoded text tokens form a token sequence of params.constraint that is not the
+// beginning of a longer one
+static bool whisper_constraint_is_complete(
+        const struct whisper_full_params & params,
+        const std::vector<whisper_token_data> & tokens,
+                             whisper_token   token_eot) {
+    bool complete = false;
+
+    for (int k = 0; k < params.constraint.n_sequences; ++k) {
+        const int n = whisper_constraint_match(params.constraint.tokens[k], params.constraint.n_tokens[k], tokens, token_eot);
+
+        if (n >= 0) {
+            if (n < params.constraint.n_tokens[k]) {
+                return false;
+            }
+
+            complete = true;
+        }
+    }
+
+    return complete;
+}
+
+// process the logits for the selected decoder
+// - applies logit filters
+// - computes logprobs and probs
+// the logits of the last decoded token are used, unless logits_src points to another row of the logits buffer
+static void whisper_process_logits(
+              struct whisper_context & ctx,
+               struct whisper_state  & state,
+    const struct whisper_full_params   params,
+              struct whisper_decoder & decoder,
+                               float   temperature,
+                         const float * logits_src = nullptr) {
+    const auto & vocab      = ctx.vocab;
+    const auto & tokens_cur = decoder.sequence.tokens;
+
+    const bool is_initial = tokens_cur.size() == 0;
+    const int  n_logits   = vocab.id_to_token.size();
+
+    WHISPER_ASSERT(n_logits == ctx.vocab.n_vocab);
+
+    // extract the logits for the last token
+    // we will be mutating, and therefore we don't want to use the ctx.logits buffer directly
+    auto & probs    = decoder.probs;
+    auto & logits   = decoder.logits;
+    auto & logprobs = decoder.logprobs;
+    {
+        const float * logits_last = logits_src ? logits_src : state.logits.data() + (state.logits.size() - n_logits);
+
+        logits.resize(n_logits);
+
+        if (temperature > 0.0f) {
+            for (int i = 0; i < n_logits; i++) {
+                logits[i] = logits_last[i]/temperature;
+            }
+        } else {
+            memcpy(logits.data(), logits_last, n_logits*sizeof(float));
         }
 
-        // FFT
-        fft(fft_in, fft_out);
+        // will be populated a bit later
+        probs.resize(n_logits);
+        logprobs.resize(n_logits);
+    }
 
-        // Calculate modulus^2 of complex numbers
-        // Use pow(fft_out[2 * j + 0], 2) + pow(fft_out[2 * j + 1], 2) causes inference quality problem? Interesting.
-        for (int j = 0; j < frame_size; j++) {
-            fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
+    // apply logit filters here
+    // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L480-L493
+    {
+        // suppress blank
+        // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L388-L390
+        if (params.suppress_blank) {
+            if (is_initial) {
+                logits[vocab.token_eot]           = -INFINITY;
+                logits[vocab.token_to_id.at(" ")] = -INFINITY;
+            }
         }
 
-        // mel spectrogram
-        for (int j = 0; j < mel.n_mel; j++) {
-            double sum = 0.0;
+        // suppress <|notimestamps|> token
+        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L410-L412
+        logits[vocab.token_not] = -INFINITY;
 
-            // unroll loop (suggested by GH user @lunixbochs)
-            int k = 0;
-            for (k = 0; k < n_fft - 3; k += 4) {
-                sum +=
-                        fft_out[k + 0] * filters.data[j * n_fft + k + 0] +
-                        fft_out[k + 1] * filters.data[j * n_fft + k + 1] +
-                        fft_out[k + 2] * filters.data[j * n_fft + k + 2] +
-                        fft_out[k + 3] * filters.data[j * n_fft + k + 3];
+        // suppress sot and nosp tokens
+        logits[vocab.token_sot]  = -INFINITY;
+        logits[vocab.token_nosp] = -INFINITY; // only used for the no-speech probability, see whisper_no_speech_prob()
+
+        // [TDRZ] when tinydiarize is disabled, suppress solm token
+        if (params.tdrz_enable == false) {
+            logits[vocab.token_solm] = -INFINITY;
+        }
+
+        // suppress task tokens
+        logits[vocab.token_translate]  = -INFINITY;
+        logits[vocab.token_transcribe] = -INFINITY;
+
+        if (params.logits_filter_callback) {
+            params.logits_filter_callback(&ctx, &state, tokens_cur.data(), tokens_cur.size(), logits.data(), params.logits_filter_callback_user_data);
+        }
+
+        // suppress non-speech tokens
+        // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
+        if (params.suppress_non_speech_tokens) {
+            for (const auto id : vocab.token_non_speech) {
+                logits[id] = -INFINITY;
+            }
+        }
+
+        // constrained decoding - allow only the tokens that continue one of the token sequences of params.constraint, the
+        // end of text once a sequence is complete and the initial timestamp
+        if (params.constraint.n_sequences > 0) {
+            // logprobs are populated a bit later
+            memcpy(logprobs.data(), logits.data(), n_logits*sizeof(float));
+
+            std::fill(logits.begin(), logits.begin() + vocab.token_beg, -INFINITY);
+
+            bool has_text = false;
+
+            for (int k = 0; k < params.constraint.n_sequences; ++k) {
+                const int n_seq = params.constraint.n_tokens[k];
+                const int n     = whisper_constraint_match(params.constraint.tokens[k], n_seq, tokens_cur, vocab.token_eot);
+
+                if (n < 0) {
+                    continue;
+                }
+
+                has_text = n > 0;
+
+                const whisper_token id = n < n_seq ? params.constraint.tokens[k][n] : vocab.token_eot;
+
+                logits[id] = logprobs[id];
+            }
+
+            if (has_text) {
+                std::fill(logits.begin() + vocab.token_beg, logits.end(), -INFINITY);
+            }
+        }
+
+        // timestamps have to appear in pairs, except directly before EOT; mask logits accordingly
+        // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L414-L424
+        {
+            const bool last_was_timestamp        = tokens_cur.size() > 0 && tokens_cur.back().id >= vocab.token_beg;
+            const bool penultimate_was_timestamp = tokens_cur.size() < 2 || tokens_cur[tokens_cur.size() - 2].id >= vocab.token_beg;
+
+            //log("last_was_timestamp=%d penultimate_was_timestamp=%d\n", last_was_timestamp, penultimate_was_timestamp);
+
+            if (last_was_timestamp) {
+                if (penultimate_was_timestamp) {
+                    for (int i = vocab.token_beg; i < n_logits; ++i) {
+                        logits[i] = -INFINITY;
+                    }
+                } else {
+                    for (int i = 0; i < vocab.token_eot; ++i) {
+                        logits[i] = -INFINITY;
+                    }
+                }
+            }
+        }
+
+        // the initial timestamp cannot be larger than max_initial_ts
+        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L426-L429
+        if (is_initial && params.max_initial_ts > 0.0f) {
+            const float precision = float(WHISPER_CHUNK_SIZE)/ctx.model.hparams.n_audio_ctx;
+            const int   tid0      = std::round(params.max_initial_ts/precision);
+
+            for (int i = vocab.token_beg + tid0 + 1; i < n_logits; ++i) {
+                logits[i] = -INFINITY;
+            }
+        }
+
+        // condition timestamp tokens to be increasing
+        // ref: https://github.com/openai/whisper/pull/831#issuecomment-1385910556
+        if (decoder.has_ts) {
+            const int tid0 = decoder.seek_delta/2;
+
+            for (int i = vocab.token_beg; i < vocab.token_beg + tid0; ++i) {
+                logits[i] = -INFINITY;
+            }
+        }
+
+        // populate the probs and logprobs arrays (softmax + log_softmax)
+        // if sum of probability over timestamps is above any other token, sample timestamp
+        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
+        //
+        // the exponentials are computed once, in a single vectorized pass that also sums the probability mass
+        // of the text and of the timestamp tokens
+        {
+            const int n_text = vocab.token_beg; // [0, token_beg) - text tokens, [token_beg, n_logits) - timestamps
+
+            const float logit_max_text = ggml_max_row_f32(logits.data(),          n_text);
+            const float logit_max_ts   = ggml_max_row_f32(logits.data() + n_text, n_logits - n_text);
+
+            const float logit_max = std::max(logit_max_text, logit_max_ts);
+
+            const float sum_text = ggml_exp_row_f32(logits.data(),          probs.data(),          logit_max, n_text);
+            const float sum_ts   = ggml_exp_row_f32(logits.data() + n_text, probs.data() + n_text, logit_max, n_logits - n_text);
+
+            const float logsumexp = logf(sum_text + sum_ts) + logit_max;
+
+            // logsumexp over timestamps
+            const float timestamp_logprob = sum_ts > 0.0f ? logf(sum_ts) + logit_max - logsumexp : -INFINITY;
+
+            const float max_text_token_logprob = logit_max_text - logsumexp;
+
+            //log("timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
+
+            const float scale = 1.0f/(sum_text + sum_ts);
+
+            for (int i = 0; i < n_logits; ++i) {
+                logprobs[i] = logits[i] - logsumexp;
+                probs[i]   *= scale;
+            }
+
+            if (timestamp_logprob > max_text_token_logprob) {
+                std::fill(logits.begin(),   logits.begin()   + n_text, -INFINITY);
+                std::fill(logprobs.begin(), logprobs.begin() + n_text, -INFINITY);
+                std::fill(probs.begin(),    probs.begin()    + n_text, 0.0f);
+            }
+        }
+    }
+
+#if 0
+    // print first 100 logits - token string : logit
+    for (int i = 0; i < 100; i++) {
+        const auto token   = vocab.id_to_token.at(i);
+        const auto prob    = probs[i];
+        const auto logit   = logits[i];
+        const auto logprob = logprobs[i];
+        printf("%s : prob=%9.5f logit=%9.5f logprob=%9.5f\n", token.c_str(), prob, logit, logprob);
+    }
+
+    // "And", "and", " And", " and"
+    printf("logits[\"and\"]  = %f\n", logits[vocab.token_to_id.at("and")]);
+    printf("logits[\"And\"]  = %f\n", logits[vocab.token_to_id.at("And")]);
+    printf("logits[\" and\"] = %f\n", logits[vocab.token_to_id.at(" and")]);
+    printf("logits[\" And\"] = %f\n", logits[vocab.token_to_id.at(" And")]);
+    printf("logits[\" so\"]  = %f\n", logits[vocab.token_to_id.at(" so")]);
+
+    printf("logprobs[\"and\"]  = %f\n", logprobs[vocab.token_to_id.at("and")]);
+    printf("logprobs[\"And\"]  = %f\n", logprobs[vocab.token_to_id.at("And")]);
+    printf("logprobs[\" and\"] = %f\n", logprobs[vocab.token_to_id.at(" and")]);
+    printf("logprobs[\" And\"] = %f\n", logprobs[vocab.token_to_id.at(" And")]);
+    printf("logprobs[\" so\"]  = %f\n", logprobs[vocab.token_to_id.at(" so")]);
+
+    printf("probs[\"and\"]  = %f\n", probs[vocab.token_to_id.at("and")]);
+    printf("probs[\"And\"]  = %f\n", probs[vocab.token_to_id.at("And")]);
+    printf("probs[\" and\"] = %f\n", probs[vocab.token_to_id.at(" and")]);
+    printf("probs[\" And\"] = %f\n", probs[vocab.token_to_id.at(" And")]);
+    printf("probs[\" so\"]  = %f\n", probs[vocab.token_to_id.at(" so")]);
+#endif
+}
+
+// find the tokens that the logit filters of whisper_process_logits() can leave unmasked after the current sequence of
+// the decoder, so that whisper_decode only computes their logits
+// returns false if the logits of the full vocabulary are needed
+static bool whisper_logits_active(
+        const whisper_context & ctx,
+        const struct whisper_full_params & params,
+        whisper_decoder & decoder) {
+    const auto & vocab      = ctx.vocab;
+    const auto & tokens_cur = decoder.sequence.tokens;
+
+    const int n_logits = vocab.id_to_token.size();
+    const int n_cur    = tokens_cur.size();
+
+    auto & logits_id = decoder.logits_id;
+
+    logits_id.clear();
+
+    // the filter callback gets to see all logits
+    if (params.logits_filter_callback) {
+        return false;
+    }
+
+    if (n_cur >= 2 && tokens_cur[n_cur - 1].id >= vocab.token_beg && tokens_cur[n_cur - 2].id < vocab.token_beg) {
+        // the closing timestamp of a pair - only the end of text and timestamps can follow
+        for (int i = vocab.token_eot; i < n_logits; ++i) {
+            logits_id.push_back(i);
+        }
+    } else if (params.constraint.n_sequences > 0) {
+        bool has_text = false;
+
+        for (int k = 0; k < params.constraint.n_sequences; ++k) {
+            const int n_seq = params.constraint.n_tokens[k];
+            const int n     = whisper_constraint_match(params.constraint.tokens[k], n_seq, tokens_cur, vocab.token_eot);
+
+            if (n < 0) {
+                continue;
+            }
+
+            has_text = n > 0;
+
+            logits_id.push_back(n < n_seq ? params.constraint.tokens[k][n] : vocab.token_eot);
+        }
+
+        if (!has_text) {
+            for (int i = vocab.token_beg; i < n_logits; ++i) {
+                logits_id.push_back(i);
             }
+        }
+    }
+
+    // for larger sets, the gather costs more than it saves
+    if (logits_id.empty() || (int) logits_id.size() > n_logits/16) {
+        logits_id.clear();
+        return false;
+    }
+
+    return true;
+}
+
+static whisper_token_data whisper_sample_token(
+            whisper_context & ctx,
+              whisper_state & state,
+      const whisper_decoder & decoder,
+                       bool   best) {
+    whisper_token_data result = {
+        0, 0, 0.0f, 0.0f, 0.0f, 0.0f, -1, -1, 0.0f,
+    };
+
+    const auto & vocab = ctx.vocab;
+
+    const auto & probs    = decoder.probs;
+    const auto & logprobs = decoder.logprobs;
+
+    const int n_logits = vocab.n_vocab;
+
+    {
+        double sum_ts = 0.0;
+        double max_ts = 0.0;
 
-            // handle n_fft remainder
-            for (; k < n_fft; k++) {
-                sum += fft_out[k] * filters.data[j * n_fft + k];
+        for (int i = vocab.token_beg; i < n_logits; i++) {
+            if (probs[i] == -INFINITY) {
+                continue;
             }
 
-            sum = log10(std::max(sum, 1e-10));
-
-            mel.data[j * mel.n_len + i] = sum;
+            sum_ts += probs[i];
+            if (max_ts < probs[i]) {
+                max_ts = probs[i];
+                result.tid = i;
+            }
         }
-    }
 
-    // Otherwise fft_out are all zero
-    double sum = log10(1e-10);
-    for (; i < mel.n_len; i += n_threads) {
-        for (int j = 0; j < mel.n_mel; j++) {
-            mel.data[j * mel.n_len + i] = sum;
-        }
+        result.pt    = max_ts/(sum_ts + 1e-10);
+        result.ptsum = sum_ts;
     }
-}
-
-// ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L110-L157
-static bool log_mel_spectrogram(
-              whisper_state & wstate,
-              const float * samples,
-              const int   n_samples,
-              const int   /*sample_rate*/,
-              const int   frame_size,
-              const int   frame_step,
-              const int   n_mel,
-              const int   n_threads,
-              const whisper_filters & filters,
-              const bool   debug,
-              whisper_mel & mel) {
-    const int64_t t_start_us = ggml_time_us();
 
-    // Hanning window (Use cosf to eliminate difference)
-    // ref: https://pytorch.org/docs/stable/generated/torch.hann_window.html
-    // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L147
-    std::vector<float> hann;
-    hann_window(frame_size, true, hann);
+    if (best) {
+        ggml_topk_row_f32(probs.data(), n_logits, 1, &result.id);
 
+        result.p    = probs[result.id];
+        result.plog = logprobs[result.id];
+    } else {
+        // inverse CDF sampling
+        // the CDF is walked block by block, only the block that contains the draw is scanned token by token
+        const int n_block = (n_logits + WHISPER_SAMPLE_BLOCK - 1)/WHISPER_SAMPLE_BLOCK;
 
-    // Calculate the length of padding
-    int64_t stage_1_pad = WHISPER_SAMPLE_RATE * 30;
-    int64_t stage_2_pad = frame_size / 2;
+        auto & probs_block = state.probs_block;
+        probs_block.resize(n_block);
 
-    // Initialize a vector and copy data from C array to it.
-    std::vector<float> samples_padded;
-    samples_padded.resize(n_samples + stage_1_pad + stage_2_pad * 2);
-    std::copy(samples, samples + n_samples, samples_padded.begin() + stage_2_pad);
+        double sum = 0.0;
 
-    // pad 30 seconds of zeros at the end of audio (480,000 samples) + reflective pad 200 samples at the end of audio
-    std::fill(samples_padded.begin() + n_samples + stage_2_pad, samples_padded.begin() + n_samples + stage_1_pad + 2 * stage_2_pad, 0);
+        for (int ib = 0; ib < n_block; ++ib) {
+            const int i0 = ib*WHISPER_SAMPLE_BLOCK;
+            const int i1 = std::min(i0 + WHISPER_SAMPLE_BLOCK, n_logits);
 
-    // reflective pad 200 samples at the beginning of audio
-    std::reverse_copy(samples + 1, samples + 1 + stage_2_pad, samples_padded.begin());
+            // independent partial sums, so that the compiler can vectorize the loop
+            float acc[8] = { 0.0f };
 
-    mel.n_mel     = n_mel;
-    // https://github.com/pytorch/pytorch/blob/main/aten/src/ATen/native/SpectralOps.cpp#L936
-    // Calculate number of frames + remove the last frame
-    mel.n_len     = (samples_padded.size() - frame_size) / frame_step;
-    // Calculate semi-padded sample length to ensure compatibility
-    mel.n_len_org = 1 + (n_samples + stage_2_pad - frame_size) / frame_step;
-    mel.data.resize(mel.n_mel * mel.n_len);
+            int i = i0;
+            for (; i + 8 <= i1; i += 8) {
+                for (int j = 0; j < 8; ++j) {
+                    acc[j] += probs[i + j];
+                }
+            }
+            for (; i < i1; ++i) {
+                acc[0] += probs[i];
+            }
 
+            probs_block[ib] = ((acc[0] + acc[1]) + (acc[2] + acc[3])) + ((acc[4] + acc[5]) + (acc[6] + acc[7]));
 
-    {
-        std::vector<std::thread> workers(n_threads - 1);
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw] = std::thread(
-                    log_mel_spectrogram_worker_thread, iw + 1, std::cref(hann), samples_padded,
-                    n_samples + stage_2_pad, frame_size, frame_step, n_threads,
-                    std::cref(filters), std::ref(mel));
+            sum += probs_block[ib];
         }
 
-        // main thread
-        log_mel_spectrogram_worker_thread(0, hann, samples_padded, n_samples + stage_2_pad, frame_size, frame_step, n_threads, filters, mel);
+        const double u = std::generate_canonical<double, std::numeric_limits<double>::digits>(state.rng)*sum;
 
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw].join();
-        }
-    }
+        double cdf = 0.0;
 
-    // clamping and normalization
-    double mmax = -1e20;
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] > mmax) {
-            mmax = mel.data[i];
+        int ib = 0;
+        for (; ib < n_block - 1; ++ib) {
+            if (cdf + probs_block[ib] > u) {
+                break;
+            }
+            cdf += probs_block[ib];
         }
-    }
 
-    mmax -= 8.0;
+        const int i0 = ib*WHISPER_SAMPLE_BLOCK;
+        const int i1 = std::min(i0 + WHISPER_SAMPLE_BLOCK, n_logits);
 
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] < mmax) {
-            mel.data[i] = mmax;
+        // the block sum and the running sum may round differently - fall back to the last possible token of the block
+        result.id = i0;
+        for (int i = i0; i < i1; ++i) {
+            if (probs[i] > 0.0f) {
+                result.id = i;
+            }
+
+            cdf += probs[i];
+            if (cdf > u && probs[i] > 0.0f) {
+                break;
+            }
         }
 
-        mel.data[i] = (mel.data[i] + 4.0)/4.0;
+        result.p    = probs[result.id];
+        result.plog = logprobs[result.id];
     }
 
-    wstate.t_mel_us += ggml_time_us() - t_start_us;
-
-    // Dump log_mel_spectrogram
-    if (debug) {
-        std::ofstream outFile("log_mel_spectrogram.json");
-        outFile << "[";
-        for (uint64_t i = 0; i < mel.data.size() - 1; i++) {
-            outFile << mel.data[i] << ", ";
-        }
-        outFile << mel.data[mel.data.size() - 1] << "]";
-        outFile.close();
+    if (result.id >= vocab.token_beg) {
+        result.tid = result.id;
+        result.pt  = result.p;
     }
 
-    return true;
+    state.n_sample++;
+
+    return result;
 }
 
-// split text into tokens
-//
-// ref: https://github.com/openai/gpt-2/blob/a74da5d99abaaba920de8131d64da2862a8f213b/src/encoder.py#L53
-//
-// Regex (Python):
-// r"""'s|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+"""
-//
-// Regex (C++):
-// R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)"
-//
-static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
-    std::vector<std::string> words;
+// the top k tokens are written to result, which is expected to be a reusable work container
+static void whisper_sample_token_topk(
+            whisper_context & ctx,
+              whisper_state & state,
+      const whisper_decoder & decoder,
+                        int   k,
+            std::vector<whisper_token_data> & result) {
+    const auto & vocab = ctx.vocab;
 
-    // first split the text into words
-    {
-        std::string str = text;
-        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
+    const auto & probs    = decoder.probs;
+    const auto & logits   = decoder.logits;
+    const auto & logprobs = decoder.logprobs;
 
-        std::regex re(pat);
-        std::smatch m;
+    const int n_logits = vocab.n_vocab;
 
-        while (std::regex_search(str, m, re)) {
-            for (auto x : m) {
-                words.push_back(x);
-            }
-            str = m.suffix();
+    auto & topk_id = state.topk_id;
+    topk_id.resize(k);
+
+    int n_top = ggml_topk_row_f32(logits.data(), n_logits, k, topk_id.data());
+
+    // fewer than k tokens can be sampled - fill up with suppressed tokens, as a full sort of the logits would do
+    for (int i = 0; n_top < k && i < n_logits; ++i) {
+        if (logits[i] == -INFINITY) {
+            topk_id[n_top++] = i;
         }
     }
 
-    // find the longest tokens that form the words:
-    std::vector<whisper_vocab::id> tokens;
-    for (const auto & word : words) {
-        if (word.empty()) continue;
+    result.clear();
 
-        int i = 0;
-        int n = word.size();
-        while (i < n) {
-            int j = n;
-            bool found = false;
-            while (j > i) {
-                auto sub = word.substr(i, j-i);
-                auto it = vocab.token_to_id.find(sub);
-                if (it != vocab.token_to_id.end()) {
-                    tokens.push_back(it->second);
-                    i = j;
-                    found = true;
-                    break;
-                }
-                --j;
+    whisper_token tid = vocab.token_beg;
+
+    float pt    = 0.0;
+    float ptsum = 0.0;
+
+    {
+        double sum_ts = 0.0;
+        double max_ts = 0.0;
+
+        for (int i = vocab.token_beg; i < n_logits; i++) {
+            if (probs[i] == -INFINITY) {
+                continue;
             }
-            if (!found) {
-                log("unknown token\n");
-                ++i;
+
+            sum_ts += probs[i];
+            if (max_ts < probs[i]) {
+                max_ts = probs[i];
+                tid = i;
             }
         }
-    }
 
-    return tokens;
-}
+        pt    = max_ts/(sum_ts + 1e-10);
+        ptsum = sum_ts;
+    }
 
-//
-// interface implementation
-//
+    for (int i = 0; i < k; ++i) {
+        const auto id = topk_id[i];
 
-#ifdef WHISPER_USE_COREML
-// replace .bin with -encoder.mlmodelc
-static std::string whisper_get_coreml_path_encoder(std::string path_bin) {
-    auto pos = path_bin.rfind('.');
-    if (pos != std::string::npos) {
-        path_bin = path_bin.substr(0, pos);
-    }
+        result.push_back({ id, tid, probs[id], logprobs[id], pt, ptsum, -1, -1, 0.0f, });
 
-    // match "-qx_x"
-    pos = path_bin.rfind('-');
-    if (pos != std::string::npos) {
-        auto sub = path_bin.substr(pos);
-        if (sub.size() == 5 && sub[1] == 'q' && sub[3] == '_') {
-            path_bin = path_bin.substr(0, pos);
+        if (result[i].id >= vocab.token_beg) {
+            result[i].tid = result[i].id;
+            result[i].pt  = result[i].p;
         }
     }
 
-    path_bin += "-encoder.mlmodelc";
-
-    return path_bin;
+    state.n_sample++;
 }
-#endif
-
-#ifdef WHISPER_USE_OPENVINO
-// replace .bin with-encoder-openvino.xml
-static std::string whisper_openvino_get_path_encoder(std::string path_bin) {
-    auto pos = path_bin.rfind('.');
-    if (pos != std::string::npos) {
-        path_bin = path_bin.substr(0, pos);
-    }
 
-    path_bin += "-encoder-openvino.xml";
+// entropy of the last 32 tokens before tokens[n]
+static double whisper_tokens_entropy(const std::vector<whisper_token_data> & tokens, int n) {
+    const int n_win = 32;
 
-    return path_bin;
-}
+    int cnt = 0;
+    double entropy = 0.0f;
 
-static std::string whisper_openvino_get_path_cache(std::string path_bin) {
-    auto pos = path_bin.rfind('.');
-    if (pos != std::string::npos) {
-        path_bin = path_bin.substr(0, pos);
+    // count the tokens by sorting them - visits the counts in the same order as a std::map would
+    whisper_token ids[n_win];
+    for (int i = std::max(0, n - n_win); i < n; ++i) {
+        ids[cnt++] = tokens[i].id;
     }
 
-    path_bin += "-encoder-openvino-cache";
-
-    return path_bin;
-}
-#endif
+    std::sort(ids, ids + cnt);
 
-struct whisper_state * whisper_init_state(whisper_context * ctx) {
-    fill_sin_cos_table();
-    whisper_state * state = new whisper_state;
+    for (int i0 = 0, i1 = 0; i0 < cnt; i0 = i1) {
+        while (i1 < cnt && ids[i1] == ids[i0]) {
+            ++i1;
+        }
 
-    const size_t scale = ctx->model.hparams.ftype ? 1 : 2;
+        const auto p = (i1 - i0)/(double)cnt;
+        entropy -= p*log(p);
 
-    if (!kv_cache_init(ctx->model.hparams, scale * MEM_REQ_KV_SELF.at(ctx->model.type), state->decoders[0].kv_self, ctx->itype, ctx->model.hparams.n_text_ctx)) {
-        log("%s: kv_cache_init() failed for self-attention cache\n", __func__);
-        delete state;
-        return nullptr;
+        //WHISPER_PRINT_DEBUG("entropy: %d %f %f, count %d\n", ids[i0], p, log(p), i1 - i0);
     }
 
-    {
-        const size_t memory_size = ggml_nbytes(state->decoders[0].kv_self.k) + ggml_nbytes(state->decoders[0].kv_self.v);
-        log("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
-    }
+    return entropy;
+}
 
-    if (!kv_cache_init(ctx->model.hparams, scale * MEM_REQ_KV_CROSS.at(ctx->model.type), state->kv_cross, ctx->itype, ctx->model.hparams.n_audio_ctx)) {
-        log("%s: kv_cache_init() failed for cross-attention cache\n", __func__);
-        delete state;
-        return nullptr;
+// ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L178-L192
+static void whisper_sequence_score(
+        const struct whisper_full_params & params,
+                        whisper_sequence & sequence) {
+    if (sequence.result_len == 0) {
+        return;
     }
 
-    {
-        const size_t memory_size = ggml_nbytes(state->kv_cross.k) + ggml_nbytes(state->kv_cross.v);
-        log("%s: kv cross size = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
+    double result = 0.0f;
+
+    for (int i = 0; i < sequence.result_len; ++i) {
+        result += sequence.tokens[i].plog;
     }
 
-#ifdef WHISPER_USE_COREML
-    const auto path_coreml = whisper_get_coreml_path_encoder(ctx->path_model);
+    sequence.sum_logprobs = result;
+    sequence.avg_logprobs = result/sequence.result_len;
 
-    log("%s: loading Core ML model from '%s'\n", __func__, path_coreml.c_str());
-    log("%s: first run on a device may take a while ...\n", __func__);
+    double penalty = sequence.result_len;
 
-    state->ctx_coreml = whisper_coreml_init(path_coreml.c_str());
-    if (!state->ctx_coreml) {
-        log("%s: failed to load Core ML model from '%s'\n", __func__, path_coreml.c_str());
-#ifndef WHISPER_COREML_ALLOW_FALLBACK
-        return nullptr;
-#endif
-    } else {
-        log("%s: Core ML model loaded\n", __func__);
+    if (params.length_penalty > 0.0f) {
+        penalty = pow((5.0 + penalty)/6.0, params.length_penalty);
     }
-#endif
-
-    state->logits.reserve(ctx->vocab.n_vocab * ctx->model.hparams.n_text_ctx);
 
-    state->logits_id.reserve(ctx->model.hparams.n_vocab);
+    sequence.score = result/penalty;
 
-    // TAGS: WHISPER_DECODER_INIT
-    state->decoders[0].sequence.tokens.reserve(ctx->model.hparams.n_text_ctx);
+    // compute the entropy of the sequence of the last 32 tokens
+    sequence.entropy = whisper_tokens_entropy(sequence.tokens, sequence.result_len);
+}
+
+// beam-search: stop decoding the beams that can no longer be selected
+// - once round(n_decoders*patience) sequences are completed, the remaining beams are dropped. a completed sequence
+//   keeps its decoder, so there are never more than n_decoders of them and patience is clamped to 1
+// - a beam is dropped when the upper bound of its final score is below the score of the best completed sequence
+//   the sum of the logprobs of the result only decreases with more tokens, so the bound is the current sum divided by
+//   the length penalty of the longest possible result
+// the completed sequences that would fail the entropy check are not taken into account
+// ref: https://arxiv.org/pdf/2204.05424.pdf
+// returns the number of dropped beams
+static int whisper_beam_search_prune(
+        const struct whisper_full_params & params,
+                         whisper_decoder * decoders,
+                                     int   n_decoders,
+                                     int   n_max) {
+    const float patience = params.beam_search.patience > 0.0f ? std::min(1.0f, params.beam_search.patience) : 1.0f;
+    const int   n_finish = std::max(1, (int) std::round(n_decoders*patience));
 
-    state->decoders[0].probs.reserve(ctx->vocab.n_vocab);
-    state->decoders[0].logits.reserve(ctx->vocab.n_vocab);
-    state->decoders[0].logprobs.reserve(ctx->vocab.n_vocab);
-    state->buf_compute.resize(scale * std::max(MEM_REQ_ENCODE.at(ctx->model.type), MEM_REQ_DECODE.at(ctx->model.type)));
+    int    n_completed = 0;
+    double best_score  = -INFINITY;
 
-    state->buf_scratch[0].resize(MEM_REQ_SCRATCH0.at(ctx->model.type));
-    state->buf_scratch[1].resize(MEM_REQ_SCRATCH1.at(ctx->model.type));
-    state->buf_scratch[2].resize(MEM_REQ_SCRATCH2.at(ctx->model.type));
-    state->buf_scratch[3].resize(MEM_REQ_SCRATCH3.at(ctx->model.type));
+    for (int j = 0; j < n_decoders; ++j) {
+        auto & decoder = decoders[j];
 
-    state->rng = std::mt19937(0);
+        if (!decoder.completed || decoder.failed || decoder.sequence.result_len == 0) {
+            continue;
+        }
 
-    return state;
-}
+        whisper_sequence_score(params, decoder.sequence);
 
-int whisper_ctx_init_openvino_encoder(
-        struct whisper_context * ctx,
-                    const char * model_path,
-                    const char * device,
-                    const char * cache_dir) {
-#ifndef WHISPER_USE_OPENVINO
-    (void)(ctx);
-    (void)(model_path);
-    (void)(device);
-    (void)(cache_dir);
+        if (decoder.sequence.result_len > 32 && decoder.sequence.entropy < params.entropy_thold) {
+            continue;
+        }
 
-    return 1;
-#else
-    if (!model_path && ctx->path_model.empty()) {
-        log("%s: model_path is nullptr, and ctx has no model_path set.\n", __func__);
-        return 1;
+        n_completed++;
+        best_score = std::max(best_score, decoder.sequence.score);
     }
 
-    std::string path_encoder;
-    if (!model_path) {
-        //if model_path is not set, attempt to find it in the same directory as ggml-<model>.bin model
-        path_encoder = whisper_openvino_get_path_encoder(ctx->path_model);
-    } else {
-        path_encoder = model_path;
+    if (n_completed == 0) {
+        return 0;
     }
 
-    std::string path_cache;
-    if (!cache_dir) {
-        //if cache_dir is not set, set it as a dir residing next to ggml-<model>.bin
-        path_cache = whisper_openvino_get_path_cache(ctx->path_model);
-    } else {
-        path_cache = cache_dir;
+    double penalty_max = n_max;
+
+    if (params.length_penalty > 0.0f) {
+        penalty_max = pow((5.0 + penalty_max)/6.0, params.length_penalty);
     }
 
-    log("%s: loading OpenVINO model from '%s'\n", __func__, path_encoder.c_str());
-    log("%s: first run on a device may take a while ...\n", __func__);
+    int n_pruned = 0;
 
-    ctx->state->ctx_openvino = whisper_openvino_init(path_encoder.c_str(), device, path_cache.c_str());
-    if (!ctx->state->ctx_openvino) {
-        log("%s: failed to init OpenVINO encoder from '%s'\n", __func__, path_encoder.c_str());
-        return 1;
-    } else {
-        log("%s: OpenVINO model loaded\n", __func__);
+    for (int j = 0; j < n_decoders; ++j) {
+        auto & decoder = decoders[j];
+
+        if (decoder.completed || decoder.failed) {
+            continue;
+        }
+
+        double sum_logprobs = 0.0;
+
+        for (int i = 0; i < decoder.sequence.result_len; ++i) {
+            sum_logprobs += decoder.sequence.tokens[i].plog;
+        }
+
+        if (n_completed >= n_finish || sum_logprobs/penalty_max < best_score) {
+            decoder.failed = true;
+            n_pruned++;
+        }
     }
 
-    return 0;
-#endif
+    return n_pruned;
 }
 
-struct whisper_context * whisper_init_from_file_no_state(const char * path_model) {
+// check if the decoding is stuck in a repetition loop, while the tokens are being sampled:
+// - the entropy check of the completed sequences, on the result so far: the 32 tokens before result_len (the last
+//   timestamp) have an entropy below entropy_thold. it is done when result_len has moved with the last token, as the
+//   window is the same otherwise
+// - the last text tokens repeat a phrase of up to 16 tokens at least 3 times (timestamp tokens are ignored)
+static bool whisper_sequence_is_looping(
+        const struct whisper_full_params & params,
+                  const whisper_sequence & sequence,
+                           whisper_token   token_eot) {
+    const auto & tokens = sequence.tokens;
 
-    log("%s: loading model from '%s'\n", __func__, path_model);
+    const int n = tokens.size();
 
-    auto fin = std::ifstream(path_model, std::ios::binary);
-    if (!fin) {
-        log("%s: failed to open '%s'\n", __func__, path_model);
-        return nullptr;
+    if (sequence.result_len == n && n > 32 && whisper_tokens_entropy(tokens, n) < params.entropy_thold) {
+        return true;
     }
 
-    whisper_model_loader loader = {};
-
-    loader.context = &fin;
+    const int n_period_max = 16;
+    const int n_text_max   = 3*n_period_max;
 
-    loader.read = [](void * ctx, void * output, size_t read_size) {
-        std::ifstream * fin = (std::ifstream*)ctx;
-        fin->read((char *)output, read_size);
-        return read_size;
-    };
+    // the last text tokens, most recent first
+    whisper_token text[n_text_max];
+    int n_text = 0;
+    for (int i = n - 1; i >= 0 && n_text < n_text_max; --i) {
+        if (tokens[i].id < token_eot) {
+            text[n_text++] = tokens[i].id;
+        }
+    }
 
-    loader.eof = [](void * ctx) {
-        std::ifstream * fin = (std::ifstream*)ctx;
-        return fin->eof();
-    };
+    for (int period = 1; period <= n_period_max; ++period) {
+        const int n_rep = std::max(2*period, 16); // 3 occurrences of the phrase and at least 16 repeated tokens
 
-    loader.close = [](void * ctx) {
-        std::ifstream * fin = (std::ifstream*)ctx;
-        fin->close();
-    };
+        if (period + n_rep > n_text) {
+            break;
+        }
 
-    auto ctx = whisper_init_no_state(&loader);
+        int k = 0;
+        while (k < n_rep && text[k] == text[k + period]) {
+            ++k;
+        }
 
-    if (ctx) {
-        ctx->path_model = path_model;
+        if (k == n_rep) {
+            return true;
+        }
     }
 
-    return ctx;
+    return false;
 }
 
-struct whisper_context * whisper_init_from_buffer_no_state(void * buffer, size_t buffer_size) {
-    struct buf_context {
-        uint8_t* buffer;
-        size_t size;
-        size_t current_offset;
-    };
-
-    buf_context ctx = { reinterpret_cast<uint8_t*>(buffer), buffer_size, 0 };
+// draft up to n_draft tokens that follow the current sequence of the decoder, using the draft model
+// the draft decoder keeps its KV cache for the tokens that agree with the sequence and evaluates only the rest
+// the drafted tokens are stored in state.draft_verify, after the last token of the sequence
+// returns the number of drafted tokens, or -1 on failure
+static int whisper_draft(
+              struct whisper_context & ctx_draft,
+               struct whisper_state  & dstate,
+               struct whisper_state  & state,
+    const struct whisper_full_params & params,
+        const struct whisper_decoder & decoder,
+                                 int   n_prompt,
+                                 int   n_draft) {
+    auto & ddecoder = dstate.decoders[0];
 
-    log("%s: loading model from buffer\n", __func__);
+    auto & past   = state.draft_past;
+    auto & verify = state.draft_verify;
 
-    whisper_model_loader loader = {};
+    const auto & tokens = decoder.sequence.tokens;
 
-    loader.context = &ctx;
+    const int n_tokens = tokens.size();
 
-    loader.read = [](void * ctx, void * output, size_t read_size) {
-        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
+    // the last token of the sequence has not been evaluated by any of the models yet
+    int n_keep = 0;
+    while (n_keep < (int) past.size() && n_keep < n_tokens - 1 && past[n_keep] == tokens[n_keep].id) {
+        ++n_keep;
+    }
 
-        size_t size_to_copy = buf->current_offset + read_size < buf->size ? read_size : buf->size - buf->current_offset;
+    past.resize(n_keep);
+    for (int i = n_keep; i < n_tokens; ++i) {
+        past.push_back(tokens[i].id);
+    }
 
-        memcpy(output, buf->buffer + buf->current_offset, size_to_copy);
-        buf->current_offset += size_to_copy;
+    if (!whisper_decode_internal(ctx_draft, dstate, ddecoder, past.data() + n_keep, n_tokens - n_keep, n_prompt + n_keep, params.n_threads)) {
+        return -1;
+    }
 
-        return size_to_copy;
-    };
+    ddecoder.kv_self.n = n_prompt + n_tokens;
 
-    loader.eof = [](void * ctx) {
-        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
+    ddecoder.sequence.tokens = tokens;
+    ddecoder.seek_delta      = decoder.seek_delta;
+    ddecoder.has_ts          = decoder.has_ts;
 
-        return buf->current_offset >= buf->size;
-    };
+    verify.clear();
+    verify.push_back(tokens.back().id);
 
-    loader.close = [](void * /*ctx*/) { };
+    for (int i = 0; i < n_draft; ++i) {
+        whisper_process_logits(ctx_draft, dstate, params, ddecoder, 0.0f);
 
-    return whisper_init_no_state(&loader);
-}
+        const whisper_token_data token = whisper_sample_token(ctx_draft, dstate, ddecoder, true);
 
-struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loader) {
-    ggml_time_init();
+        verify.push_back(token.id);
 
-    whisper_context * ctx = new whisper_context;
+        if (token.id == ctx_draft.vocab.token_eot || i == n_draft - 1) {
+            break;
+        }
 
-    if (!whisper_model_load(loader, *ctx)) {
-        loader->close(loader->context);
-        log("%s: failed to load model\n", __func__);
-        delete ctx;
-        return nullptr;
-    }
+        ddecoder.sequence.tokens.push_back(token);
 
-    loader->close(loader->context);
+        if (token.id > ctx_draft.vocab.token_beg) {
+            ddecoder.seek_delta = 2*(token.id - ctx_draft.vocab.token_beg);
+            ddecoder.has_ts     = true;
+        }
 
-    return ctx;
-}
+        past.push_back(token.id);
 
-struct whisper_context * whisper_init_from_file(const char * path_model) {
-    whisper_context * ctx = whisper_init_from_file_no_state(path_model);
-    if (!ctx) {
-        return nullptr;
-    }
+        if (!whisper_decode_internal(ctx_draft, dstate, ddecoder, &token.id, 1, ddecoder.kv_self.n, params.n_threads)) {
+            return -1;
+        }
 
-    ctx->state = whisper_init_state(ctx);
-    if (!ctx->state) {
-        whisper_free(ctx);
-        return nullptr;
+        ++ddecoder.kv_self.n;
     }
 
-    return ctx;
+    return verify.size() - 1;
 }
 
-struct whisper_context * whisper_init_from_buffer(void * buffer, size_t buffer_size) {
-    whisper_context * ctx = whisper_init_from_buffer_no_state(buffer, buffer_size);
-    if (!ctx) {
-        return nullptr;
-    }
+// voice activity detection in the frames [i0, i1) of the log mel spectrogram
+//
+// a frame is speech if the energy in the speech band (~300 - 3400 Hz) is above the noise floor of the audio by
+// params.vad.thold dB and the spectrum of the band is not flat (hiss, fans and other stationary noise). the frame
+// decisions are smoothed with a 3 dB hysteresis, the short pauses are merged, the short regions are dropped and
+// the remaining regions are padded. returns the speech regions, packed one after another
+static std::vector<whisper_vad_region> whisper_vad_detect(const whisper_mel & mel, const whisper_full_params & params, int i0, int i1) {
+    std::vector<whisper_vad_region> regions;
 
-    ctx->state = whisper_init_state(ctx);
-    if (!ctx->state) {
-        whisper_free(ctx);
-        return nullptr;
+    const int n = i1 - i0;
+    if (n <= 0) {
+        return regions;
     }
 
-    return ctx;
-}
+    const int b0 = ( 8*mel.n_mel)/80;
+    const int b1 = (58*mel.n_mel)/80;
 
-struct whisper_context * whisper_init(struct whisper_model_loader * loader) {
-    whisper_context * ctx = whisper_init_no_state(loader);
-    if (!ctx) {
-        return nullptr;
-    }
+    std::vector<float> energy(n);   // dB
+    std::vector<float> flatness(n); // dB, geometric over arithmetic mean of the band power
 
-    ctx->state = whisper_init_state(ctx);
-    if (!ctx->state) {
-        whisper_free(ctx);
-        return nullptr;
+    for (int i = 0; i < n; ++i) {
+        double sum_p = 0.0;
+        double sum_l = 0.0;
+
+        for (int j = b0; j < b1; ++j) {
+            // undo the normalization of log_mel_spectrogram()
+            const double l = 4.0*mel.data[j*mel.n_len + i0 + i] - 4.0;
+
+            sum_p += pow(10.0, l);
+            sum_l += l;
+        }
+
+        energy[i]   = 10.0*log10(sum_p/(b1 - b0));
+        flatness[i] = 10.0*sum_l/(b1 - b0) - energy[i];
     }
 
-    return ctx;
-}
+    // the noise floor is the 10th percentile of the frame energy
+    float noise_floor = 0.0f;
+    {
+        std::vector<float> tmp = energy;
+        std::nth_element(tmp.begin(), tmp.begin() + n/10, tmp.end());
+        noise_floor = tmp[n/10];
+    }
 
-void whisper_free_state(struct whisper_state * state)
-{
-    if (state) {
-        kv_cache_free(state->kv_cross);
+    const float thold_on  = noise_floor + params.vad.thold;
+    const float thold_off = thold_on - 3.0f;
 
-        for (int i = 0; i < WHISPER_MAX_DECODERS; ++i) {
-            kv_cache_free(state->decoders[i].kv_self);
+    bool speech = false;
+    for (int i = 0; i < n; ++i) {
+        if (speech) {
+            speech = energy[i] >= thold_off;
+        } else {
+            speech = energy[i] >= thold_on && flatness[i] < params.vad.flatness_thold;
         }
 
-#ifdef WHISPER_USE_COREML
-        if (state->ctx_coreml != nullptr) {
-            whisper_coreml_free(state->ctx_coreml);
-            state->ctx_coreml = nullptr;
+        if (speech) {
+            if (regions.empty() || regions.back().t_orig + regions.back().n < i0 + i) {
+                regions.push_back({ 0, i0 + i, 0 });
+            }
+            regions.back().n = i0 + i + 1 - regions.back().t_orig;
         }
-#endif
+    }
 
-#ifdef WHISPER_USE_OPENVINO
-        if (state->ctx_openvino != nullptr) {
-            whisper_openvino_free(state->ctx_openvino);
-            state->ctx_openvino = nullptr;
-        }
-#endif
+    const int64_t n_min_speech  = params.vad.min_speech_ms/10;
+    const int64_t n_min_silence = params.vad.min_silence_ms/10;
+    const int64_t n_pad         = params.vad.pad_ms/10;
 
-        delete state;
+    // merge the regions separated by short pauses
+    std::vector<whisper_vad_region> merged;
+    for (const auto & r : regions) {
+        if (!merged.empty() && r.t_orig - (merged.back().t_orig + merged.back().n) < n_min_silence) {
+            merged.back().n = r.t_orig + r.n - merged.back().t_orig;
+        } else {
+            merged.push_back(r);
+        }
     }
-}
 
-void whisper_free(struct whisper_context * ctx) {
-    if (ctx) {
-        if (ctx->model.ctx) {
-            ggml_free(ctx->model.ctx);
-        }
-        if (ctx->model.buf) {
-            delete ctx->model.buf;
+    // drop the short regions and pad the rest
+    regions.clear();
+    for (const auto & r : merged) {
+        if (r.n < n_min_speech) {
+            continue;
         }
 
-        whisper_free_state(ctx->state);
+        const int64_t t0 = std::max<int64_t>(i0, r.t_orig - n_pad);
+        const int64_t t1 = std::min<int64_t>(i1, r.t_orig + r.n + n_pad);
 
-        delete ctx;
+        if (!regions.empty() && regions.back().t_orig + regions.back().n >= t0) {
+            regions.back().n = t1 - regions.back().t_orig;
+        } else {
+            regions.push_back({ 0, t0, t1 - t0 });
+        }
     }
-}
 
-void whisper_free_params(struct whisper_full_params * params) {
-    if (params) {
-        delete params;
+    int64_t t_packed = 0;
+    for (auto & r : regions) {
+        r.t_packed = t_packed;
+        t_packed  += r.n;
     }
+
+    return regions;
 }
 
-int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
-    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, false, state->mel)) {
-        log("%s: failed to compute mel spectrogram\n", __func__);
-        return -1;
+// pack the speech regions of the spectrogram of the state one after another into state.mel_vad, which the encoder
+// then uses instead of the spectrogram. the spectrogram itself is left unchanged
+// the zero padding at the end of the audio is kept
+static void whisper_vad_pack_mel(whisper_state & state, const std::vector<whisper_vad_region> & regions) {
+    const whisper_mel & mel = state.mel;
+
+    const int n_speech = regions.empty() ? 0 : regions.back().t_packed + regions.back().n;
+    const int n_pad    = mel.n_len - mel.n_len_org;
+
+    whisper_mel & packed = state.mel_vad;
+    packed.n_mel     = mel.n_mel;
+    packed.n_len     = n_speech + n_pad;
+    packed.n_len_org = n_speech;
+    packed.data.resize(packed.n_mel*packed.n_len);
+
+    for (int j = 0; j < mel.n_mel; ++j) {
+        const float * src = mel.data.data()    + j*mel.n_len;
+              float * dst = packed.data.data() + j*packed.n_len;
+
+        for (const auto & r : regions) {
+            memcpy(dst + r.t_packed, src + r.t_orig, r.n*sizeof(float));
+        }
+
+        if (n_pad > 0) {
+            std::fill(dst + n_speech, dst + packed.n_len, src[mel.n_len - 1]);
+        }
     }
 
-    return 0;
+    state.use_mel_vad = true;
 }
 
-int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
-    return whisper_pcm_to_mel_with_state(ctx, ctx->state, samples, n_samples, n_threads);
-}
+// keep the signal energy of the speech regions, in the same order as the packed spectrogram
+static std::vector<float> whisper_vad_pack_energy(const std::vector<float> & energy, const std::vector<whisper_vad_region> & regions) {
+    std::vector<float> packed;
 
-// same as whisper_pcm_to_mel, but applies a Phase Vocoder to speed up the audio x2 (PV without phase lock is not good)
-int whisper_pcm_to_mel_phase_vocoder_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
-    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, 2 * WHISPER_N_FFT, 2 * WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, false, state->mel)) {
-        log("%s: failed to compute mel spectrogram\n", __func__);
-        return -1;
+    for (const auto & r : regions) {
+        const int64_t i0 = std::min<int64_t>(energy.size(), r.t_orig*WHISPER_HOP_LENGTH);
+        const int64_t i1 = std::min<int64_t>(energy.size(), (r.t_orig + r.n)*WHISPER_HOP_LENGTH);
+
+        packed.insert(packed.end(), energy.begin() + i0, energy.begin() + i1);
     }
 
-    return 0;
+    return packed;
 }
 
-// same as whisper_pcm_to_mel, but applies a Phase Vocoder to speed up the audio x2 (PV without phase lock is not good)
-int whisper_pcm_to_mel_phase_vocoder(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
-    return whisper_pcm_to_mel_phase_vocoder_with_state(ctx, ctx->state, samples, n_samples, n_threads);
+// map a timestamp of the packed spectrogram to the original audio
+// the end of a region and the start of the next one are the same packed timestamp - end selects the former
+static int64_t whisper_vad_restore_t(const std::vector<whisper_vad_region> & regions, int64_t t, bool end) {
+    if (regions.empty() || t < 0) {
+        return t;
+    }
+
+    size_t i = 0;
+    while (i + 1 < regions.size() && (end ? regions[i + 1].t_packed < t : regions[i + 1].t_packed <= t)) {
+        ++i;
+    }
+
+    return regions[i].t_orig + std::min(t - regions[i].t_packed, regions[i].n);
 }
 
-// same as whisper_pcm_to_mel, but applies WSOLA to speed up the audio x2
-// TODO
+// map the timestamps of the segments starting at i_segment and of their tokens to the original audio
+static void whisper_vad_restore_segments(whisper_state & state, int i_segment) {
+    const auto & regions = state.vad_regions;
 
-// same as whisper_pcm_to_mel, but applies HPTSM to speed up the audio x2
-// TODO
+    for (int i = i_segment; i < (int) state.result_all.size(); ++i) {
+        auto & segment = state.result_all[i];
 
-// same as whisper_pcm_to_mel, but applies PV (with phase lock) to speed up the audio x2
-// TODO
+        segment.t0 = whisper_vad_restore_t(regions, segment.t0, false);
+        segment.t1 = whisper_vad_restore_t(regions, segment.t1, true);
 
-int whisper_set_mel_with_state(
-        struct whisper_context * /*ctx*/,
-          struct whisper_state * state,
-                   const float * data,
-                           int   n_len,
-                           int   n_mel) {
-    if (n_mel != WHISPER_N_MEL) {
-        log("%s: invalid number of mel bands: %d (expected %d)\n", __func__, n_mel, WHISPER_N_MEL);
-        return -1;
+        for (auto & token : segment.tokens) {
+            token.t0 = whisper_vad_restore_t(regions, token.t0, false);
+            token.t1 = whisper_vad_restore_t(regions, token.t1, true);
+        }
     }
+}
 
-    state->mel.n_len     = n_len;
-    state->mel.n_len_org = n_len;
-    state->mel.n_mel     = n_mel;
+// initialize the decoders used by whisper_full() and size the beam-search arena of the state
+static int whisper_full_init_decoders(
+              struct whisper_context * ctx,
+                struct whisper_state * state,
+    const struct whisper_full_params & params) {
+    int n_decoders = 1;
 
-    state->mel.data.resize(n_len*n_mel);
-    memcpy(state->mel.data.data(), data, n_len*n_mel*sizeof(float));
+    switch (params.strategy) {
+        case WHISPER_SAMPLING_GREEDY:
+            {
+                n_decoders = params.greedy.best_of;
+            } break;
+        case WHISPER_SAMPLING_BEAM_SEARCH:
+            {
+                n_decoders = std::max(params.greedy.best_of, params.beam_search.beam_size);
+            } break;
+    };
 
-    return 0;
-}
+    n_decoders = std::max(1, n_decoders);
 
-int whisper_set_mel(
-        struct whisper_context * ctx,
-        const float * data,
-        int n_len,
-        int n_mel) {
-    return whisper_set_mel_with_state(ctx, ctx->state, data, n_len, n_mel);
-}
+    // TAGS: WHISPER_DECODER_INIT
+    for (int j = 1; j < n_decoders; j++) {
+        auto & decoder = state->decoders[j];
 
-int whisper_encode_with_state(struct whisper_context * ctx, struct whisper_state * state, int offset, int n_threads) {
-    if (!whisper_encode_internal(*ctx, *state, offset, n_threads)) {
-        log("%s: failed to eval\n", __func__);
-        return -1;
-    }
+        if (decoder.kv_self.ctx == nullptr) {
+            decoder.kv_self = state->decoders[0].kv_self;
+            if (!kv_cache_reinit(decoder.kv_self)) {
+                log("%s: kv_cache_reinit() failed for self-attention, decoder %d\n", __func__, j);
+                return -4;
+            }
 
-    return 0;
-}
+            WHISPER_PRINT_DEBUG("%s: initialized self-attention kv cache, decoder %d\n", __func__, j);
 
-int whisper_encode(struct whisper_context * ctx, int offset, int n_threads) {
-    if (!whisper_encode_internal(*ctx, *ctx->state, offset, n_threads)) {
-        log("%s: failed to eval\n", __func__);
-        return -1;
+            decoder.sequence.tokens.reserve(state->decoders[0].sequence.tokens.capacity());
+
+            decoder.probs.resize   (ctx->vocab.n_vocab);
+            decoder.logits.resize  (ctx->vocab.n_vocab);
+            decoder.logprobs.resize(ctx->vocab.n_vocab);
+
+            decoder.logits_id.reserve(ctx->vocab.n_vocab);
+        }
     }
 
-    return 0;
-}
+    // beam-search: snapshots of the KV caches and of the sequences of all decoders + the candidates of each step
+    if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
+        const size_t kv_swap_k = ggml_nbytes(state->decoders[0].kv_self.k);
+        const size_t kv_swap_v = ggml_nbytes(state->decoders[0].kv_self.v);
 
-int whisper_decode_with_state(struct whisper_context * ctx, struct whisper_state * state, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
-    const int selected_decoder_id = 0;
+        state->kv_swap.resize(n_decoders*(kv_swap_k + kv_swap_v));
 
-    if (!whisper_decode_internal(*ctx, *state, state->decoders[selected_decoder_id], tokens, n_tokens, n_past, n_threads)) {
-        log("%s: failed to eval\n", __func__);
-        return 1;
+        if ((int) state->seq_swap.size() < n_decoders) {
+            state->seq_swap.resize(n_decoders);
+            for (auto & sequence : state->seq_swap) {
+                sequence.tokens.reserve(state->decoders[0].sequence.tokens.capacity());
+            }
+        }
+
+        state->beam_candidates.reserve(n_decoders*params.beam_search.beam_size);
+        state->tokens_topk.reserve(params.beam_search.beam_size);
+        state->topk_id.reserve(params.beam_search.beam_size);
     }
 
     return 0;
 }
 
-int whisper_decode(struct whisper_context * ctx, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
-    // TODO: add selected_decoder_id to state
-    const int selected_decoder_id = 0;
+// check if the sequence selected for a window by the first model of a cascade has low confidence
+static bool whisper_cascade_escalate(
+    const struct whisper_full_params & params,
+        const struct whisper_decoder & decoder,
+                         whisper_token token_eot) {
+    if (decoder.failed) {
+        return true;
+    }
 
-    if (ctx->state == nullptr) {
-        log("%s: ERROR state was not loaded.\n", __func__);
+    const auto & sequence = decoder.sequence;
+
+    if (sequence.result_len == 0) {
         return false;
     }
 
-    if (!whisper_decode_internal(*ctx, *ctx->state, ctx->state->decoders[selected_decoder_id], tokens, n_tokens, n_past, n_threads)) {
-        log("%s: failed to eval\n", __func__);
-        return 1;
+    if (sequence.avg_logprobs < params.cascade.logprob_thold) {
+        return true;
     }
 
-    return 0;
-}
-
-int whisper_tokenize(struct whisper_context * ctx, const char * text, whisper_token * tokens, int n_max_tokens) {
-    const auto res = tokenize(ctx->vocab, text);
-
-    if (n_max_tokens < (int) res.size()) {
-        log("%s: too many resulting tokens: %d (max %d)\n", __func__, (int) res.size(), n_max_tokens);
-        return -1;
+    if (sequence.result_len > 32 && sequence.entropy < params.cascade.entropy_thold) {
+        return true;
     }
 
-    for (int i = 0; i < (int) res.size(); i++) {
-        tokens[i] = res[i];
+    for (int i = 0; i < sequence.result_len; ++i) {
+        if (sequence.tokens[i].id < token_eot && sequence.tokens[i].p < params.cascade.token_p_thold) {
+            return true;
+        }
     }
 
-    return res.size();
+    return false;
 }
 
-int whisper_lang_max_id() {
-    auto max_id = 0;
-    for (const auto & kv : g_lang) {
-        max_id = std::max(max_id, kv.second.first);
-    }
+// probability of the <|nospeech|> token in the logits of the first decoding step of a window
+// ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py
+static float whisper_no_speech_prob(const whisper_vocab & vocab, const float * logits, std::vector<float> & probs) {
+    const int n_logits = vocab.n_vocab;
 
-    return max_id;
-}
+    probs.resize(n_logits);
 
-int whisper_lang_id(const char * lang) {
-    if (!g_lang.count(lang)) {
-        for (const auto & kv : g_lang) {
-            if (kv.second.second == lang) {
-                return kv.second.first;
-            }
-        }
+    const float logit_max = ggml_max_row_f32(logits, n_logits);
+    const float sum       = ggml_exp_row_f32(logits, probs.data(), logit_max, n_logits);
 
-        log("%s: unknown language '%s'\n", __func__, lang);
-        return -1;
-    }
-    return g_lang.at(lang).first;
+    return probs[vocab.token_nosp]/sum;
 }
 
-const char * whisper_lang_str(int id) {
-    for (const auto & kv : g_lang) {
-        if (kv.second.first == id) {
-            return kv.first.c_str();
-        }
+// send the changes of the hypothesis of the window to params.new_token_callback: the provisional text tokens that
+// differ from the hypothesis are retracted, last first, then the new text tokens of the hypothesis are sent
+static void whisper_stream_tokens(
+              struct whisper_context * ctx,
+                struct whisper_state * state,
+    const struct whisper_full_params & params,
+    const std::vector<whisper_token_data> & tokens) {
+    if (params.new_token_callback == nullptr) {
+        return;
     }
 
-    log("%s: unknown language id %d\n", __func__, id);
-    return nullptr;
-}
+    const whisper_token token_eot = whisper_token_eot(ctx);
 
-int whisper_lang_auto_detect_with_state(
-        struct whisper_context * ctx,
-          struct whisper_state * state,
-                           int   offset_ms,
-                           int   n_threads,
-                         float * lang_probs) {
-    const int seek = offset_ms/10;
+    auto & stream = state->stream_tokens;
 
-    if (seek < 0) {
-        log("%s: offset %dms is before the start of the audio\n", __func__, offset_ms);
-        return -1;
-    }
+    // common prefix with the provisional tokens
+    size_t n_match = 0;
+    size_t i       = 0;
 
-    if (seek >= state->mel.n_len_org) {
-        log("%s: offset %dms is past the end of the audio (%dms)\n", __func__, offset_ms, state->mel.n_len_org*10);
-        return -2;
+    for (; i < tokens.size(); ++i) {
+        if (tokens[i].id >= token_eot) {
+            continue;
+        }
+        if (n_match == stream.size() || stream[n_match].id != tokens[i].id) {
+            break;
+        }
+        n_match++;
     }
 
-    // run the encoder
-    if (whisper_encode_with_state(ctx, state, seek, n_threads) != 0) {
-        log("%s: failed to encode\n", __func__);
-        return -6;
+    while (stream.size() > n_match) {
+        params.new_token_callback(ctx, state, &stream.back(), WHISPER_TOKEN_RETRACTED, params.new_token_callback_user_data);
+        stream.pop_back();
     }
 
-    const std::vector<whisper_token> prompt = { whisper_token_sot(ctx) };
+    for (; i < tokens.size(); ++i) {
+        if (tokens[i].id >= token_eot) {
+            continue;
+        }
+        stream.push_back(tokens[i]);
+        params.new_token_callback(ctx, state, &stream.back(), WHISPER_TOKEN_PROVISIONAL, params.new_token_callback_user_data);
+    }
+}
 
-    if (whisper_decode_with_state(ctx, state, prompt.data(), prompt.size(), 0, n_threads) != 0) {
-        log("%s: failed to decode\n", __func__);
-        return -7;
+// the window is done - its tokens are the result
+static void whisper_stream_tokens_final(
+              struct whisper_context * ctx,
+                struct whisper_state * state,
+    const struct whisper_full_params & params,
+    const std::vector<whisper_token_data> & tokens) {
+    if (params.new_token_callback == nullptr) {
+        return;
     }
 
-    auto & logits_id = state->logits_id;
-    logits_id.clear();
+    whisper_stream_tokens(ctx, state, params, tokens);
 
-    for (const auto & kv : g_lang) {
-        const auto token_lang = whisper_token_lang(ctx, kv.second.first);
-        logits_id.emplace_back(state->logits[token_lang], kv.second.first);
+    for (const auto & token : state->stream_tokens) {
+        params.new_token_callback(ctx, state, &token, WHISPER_TOKEN_FINAL, params.new_token_callback_user_data);
     }
 
-    // sort descending
-    {
-        using pair_type = std::remove_reference<decltype(logits_id)>::type::value_type;
-        std::sort(logits_id.begin(), logits_id.end(), [](const pair_type & a, const pair_type & b) {
-            return a.first > b.first;
-        });
-    }
+    state->stream_tokens.clear();
+}
 
-    // softmax
-    {
-        const auto max = logits_id[0].first;
+// start the performance record of the window at offset seek, see whisper_full_get_window_timings()
+// the record keeps the counters of the state until whisper_window_timings_end() replaces them with their increase
+static void whisper_window_timings_begin(whisper_state & state, int seek) {
+    auto & window = state.window;
 
-        double sum = 0.0f;
-        for (auto & kv : logits_id) {
-            kv.first = exp(kv.first - max);
-            sum += kv.first;
-        }
+    window = {};
 
-        for (auto & kv : logits_id) {
-            kv.first /= sum;
-        }
-    }
+    window.t0 = seek;
+    window.t_first_token_us = -1;
 
-    {
-        for (const auto & prob : logits_id) {
-            if (lang_probs) {
-                lang_probs[prob.second] = prob.first;
-            }
+    window.t_encode_us = state.t_encode_us;
+    window.t_decode_us = state.t_decode_us;
+    window.t_sample_us = state.t_sample_us;
+    window.n_decode    = state.n_decode;
+    window.n_sample    = state.n_sample;
 
-            //printf("%s: lang %2d (%3s): %f\n", __func__, prob.second, whisper_lang_str(prob.second), prob.first);
-        }
+    for (int i = 0; i < WHISPER_MAX_SCRATCH_BUFFERS; ++i) {
+        state.buf_max_size_all[i] = std::max(state.buf_max_size_all[i], state.buf_max_size[i]);
+        state.buf_max_size[i] = 0;
     }
 
-    return logits_id[0].second;
+    state.t_window_start_us = ggml_time_us();
 }
 
-int whisper_lang_auto_detect(
-        struct whisper_context * ctx,
-                           int   offset_ms,
-                           int   n_threads,
-                         float * lang_probs) {
-    return whisper_lang_auto_detect_with_state(ctx, ctx->state, offset_ms, n_threads, lang_probs);
-}
+// the window has consumed seek_delta of the spectrogram with a result of n_tokens tokens
+static void whisper_window_timings_end(whisper_state & state, const whisper_full_params & params, int seek_delta, int n_tokens) {
+    auto & window = state.window;
 
-int whisper_model_n_vocab(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_vocab;
-}
+    const int64_t t0 = window.t0;
+    const int64_t t1 = window.t0 + seek_delta;
 
-int whisper_model_n_audio_ctx(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_ctx;
-}
+    window.t0 = whisper_vad_restore_t(state.vad_regions, params.speed_up ? 2*t0 : t0, false);
+    window.t1 = whisper_vad_restore_t(state.vad_regions, params.speed_up ? 2*t1 : t1, true);
 
-int whisper_model_n_audio_state(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_state;
-}
+    window.t_total_us  = ggml_time_us() - state.t_window_start_us;
+    window.t_encode_us = state.t_encode_us - window.t_encode_us;
+    window.t_decode_us = state.t_decode_us - window.t_decode_us;
+    window.t_sample_us = state.t_sample_us - window.t_sample_us;
+    window.n_decode    = state.n_decode    - window.n_decode;
+    window.n_sample    = state.n_sample    - window.n_sample;
+    window.n_tokens    = n_tokens;
 
-int whisper_model_n_audio_head(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_head;
-}
+    for (int i = 0; i < WHISPER_MAX_SCRATCH_BUFFERS; ++i) {
+        window.mem_scratch += state.buf_max_size[i];
+    }
 
-int whisper_model_n_audio_layer(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_layer;
+    state.windows.push_back(window);
+
+    state.t_window_start_us = 0;
 }
 
-int whisper_model_n_text_ctx(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_ctx;
-}
+// decode the window of the spectrogram at offset seek with the temperature state->temperatures[it]
+// the prompt is built from state->prompt_past and state->prompt_init
+// the selected sequence is left in state->decoders[best_decoder_id]
+static int whisper_full_window_decode(
+              struct whisper_context * ctx,
+                struct whisper_state * state,
+    const struct whisper_full_params & params,
+              struct whisper_context * ctx_draft,
+                struct whisper_state * state_draft,
+                                 int   it,
+                                 int   seek,
+                                 int   seek_end,
+                                 int & best_decoder_id) {
+    const auto & temperatures = state->temperatures;
+    const auto & prompt_past  = state->prompt_past;
+    const auto & prompt_init  = state->prompt_init;
+
+    auto & prompt = state->prompt;
+
+    // beam-search helpers
+    auto & kv_swap         = state->kv_swap;
+    auto & seq_swap        = state->seq_swap;
+    auto & beam_candidates = state->beam_candidates;
+    auto & tokens_topk     = state->tokens_topk;
+
+    const size_t kv_swap_k = ggml_nbytes(state->decoders[0].kv_self.k);
+    const size_t kv_swap_v = ggml_nbytes(state->decoders[0].kv_self.v);
 
-int whisper_model_n_text_state(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_state;
-}
+    const float t_cur = temperatures[it];
 
-int whisper_model_n_text_head(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_head;
-}
+    int n_decoders_cur = 1;
 
-int whisper_model_n_text_layer(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_layer;
-}
+    switch (params.strategy) {
+        case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
+            {
+                if (t_cur > 0.0f) {
+                    n_decoders_cur = params.greedy.best_of;
+                }
+            } break;
+        case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
+            {
+                if (t_cur > 0.0f) {
+                    n_decoders_cur = params.greedy.best_of;
+                } else {
+                    n_decoders_cur = params.beam_search.beam_size;
+                }
+            } break;
+    };
 
-int whisper_model_n_mels(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_mels;
-}
+    n_decoders_cur = std::max(1, n_decoders_cur);
 
-int whisper_model_ftype(struct whisper_context * ctx) {
-    return ctx->model.hparams.ftype;
-}
+    state->window.n_decoders = n_decoders_cur;
 
-int whisper_model_type(struct whisper_context * ctx) {
-    return ctx->model.type;
-}
+    // the drafted tokens are verified against the greedy choice of the model
+    const bool use_draft = ctx_draft && t_cur < 1e-6f;
 
-const char *whisper_model_type_readable(struct whisper_context * ctx) {
-    switch (ctx->model.type) {
-    case e_model::MODEL_TINY:
-        return "tiny";
-    case e_model::MODEL_BASE:
-        return "base";
-    case e_model::MODEL_SMALL:
-        return "small";
-    case e_model::MODEL_MEDIUM:
-        return "medium";
-    case e_model::MODEL_LARGE:
-        return "large";
-    default:
-        return "unknown";
-    }
-}
+    WHISPER_PRINT_DEBUG("\n%s: decoding with %d decoders, temperature = %.2f\n", __func__, n_decoders_cur, t_cur);
 
-int whisper_n_len_from_state(struct whisper_state * state) {
-    return state->mel.n_len_org;
-}
+    // TAGS: WHISPER_DECODER_INIT
+    for (int j = 0; j < n_decoders_cur; ++j) {
+        auto & decoder = state->decoders[j];
 
-int whisper_n_len(struct whisper_context * ctx) {
-    return ctx->state->mel.n_len_org;
-}
+        decoder.kv_self.n = 0;
 
-int whisper_n_vocab(struct whisper_context * ctx) {
-    return ctx->vocab.n_vocab;
-}
+        decoder.sequence.tokens.clear();
+        decoder.sequence.result_len       = 0;
+        decoder.sequence.sum_logprobs_all = 0.0;
+        decoder.sequence.sum_logprobs     = -INFINITY;
+        decoder.sequence.avg_logprobs     = -INFINITY;
+        decoder.sequence.entropy          = 0.0;
+        decoder.sequence.score            = -INFINITY;
 
-int whisper_n_text_ctx(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_ctx;
-}
+        decoder.seek_delta = 100*WHISPER_CHUNK_SIZE;
 
-int whisper_n_audio_ctx(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_ctx;
-}
+        decoder.failed    = false;
+        decoder.completed = false;
+        decoder.has_ts    = false;
+    }
 
-int whisper_is_multilingual(struct whisper_context * ctx) {
-    return ctx->vocab.is_multilingual() ? 1 : 0;
-}
+    // init prompt and kv cache for the current iteration
+    // run whisper_decoder() only for decoder 0 and copy the results for the other decoders
+    {
+        prompt.clear();
 
-float * whisper_get_logits(struct whisper_context * ctx) {
-    return ctx->state->logits.data();
-}
+        // if we have already generated some text, use it as a prompt to condition the next generation
+        if (!prompt_past.empty() && t_cur < 0.5f && params.n_max_text_ctx > 0) {
+            int n_take = std::min(std::min(params.n_max_text_ctx, whisper_n_text_ctx(ctx)/2), int(prompt_past.size()));
 
-float * whisper_get_logits_from_state(struct whisper_state * state) {
-    return state->logits.data();
-}
+            prompt = { whisper_token_prev(ctx) };
+            prompt.insert(prompt.begin() + 1, prompt_past.end() - n_take, prompt_past.end());
+        }
 
-const char * whisper_token_to_str(struct whisper_context * ctx, whisper_token token) {
-    return ctx->vocab.id_to_token.at(token).c_str();
-}
+        // init new transcription with sot, language (opt) and task tokens
+        prompt.insert(prompt.end(), prompt_init.begin(), prompt_init.end());
 
-whisper_token whisper_token_eot(struct whisper_context * ctx) {
-    return ctx->vocab.token_eot;
-}
+        // print the prompt
+        WHISPER_PRINT_DEBUG("\n\n");
+        for (int i = 0; i < (int) prompt.size(); i++) {
+            WHISPER_PRINT_DEBUG("%s: prompt[%d] = %s\n", __func__, i, ctx->vocab.id_to_token.at(prompt[i]).c_str());
+        }
+        WHISPER_PRINT_DEBUG("\n\n");
 
-whisper_token whisper_token_sot(struct whisper_context * ctx) {
-    return ctx->vocab.token_sot;
-}
+        // the no-speech probability is predicted at the position of the sot token - when the sot token is followed by
+        // the language and the task tokens, the prompt is decoded in two parts
+        const int n_sot = params.no_speech_thold > 0.0f ? prompt.size() - prompt_init.size() + 1 : 0;
 
-whisper_token whisper_token_solm(struct whisper_context * ctx) {
-    return ctx->vocab.token_solm;
-}
+        int n_past = 0;
 
-whisper_token whisper_token_prev(struct whisper_context * ctx) {
-    return ctx->vocab.token_prev;
-}
+        state->no_speech_prob = 0.0f;
 
-whisper_token whisper_token_nosp(struct whisper_context * ctx) {
-    return ctx->vocab.token_nosp;
-}
+        if (n_sot > 0 && n_sot < (int) prompt.size()) {
+            if (!whisper_decode_internal(*ctx, *state, state->decoders[0], prompt.data(), n_sot, 0, params.n_threads)) {
+                if (!whisper_full_stopped(*state)) {
+                    log("%s: failed to decode\n", __func__);
+                }
+                return -7;
+            }
 
-whisper_token whisper_token_not(struct whisper_context * ctx) {
-    return ctx->vocab.token_not;
-}
+            state->no_speech_prob = whisper_no_speech_prob(ctx->vocab, state->logits.data() + (state->logits.size() - ctx->vocab.n_vocab), state->decoders[0].probs);
 
-whisper_token whisper_token_beg(struct whisper_context * ctx) {
-    return ctx->vocab.token_beg;
-}
+            n_past = n_sot;
+        }
 
-whisper_token whisper_token_lang(struct whisper_context * ctx, int lang_id) {
-    return whisper_token_sot(ctx) + 1 + lang_id;
-}
+        if (!whisper_decode_internal(*ctx, *state, state->decoders[0], prompt.data() + n_past, prompt.size() - n_past, n_past, params.n_threads)) {
+            if (!whisper_full_stopped(*state)) {
+                log("%s: failed to decode\n", __func__);
+            }
+            return -7;
+        }
 
-whisper_token whisper_token_translate(struct whisper_context * ctx) {
-    return ctx->vocab.token_translate;
-}
+        if (n_sot == (int) prompt.size()) {
+            state->no_speech_prob = whisper_no_speech_prob(ctx->vocab, state->logits.data() + (state->logits.size() - ctx->vocab.n_vocab), state->decoders[0].probs);
+        }
 
-whisper_token whisper_token_transcribe(struct whisper_context * ctx) {
-    return ctx->vocab.token_transcribe;
-}
+        {
+            const int64_t t_start_sample_us = ggml_time_us();
 
-void whisper_print_timings(struct whisper_context * ctx) {
-    const int64_t t_end_us = ggml_time_us();
+            whisper_process_logits(*ctx, *state, params, state->decoders[0], t_cur);
 
-    log("\n");
-    log("%s:     load time = %8.2f ms\n", __func__, ctx->t_load_us / 1000.0f);
-    if (ctx->state != nullptr) {
+            state->decoders[0].kv_self.n += prompt.size();
 
-        const int32_t n_sample = std::max(1, ctx->state->n_sample);
-        const int32_t n_encode = std::max(1, ctx->state->n_encode);
-        const int32_t n_decode = std::max(1, ctx->state->n_decode);
+            for (int j = 1; j < n_decoders_cur; ++j) {
+                auto & decoder = state->decoders[j];
 
-        log("%s:     fallbacks = %3d p / %3d h\n", __func__, ctx->state->n_fail_p, ctx->state->n_fail_h);
-        log("%s:      mel time = %8.2f ms\n", __func__, ctx->state->t_mel_us / 1000.0f);
-        log("%s:   sample time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_sample_us, n_sample, 1e-3f * ctx->state->t_sample_us / n_sample);
-        log("%s:   encode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_encode_us, n_encode, 1e-3f * ctx->state->t_encode_us / n_encode);
-        log("%s:   decode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_decode_us, n_decode, 1e-3f * ctx->state->t_decode_us / n_decode);
-    }
-    log("%s:    total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0f);
-}
+                memcpy(decoder.kv_self.k->data, state->decoders[0].kv_self.k->data, ggml_nbytes(decoder.kv_self.k));
+                memcpy(decoder.kv_self.v->data, state->decoders[0].kv_self.v->data, ggml_nbytes(decoder.kv_self.v));
 
-void whisper_reset_timings(struct whisper_context * ctx) {
-    if (ctx->state != nullptr) {
-        ctx->state->t_sample_us = 0;
-        ctx->state->t_encode_us = 0;
-        ctx->state->t_decode_us = 0;
-    }
-}
+                decoder.kv_self.n += prompt.size();
 
-static int whisper_has_coreml(void) {
-#ifdef WHISPER_USE_COREML
-    return 1;
-#else
-    return 0;
-#endif
-}
+                memcpy(decoder.probs.data(), state->decoders[0].probs.data(),    decoder.probs.size()*sizeof(decoder.probs[0]));
+                memcpy(decoder.logits.data(), state->decoders[0].logits.data(),   decoder.logits.size()*sizeof(decoder.logits[0]));
+                memcpy(decoder.logprobs.data(), state->decoders[0].logprobs.data(), decoder.logprobs.size()*sizeof(decoder.logprobs[0]));
+            }
 
-static int whisper_has_openvino(void) {
-#ifdef WHISPER_USE_OPENVINO
-    return 1;
-#else
-    return 0;
-#endif
-}
+            state->t_sample_us += ggml_time_us() - t_start_sample_us;
+        }
 
-const char * whisper_print_system_info(void) {
-    static std::string s;
+        if (use_draft) {
+            const int64_t t_start_draft_us = ggml_time_us();
 
-    s  = "";
-    s += "AVX = "       + std::to_string(ggml_cpu_has_avx())       + " | ";
-    s += "AVX2 = "      + std::to_string(ggml_cpu_has_avx2())      + " | ";
-    s += "AVX512 = "    + std::to_string(ggml_cpu_has_avx512())    + " | ";
-    s += "FMA = "       + std::to_string(ggml_cpu_has_fma())       + " | ";
-    s += "NEON = "      + std::to_string(ggml_cpu_has_neon())      + " | ";
-    s += "ARM_FMA = "   + std::to_string(ggml_cpu_has_arm_fma())   + " | ";
-    s += "F16C = "      + std::to_string(ggml_cpu_has_f16c())      + " | ";
-    s += "FP16_VA = "   + std::to_string(ggml_cpu_has_fp16_va())   + " | ";
-    s += "WASM_SIMD = " + std::to_string(ggml_cpu_has_wasm_simd()) + " | ";
-    s += "BLAS = "      + std::to_string(ggml_cpu_has_blas())      + " | ";
-    s += "SSE3 = "      + std::to_string(ggml_cpu_has_sse3())      + " | ";
-    s += "SSSE3 = "     + std::to_string(ggml_cpu_has_ssse3())     + " | ";
-    s += "VSX = "       + std::to_string(ggml_cpu_has_vsx())       + " | ";
-    s += "COREML = "    + std::to_string(whisper_has_coreml())     + " | ";
-    s += "OPENVINO = "  + std::to_string(whisper_has_openvino())   + " | ";
+            auto & dstate = *state_draft;
 
-    return s.c_str();
-}
+            if (!whisper_encode_internal(*ctx_draft, dstate, seek, params.n_threads)) {
+                log("%s: failed to encode with the draft model\n", __func__);
+                return -6;
+            }
 
-////////////////////////////////////////////////////////////////////////////
+            if (!whisper_decode_internal(*ctx_draft, dstate, dstate.decoders[0], prompt.data(), prompt.size(), 0, params.n_threads)) {
+                log("%s: failed to decode with the draft model\n", __func__);
+                return -7;
+            }
 
-struct whisper_full_params * whisper_full_default_params_by_ref(enum whisper_sampling_strategy strategy) {
-    struct whisper_full_params params = whisper_full_default_params(strategy);
+            state->draft_past.clear();
+            state->draft_verify.clear();
+            state->draft_verify_i = 0;
 
-    struct whisper_full_params* result = new whisper_full_params();
-    *result = params;
-    return result;
-}
+            state->t_draft_us += ggml_time_us() - t_start_draft_us;
+        }
+    }
 
-struct whisper_full_params whisper_full_default_params(enum whisper_sampling_strategy strategy) {
-    struct whisper_full_params result = {
-        /*.strategy          =*/ strategy,
+    const int n_max = whisper_n_text_ctx(ctx)/2 - 4;
 
-        /*.n_threads         =*/ std::min(4, (int32_t) std::thread::hardware_concurrency()),
-        /*.n_max_text_ctx    =*/ 16384,
-        /*.offset_ms         =*/ 0,
-        /*.duration_ms       =*/ 0,
+    // the drafted tokens are verified one decoder at a time
+    const whisper_decode_batch_session batch_session(*ctx, !use_draft);
 
-        /*.translate         =*/ false,
-        /*.no_context        =*/ true,
-        /*.single_segment    =*/ false,
-        /*.print_special     =*/ false,
-        /*.print_progress    =*/ true,
-        /*.print_realtime    =*/ false,
-        /*.print_timestamps  =*/ true,
+    for (int i = 0; i < n_max; ++i) {
+        // cancelled by whisper_full_window() - the result is not used
+        if (state->fallback_cancel) {
+            return 0;
+        }
 
-        /*.token_timestamps  =*/ false,
-        /*.thold_pt          =*/ 0.01f,
-        /*.thold_ptsum       =*/ 0.01f,
-        /*.max_len           =*/ 0,
-        /*.split_on_word     =*/ false,
-        /*.max_tokens        =*/ 0,
+        // aborted or past the deadline - the window is discarded
+        if (whisper_full_stopped(*state)) {
+            return -8;
+        }
 
-        /*.speed_up          =*/ false,
-        /*.debug_mode        =*/ false,
-        /*.audio_ctx         =*/ 0,
+        const int64_t t_start_sample_us = ggml_time_us();
 
-        /*.tdrz_enable       =*/ false,
+        // store the KV caches and the sequences of all decoders when doing beam-search
+        if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
+            for (int j = 0; j < n_decoders_cur; ++j) {
+                auto & decoder = state->decoders[j];
 
-        /*.initial_prompt    =*/ nullptr,
-        /*.prompt_tokens     =*/ nullptr,
-        /*.prompt_n_tokens   =*/ 0,
+                if (decoder.completed || decoder.failed) {
+                    continue;
+                }
 
-        /*.language          =*/ "en",
-        /*.detect_language   =*/ false,
+                uint8_t * kv_dst = kv_swap.data() + j*(kv_swap_k + kv_swap_v);
 
-        /*.suppress_blank    =*/ true,
-        /*.suppress_non_speech_tokens =*/ false,
+                memcpy(kv_dst,             decoder.kv_self.k->data, kv_swap_k);
+                memcpy(kv_dst + kv_swap_k, decoder.kv_self.v->data, kv_swap_v);
 
-        /*.temperature       =*/  0.0f,
-        /*.max_initial_ts    =*/  1.0f,
-        /*.length_penalty    =*/ -1.0f,
+                seq_swap[j] = decoder.sequence;
+            }
 
-        /*.temperature_inc   =*/  0.4f,
-        /*.entropy_thold     =*/  2.4f,
-        /*.logprob_thold     =*/ -1.0f,
-        /*.no_speech_thold   =*/  0.6f,
+            beam_candidates.clear();
+        }
 
-        /*.greedy            =*/ {
-            /*.best_of   =*/ -1,
-        },
+        // generate new sequence candidates for each decoder
+        for (int j = 0; j < n_decoders_cur; ++j) {
+            auto & decoder = state->decoders[j];
 
-        /*.beam_search      =*/ {
-            /*.beam_size =*/ -1,
+            if (decoder.completed || decoder.failed) {
+                continue;
+            }
 
-            /*.patience  =*/ -1.0f,
-        },
+            switch (params.strategy) {
+                case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
+                    {
+                        if (t_cur < 1e-6f) {
+                            decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, *state, decoder, true));
+                        } else {
+                            decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, *state, decoder, false));
+                        }
 
-        /*.new_segment_callback           =*/ nullptr,
-        /*.new_segment_callback_user_data =*/ nullptr,
+                        decoder.sequence.sum_logprobs_all += decoder.sequence.tokens.back().plog;
+                    } break;
+                case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
+                    {
+                        whisper_sample_token_topk(*ctx, *state, decoder, params.beam_search.beam_size, tokens_topk);
 
-        /*.progress_callback           =*/ nullptr,
-        /*.progress_callback_user_data =*/ nullptr,
+                        for (const auto & token : tokens_topk) {
+                            // masked tokens, e.g. with constrained decoding there can be fewer allowed tokens than beams
+                            if (token.plog == -INFINITY) {
+                                continue;
+                            }
 
-        /*.encoder_begin_callback           =*/ nullptr,
-        /*.encoder_begin_callback_user_data =*/ nullptr,
+                            beam_candidates.push_back({ j, decoder.seek_delta, decoder.has_ts, token, decoder.sequence.sum_logprobs_all + token.plog });
 
-        /*.logits_filter_callback           =*/ nullptr,
-        /*.logits_filter_callback_user_data =*/ nullptr,
-    };
+                            //WHISPER_PRINT_DEBUG("%s: beam candidate: %s (%f, %f)\n", __func__, ctx->vocab.id_to_token.at(token.id).c_str(), token.plog, beam_candidates.back().sum_logprobs_all);
+                        }
+                    } break;
+            };
+        }
+
+        // for beam-search, choose the top candidates and update the KV caches
+        if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
+            std::sort(
+                    beam_candidates.begin(),
+                    beam_candidates.end(),
+                    [](const whisper_beam_candidate & a, const whisper_beam_candidate & b) {
+                return a.sum_logprobs_all > b.sum_logprobs_all;
+            });
 
-    switch (strategy) {
-        case WHISPER_SAMPLING_GREEDY:
-            {
-                result.greedy = {
-                    /*.best_of   =*/ 2, // TODO: increase to 5 when we speed-up batch decoding
-                };
-            } break;
-        case WHISPER_SAMPLING_BEAM_SEARCH:
-            {
-                result.beam_search = {
-                    /*.beam_size =*/ 2, // TODO: increase to 5 when we speed-up batch decoding
+            uint32_t cur_c = 0;
 
-                    /*.patience  =*/ -1.0f,
-                };
-            } break;
-    }
+            for (int j = 0; j < n_decoders_cur; ++j) {
+                auto & decoder = state->decoders[j];
 
-    return result;
-}
+                if (decoder.completed || decoder.failed) {
+                    continue;
+                }
 
-// forward declarations
-static std::vector<float> get_signal_energy(const float * signal, int n_samples, int n_samples_per_half_window);
-static void whisper_exp_compute_token_level_timestamps(
-        struct whisper_context & ctx,
-          struct whisper_state & state,
-                           int   i_segment,
-                         float   thold_pt,
-                         float   thold_ptsum);
+                // when there are fewer candidates than decoders, the remaining decoders continue the last one
+                auto & cur = beam_candidates[std::min<size_t>(cur_c++, beam_candidates.size() - 1)];
 
-static inline bool should_split_on_word(const char * txt, bool split_on_word) {
-    if (!split_on_word) return true;
+                while (beam_candidates.size() > cur_c && beam_candidates[cur_c].sum_logprobs_all == cur.sum_logprobs_all && i > 0) {
+                    ++cur_c;
+                }
 
-    return txt[0] == ' ';
-}
+                decoder.sequence = seq_swap[cur.decoder_idx];
+                decoder.sequence.tokens.push_back(cur.token);
+                decoder.sequence.sum_logprobs_all = cur.sum_logprobs_all;
 
-// wrap the last segment to max_len characters
-// returns the number of new segments
-static int whisper_wrap_segment(struct whisper_context & ctx, struct whisper_state & state, int max_len, bool split_on_word) {
-    auto segment = state.result_all.back();
+                decoder.seek_delta = cur.seek_delta;
+                decoder.has_ts     = cur.has_ts;
 
-    int res = 1;
-    int acc = 0;
+                const uint8_t * kv_src = kv_swap.data() + cur.decoder_idx*(kv_swap_k + kv_swap_v);
 
-    std::string text;
+                memcpy(decoder.kv_self.k->data, kv_src,             kv_swap_k);
+                memcpy(decoder.kv_self.v->data, kv_src + kv_swap_k, kv_swap_v);
 
-    for (int i = 0; i < (int) segment.tokens.size(); i++) {
-        const auto & token = segment.tokens[i];
-        if (token.id >= whisper_token_eot(&ctx)) {
-            continue;
+                WHISPER_PRINT_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
+                        __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(decoder.sequence.tokens.back().id).c_str(), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
+            }
         }
 
-        const auto txt = whisper_token_to_str(&ctx, token.id);
-        const int cur = strlen(txt);
-
-        if (acc + cur > max_len && i > 0 && should_split_on_word(txt, split_on_word)) {
-            state.result_all.back().text = std::move(text);
-            state.result_all.back().t1 = token.t0;
-            state.result_all.back().tokens.resize(i);
-            state.result_all.back().speaker_turn_next = false;
+        // the fallback states and the state of the cascade model have no window record
+        if (state->t_window_start_us > 0 && state->window.t_first_token_us < 0) {
+            state->window.t_first_token_us = ggml_time_us() - state->t_window_start_us;
+        }
 
-            state.result_all.push_back({});
-            state.result_all.back().t0 = token.t0;
-            state.result_all.back().t1 = segment.t1;
+        // update the decoder state
+        // - check if the sequence is completed
+        // - check if the sequence is failed
+        // - update sliding window based on timestamp tokens
+        for (int j = 0; j < n_decoders_cur; ++j) {
+            auto & decoder = state->decoders[j];
 
-            // add tokens [i, end] to the new segment
-            state.result_all.back().tokens.insert(
-                state.result_all.back().tokens.end(),
-                    segment.tokens.begin() + i,
-                    segment.tokens.end());
+            if (decoder.completed || decoder.failed) {
+                continue;
+            }
 
-            state.result_all.back().speaker_turn_next = segment.speaker_turn_next;
+            auto & has_ts     = decoder.has_ts;
+            auto & failed     = decoder.failed;
+            auto & completed  = decoder.completed;
+            auto & seek_delta = decoder.seek_delta;
+            auto & result_len = decoder.sequence.result_len;
 
-            acc = 0;
-            text = "";
+            {
+                const auto & token = decoder.sequence.tokens.back();
 
-            segment = state.result_all.back();
-            i = -1;
+                // timestamp token - update sliding window
+                if (token.id > whisper_token_beg(ctx)) {
+                    const int seek_delta_new = 2*(token.id - whisper_token_beg(ctx));
 
-            res++;
-        } else {
-            acc += cur;
-            text += txt;
-        }
-    }
+                    // do not allow to go back in time
+                    if (has_ts && seek_delta > seek_delta_new && result_len < i) {
+                        failed = true; // TODO: maybe this is not a failure ?
+                        continue;
+                    }
 
-    state.result_all.back().text = std::move(text);
+                    seek_delta = seek_delta_new;
+                    result_len = i + 1;
+                    has_ts = true;
+                }
 
-    return res;
-}
+#ifdef WHISPER_DEBUG
+                {
+                    const auto tt = token.pt > 0.10 ? ctx->vocab.id_to_token.at(token.tid) : "[?]";
+                    WHISPER_PRINT_DEBUG("%s: id = %3d, decoder = %d, token = %6d, p = %6.3f, ts = %10s, %6.3f, result_len = %4d '%s'\n",
+                            __func__, i, j, token.id, token.p, tt.c_str(), token.pt, result_len, ctx->vocab.id_to_token.at(token.id).c_str());
+                }
+#endif
 
-static const std::vector<std::string> non_speech_tokens = {
-    "\"", "#", "(", ")", "*", "+", "/", ":", ";", "<", "=", ">", "@", "[", "\\", "]", "^",
-    "_", "`", "{", "|", "}", "~", "「", "」", "『", "』", "<<", ">>", "<<<", ">>>", "--",
-    "---", "-(", "-[", "('", "(\"", "((", "))", "(((", ")))", "[[", "]]", "{{", "}}", "♪♪",
-    "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
-};
+                // constrained decoding - the window is a single segment that ends once a token sequence is complete
+                if (params.constraint.n_sequences > 0 &&
+                    (token.id == whisper_token_eot(ctx) || whisper_constraint_is_complete(params, decoder.sequence.tokens, whisper_token_eot(ctx)))) {
+                    result_len = i + 1;
+                    seek_delta = 100*WHISPER_CHUNK_SIZE;
 
-// process the logits for the selected decoder
-// - applies logit filters
-// - computes logprobs and probs
-static void whisper_process_logits(
-              struct whisper_context & ctx,
-               struct whisper_state  & state,
-    const struct whisper_full_params   params,
-              struct whisper_decoder & decoder,
-                               float   temperature) {
-    const auto & vocab      = ctx.vocab;
-    const auto & tokens_cur = decoder.sequence.tokens;
+                    completed = true;
+                    continue;
+                }
 
-    const bool is_initial = tokens_cur.size() == 0;
-    const int  n_logits   = vocab.id_to_token.size();
+                // end of segment
+                if (token.id == whisper_token_eot(ctx) ||               // end of text token
+                   (params.max_tokens > 0 && i >= params.max_tokens) || // max tokens per segment reached
+                   (has_ts && seek + seek_delta + 100 >= seek_end)      // end of audio reached
+                   ) {
+                    if (result_len == 0) {
+                        if (seek + seek_delta + 100 >= seek_end) {
+                            result_len = i + 1;
+                        } else {
+                            failed = true;
+                            continue;
+                        }
+                    }
 
-    WHISPER_ASSERT(n_logits == ctx.vocab.n_vocab);
+                    if (params.single_segment) {
+                        result_len = i + 1;
+                        seek_delta = 100*WHISPER_CHUNK_SIZE;
+                    }
 
-    // extract the logits for the last token
-    // we will be mutating, and therefore we don't want to use the ctx.logits buffer directly
-    auto & probs    = decoder.probs;
-    auto & logits   = decoder.logits;
-    auto & logprobs = decoder.logprobs;
-    {
-        logits.resize(n_logits);
-        memcpy(logits.data(), state.logits.data() + (state.logits.size() - n_logits), n_logits*sizeof(float));
+                    completed = true;
+                    continue;
+                }
 
-        if (temperature > 0.0f) {
-            for (int i = 0; i < n_logits; i++) {
-                logits[i] /= temperature;
+                // TESTS: if no tensors are loaded, it means we are running tests
+                if (ctx->model.n_loaded == 0) {
+                    seek_delta = 100*WHISPER_CHUNK_SIZE;
+                    completed = true;
+                    continue;
+                }
             }
-        }
 
-        // will be populated a bit later
-        probs.resize(n_logits);
-        logprobs.resize(n_logits);
-    }
+            // stop a decoder as soon as it gets stuck in a repetition loop, instead of decoding it to the end and failing
+            // the completed sequence on its entropy
+            if (whisper_sequence_is_looping(params, decoder.sequence, whisper_token_eot(ctx))) {
+                WHISPER_PRINT_DEBUG("%s: decoder %2d: repetition loop detected at token %d\n", __func__, j, i);
 
-    // apply logit filters here
-    // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L480-L493
-    {
-        // suppress blank
-        // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L388-L390
-        if (params.suppress_blank) {
-            if (is_initial) {
-                logits[vocab.token_eot]           = -INFINITY;
-                logits[vocab.token_to_id.at(" ")] = -INFINITY;
+                failed = true;
+                state->n_fail_h++;
+                continue;
             }
-        }
 
-        // suppress <|notimestamps|> token
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L410-L412
-        logits[vocab.token_not] = -INFINITY;
+            // sometimes, the decoding can get stuck in a repetition loop
+            // this is an attempt to mitigate such cases - we flag the decoding as failed and use a fallback strategy
+            if (i == n_max - 1 && (result_len == 0 || seek_delta < 100*WHISPER_CHUNK_SIZE/2)) {
+                failed = true;
+                continue;
+            }
+        }
 
-        // suppress sot and nosp tokens
-        logits[vocab.token_sot]  = -INFINITY;
-        logits[vocab.token_nosp] = -INFINITY; // TODO: ignore this token for now
+        // beam-search: early termination
+        if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
+            const int n_pruned = whisper_beam_search_prune(params, state->decoders, n_decoders_cur, n_max);
 
-        // [TDRZ] when tinydiarize is disabled, suppress solm token
-        if (params.tdrz_enable == false) {
-            logits[vocab.token_solm] = -INFINITY;
+            if (n_pruned > 0) {
+                WHISPER_PRINT_DEBUG("%s: beam search: dropped %d beams at token %d\n", __func__, n_pruned, i);
+            }
         }
 
-        // suppress task tokens
-        logits[vocab.token_translate]  = -INFINITY;
-        logits[vocab.token_transcribe] = -INFINITY;
+        // stream the best hypothesis so far
+        if (params.new_token_callback) {
+            int j_best = -1;
 
-        if (params.logits_filter_callback) {
-            params.logits_filter_callback(&ctx, &state, tokens_cur.data(), tokens_cur.size(), logits.data(), params.logits_filter_callback_user_data);
-        }
+            for (int j = 0; j < n_decoders_cur; ++j) {
+                const auto & decoder = state->decoders[j];
 
-        // suppress non-speech tokens
-        // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
-        if (params.suppress_non_speech_tokens) {
-            for (const std::string & token : non_speech_tokens) {
-                const std::string suppress_tokens[] = {token, " " + token};
-                for (const std::string & suppress_token : suppress_tokens) {
-                    if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
-                        logits[vocab.token_to_id.at(suppress_token)] = -INFINITY;
-                    }
+                if (decoder.failed) {
+                    continue;
                 }
-            }
 
-            // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
-            if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" -")] = -INFINITY;
+                if (j_best < 0 || decoder.sequence.sum_logprobs_all > state->decoders[j_best].sequence.sum_logprobs_all) {
+                    j_best = j;
+                }
             }
-            if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" '")] = -INFINITY;
+
+            if (j_best >= 0) {
+                whisper_stream_tokens(ctx, state, params, state->decoders[j_best].sequence.tokens);
             }
         }
 
-        // timestamps have to appear in pairs, except directly before EOT; mask logits accordingly
-        // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L414-L424
+        // check if all decoders have finished (i.e. completed or failed)
         {
-            const bool last_was_timestamp        = tokens_cur.size() > 0 && tokens_cur.back().id >= vocab.token_beg;
-            const bool penultimate_was_timestamp = tokens_cur.size() < 2 || tokens_cur[tokens_cur.size() - 2].id >= vocab.token_beg;
+            bool completed_all = true;
 
-            //log("last_was_timestamp=%d penultimate_was_timestamp=%d\n", last_was_timestamp, penultimate_was_timestamp);
+            for (int j = 0; j < n_decoders_cur; ++j) {
+                auto & decoder = state->decoders[j];
 
-            if (last_was_timestamp) {
-                if (penultimate_was_timestamp) {
-                    for (int i = vocab.token_beg; i < n_logits; ++i) {
-                        logits[i] = -INFINITY;
-                    }
-                } else {
-                    for (int i = 0; i < vocab.token_eot; ++i) {
-                        logits[i] = -INFINITY;
-                    }
+                if (decoder.completed || decoder.failed) {
+                    continue;
                 }
-            }
-        }
 
-        // the initial timestamp cannot be larger than max_initial_ts
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L426-L429
-        if (is_initial && params.max_initial_ts > 0.0f) {
-            const float precision = float(WHISPER_CHUNK_SIZE)/ctx.model.hparams.n_audio_ctx;
-            const int   tid0      = std::round(params.max_initial_ts/precision);
+                completed_all = false;
+            }
 
-            for (int i = vocab.token_beg + tid0 + 1; i < n_logits; ++i) {
-                logits[i] = -INFINITY;
+            if (completed_all) {
+                break;
             }
         }
 
-        // condition timestamp tokens to be increasing
-        // ref: https://github.com/openai/whisper/pull/831#issuecomment-1385910556
-        if (decoder.has_ts) {
-            const int tid0 = decoder.seek_delta/2;
+        state->t_sample_us += ggml_time_us() - t_start_sample_us;
 
-            for (int i = vocab.token_beg; i < vocab.token_beg + tid0; ++i) {
-                logits[i] = -INFINITY;
-            }
-        }
+        // decode batching: evaluate the next token of all the active decoders, together with the other states
+        auto & decode_steps = state->decode_steps;
 
-        // populate the logprobs array (log_softmax)
-        {
-            const float logit_max = *std::max_element(logits.begin(), logits.end());
-            float logsumexp = 0.0f;
-            for (int i = 0; i < n_logits; ++i) {
-                if (logits[i] > -INFINITY) {
-                    logsumexp += expf(logits[i] - logit_max);
+        decode_steps.clear();
+
+        if (batch_session.enabled) {
+            for (int j = 0; j < n_decoders_cur; ++j) {
+                auto & decoder = state->decoders[j];
+
+                if (decoder.failed || decoder.completed || whisper_logits_active(*ctx, params, decoder)) {
+                    continue;
                 }
+
+                decode_steps.push_back({ state, &decoder, decoder.sequence.tokens.back().id, decoder.kv_self.n, nullptr, false, false });
             }
-            logsumexp = logf(logsumexp) + logit_max;
 
-            for (int i = 0; i < n_logits; ++i) {
-                if (logits[i] > -INFINITY) {
-                    logprobs[i] = logits[i] - logsumexp;
-                } else {
-                    logprobs[i] = -INFINITY;
+            if (!decode_steps.empty()) {
+                state->decode_logits.resize(decode_steps.size()*ctx->vocab.n_vocab);
+
+                for (int k = 0; k < (int) decode_steps.size(); ++k) {
+                    decode_steps[k].logits = state->decode_logits.data() + k*ctx->vocab.n_vocab;
+                }
+
+                if (!whisper_decode_batch(*ctx, decode_steps.data(), decode_steps.size(), params.n_threads)) {
+                    log("%s: failed to decode\n", __func__);
+                    return -8;
                 }
             }
         }
 
-        // if sum of probability over timestamps is above any other token, sample timestamp
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
-        {
-            // logsumexp over timestamps
-            float timestamp_logprob = -INFINITY;
-            {
-                float logsumexp = 0.0f;
-                const float logprob_max = *std::max_element(logprobs.begin() + vocab.token_beg, logprobs.end());
-                for (int i = vocab.token_beg; i < n_logits; ++i) {
-                    if (logprobs[i] > -INFINITY) {
-                        logsumexp += expf(logprobs[i] - logprob_max);
+        // obtain logits for the next token
+        for (int j = 0, k = 0; j < n_decoders_cur; ++j) {
+            auto & decoder = state->decoders[j];
+
+            if (decoder.failed || decoder.completed) {
+                continue;
+            }
+
+            const whisper_token token = decoder.sequence.tokens.back().id;
+
+            //WHISPER_PRINT_DEBUG("%s: decoder %d: token %d, kv_self.n %d, seek_delta %d\n", __func__, j, token, decoder.kv_self.n, decoder.seek_delta);
+
+            const float * logits = nullptr;
+
+            if (use_draft) {
+                auto & verify   = state->draft_verify;
+                auto & verify_i = state->draft_verify_i;
+
+                // if the sampled token is the drafted one, its logits are already in the verification output
+                // otherwise, draft the next tokens and evaluate them together with the sampled token
+                if (verify_i > 0 && verify_i < (int) verify.size() && verify[verify_i] == token) {
+                    state->n_draft_accept++;
+                } else {
+                    const int64_t t_start_draft_us = ggml_time_us();
+
+                    const int n_draft = std::min(params.speculative.n_draft, whisper_n_text_ctx(ctx) - decoder.kv_self.n - 1);
+
+                    const int n_drafted = whisper_draft(*ctx_draft, *state_draft, *state, params, decoder, prompt.size(), n_draft);
+                    if (n_drafted < 0) {
+                        log("%s: failed to decode with the draft model\n", __func__);
+                        return -8;
+                    }
+
+                    state->n_draft    += n_drafted;
+                    state->t_draft_us += ggml_time_us() - t_start_draft_us;
+
+                    if (!whisper_decode_internal(*ctx, *state, decoder, verify.data(), verify.size(), decoder.kv_self.n, params.n_threads, true)) {
+                        if (!whisper_full_stopped(*state)) {
+                            log("%s: failed to decode\n", __func__);
+                        }
+                        return -8;
                     }
+
+                    verify_i = 0;
                 }
-                if (logsumexp > 0.0f) {
-                    timestamp_logprob = logf(logsumexp) + logprob_max;
+
+                logits = state->logits.data() + (verify_i++)*ctx->vocab.n_vocab;
+            } else if (k < (int) decode_steps.size() && decode_steps[k].decoder == &decoder) {
+                logits = decode_steps[k++].logits;
+            } else {
+                const bool restricted = whisper_logits_active(*ctx, params, decoder);
+
+                if (!whisper_decode_internal(*ctx, *state, decoder, &token, 1, decoder.kv_self.n, params.n_threads, false, restricted ? &decoder.logits_id : nullptr)) {
+                    if (!whisper_full_stopped(*state)) {
+                        log("%s: failed to decode\n", __func__);
+                    }
+                    return -8;
                 }
             }
 
-            const float max_text_token_logprob = *std::max_element(logprobs.begin(), logprobs.begin() + vocab.token_beg);
+            {
+                const int64_t t_start_sample_us = ggml_time_us();
+
+                whisper_process_logits(*ctx, *state, params, decoder, t_cur, logits);
+
+                ++decoder.kv_self.n;
+
+                state->t_sample_us += ggml_time_us() - t_start_sample_us;
+            }
+        }
+    }
+
+    // rank the resulting sequences and select the best one
+    {
+        double best_score = -INFINITY;
+
+        for (int j = 0; j < n_decoders_cur; ++j) {
+            auto & decoder = state->decoders[j];
+
+            if (decoder.failed) {
+                continue;
+            }
+
+            decoder.sequence.tokens.resize(decoder.sequence.result_len);
+            whisper_sequence_score(params, decoder.sequence);
 
-            //log("timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
+            WHISPER_PRINT_DEBUG("%s: decoder %2d: score = %8.5f, result_len = %3d, avg_logprobs = %8.5f, entropy = %8.5f\n",
+                    __func__, j, decoder.sequence.score, decoder.sequence.result_len, decoder.sequence.avg_logprobs, decoder.sequence.entropy);
 
-            if (timestamp_logprob > max_text_token_logprob) {
-                for (int i = 0; i < vocab.token_beg; ++i) {
-                    logits[i]   = -INFINITY;
-                    logprobs[i] = -INFINITY;
-                }
+            if (decoder.sequence.result_len > 32 && decoder.sequence.entropy < params.entropy_thold) {
+                WHISPER_PRINT_DEBUG("%s: decoder %2d: failed due to entropy %8.5f < %8.5f\n",
+                        __func__, j, decoder.sequence.entropy, params.entropy_thold);
+
+                decoder.failed = true;
+                state->n_fail_h++;
+
+                continue;
             }
-        }
-    }
 
-    // compute probs
-    {
-        for (int i = 0; i < n_logits; ++i) {
-            if (logits[i] == -INFINITY) {
-                probs[i] = 0.0f;
-            } else {
-                probs[i] = expf(logprobs[i]);
+            if (best_score < decoder.sequence.score) {
+                best_score = decoder.sequence.score;
+                best_decoder_id = j;
             }
         }
-    }
 
-#if 0
-    // print first 100 logits - token string : logit
-    for (int i = 0; i < 100; i++) {
-        const auto token   = vocab.id_to_token.at(i);
-        const auto prob    = probs[i];
-        const auto logit   = logits[i];
-        const auto logprob = logprobs[i];
-        printf("%s : prob=%9.5f logit=%9.5f logprob=%9.5f\n", token.c_str(), prob, logit, logprob);
+        WHISPER_PRINT_DEBUG("%s: best decoder = %d\n", __func__, best_decoder_id);
     }
 
-    // "And", "and", " And", " and"
-    printf("logits[\"and\"]  = %f\n", logits[vocab.token_to_id.at("and")]);
-    printf("logits[\"And\"]  = %f\n", logits[vocab.token_to_id.at("And")]);
-    printf("logits[\" and\"] = %f\n", logits[vocab.token_to_id.at(" and")]);
-    printf("logits[\" And\"] = %f\n", logits[vocab.token_to_id.at(" And")]);
-    printf("logits[\" so\"]  = %f\n", logits[vocab.token_to_id.at(" so")]);
+    return 0;
+}
 
-    printf("logprobs[\"and\"]  = %f\n", logprobs[vocab.token_to_id.at("and")]);
-    printf("logprobs[\"And\"]  = %f\n", logprobs[vocab.token_to_id.at("And")]);
-    printf("logprobs[\" and\"] = %f\n", logprobs[vocab.token_to_id.at(" and")]);
-    printf("logprobs[\" And\"] = %f\n", logprobs[vocab.token_to_id.at(" And")]);
-    printf("logprobs[\" so\"]  = %f\n", logprobs[vocab.token_to_id.at(" so")]);
+// check if the decoding of the window at the temperature state->temperatures[it] is accepted
+// do fallback only if:
+// - we are not at the last temperature
+// - we are not at the end of the audio (3 sec)
+// - the window is not silent
+static bool whisper_full_window_accept(
+    const struct whisper_full_params & params,
+                struct whisper_state * state,
+                                 int   it,
+                                 int   seek,
+                                 int   seek_end,
+                                 int   best_decoder_id) {
+    if (it == (int) state->temperatures.size() - 1 || seek_end - seek <= 10*WHISPER_CHUNK_SIZE) {
+        return true;
+    }
 
-    printf("probs[\"and\"]  = %f\n", probs[vocab.token_to_id.at("and")]);
-    printf("probs[\"And\"]  = %f\n", probs[vocab.token_to_id.at("And")]);
-    printf("probs[\" and\"] = %f\n", probs[vocab.token_to_id.at(" and")]);
-    printf("probs[\" And\"] = %f\n", probs[vocab.token_to_id.at(" And")]);
-    printf("probs[\" so\"]  = %f\n", probs[vocab.token_to_id.at(" so")]);
-#endif
-}
+    // silence - if the logprob is low, the window is skipped by whisper_full_with_state()
+    if (params.no_speech_thold > 0.0f && state->no_speech_prob > params.no_speech_thold) {
+        return true;
+    }
 
-static whisper_token_data whisper_sample_token(
-            whisper_context & ctx,
-              whisper_state & state,
-      const whisper_decoder & decoder,
-                       bool   best) {
-    whisper_token_data result = {
-        0, 0, 0.0f, 0.0f, 0.0f, 0.0f, -1, -1, 0.0f,
-    };
+    const auto & decoder = state->decoders[best_decoder_id];
 
-    const auto & vocab = ctx.vocab;
+    if (decoder.failed || decoder.sequence.avg_logprobs < params.logprob_thold) {
+        state->n_fail_p++;
 
-    const auto & probs    = decoder.probs;
-    const auto & logprobs = decoder.logprobs;
+        WHISPER_PRINT_DEBUG("\n%s: failed to decode with temperature = %.2f\n", __func__, state->temperatures[it]);
 
-    const int n_logits = vocab.n_vocab;
+        return false;
+    }
 
-    {
-        double sum_ts = 0.0;
-        double max_ts = 0.0;
+    return true;
+}
 
-        for (int i = vocab.token_beg; i < n_logits; i++) {
-            if (probs[i] == -INFINITY) {
-                continue;
+// decode the window of the spectrogram at offset seek, falling back to higher temperatures when the decoding fails
+// the selected sequence is left in state->decoders[best_decoder_id]
+//
+// with params.n_fallback_parallel > 0, the next temperatures of the fallback are decoded concurrently with the current
+// one, by the fallback states of the state. they use the cross-attention KV cache of the state and a share of the
+// threads. the lowest accepted temperature is used and the decoding of the higher ones is cancelled
+static int whisper_full_window(
+              struct whisper_context * ctx,
+                struct whisper_state * state,
+    const struct whisper_full_params & params,
+              struct whisper_context * ctx_draft,
+                struct whisper_state * state_draft,
+                                 int   seek,
+                                 int   seek_end,
+                                 int & best_decoder_id) {
+    const int n_temperatures = state->temperatures.size();
+
+    // there is no fallback at the end of the audio
+    const int n_parallel = seek_end - seek > 10*WHISPER_CHUNK_SIZE ? std::max(0, std::min(WHISPER_MAX_DECODERS, params.n_fallback_parallel)) : 0;
+
+    for (int it = 0; it < n_temperatures; ) {
+        const int n_group = std::min(n_parallel, n_temperatures - 1 - it);
+
+        if (n_group == 0) {
+            const int ret = whisper_full_window_decode(ctx, state, params, ctx_draft, state_draft, it, seek, seek_end, best_decoder_id);
+            if (ret != 0) {
+                return ret;
             }
 
-            sum_ts += probs[i];
-            if (max_ts < probs[i]) {
-                max_ts = probs[i];
-                result.tid = i;
+            if (whisper_full_window_accept(params, state, it, seek, seek_end, best_decoder_id)) {
+                state->window.n_fallback  = it;
+                state->window.temperature = state->temperatures[it];
+                break;
             }
+
+            ++it;
+            continue;
         }
 
-        result.pt    = max_ts/(sum_ts + 1e-10);
-        result.ptsum = sum_ts;
-    }
+        auto & fstates = state->fallback_states;
 
-    if (best) {
-        for (int i = 0; i < n_logits; ++i) {
-            if (result.p < probs[i]) {
-                result.id   = i;
-                result.p    = probs[i];
-                result.plog = logprobs[i];
+        while ((int) fstates.size() < n_group) {
+            whisper_state * fstate = whisper_init_state_impl(ctx, false);
+            if (fstate == nullptr) {
+                log("%s: failed to initialize the fallback state\n", __func__);
+                return -4;
             }
-        }
-    } else {
-        std::discrete_distribution<> dist(probs.begin(), probs.end());
 
-        result.id   = dist(state.rng);
-        result.p    = probs[result.id];
-        result.plog = logprobs[result.id];
-    }
+            fstate->fallback_worker.reset(new whisper_worker);
 
-    if (result.id >= vocab.token_beg) {
-        result.tid = result.id;
-        result.pt  = result.p;
-    }
+            fstates.push_back(fstate);
+        }
 
-    state.n_sample++;
+        whisper_full_params fparams = params;
+        fparams.n_threads = std::max(1, params.n_threads/(n_group + 1));
 
-    return result;
-}
+        // the tokens are streamed from the lowest temperature of the group only
+        whisper_full_params gparams = fparams;
+        gparams.new_token_callback = nullptr;
 
-static std::vector<whisper_token_data> whisper_sample_token_topk(
-            whisper_context & ctx,
-              whisper_state & state,
-      const whisper_decoder & decoder,
-                        int   k) {
-    const auto & vocab = ctx.vocab;
+        for (int g = 0; g < n_group; ++g) {
+            auto & fstate = *fstates[g];
 
-    const auto & probs    = decoder.probs;
-    const auto & logits   = decoder.logits;
-    const auto & logprobs = decoder.logprobs;
+            // the encoder output is shared with the state - the tensors are owned by the state
+            fstate.kv_cross.k = state->kv_cross.k;
+            fstate.kv_cross.v = state->kv_cross.v;
 
-    const int n_logits = vocab.n_vocab;
+            fstate.exp_n_audio_ctx = state->exp_n_audio_ctx;
+            fstate.use_flash_attn  = state->use_flash_attn;
+            fstate.priority        = state->priority;
+            fstate.sched_scope     = state->sched_scope;
+            fstate.lang_id         = state->lang_id;
+            fstate.temperatures    = state->temperatures;
+            fstate.prompt_init     = state->prompt_init;
+            fstate.prompt_past     = state->prompt_past;
 
-    auto & logits_id = state.logits_id;
+            fstate.fallback_cancel = false;
+            fstate.stop_parent     = state;
 
-    logits_id.clear();
-    for (int i = 0; i < n_logits; ++i) {
-        logits_id.push_back({ logits[i], i });
-    }
+            const int ret = whisper_full_init_decoders(ctx, &fstate, gparams);
+            if (ret != 0) {
+                return ret;
+            }
+        }
+
+        int fret [WHISPER_MAX_DECODERS] = {};
+        int fbest[WHISPER_MAX_DECODERS] = {};
 
-    std::partial_sort(
-            logits_id.begin(),
-            logits_id.begin() + k, logits_id.end(),
-            [](const std::pair<double, whisper_token> & a, const std::pair<double, whisper_token> & b) {
-                return a.first > b.first;
+        for (int g = 0; g < n_group; ++g) {
+            fstates[g]->fallback_worker->run([&, g]() {
+                fret[g] = whisper_full_window_decode(ctx, fstates[g], gparams, nullptr, nullptr, it + 1 + g, seek, seek_end, fbest[g]);
             });
+        }
 
-    std::vector<whisper_token_data> result;
-    result.reserve(k);
+        // the lowest temperature of the group is decoded by the state itself
+        int ret = whisper_full_window_decode(ctx, state, fparams, ctx_draft, state_draft, it, seek, seek_end, best_decoder_id);
 
-    whisper_token tid = vocab.token_beg;
+        // index of the accepted result in the group: 0 - the state, g + 1 - the fallback state g
+        int i_accept = ret == 0 && whisper_full_window_accept(params, state, it, seek, seek_end, best_decoder_id) ? 0 : -1;
 
-    float pt    = 0.0;
-    float ptsum = 0.0;
+        for (int g = 0; g < n_group; ++g) {
+            if (i_accept >= 0 || ret != 0) {
+                for (int h = g; h < n_group; ++h) {
+                    fstates[h]->fallback_cancel = true;
+                }
+            }
 
-    {
-        double sum_ts = 0.0;
-        double max_ts = 0.0;
+            fstates[g]->fallback_worker->wait();
 
-        for (int i = vocab.token_beg; i < n_logits; i++) {
-            if (probs[i] == -INFINITY) {
-                continue;
+            if (i_accept < 0 && ret == 0) {
+                ret = fret[g];
+                if (ret == 0 && whisper_full_window_accept(params, fstates[g], it + 1 + g, seek, seek_end, fbest[g])) {
+                    i_accept = g + 1;
+                }
             }
+        }
 
-            sum_ts += probs[i];
-            if (max_ts < probs[i]) {
-                max_ts = probs[i];
-                tid = i;
-            }
+        for (int g = 0; g < n_group; ++g) {
+            auto & fstate = *fstates[g];
+
+            state->t_sample_us += fstate.t_sample_us;
+            state->t_decode_us += fstate.t_decode_us;
+            state->n_sample    += fstate.n_sample;
+            state->n_decode    += fstate.n_decode;
+            state->n_fail_p    += fstate.n_fail_p;
+            state->n_fail_h    += fstate.n_fail_h;
+
+            fstate.t_sample_us = 0;
+            fstate.t_decode_us = 0;
+            fstate.n_sample    = 0;
+            fstate.n_decode    = 0;
+            fstate.n_fail_p    = 0;
+            fstate.n_fail_h    = 0;
         }
 
-        pt    = max_ts/(sum_ts + 1e-10);
-        ptsum = sum_ts;
-    }
+        if (ret != 0) {
+            return ret;
+        }
 
-    for (int i = 0; i < k; ++i) {
-        const auto id = logits_id[i].second;
+        if (i_accept > 0) {
+            const auto & fstate   = *fstates[i_accept - 1];
+            const auto & fdecoder = fstate.decoders[fbest[i_accept - 1]];
 
-        result.push_back({ id, tid, probs[id], logprobs[id], pt, ptsum, -1, -1, 0.0f, });
+            best_decoder_id = 0;
 
-        if (result[i].id >= vocab.token_beg) {
-            result[i].tid = result[i].id;
-            result[i].pt  = result[i].p;
+            auto & decoder = state->decoders[best_decoder_id];
+
+            decoder.sequence   = fdecoder.sequence;
+            decoder.seek_delta = fdecoder.seek_delta;
+            decoder.failed     = fdecoder.failed;
+            decoder.completed  = fdecoder.completed;
+            decoder.has_ts     = fdecoder.has_ts;
+
+            state->prompt         = fstate.prompt;
+            state->no_speech_prob = fstate.no_speech_prob;
         }
-    }
 
-    state.n_sample++;
+        if (i_accept >= 0) {
+            if (i_accept > 0) {
+                state->window.n_decoders = fstates[i_accept - 1]->window.n_decoders;
+            }
 
-    return result;
-}
+            state->window.n_fallback  = it + i_accept;
+            state->window.temperature = state->temperatures[it + i_accept];
+            break;
+        }
 
-// ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L178-L192
-static void whisper_sequence_score(
-        const struct whisper_full_params & params,
-                        whisper_sequence & sequence) {
-    if (sequence.result_len == 0) {
-        return;
+        it += n_group + 1;
     }
 
-    double result = 0.0f;
+    return 0;
+}
 
-    for (int i = 0; i < sequence.result_len; ++i) {
-        result += sequence.tokens[i].plog;
+// compute the log mel spectrogram of the samples for whisper_full_with_state()
+static int whisper_full_mel(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples) {
+    if (params.speed_up) {
+        // TODO: Replace PV with more advanced algorithm
+        log("%s: failed to compute log mel spectrogram\n", __func__);
+        return -1;
     }
 
-    sequence.sum_logprobs = result;
-    sequence.avg_logprobs = result/sequence.result_len;
+    // the threads of the spectrogram count against the budget of the CPU scheduler too
+    const auto sched = whisper_state_scheduler(*state);
 
-    double penalty = sequence.result_len;
+    const int n_threads = sched ? whisper_cpu_scheduler_acquire(*sched, params.priority, params.n_threads) : params.n_threads;
 
-    if (params.length_penalty > 0.0f) {
-        penalty = pow((5.0 + penalty)/6.0, params.length_penalty);
+    const int ret = whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, n_threads);
+
+    if (sched) {
+        whisper_cpu_scheduler_release(*sched, params.priority, n_threads);
     }
 
-    sequence.score = result/penalty;
+    if (ret != 0) {
+        log("%s: failed to compute log mel spectrogram\n", __func__);
+        return -2;
+    }
 
-    // compute the entropy of the sequence of the last 32 tokens
-    {
-        const int n = 32;
+    return 0;
+}
 
-        int cnt = 0;
-        double entropy = 0.0f;
+// a state of an auxiliary context (draft model, model cascade), acquired for the lifetime of the scope
+struct whisper_state_scope {
+    whisper_context * ctx   = nullptr;
+    whisper_state   * state = nullptr;
 
-        std::map<whisper_token, int> token_counts;
-        for (int i = std::max(0, sequence.result_len - n); i < sequence.result_len; ++i) {
-            token_counts[sequence.tokens[i].id]++;
-            cnt++;
-        }
+    bool acquire(whisper_context * ctx) {
+        this->ctx   = ctx;
+        this->state = whisper_state_acquire(ctx);
 
-        for (const auto & kv : token_counts) {
-            const auto p = kv.second/(double)cnt;
-            entropy -= p*log(p);
+        return state != nullptr;
+    }
 
-            //WHISPER_PRINT_DEBUG("entropy: %d %f %f, count %d\n", kv.first, p, log(p), kv.second);
+    ~whisper_state_scope() {
+        if (state) {
+            whisper_state_release(ctx, state);
         }
-
-        sequence.entropy = entropy;
     }
-}
+};
 
-int whisper_full_with_state(
+// run whisper_full_with_state() on the spectrogram that is already in the state
+// the samples are still used for the signal energy of the token timestamps
+static int whisper_full_from_mel(
         struct whisper_context * ctx,
           struct whisper_state * state,
     struct whisper_full_params   params,
@@ -4086,18 +7380,52 @@ int whisper_full_with_state(
     auto & result_all = state->result_all;
 
     result_all.clear();
+    state->stream_tokens.clear();
 
-    if (n_samples > 0) {
-        // compute log mel spectrogram
-        if (params.speed_up) {
-            // TODO: Replace PV with more advanced algorithm
-            log("%s: failed to compute log mel spectrogram\n", __func__);
-            return -1;
-        } else {
-            if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
-                log("%s: failed to compute log mel spectrogram\n", __func__);
-                return -2;
-            }
+    state->windows.clear();
+    state->t_window_start_us = 0;
+
+    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
+    // done first, so that the language detection uses the same encoder as the transcription
+    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
+        log("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
+        return -5;
+    }
+    state->exp_n_audio_ctx = params.audio_ctx;
+
+    if (!whisper_constraint_is_valid(params, whisper_token_eot(ctx))) {
+        log("%s: the constraint sequences must be non-empty and contain only text tokens\n", __func__);
+        return -9;
+    }
+
+    state->use_flash_attn = params.flash_attn;
+    state->priority       = params.priority;
+
+    // voice activity detection - only the speech regions of the spectrogram are decoded
+    state->vad_regions.clear();
+    state->use_mel_vad = false;
+    if (params.vad.enable) {
+        const int64_t t_start_us = ggml_time_us();
+
+        const int n_len_org = whisper_n_len_from_state(state);
+
+        const int i0 = std::min(n_len_org, params.offset_ms/10);
+        const int i1 = params.duration_ms == 0 ? n_len_org : std::min(n_len_org, i0 + params.duration_ms/10);
+
+        state->vad_regions = whisper_vad_detect(state->mel, params, i0, i1);
+        whisper_vad_pack_mel(*state, state->vad_regions);
+
+        // the offset and the duration have been applied to the packed spectrogram
+        params.offset_ms   = 0;
+        params.duration_ms = 0;
+
+        state->n_vad_frames += i1 - i0;
+        state->n_vad_speech += state->get_mel().n_len_org;
+        state->t_vad_us     += ggml_time_us() - t_start_us;
+
+        if (state->vad_regions.empty()) {
+            WHISPER_PRINT_DEBUG("%s: no speech detected\n", __func__);
+            return 0;
         }
     }
 
@@ -4107,6 +7435,9 @@ int whisper_full_with_state(
 
         const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, 0, params.n_threads, probs.data());
         if (lang_id < 0) {
+            if (whisper_full_stopped(*state)) {
+                return 0;
+            }
             log("%s: failed to auto-detect language\n", __func__);
             return -3;
         }
@@ -4125,11 +7456,14 @@ int whisper_full_with_state(
         state->tid_last = 0;
         if (n_samples > 0) {
             state->energy = get_signal_energy(samples, n_samples, 32);
+            if (!state->vad_regions.empty()) {
+                state->energy = whisper_vad_pack_energy(state->energy, state->vad_regions);
+            }
         }
     }
 
     const int seek_start = params.offset_ms/10;
-    const int seek_end = params.duration_ms == 0 ? whisper_n_len_from_state(state) : seek_start + params.duration_ms/10;
+    const int seek_end = params.duration_ms == 0 ? state->get_mel().n_len_org : seek_start + params.duration_ms/10;
 
     // if length of spectrogram is less than 1.0s (100 frames), then return
     // basically don't process anything that is less than 1.0s
@@ -4141,7 +7475,8 @@ int whisper_full_with_state(
 
     // a set of temperatures to use
     // [ t0, t0 + delta, t0 + 2*delta, ..., < 1.0f + 1e-6f ]
-    std::vector<float> temperatures;
+    auto & temperatures = state->temperatures;
+    temperatures.clear();
     if (params.temperature_inc > 0.0f) {
         for (float t = params.temperature; t < 1.0f + 1e-6f; t += params.temperature_inc) {
             temperatures.push_back(t);
@@ -4151,39 +7486,10 @@ int whisper_full_with_state(
     }
 
     // initialize the decoders
-    int n_decoders = 1;
-
-    switch (params.strategy) {
-        case WHISPER_SAMPLING_GREEDY:
-            {
-                n_decoders = params.greedy.best_of;
-            } break;
-        case WHISPER_SAMPLING_BEAM_SEARCH:
-            {
-                n_decoders = std::max(params.greedy.best_of, params.beam_search.beam_size);
-            } break;
-    };
-
-    n_decoders = std::max(1, n_decoders);
-
-    // TAGS: WHISPER_DECODER_INIT
-    for (int j = 1; j < n_decoders; j++) {
-        auto & decoder = state->decoders[j];
-
-        if (decoder.kv_self.ctx == nullptr) {
-            decoder.kv_self = state->decoders[0].kv_self;
-            if (!kv_cache_reinit(decoder.kv_self)) {
-                log("%s: kv_cache_reinit() failed for self-attention, decoder %d\n", __func__, j);
-                return -4;
-            }
-
-            WHISPER_PRINT_DEBUG("%s: initialized self-attention kv cache, decoder %d\n", __func__, j);
-
-            decoder.sequence.tokens.reserve(state->decoders[0].sequence.tokens.capacity());
-
-            decoder.probs.resize   (ctx->vocab.n_vocab);
-            decoder.logits.resize  (ctx->vocab.n_vocab);
-            decoder.logprobs.resize(ctx->vocab.n_vocab);
+    {
+        const int ret = whisper_full_init_decoders(ctx, state, params);
+        if (ret != 0) {
+            return ret;
         }
     }
 
@@ -4195,7 +7501,7 @@ int whisper_full_with_state(
 
     // prepare prompt
     {
-        std::vector<whisper_token> prompt_tokens;
+        auto & prompt_tokens = state->prompt_tokens;
 
         // initial prompt
         if (!params.prompt_tokens && params.initial_prompt) {
@@ -4215,15 +7521,10 @@ int whisper_full_with_state(
         }
     }
 
-    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
-    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
-        log("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
-        return -5;
-    }
-    state->exp_n_audio_ctx = params.audio_ctx;
-
     // these tokens determine the task that will be performed
-    std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx) };
+    auto & prompt_init = state->prompt_init;
+    prompt_init.clear();
+    prompt_init.push_back(whisper_token_sot(ctx));
     if (whisper_is_multilingual(ctx)) {
         const int lang_id = whisper_lang_id(params.language);
         state->lang_id = lang_id;
@@ -4237,27 +7538,72 @@ int whisper_full_with_state(
 
     int seek = seek_start;
 
-    std::vector<whisper_token> prompt;
-    prompt.reserve(whisper_n_text_ctx(ctx));
+    auto & prompt = state->prompt;
 
-    // beam-search helpers
-    struct kv_buf {
-        std::vector<uint8_t> k;
-        std::vector<uint8_t> v;
-    };
+    // speculative decoding - the draft model gets a copy of the spectrogram and follows the greedy decoder
+    // the draft state is taken from the pool of the draft context for the transcription
+    struct whisper_context * ctx_draft = nullptr;
+
+    whisper_state_scope draft_scope;
 
-    std::vector<kv_buf> kv_bufs;
+    if (params.speculative.ctx_draft && params.speculative.n_draft > 0 && params.strategy == WHISPER_SAMPLING_GREEDY) {
+        ctx_draft = params.speculative.ctx_draft;
 
-    struct beam_candidate {
-        int decoder_idx;
-        int seek_delta;
+        if (ctx_draft->vocab.n_vocab != ctx->vocab.n_vocab ||
+            whisper_n_text_ctx(ctx_draft) != whisper_n_text_ctx(ctx) ||
+            params.audio_ctx > whisper_n_audio_ctx(ctx_draft)) {
+            log("%s: the draft model is not compatible with the model - speculative decoding disabled\n", __func__);
+            ctx_draft = nullptr;
+        } else if (!draft_scope.acquire(ctx_draft)) {
+            log("%s: failed to allocate the draft state - speculative decoding disabled\n", __func__);
+            ctx_draft = nullptr;
+        } else {
+            auto & dstate = *draft_scope.state;
 
-        bool has_ts;
+            dstate.mel             = state->get_mel();
+            dstate.exp_n_audio_ctx = params.audio_ctx;
+            dstate.use_flash_attn  = params.flash_attn;
+            dstate.priority        = params.priority;
+            dstate.sched_scope     = state->sched_scope;
 
-        whisper_sequence sequence;
-    };
+            state->draft_past.reserve(whisper_n_text_ctx(ctx));
+            state->draft_verify.reserve(params.speculative.n_draft + 1);
+        }
+    }
 
-    std::vector<beam_candidate> beam_candidates;
+    // model cascade - the larger model gets a copy of the spectrogram and of the task and decodes the windows with
+    // low confidence. its state is taken from the pool of the cascade context for the transcription
+    struct whisper_context * ctx_large = params.cascade.ctx_large;
+
+    whisper_state_scope large_scope;
+
+    if (ctx_large) {
+        if (ctx_large->vocab.n_vocab != ctx->vocab.n_vocab ||
+            whisper_n_text_ctx(ctx_large) != whisper_n_text_ctx(ctx) ||
+            params.audio_ctx > whisper_n_audio_ctx(ctx_large)) {
+            log("%s: the cascade model is not compatible with the model - cascade disabled\n", __func__);
+            ctx_large = nullptr;
+        } else if (!large_scope.acquire(ctx_large)) {
+            log("%s: failed to allocate the cascade state - cascade disabled\n", __func__);
+            ctx_large = nullptr;
+        } else {
+            auto & lstate = *large_scope.state;
+
+            lstate.mel             = state->get_mel();
+            lstate.exp_n_audio_ctx = params.audio_ctx;
+            lstate.use_flash_attn  = params.flash_attn;
+            lstate.priority        = params.priority;
+            lstate.sched_scope     = state->sched_scope;
+            lstate.lang_id         = state->lang_id;
+            lstate.temperatures    = temperatures;
+            lstate.prompt_init     = prompt_init;
+
+            const int ret = whisper_full_init_decoders(ctx_large, &lstate, params);
+            if (ret != 0) {
+                return ret;
+            }
+        }
+    }
 
     // main loop
     while (true) {
@@ -4273,6 +7619,11 @@ int whisper_full_with_state(
             break;
         }
 
+        // aborted or past the deadline - keep the segments of the windows done so far
+        if (whisper_full_stopped(*state)) {
+            break;
+        }
+
         if (params.encoder_begin_callback) {
             if (params.encoder_begin_callback(ctx, state, params.encoder_begin_callback_user_data) == false) {
                 log("%s: encoder_begin_callback returned false - aborting\n", __func__);
@@ -4280,8 +7631,19 @@ int whisper_full_with_state(
             }
         }
 
-        // encode audio features starting at offset seek
-        if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads)) {
+        whisper_window_timings_begin(*state, seek);
+
+        // encode audio features starting at offset seek, unless whisper_full_batch() already did
+        if (state->kv_cross_seek == seek) {
+            state->kv_cross_seek = -1;
+
+            // the record starts after the batched encoder - count the share of the state
+            state->window.t_encode_us -= state->t_encode_batch_us;
+            state->t_window_start_us  -= state->t_encode_batch_us;
+        } else if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads)) {
+            if (whisper_full_stopped(*state)) {
+                break;
+            }
             log("%s: failed to encode\n", __func__);
             return -6;
         }
@@ -4294,536 +7656,650 @@ int whisper_full_with_state(
 
         int best_decoder_id = 0;
 
-        for (int it = 0; it < (int) temperatures.size(); ++it) {
-            const float t_cur = temperatures[it];
+        {
+            const int ret = whisper_full_window(ctx, state, params, ctx_draft, draft_scope.state, seek, seek_end, best_decoder_id);
+            if (ret != 0) {
+                if (whisper_full_stopped(*state)) {
+                    break;
+                }
+                return ret;
+            }
+        }
 
-            int n_decoders_cur = 1;
+        // skip the windows without speech
+        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/transcribe.py
+        if (params.no_speech_thold > 0.0f && state->no_speech_prob > params.no_speech_thold &&
+            state->decoders[best_decoder_id].sequence.avg_logprobs < params.logprob_thold) {
+            WHISPER_PRINT_DEBUG("%s: no speech at seek = %d, p = %f\n", __func__, seek, state->no_speech_prob);
 
-            switch (params.strategy) {
-                case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
-                    {
-                        if (t_cur > 0.0f) {
-                            n_decoders_cur = params.greedy.best_of;
-                        }
-                    } break;
-                case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
-                    {
-                        if (t_cur > 0.0f) {
-                            n_decoders_cur = params.greedy.best_of;
-                        } else {
-                            n_decoders_cur = params.beam_search.beam_size;
-                        }
-                    } break;
-            };
+            state->n_nosp++;
 
-            n_decoders_cur = std::max(1, n_decoders_cur);
+            whisper_stream_tokens(ctx, state, params, {});
 
-            WHISPER_PRINT_DEBUG("\n%s: decoding with %d decoders, temperature = %.2f\n", __func__, n_decoders_cur, t_cur);
+            const int seek_delta = std::min(100*WHISPER_CHUNK_SIZE, seek_end - seek);
 
-            // TAGS: WHISPER_DECODER_INIT
-            for (int j = 0; j < n_decoders_cur; ++j) {
-                auto & decoder = state->decoders[j];
+            state->window.no_speech = true;
+            whisper_window_timings_end(*state, params, seek_delta, 0);
 
-                decoder.kv_self.n = 0;
+            seek += seek_delta;
+            continue;
+        }
 
-                decoder.sequence.tokens.clear();
-                decoder.sequence.result_len       = 0;
-                decoder.sequence.sum_logprobs_all = 0.0;
-                decoder.sequence.sum_logprobs     = -INFINITY;
-                decoder.sequence.avg_logprobs     = -INFINITY;
-                decoder.sequence.entropy          = 0.0;
-                decoder.sequence.score            = -INFINITY;
+        // model cascade - replace a low-confidence result with the one of the larger model
+        if (ctx_large) {
+            state->n_cascade++;
 
-                decoder.seek_delta = 100*WHISPER_CHUNK_SIZE;
+            if (whisper_cascade_escalate(params, state->decoders[best_decoder_id], whisper_token_eot(ctx))) {
+                const int64_t t_start_cascade_us = ggml_time_us();
 
-                decoder.failed    = false;
-                decoder.completed = false;
-                decoder.has_ts    = false;
-            }
+                auto & lstate = *large_scope.state;
 
-            // init prompt and kv cache for the current iteration
-            // run whisper_decoder() only for decoder 0 and copy the results for the other decoders
-            {
-                prompt.clear();
+                // the larger model stops with the state
+                lstate.stop_parent = state;
 
-                // if we have already generated some text, use it as a prompt to condition the next generation
-                if (!prompt_past.empty() && t_cur < 0.5f && params.n_max_text_ctx > 0) {
-                    int n_take = std::min(std::min(params.n_max_text_ctx, whisper_n_text_ctx(ctx)/2), int(prompt_past.size()));
+                const bool encoded = whisper_encode_internal(*ctx_large, lstate, seek, params.n_threads);
 
-                    prompt = { whisper_token_prev(ctx) };
-                    prompt.insert(prompt.begin() + 1, prompt_past.end() - n_take, prompt_past.end());
-                }
+                lstate.prompt_past = prompt_past;
 
-                // init new transcription with sot, language (opt) and task tokens
-                prompt.insert(prompt.end(), prompt_init.begin(), prompt_init.end());
+                int best_large_id = 0;
 
-                // print the prompt
-                WHISPER_PRINT_DEBUG("\n\n");
-                for (int i = 0; i < (int) prompt.size(); i++) {
-                    WHISPER_PRINT_DEBUG("%s: prompt[%d] = %s\n", __func__, i, ctx->vocab.id_to_token.at(prompt[i]).c_str());
-                }
-                WHISPER_PRINT_DEBUG("\n\n");
+                // the result of the larger model replaces the streamed tokens once the window is done
+                whisper_full_params lparams = params;
+                lparams.new_token_callback = nullptr;
 
-                if (!whisper_decode_internal(*ctx, *state, state->decoders[0], prompt.data(), prompt.size(), 0, params.n_threads)) {
-                    log("%s: failed to decode\n", __func__);
-                    return -7;
+                const int ret = encoded ? whisper_full_window(ctx_large, &lstate, lparams, nullptr, nullptr, seek, seek_end, best_large_id) : -6;
+
+                lstate.stop_parent = nullptr;
+
+                if (ret != 0) {
+                    if (whisper_full_stopped(*state)) {
+                        break;
+                    }
+                    if (!encoded) {
+                        log("%s: failed to encode with the cascade model\n", __func__);
+                    }
+                    return ret;
                 }
 
-                {
-                    const int64_t t_start_sample_us = ggml_time_us();
+                auto       & decoder       = state->decoders[best_decoder_id];
+                const auto & decoder_large = lstate.decoders[best_large_id];
 
-                    whisper_process_logits(*ctx, *state, params, state->decoders[0], t_cur);
+                decoder.sequence   = decoder_large.sequence;
+                decoder.seek_delta = decoder_large.seek_delta;
 
-                    state->decoders[0].kv_self.n += prompt.size();
+                prompt = lstate.prompt;
 
-                    for (int j = 1; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+                state->no_speech_prob = lstate.no_speech_prob;
 
-                        memcpy(decoder.kv_self.k->data, state->decoders[0].kv_self.k->data, ggml_nbytes(decoder.kv_self.k));
-                        memcpy(decoder.kv_self.v->data, state->decoders[0].kv_self.v->data, ggml_nbytes(decoder.kv_self.v));
+                state->window.escalated   = true;
+                state->window.n_fallback  = lstate.window.n_fallback;
+                state->window.n_decoders  = lstate.window.n_decoders;
+                state->window.temperature = lstate.window.temperature;
 
-                        decoder.kv_self.n += prompt.size();
+                state->n_cascade_escalated++;
+                state->t_cascade_us += ggml_time_us() - t_start_cascade_us;
+            }
+        }
 
-                        memcpy(decoder.probs.data(), state->decoders[0].probs.data(),    decoder.probs.size()*sizeof(decoder.probs[0]));
-                        memcpy(decoder.logits.data(), state->decoders[0].logits.data(),   decoder.logits.size()*sizeof(decoder.logits[0]));
-                        memcpy(decoder.logprobs.data(), state->decoders[0].logprobs.data(), decoder.logprobs.size()*sizeof(decoder.logprobs[0]));
-                    }
+        // output results through a user-provided callback
+        {
+            const auto & best_decoder = state->decoders[best_decoder_id];
 
-                    state->t_sample_us += ggml_time_us() - t_start_sample_us;
-                }
+            const auto seek_delta = best_decoder.seek_delta;
+            const auto result_len = best_decoder.sequence.result_len;
+
+            const auto & tokens_cur = best_decoder.sequence.tokens;
+
+            whisper_stream_tokens_final(ctx, state, params, tokens_cur);
+
+            //WHISPER_PRINT_DEBUG("prompt_init.size() = %d, prompt.size() = %d, result_len = %d, seek_delta = %d\n", prompt_init.size(), prompt.size(), result_len, seek_delta);
+
+            // update prompt_past
+            prompt_past.clear();
+            if (prompt.front() == whisper_token_prev(ctx)) {
+                prompt_past.insert(prompt_past.end(), prompt.begin() + 1, prompt.end() - prompt_init.size());
             }
 
-            for (int i = 0, n_max = whisper_n_text_ctx(ctx)/2 - 4; i < n_max; ++i) {
-                const int64_t t_start_sample_us = ggml_time_us();
+            for (int i = 0; i < result_len; ++i) {
+                prompt_past.push_back(tokens_cur[i].id);
+            }
 
-                // store the KV caches of all decoders when doing beam-search
-                if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
-                    kv_bufs.resize(n_decoders_cur);
-                    for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+            if (!tokens_cur.empty() && ctx->model.n_loaded > 0) {
+                int  i0 = 0;
+                auto t0 = seek + 2*(tokens_cur.front().tid - whisper_token_beg(ctx));
 
-                        if (decoder.completed || decoder.failed) {
-                            continue;
-                        }
+                auto & text = state->text;
+                text.clear();
+
+                bool speaker_turn_next = false;
 
-                        kv_bufs[j].k.resize(ggml_nbytes(decoder.kv_self.k));
-                        kv_bufs[j].v.resize(ggml_nbytes(decoder.kv_self.v));
+                for (int i = 0; i < (int) tokens_cur.size(); i++) {
+                    //printf("%s: %18s %6.3f %18s %6.3f\n", __func__,
+                    //        ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].p,
+                    //        ctx->vocab.id_to_token[tokens_cur[i].tid].c_str(), tokens_cur[i].pt);
 
-                        memcpy(kv_bufs[j].k.data(), decoder.kv_self.k->data, kv_bufs[j].k.size());
-                        memcpy(kv_bufs[j].v.data(), decoder.kv_self.v->data, kv_bufs[j].v.size());
+                    if (params.print_special || tokens_cur[i].id < whisper_token_eot(ctx)) {
+                        text += whisper_token_to_str(ctx, tokens_cur[i].id);
                     }
 
-                    beam_candidates.clear();
-                }
+                    // [TDRZ] record if speaker turn was predicted after current segment
+                    if (params.tdrz_enable && tokens_cur[i].id == whisper_token_solm(ctx)) {
+                        speaker_turn_next = true;
+                    }
 
-                // generate new sequence candidates for each decoder
-                for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = state->decoders[j];
+                    if (tokens_cur[i].id > whisper_token_beg(ctx) && !params.single_segment) {
+                        const auto t1 = seek + 2*(tokens_cur[i].tid - whisper_token_beg(ctx));
 
-                    if (decoder.completed || decoder.failed) {
-                        continue;
-                    }
+                        if (!text.empty()) {
+                            const auto tt0 = params.speed_up ? 2*t0 : t0;
+                            const auto tt1 = params.speed_up ? 2*t1 : t1;
 
-                    switch (params.strategy) {
-                        case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
-                            {
-                                if (t_cur < 1e-6f) {
-                                    decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, *state, decoder, true));
+                            if (params.print_realtime) {
+                                if (params.print_timestamps) {
+                                    printf("[%s --> %s]  %s\n", to_timestamp(whisper_vad_restore_t(state->vad_regions, tt0, false)).c_str(), to_timestamp(whisper_vad_restore_t(state->vad_regions, tt1, true)).c_str(), text.c_str());
                                 } else {
-                                    decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, *state, decoder, false));
+                                    printf("%s", text.c_str());
+                                    fflush(stdout);
                                 }
+                            }
+
+                            //printf("tt0 = %d, tt1 = %d, text = %s, token = %s, token_id = %d, tid = %d\n", tt0, tt1, text.c_str(), ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].id, tokens_cur[i].tid);
 
-                                decoder.sequence.sum_logprobs_all += decoder.sequence.tokens.back().plog;
-                            } break;
-                        case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
-                            {
-                                const auto tokens_new = whisper_sample_token_topk(*ctx, *state, decoder, params.beam_search.beam_size);
+                            result_all.push_back({ tt0, tt1, text, {}, speaker_turn_next, state->no_speech_prob });
+                            result_all.back().tokens.assign(tokens_cur.begin() + i0, tokens_cur.begin() + i + 1);
 
-                                for (const auto & token : tokens_new) {
-                                    beam_candidates.push_back({ j, decoder.seek_delta, decoder.has_ts, decoder.sequence });
-                                    beam_candidates.back().sequence.tokens.push_back(token);
-                                    beam_candidates.back().sequence.sum_logprobs_all += token.plog;
+                            int n_new = 1;
+
+                            if (params.token_timestamps) {
+                                whisper_exp_compute_token_level_timestamps(
+                                        *ctx, *state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
 
-                                    //WHISPER_PRINT_DEBUG("%s: beam candidate: %s (%f, %f)\n", __func__, ctx->vocab.id_to_token.at(token.id).c_str(), token.plog, beam_candidates.back().sequence.sum_logprobs_all);
+                                if (params.max_len > 0) {
+                                    n_new = whisper_wrap_segment(*ctx, *state, params.max_len, params.split_on_word);
                                 }
-                            } break;
-                    };
+                            }
+                            if (!state->vad_regions.empty()) {
+                                whisper_vad_restore_segments(*state, result_all.size() - n_new);
+                            }
+                            if (params.new_segment_callback) {
+                                params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
+                            }
+                        }
+                        text.clear();
+                        while (i < (int) tokens_cur.size() && tokens_cur[i].id > whisper_token_beg(ctx)) {
+                            i++;
+                        }
+                        i--;
+                        t0 = t1;
+                        i0 = i + 1;
+                        speaker_turn_next = false;
+                    }
                 }
 
-                // for beam-search, choose the top candidates and update the KV caches
-                if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
-                    std::sort(
-                            beam_candidates.begin(),
-                            beam_candidates.end(),
-                            [](const beam_candidate & a, const beam_candidate & b) {
-                        return a.sequence.sum_logprobs_all > b.sequence.sum_logprobs_all;
-                    });
-
-                    uint32_t cur_c = 0;
+                if (!text.empty()) {
+                    const auto t1 = seek + seek_delta;
 
-                    for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+                    const auto tt0 = params.speed_up ? 2*t0 : t0;
+                    const auto tt1 = params.speed_up ? 2*t1 : t1;
 
-                        if (decoder.completed || decoder.failed) {
-                            continue;
+                    if (params.print_realtime) {
+                        if (params.print_timestamps) {
+                            printf("[%s --> %s]  %s\n", to_timestamp(whisper_vad_restore_t(state->vad_regions, tt0, false)).c_str(), to_timestamp(whisper_vad_restore_t(state->vad_regions, tt1, true)).c_str(), text.c_str());
+                        } else {
+                            printf("%s", text.c_str());
+                            fflush(stdout);
                         }
+                    }
 
-                        auto & cur = beam_candidates[cur_c++];
-
-                        while (beam_candidates.size() > cur_c && beam_candidates[cur_c].sequence.sum_logprobs_all == cur.sequence.sum_logprobs_all && i > 0) {
-                            ++cur_c;
-                        }
+                    result_all.push_back({ tt0, tt1, text, {} , speaker_turn_next, state->no_speech_prob });
+                    result_all.back().tokens.assign(tokens_cur.begin() + i0, tokens_cur.end());
 
-                        decoder.sequence   = cur.sequence;
-                        decoder.seek_delta = cur.seek_delta;
-                        decoder.has_ts     = cur.has_ts;
+                    int n_new = 1;
 
-                        memcpy(decoder.kv_self.k->data, kv_bufs[cur.decoder_idx].k.data(), kv_bufs[cur.decoder_idx].k.size());
-                        memcpy(decoder.kv_self.v->data, kv_bufs[cur.decoder_idx].v.data(), kv_bufs[cur.decoder_idx].v.size());
+                    if (params.token_timestamps) {
+                        whisper_exp_compute_token_level_timestamps(
+                                *ctx, *state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
 
-                        WHISPER_PRINT_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
-                                __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(decoder.sequence.tokens.back().id).c_str(), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
+                        if (params.max_len > 0) {
+                            n_new = whisper_wrap_segment(*ctx, *state, params.max_len, params.split_on_word);
+                        }
+                    }
+                    if (!state->vad_regions.empty()) {
+                        whisper_vad_restore_segments(*state, result_all.size() - n_new);
+                    }
+                    if (params.new_segment_callback) {
+                        params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
                     }
                 }
+            }
 
-                // update the decoder state
-                // - check if the sequence is completed
-                // - check if the sequence is failed
-                // - update sliding window based on timestamp tokens
-                for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = state->decoders[j];
+            whisper_window_timings_end(*state, params, std::min(seek_delta, seek_end - seek), tokens_cur.size());
 
-                    if (decoder.completed || decoder.failed) {
-                        continue;
-                    }
+            // update audio window
+            seek += seek_delta;
 
-                    auto & has_ts     = decoder.has_ts;
-                    auto & failed     = decoder.failed;
-                    auto & completed  = decoder.completed;
-                    auto & seek_delta = decoder.seek_delta;
-                    auto & result_len = decoder.sequence.result_len;
+            WHISPER_PRINT_DEBUG("seek = %d, seek_delta = %d\n", seek, seek_delta);
+        }
+    }
 
-                    {
-                        const auto & token = decoder.sequence.tokens.back();
+    return 0;
+}
 
-                        // timestamp token - update sliding window
-                        if (token.id > whisper_token_beg(ctx)) {
-                            const int seek_delta_new = 2*(token.id - whisper_token_beg(ctx));
+// enables the early stop of the transcriptions of the states for its lifetime, see whisper_full_stopped()
+// the deadline counts from the construction. the stop reason is kept after the end of the transcriptions
+struct whisper_full_stop_scope {
+    std::vector<whisper_state *> states;
 
-                            // do not allow to go back in time
-                            if (has_ts && seek_delta > seek_delta_new && result_len < i) {
-                                failed = true; // TODO: maybe this is not a failure ?
-                                continue;
-                            }
+    whisper_full_stop_scope(whisper_state * const * states, int n_states, const whisper_full_params & params)
+        : states(states, states + n_states) {
+        const int64_t t_deadline_us = params.deadline_ms > 0 ? ggml_time_us() + 1000*(int64_t) params.deadline_ms : 0;
 
-                            seek_delta = seek_delta_new;
-                            result_len = i + 1;
-                            has_ts = true;
-                        }
+        for (auto * state : this->states) {
+            state->abort_callback           = params.abort_callback;
+            state->abort_callback_user_data = params.abort_callback_user_data;
+            state->t_deadline_us            = t_deadline_us;
+            state->stop_reason              = WHISPER_STOP_NONE;
+            state->stop_check               = true;
+        }
+    }
 
-#ifdef WHISPER_DEBUG
-                        {
-                            const auto tt = token.pt > 0.10 ? ctx->vocab.id_to_token.at(token.tid) : "[?]";
-                            WHISPER_PRINT_DEBUG("%s: id = %3d, decoder = %d, token = %6d, p = %6.3f, ts = %10s, %6.3f, result_len = %4d '%s'\n",
-                                    __func__, i, j, token.id, token.p, tt.c_str(), token.pt, result_len, ctx->vocab.id_to_token.at(token.id).c_str());
-                        }
-#endif
+    ~whisper_full_stop_scope() {
+        for (auto * state : states) {
+            state->abort_callback           = nullptr;
+            state->abort_callback_user_data = nullptr;
+            state->t_deadline_us            = 0;
+            state->stop_check               = false;
+        }
+    }
+};
 
-                        // end of segment
-                        if (token.id == whisper_token_eot(ctx) ||               // end of text token
-                           (params.max_tokens > 0 && i >= params.max_tokens) || // max tokens per segment reached
-                           (has_ts && seek + seek_delta + 100 >= seek_end)      // end of audio reached
-                           ) {
-                            if (result_len == 0) {
-                                if (seek + seek_delta + 100 >= seek_end) {
-                                    result_len = i + 1;
-                                } else {
-                                    failed = true;
-                                    continue;
-                                }
-                            }
+int whisper_full_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples) {
+    // checked before the scheduler reserves the cores of the class
+    if (params.priority < 0 || params.priority >= WHISPER_PRIORITY_COUNT) {
+        log("%s: invalid priority class %d\n", __func__, (int) params.priority);
+        return -10;
+    }
 
-                            if (params.single_segment) {
-                                result_len = i + 1;
-                                seek_delta = 100*WHISPER_CHUNK_SIZE;
-                            }
+    const whisper_full_stop_scope       stop_scope (&state, 1, params);
+    const whisper_cpu_scheduler_scope sched_scope(&state, 1, params.priority, params.n_threads);
 
-                            completed = true;
-                            continue;
-                        }
+    // clear old results
+    state->result_all.clear();
 
-                        // TESTS: if no tensors are loaded, it means we are running tests
-                        if (ctx->model.n_loaded == 0) {
-                            seek_delta = 100*WHISPER_CHUNK_SIZE;
-                            completed = true;
-                            continue;
-                        }
-                    }
+    if (n_samples > 0) {
+        const int ret = whisper_full_mel(ctx, state, params, samples, n_samples);
+        if (ret != 0) {
+            return ret;
+        }
+    }
 
-                    // sometimes, the decoding can get stuck in a repetition loop
-                    // this is an attempt to mitigate such cases - we flag the decoding as failed and use a fallback strategy
-                    if (i == n_max - 1 && (result_len == 0 || seek_delta < 100*WHISPER_CHUNK_SIZE/2)) {
-                        failed = true;
-                        continue;
-                    }
-                }
+    const int ret = whisper_full_from_mel(ctx, state, params, samples, n_samples);
 
-                // check if all decoders have finished (i.e. completed or failed)
-                {
-                    bool completed_all = true;
+    // the spectrogram of the state is encoded again by the next calls
+    state->use_mel_vad = false;
 
-                    for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+    // the window that was being decoded when the transcription stopped
+    whisper_stream_tokens(ctx, state, params, {});
 
-                        if (decoder.completed || decoder.failed) {
-                            continue;
-                        }
+    return ret;
+}
 
-                        completed_all = false;
-                    }
+int whisper_full(
+        struct whisper_context * ctx,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples) {
+    return whisper_full_with_state(ctx, ctx->state, params, samples, n_samples);
+}
 
-                    if (completed_all) {
-                        break;
-                    }
+int whisper_full_batch(
+        struct whisper_context * ctx,
+          struct whisper_state ** states,
+    struct whisper_full_params   params,
+                   const float ** samples,
+                     const int * n_samples,
+                           int   n_clips) {
+    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
+        log("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
+        return -5;
+    }
+
+    for (int i = 0; i < n_clips; ++i) {
+        if (states[i] == nullptr) {
+            log("%s: clip %d has no state\n", __func__, i);
+            return -1;
+        }
+    }
+
+    if (params.priority < 0 || params.priority >= WHISPER_PRIORITY_COUNT) {
+        log("%s: invalid priority class %d\n", __func__, (int) params.priority);
+        return -10;
+    }
+
+    // the deadline is shared by all the clips
+    const whisper_full_stop_scope       stop_scope (states, n_clips, params);
+    const whisper_cpu_scheduler_scope sched_scope(states, n_clips, params.priority, params.n_threads);
+
+    const int n_ctx = params.audio_ctx > 0 ? params.audio_ctx : whisper_n_audio_ctx(ctx);
+
+    // the batch is evaluated in the buffers of a single state, which are sized for a full window
+    const int n_batch_max = std::max(1, std::min(WHISPER_MAX_ENCODE_BATCH, whisper_n_audio_ctx(ctx)/n_ctx));
+
+    const int seek_start = params.offset_ms/10;
+
+    // the language detection encodes the beginning of the audio, so the batch would be wasted with an offset
+    const bool detect_language = params.language == nullptr || strlen(params.language) == 0 ||
+                                 strcmp(params.language, "auto") == 0 || params.detect_language;
+
+    const bool use_batch = !params.vad.enable && !(detect_language && seek_start > 0);
+
+    std::vector<whisper_state *> batch;
+    batch.reserve(n_batch_max);
+
+    int ret = 0;
+
+    for (int i0 = 0; i0 < n_clips; i0 += n_batch_max) {
+        const int i1 = std::min(n_clips, i0 + n_batch_max);
+
+        batch.clear();
+
+        for (int i = i0; i < i1; ++i) {
+            auto * state = states[i];
+
+            state->result_all.clear();
+
+            if (n_samples[i] > 0) {
+                const int ret_mel = whisper_full_mel(ctx, state, params, samples[i], n_samples[i]);
+                if (ret_mel != 0) {
+                    return ret_mel;
                 }
+            }
 
-                state->t_sample_us += ggml_time_us() - t_start_sample_us;
+            state->exp_n_audio_ctx = params.audio_ctx;
+            state->use_flash_attn  = params.flash_attn;
+            state->priority        = params.priority;
 
-                // obtain logits for the next token
-                for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = state->decoders[j];
+            const int n_len    = whisper_n_len_from_state(state);
+            const int seek_end = params.duration_ms == 0 ? n_len : seek_start + params.duration_ms/10;
 
-                    if (decoder.failed || decoder.completed) {
-                        continue;
-                    }
+            // only the windows that whisper_full_with_state() would encode - with VAD, it encodes the packed speech
+            if (use_batch && seek_start + 100 < seek_end && seek_start < n_len) {
+                batch.push_back(state);
+            }
+        }
 
-                    decoder.tokens_tmp.resize(1);
-                    decoder.tokens_tmp[0] = decoder.sequence.tokens.back().id;
+        if (!batch.empty()) {
+            if (!whisper_encode_batch_internal(*ctx, batch.data(), batch.size(), seek_start, params.n_threads)) {
+                log("%s: failed to encode\n", __func__);
+                return -6;
+            }
 
-                    //WHISPER_PRINT_DEBUG("%s: decoder %d: token %d, kv_self.n %d, seek_delta %d\n", __func__, j, decoder.tokens_tmp[0], decoder.kv_self.n, decoder.seek_delta);
+            for (auto * state : batch) {
+                state->kv_cross_seek = seek_start;
+            }
+        }
 
-                    if (!whisper_decode_internal(*ctx, *state, decoder, decoder.tokens_tmp.data(), decoder.tokens_tmp.size(), decoder.kv_self.n, params.n_threads)) {
-                        log("%s: failed to decode\n", __func__);
-                        return -8;
-                    }
+        for (int i = i0; i < i1; ++i) {
+            const int ret_clip = whisper_full_from_mel(ctx, states[i], params, samples[i], n_samples[i]);
+
+            whisper_stream_tokens(ctx, states[i], params, {});
+
+            states[i]->use_mel_vad = false;
+
+            // the window may not have been used, e.g. when the transcription was aborted
+            states[i]->kv_cross_seek = -1;
+
+            if (ret_clip != 0) {
+                log("%s: failed to process clip %d (%d)\n", __func__, i, ret_clip);
+                if (ret == 0) {
+                    ret = ret_clip;
+                }
+            }
+        }
+    }
+
+    return ret;
+}
+
+struct whisper_full_async {
+    whisper_context * ctx;
+    whisper_state   * state;
+
+    whisper_full_params params;
+    std::vector<float>  samples;
+
+    // the abort callback of the user, called by whisper_full_async_abort()
+    whisper_abort_callback abort_callback;
+    void * abort_callback_user_data;
 
-                    {
-                        const int64_t t_start_sample_us = ggml_time_us();
+    std::atomic<bool> cancelled = { false };
 
-                        whisper_process_logits(*ctx, *state, params, decoder, t_cur);
+    std::mutex              mutex;
+    std::condition_variable cv;
 
-                        ++decoder.kv_self.n;
+    bool done = false;
+    int  ret  = 0;
 
-                        state->t_sample_us += ggml_time_us() - t_start_sample_us;
-                    }
-                }
-            }
+    std::thread thread;
+};
 
-            // rank the resulting sequences and select the best one
-            {
-                double best_score = -INFINITY;
+static bool whisper_full_async_abort(void * user_data) {
+    auto * handle = (whisper_full_async *) user_data;
 
-                for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = state->decoders[j];
+    return handle->cancelled || (handle->abort_callback && handle->abort_callback(handle->abort_callback_user_data));
+}
 
-                    if (decoder.failed) {
-                        continue;
-                    }
+struct whisper_full_async * whisper_full_async_submit(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples) {
+    auto * handle = new whisper_full_async;
 
-                    decoder.sequence.tokens.resize(decoder.sequence.result_len);
-                    whisper_sequence_score(params, decoder.sequence);
+    handle->ctx     = ctx;
+    handle->state   = state;
+    handle->params  = params;
+    handle->samples = std::vector<float>(samples, samples + std::max(0, n_samples));
 
-                    WHISPER_PRINT_DEBUG("%s: decoder %2d: score = %8.5f, result_len = %3d, avg_logprobs = %8.5f, entropy = %8.5f\n",
-                            __func__, j, decoder.sequence.score, decoder.sequence.result_len, decoder.sequence.avg_logprobs, decoder.sequence.entropy);
+    handle->abort_callback           = params.abort_callback;
+    handle->abort_callback_user_data = params.abort_callback_user_data;
 
-                    if (decoder.sequence.result_len > 32 && decoder.sequence.entropy < params.entropy_thold) {
-                        WHISPER_PRINT_DEBUG("%s: decoder %2d: failed due to entropy %8.5f < %8.5f\n",
-                                __func__, j, decoder.sequence.entropy, params.entropy_thold);
+    handle->params.abort_callback           = whisper_full_async_abort;
+    handle->params.abort_callback_user_data = handle;
 
-                        decoder.failed = true;
-                        state->n_fail_h++;
+    try {
+        handle->thread = std::thread([handle]() {
+            const int ret = whisper_full_with_state(handle->ctx, handle->state, handle->params, handle->samples.data(), handle->samples.size());
 
-                        continue;
-                    }
+            std::lock_guard<std::mutex> lock(handle->mutex);
+            handle->ret  = ret;
+            handle->done = true;
+            handle->cv.notify_all();
+        });
+    } catch (const std::system_error & e) {
+        log("%s: failed to start the thread: %s\n", __func__, e.what());
+        delete handle;
+        return nullptr;
+    }
 
-                    if (best_score < decoder.sequence.score) {
-                        best_score = decoder.sequence.score;
-                        best_decoder_id = j;
-                    }
-                }
+    return handle;
+}
 
-                WHISPER_PRINT_DEBUG("%s: best decoder = %d\n", __func__, best_decoder_id);
-            }
+int whisper_full_async_poll(struct whisper_full_async * handle) {
+    std::lock_guard<std::mutex> lock(handle->mutex);
 
-            // was the decoding successful for the current temperature?
-            // do fallback only if:
-            // - we are not at the last temperature
-            // - we are not at the end of the audio (3 sec)
-            if (it != (int) temperatures.size() - 1 &&
-                seek_end - seek > 10*WHISPER_CHUNK_SIZE) {
-                bool success = true;
+    return handle->done ? 1 : 0;
+}
 
-                const auto & decoder = state->decoders[best_decoder_id];
+int whisper_full_async_wait(struct whisper_full_async * handle, int timeout_ms) {
+    std::unique_lock<std::mutex> lock(handle->mutex);
 
-                if (decoder.failed || decoder.sequence.avg_logprobs < params.logprob_thold) {
-                    success = false;
-                    state->n_fail_p++;
-                }
+    if (timeout_ms < 0) {
+        handle->cv.wait(lock, [handle]() { return handle->done; });
+    } else {
+        handle->cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), [handle]() { return handle->done; });
+    }
 
-                if (success) {
-                    //for (auto & token : ctx->decoders[best_decoder_id].sequence.tokens) {
-                    //    WHISPER_PRINT_DEBUG("%s: token = %d, p = %6.3f, pt = %6.3f, ts = %s, str = %s\n", __func__, token.id, token.p, token.pt, ctx->vocab.id_to_token.at(token.tid).c_str(), ctx->vocab.id_to_token.at(token.id).c_str());
-                    //}
+    return handle->done ? 1 : 0;
+}
 
-                    break;
-                }
-            }
+void whisper_full_async_cancel(struct whisper_full_async * handle) {
+    handle->cancelled = true;
+}
 
-            WHISPER_PRINT_DEBUG("\n%s: failed to decode with temperature = %.2f\n", __func__, t_cur);
-        }
+int whisper_full_async_join(struct whisper_full_async * handle) {
+    handle->thread.join();
 
-        // output results through a user-provided callback
-        {
-            const auto & best_decoder = state->decoders[best_decoder_id];
+    const int ret = handle->ret;
 
-            const auto seek_delta = best_decoder.seek_delta;
-            const auto result_len = best_decoder.sequence.result_len;
+    delete handle;
 
-            const auto & tokens_cur = best_decoder.sequence.tokens;
+    return ret;
+}
 
-            //WHISPER_PRINT_DEBUG("prompt_init.size() = %d, prompt.size() = %d, result_len = %d, seek_delta = %d\n", prompt_init.size(), prompt.size(), result_len, seek_delta);
+// find the quietest 100 ms of the audio within n_search samples of pos and return its center
+static int whisper_parallel_split_point(const float * samples, int n_samples, int pos, int n_search) {
+    const int n_frame  = WHISPER_SAMPLE_RATE/100; // 10 ms
+    const int n_window = 10;                      // frames
 
-            // update prompt_past
-            prompt_past.clear();
-            if (prompt.front() == whisper_token_prev(ctx)) {
-                prompt_past.insert(prompt_past.end(), prompt.begin() + 1, prompt.end() - prompt_init.size());
-            }
+    const int i0 = std::max(0, pos - n_search);
+    const int i1 = std::min(n_samples, pos + n_search);
 
-            for (int i = 0; i < result_len; ++i) {
-                prompt_past.push_back(tokens_cur[i].id);
-            }
+    const int n_frames = (i1 - i0)/n_frame;
 
-            if (!tokens_cur.empty() && ctx->model.n_loaded > 0) {
-                int  i0 = 0;
-                auto t0 = seek + 2*(tokens_cur.front().tid - whisper_token_beg(ctx));
+    if (n_frames <= n_window) {
+        return pos;
+    }
 
-                std::string text;
-                bool speaker_turn_next = false;
+    std::vector<double> energy(n_frames, 0.0);
 
-                for (int i = 0; i < (int) tokens_cur.size(); i++) {
-                    //printf("%s: %18s %6.3f %18s %6.3f\n", __func__,
-                    //        ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].p,
-                    //        ctx->vocab.id_to_token[tokens_cur[i].tid].c_str(), tokens_cur[i].pt);
+    for (int f = 0; f < n_frames; ++f) {
+        const float * x = samples + i0 + f*n_frame;
 
-                    if (params.print_special || tokens_cur[i].id < whisper_token_eot(ctx)) {
-                        text += whisper_token_to_str(ctx, tokens_cur[i].id);
-                    }
+        for (int j = 0; j < n_frame; ++j) {
+            energy[f] += x[j]*x[j];
+        }
+    }
 
-                    // [TDRZ] record if speaker turn was predicted after current segment
-                    if (params.tdrz_enable && tokens_cur[i].id == whisper_token_solm(ctx)) {
-                        speaker_turn_next = true;
-                    }
+    double sum = 0.0;
+    for (int f = 0; f < n_window; ++f) {
+        sum += energy[f];
+    }
 
-                    if (tokens_cur[i].id > whisper_token_beg(ctx) && !params.single_segment) {
-                        const auto t1 = seek + 2*(tokens_cur[i].tid - whisper_token_beg(ctx));
+    // prefer the window closest to pos among equally quiet ones
+    int    best     = pos;
+    double best_sum = INFINITY;
 
-                        if (!text.empty()) {
-                            const auto tt0 = params.speed_up ? 2*t0 : t0;
-                            const auto tt1 = params.speed_up ? 2*t1 : t1;
+    for (int f = n_window; ; ++f) {
+        const int center = i0 + (f - n_window/2)*n_frame;
 
-                            if (params.print_realtime) {
-                                if (params.print_timestamps) {
-                                    printf("[%s --> %s]  %s\n", to_timestamp(tt0).c_str(), to_timestamp(tt1).c_str(), text.c_str());
-                                } else {
-                                    printf("%s", text.c_str());
-                                    fflush(stdout);
-                                }
-                            }
+        if (sum < best_sum || (sum == best_sum && std::abs(center - pos) < std::abs(best - pos))) {
+            best_sum = sum;
+            best     = center;
+        }
 
-                            //printf("tt0 = %d, tt1 = %d, text = %s, token = %s, token_id = %d, tid = %d\n", tt0, tt1, text.c_str(), ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].id, tokens_cur[i].tid);
+        if (f == n_frames) {
+            break;
+        }
 
-                            result_all.push_back({ tt0, tt1, text, {}, speaker_turn_next });
-                            for (int j = i0; j <= i; j++) {
-                                result_all.back().tokens.push_back(tokens_cur[j]);
-                            }
+        sum += energy[f] - energy[f - n_window];
+    }
 
-                            int n_new = 1;
+    return best;
+}
 
-                            if (params.token_timestamps) {
-                                whisper_exp_compute_token_level_timestamps(
-                                        *ctx, *state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
+// remove the segments of a chunk that repeat the end of the previous chunks:
+// - the segments that end before the split point were transcribed by the previous chunk
+// - the leading text tokens of the segment across the split point that match the last text tokens of the previous
+//   chunk are removed
+static void whisper_parallel_stitch(
+        const whisper_context & ctx,
+        std::vector<whisper_segment> & result_all,
+        std::vector<whisper_segment> & segments,
+                             int64_t   t_start,
+                             int64_t   t_split) {
+    const whisper_token token_eot = ctx.vocab.token_eot;
 
-                                if (params.max_len > 0) {
-                                    n_new = whisper_wrap_segment(*ctx, *state, params.max_len, params.split_on_word);
-                                }
-                            }
-                            if (params.new_segment_callback) {
-                                params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
-                            }
-                        }
-                        text = "";
-                        while (i < (int) tokens_cur.size() && tokens_cur[i].id > whisper_token_beg(ctx)) {
-                            i++;
-                        }
-                        i--;
-                        t0 = t1;
-                        i0 = i + 1;
-                        speaker_turn_next = false;
-                    }
+    // the text tokens of the previous chunks in the overlap
+    std::vector<whisper_token> tail;
+    {
+        int i0 = result_all.size();
+        while (i0 > 0 && result_all[i0 - 1].t1 > t_start) {
+            --i0;
+        }
+
+        for (int i = i0; i < (int) result_all.size(); ++i) {
+            for (const auto & token : result_all[i].tokens) {
+                if (token.id < token_eot) {
+                    tail.push_back(token.id);
                 }
+            }
+        }
+    }
 
-                if (!text.empty()) {
-                    const auto t1 = seek + seek_delta;
+    std::vector<whisper_segment> result;
 
-                    const auto tt0 = params.speed_up ? 2*t0 : t0;
-                    const auto tt1 = params.speed_up ? 2*t1 : t1;
+    for (auto & segment : segments) {
+        if (segment.t0 >= t_split) {
+            result.push_back(std::move(segment));
+            continue;
+        }
 
-                    if (params.print_realtime) {
-                        if (params.print_timestamps) {
-                            printf("[%s --> %s]  %s\n", to_timestamp(tt0).c_str(), to_timestamp(tt1).c_str(), text.c_str());
-                        } else {
-                            printf("%s", text.c_str());
-                            fflush(stdout);
-                        }
-                    }
+        if (segment.t1 <= t_split) {
+            continue;
+        }
 
-                    result_all.push_back({ tt0, tt1, text, {} , speaker_turn_next });
-                    for (int j = i0; j < (int) tokens_cur.size(); j++) {
-                        result_all.back().tokens.push_back(tokens_cur[j]);
-                    }
+        std::vector<whisper_token> text;
+        for (const auto & token : segment.tokens) {
+            if (token.id < token_eot) {
+                text.push_back(token.id);
+            }
+        }
 
-                    int n_new = 1;
+        // the longest prefix of the text that is a suffix of the tail
+        int n_dup = 0;
+        for (int n = std::min(text.size(), tail.size()); n > 0; --n) {
+            if (std::equal(text.begin(), text.begin() + n, tail.end() - n)) {
+                n_dup = n;
+                break;
+            }
+        }
 
-                    if (params.token_timestamps) {
-                        whisper_exp_compute_token_level_timestamps(
-                                *ctx, *state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
+        if (n_dup == (int) text.size()) {
+            continue;
+        }
 
-                        if (params.max_len > 0) {
-                            n_new = whisper_wrap_segment(*ctx, *state, params.max_len, params.split_on_word);
-                        }
-                    }
-                    if (params.new_segment_callback) {
-                        params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
+        if (n_dup > 0) {
+            std::vector<whisper_token_data> tokens;
+
+            segment.text.clear();
+
+            for (const auto & token : segment.tokens) {
+                if (token.id < token_eot) {
+                    if (n_dup > 0) {
+                        --n_dup;
+                        continue;
                     }
+
+                    segment.text += ctx.vocab.id_to_token.at(token.id);
                 }
-            }
 
-            // update audio window
-            seek += seek_delta;
+                tokens.push_back(token);
+            }
 
-            WHISPER_PRINT_DEBUG("seek = %d, seek_delta = %d\n", seek, seek_delta);
+            segment.tokens = std::move(tokens);
         }
-    }
 
-    return 0;
-}
+        result.push_back(std::move(segment));
+    }
 
-int whisper_full(
-        struct whisper_context * ctx,
-    struct whisper_full_params   params,
-                   const float * samples,
-                           int   n_samples) {
-    return whisper_full_with_state(ctx, ctx->state, params, samples, n_samples);
+    segments = std::move(result);
 }
 
 int whisper_full_parallel(
@@ -4835,102 +8311,243 @@ int whisper_full_parallel(
     if (n_processors == 1) {
         return whisper_full(ctx, params, samples, n_samples);
     }
-    int ret = 0;
 
-    // prepare separate states for each thread
-    std::vector<whisper_state*> states;
+    const int n_chunks = params.parallel.n_chunks > 0 ? params.parallel.n_chunks : n_processors;
+
+    // the audio to process
+    const int offset_samples = std::min(n_samples, (WHISPER_SAMPLE_RATE*params.offset_ms)/1000);
+    if (params.duration_ms > 0) {
+        n_samples = std::min(n_samples, offset_samples + (int) ((int64_t) WHISPER_SAMPLE_RATE*params.duration_ms/1000));
+    }
+
+    const int n_samples_per_chunk = (n_samples - offset_samples)/n_chunks;
+
+    // split points, at the quietest point near the even split points
+    std::vector<int> split(n_chunks + 1);
+    {
+        const int n_search = std::min((int) ((int64_t) WHISPER_SAMPLE_RATE*params.parallel.search_ms/1000), n_samples_per_chunk/4);
+
+        split[0]        = offset_samples;
+        split[n_chunks] = n_samples;
+
+        for (int i = 1; i < n_chunks; ++i) {
+            split[i] = offset_samples + i*n_samples_per_chunk;
 
-    const int offset_samples = (WHISPER_SAMPLE_RATE*params.offset_ms)/1000;
-    const int n_samples_per_processor = (n_samples - offset_samples)/n_processors;
+            if (n_search > 0) {
+                split[i] = whisper_parallel_split_point(samples, n_samples, split[i], n_search);
+            }
+        }
+    }
+
+    const int n_overlap = std::min((int) ((int64_t) WHISPER_SAMPLE_RATE*params.parallel.overlap_ms/1000), n_samples_per_chunk/2);
 
-    // the calling thread will process the first chunk
-    // while the other threads will process the remaining chunks
+    // the first chunk is processed by the calling thread with the default state, the remaining chunks are picked up
+    // by the threads that are done with their previous chunk
+    std::vector<std::vector<whisper_segment>> results(n_chunks);
+    std::vector<std::vector<whisper_window_timings>> windows(n_chunks);
+    std::vector<int> rets (n_chunks, 0);
+    std::vector<int> stops(n_chunks, WHISPER_STOP_NONE);
 
-    std::vector<std::thread> workers(n_processors - 1);
-    for (int i = 0; i < n_processors - 1; ++i) {
-        // create a new state for each thread
-        states.push_back(whisper_init_state(ctx));
+    // the deadline is shared by all the chunks
+    const int64_t t_deadline_us = params.deadline_ms > 0 ? ggml_time_us() + 1000*(int64_t) params.deadline_ms : 0;
 
-        const int start_samples = offset_samples + (i + 1)*n_samples_per_processor;
-        const int n_samples_cur = (i == n_processors - 2) ? n_samples - start_samples : n_samples_per_processor;
+    auto process = [&](whisper_state * state, int i) {
+        const int start = std::max(offset_samples, split[i] - (i > 0 ? n_overlap : 0));
 
         auto params_cur = params;
 
-        params_cur.offset_ms = 0;
-        params_cur.print_progress = false;
+        if (t_deadline_us > 0) {
+            const int64_t t_left_us = t_deadline_us - ggml_time_us();
+            if (t_left_us <= 0) {
+                stops[i] = WHISPER_STOP_DEADLINE;
+                return;
+            }
+
+            params_cur.deadline_ms = std::max<int64_t>(1, t_left_us/1000);
+        }
+
+        params_cur.offset_ms   = 0;
+        params_cur.duration_ms = 0;
+
+        // We need to disable the print real-time for all chunks, otherwise it will show only for the first chunk.
+        params_cur.print_progress = params.print_progress && i == 0;
         params_cur.print_realtime = false;
 
         params_cur.new_segment_callback = nullptr;
         params_cur.new_segment_callback_user_data = nullptr;
 
-        params_cur.progress_callback = nullptr;
-        params_cur.progress_callback_user_data = nullptr;
+        params_cur.new_token_callback = nullptr;
+        params_cur.new_token_callback_user_data = nullptr;
+
+        if (i > 0) {
+            // the text of another chunk is not a valid context
+            params_cur.no_context = true;
+
+            params_cur.progress_callback = nullptr;
+            params_cur.progress_callback_user_data = nullptr;
+        }
+
+        rets [i] = whisper_full_with_state(ctx, state, std::move(params_cur), samples + start, split[i + 1] - start);
+        stops[i] = state->stop_reason;
+
+        // move the timestamps to the input audio, within the chunk
+        const int64_t t_start = (int64_t) 100*start/WHISPER_SAMPLE_RATE;
+        const int64_t t_end   = (int64_t) 100*split[i + 1]/WHISPER_SAMPLE_RATE;
+
+        for (auto & segment : state->result_all) {
+            segment.t0 = std::min(segment.t0 + t_start, t_end);
+            segment.t1 = std::min(segment.t1 + t_start, t_end);
+
+            for (auto & token : segment.tokens) {
+                if (token.t0 >= 0) {
+                    token.t0 += t_start;
+                    token.t1 += t_start;
+                }
+            }
+        }
+
+        for (auto & window : state->windows) {
+            window.t0 = std::min(window.t0 + t_start, t_end);
+            window.t1 = std::min(window.t1 + t_start, t_end);
+        }
+
+        results[i] = std::move(state->result_all);
+        state->result_all.clear();
+
+        windows[i] = std::move(state->windows);
+        state->windows.clear();
+    };
+
+    std::atomic<int> chunk_next(1);
+
+    auto worker = [&](whisper_state * state) {
+        for (int i = chunk_next++; i < n_chunks; i = chunk_next++) {
+            process(state, i);
+        }
+    };
+
+    // prepare separate states for each thread
+    std::vector<whisper_state*> states;
+    std::vector<std::thread>    workers;
+
+    for (int i = 0; i < std::min(n_processors, n_chunks) - 1; ++i) {
+        whisper_state * state = whisper_state_acquire(ctx);
+        if (state == nullptr) {
+            log("%s: failed to acquire a state, using %d threads\n", __func__, i + 1);
+            break;
+        }
 
-        workers[i] = std::thread(whisper_full_with_state, ctx, states[i], std::move(params_cur), samples + start_samples, n_samples_cur);
+        states.push_back(state);
+        workers.emplace_back(worker, state);
     }
 
-    {
-        auto params_cur = params;
+    const int n_workers = states.size() + 1;
 
-        // We need to disable the print real-time for this one as well, otherwise it will show only for the first chunk.
-        params_cur.print_realtime = false;
+    process(ctx->state, 0);
+    worker(ctx->state);
 
-        // Run the first transformation using default state but only for the first chunk.
-        ret = whisper_full_with_state(ctx, ctx->state, std::move(params_cur), samples, offset_samples + n_samples_per_processor);
+    for (auto & w : workers) {
+        w.join();
     }
 
-    for (int i = 0; i < n_processors - 1; ++i) {
-        workers[i].join();
+    // the first chunk that stopped early gives the stop reason of the whole audio
+    ctx->state->stop_reason = WHISPER_STOP_NONE;
+    for (int i = 0; i < n_chunks; ++i) {
+        if (stops[i] != WHISPER_STOP_NONE) {
+            ctx->state->stop_reason = stops[i];
+            break;
+        }
     }
 
-    const int64_t offset_t = (int64_t) params.offset_ms/10.0;
+    // combine the results of all chunks into ctx->state->result_all
+    auto & result_all = ctx->state->result_all;
+
+    result_all = std::move(results[0]);
 
-    // combine results into result_state->result_all from all other states
-    for (int i = 0; i < n_processors - 1; ++i) {
-        auto& results_i = states[i]->result_all;
+    for (int i = 1; i < n_chunks; ++i) {
+        auto & results_i = results[i];
 
-        for (auto& result : results_i) {
-            // correct the segment timestamp taking into account the offset
-            result.t0 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
-            result.t1 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
+        if (n_overlap > 0) {
+            whisper_parallel_stitch(*ctx, result_all, results_i,
+                    (int64_t) 100*std::max(offset_samples, split[i] - n_overlap)/WHISPER_SAMPLE_RATE,
+                    (int64_t) 100*split[i]/WHISPER_SAMPLE_RATE);
+        }
 
+        for (auto & result : results_i) {
             // make sure that segments are not overlapping
-            if (!ctx->state->result_all.empty()) {
-                result.t0 = std::max(result.t0, ctx->state->result_all.back().t1);
+            if (!result_all.empty()) {
+                result.t0 = std::max(result.t0, result_all.back().t1);
             }
 
-            ctx->state->result_all.push_back(std::move(result));
-
-            // call the new_segment_callback for each segment
-            if (params.new_segment_callback) {
-                params.new_segment_callback(ctx, ctx->state, 1, params.new_segment_callback_user_data);
-            }
+            result_all.push_back(std::move(result));
         }
+    }
 
-        ctx->state->t_mel_us += states[i]->t_mel_us;
+    // call the new_segment_callback for each segment
+    if (params.new_segment_callback) {
+        std::vector<whisper_segment> result_tmp;
+
+        std::swap(result_tmp, result_all);
+
+        for (auto & result : result_tmp) {
+            result_all.push_back(std::move(result));
+
+            params.new_segment_callback(ctx, ctx->state, 1, params.new_segment_callback_user_data);
+        }
+    }
 
-        ctx->state->t_sample_us += states[i]->t_sample_us;
-        ctx->state->t_encode_us += states[i]->t_encode_us;
-        ctx->state->t_decode_us += states[i]->t_decode_us;
+    // the window records of all chunks, in the order of the audio
+    auto & windows_all = ctx->state->windows;
 
-        whisper_free_state(states[i]);
+    for (int i = 0; i < n_chunks; ++i) {
+        windows_all.insert(windows_all.end(), windows[i].begin(), windows[i].end());
     }
 
-    // average the timings
-    ctx->state->t_mel_us    /= n_processors;
-    ctx->state->t_sample_us /= n_processors;
-    ctx->state->t_encode_us /= n_processors;
-    ctx->state->t_decode_us /= n_processors;
+    // the counters of the default state add up the work of all the states
+    for (int i = 0; i < n_workers - 1; ++i) {
+        auto & state = *ctx->state;
+        auto & other = *states[i];
+
+        state.t_mel_us    += other.t_mel_us;
+        state.t_sample_us += other.t_sample_us;
+        state.t_encode_us += other.t_encode_us;
+        state.t_decode_us += other.t_decode_us;
+
+        state.n_sample += other.n_sample;
+        state.n_encode += other.n_encode;
+        state.n_decode += other.n_decode;
+        state.n_fail_p += other.n_fail_p;
+        state.n_fail_h += other.n_fail_h;
+        state.n_nosp   += other.n_nosp;
+
+        state.t_vad_us     += other.t_vad_us;
+        state.n_vad_frames += other.n_vad_frames;
+        state.n_vad_speech += other.n_vad_speech;
+
+        for (int j = 0; j < WHISPER_MAX_SCRATCH_BUFFERS; ++j) {
+            state.buf_max_size_all[j] = std::max(state.buf_max_size_all[j], other.get_buf_max_mem(j));
+        }
+
+        whisper_state_release(ctx, states[i]);
+    }
 
     // print information about the audio boundaries
     log("\n");
-    log("%s: the audio has been split into %d chunks at the following times:\n", __func__, n_processors);
-    for (int i = 0; i < n_processors - 1; ++i) {
-        log("%s: split %d - %s\n", __func__, (i + 1), to_timestamp(100*((i + 1)*n_samples_per_processor)/WHISPER_SAMPLE_RATE + offset_t).c_str());
+    log("%s: the audio has been split into %d chunks at the following times:\n", __func__, n_chunks);
+    for (int i = 1; i < n_chunks; ++i) {
+        log("%s: split %d - %s\n", __func__, i, to_timestamp(100*(int64_t) split[i]/WHISPER_SAMPLE_RATE).c_str());
+    }
+    if (params.parallel.search_ms <= 0 && n_overlap == 0) {
+        log("%s: the transcription quality may be degraded near these boundaries\n", __func__);
     }
-    log("%s: the transcription quality may be degraded near these boundaries\n", __func__);
 
-    return ret;
+    for (int i = 0; i < n_chunks; ++i) {
+        if (rets[i] != 0) {
+            return rets[i];
+        }
+    }
+
+    return 0;
 }
 
 int whisper_full_n_segments_from_state(struct whisper_state * state) {
@@ -4945,6 +8562,14 @@ int whisper_full_lang_id_from_state(struct whisper_state * state) {
     return state->lang_id;
 }
 
+enum whisper_stop_reason whisper_full_stop_reason_from_state(struct whisper_state * state) {
+    return whisper_state_stop_reason(*state);
+}
+
+enum whisper_stop_reason whisper_full_stop_reason(struct whisper_context * ctx) {
+    return whisper_state_stop_reason(*ctx->state);
+}
+
 int whisper_full_lang_id(struct whisper_context * ctx) {
     return ctx->state->lang_id;
 }
@@ -4969,6 +8594,18 @@ bool whisper_full_get_segment_speaker_turn_next(struct whisper_context * ctx, in
     return ctx->state->result_all[i_segment].speaker_turn_next;
 }
 
+bool whisper_full_get_segment_speaker_turn_next_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].speaker_turn_next;
+}
+
+float whisper_full_get_segment_no_speech_prob_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].no_speech_prob;
+}
+
+float whisper_full_get_segment_no_speech_prob(struct whisper_context * ctx, int i_segment) {
+    return ctx->state->result_all[i_segment].no_speech_prob;
+}
+
 const char * whisper_full_get_segment_text_from_state(struct whisper_state * state, int i_segment) {
     return state->result_all[i_segment].text.c_str();
 }
@@ -5017,6 +8654,22 @@ float whisper_full_get_token_p(struct whisper_context * ctx, int i_segment, int
     return ctx->state->result_all[i_segment].tokens[i_token].p;
 }
 
+int whisper_full_n_windows_from_state(struct whisper_state * state) {
+    return state->windows.size();
+}
+
+int whisper_full_n_windows(struct whisper_context * ctx) {
+    return ctx->state->windows.size();
+}
+
+struct whisper_window_timings whisper_full_get_window_timings_from_state(struct whisper_state * state, int i_window) {
+    return state->windows[i_window];
+}
+
+struct whisper_window_timings whisper_full_get_window_timings(struct whisper_context * ctx, int i_window) {
+    return ctx->state->windows[i_window];
+}
+
 // =================================================================================================
 
 //
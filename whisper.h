@@ -111,6 +111,10 @@ extern "C" {
 
     WHISPER_API struct whisper_state * whisper_init_state(struct whisper_context * ctx);
 
+    // The default state of the context, used by the functions without a state argument
+    // Returns NULL for the contexts created with the *_no_state functions
+    WHISPER_API struct whisper_state * whisper_get_state(struct whisper_context * ctx);
+
     // Given a context, enable use of OpenVINO for encode inference.
     // model_path: Optional path to OpenVINO encoder IR model. If set to nullptr,
     //                      the path will be generated from the ggml model path that was passed
@@ -133,6 +137,72 @@ extern "C" {
     WHISPER_API void whisper_free_state(struct whisper_state * state);
     WHISPER_API void whisper_free_params(struct whisper_full_params * params);
 
+    // State pool
+    // Ready-to-use states for running several transcriptions with the same context at once, e.g. one per request.
+    // A released state is reset (audio, results, text context, timings) and kept for the next whisper_state_acquire(), so
+    // its KV caches and buffers are not allocated again. These functions are thread-safe.
+    typedef struct whisper_state_pool_stats {
+        int n_idle;   // states in the pool
+        int n_active; // states acquired and not released yet
+        int n_alloc;  // states allocated by whisper_state_acquire()
+        int n_reuse;  // states taken from the pool by whisper_state_acquire()
+        int n_free;   // states freed by whisper_state_release() because the pool was full
+    } whisper_state_pool_stats;
+
+    // Returns NULL on failure
+    WHISPER_API struct whisper_state * whisper_state_acquire(struct whisper_context * ctx);
+    WHISPER_API void                   whisper_state_release(struct whisper_context * ctx, struct whisper_state * state);
+
+    // Maximum number of idle states kept in the pool (default: 4)
+    WHISPER_API void whisper_state_pool_set_max(struct whisper_context * ctx, int n_max);
+
+    WHISPER_API struct whisper_state_pool_stats whisper_state_pool_get_stats(struct whisper_context * ctx);
+
+    // Decode batching
+    // Gathers the next-token steps of all the states that run whisper_full_with_state() with the same context at the
+    // same time (e.g. the states of concurrent requests) into single decoder evaluations. Each step keeps the KV caches
+    // of its own state, so the results are the same as without batching. States join and leave between two tokens.
+    // A batch is evaluated once all the active states have submitted their steps, when n_batch_max steps are pending, or
+    // after wait_us microseconds. The decoding of a single state gets its decoders (best-of / beam search) batched.
+    // Not used with speculative decoding and for the decoders with restricted logits. These functions are thread-safe.
+    typedef struct whisper_decode_batching_stats {
+        int64_t n_graphs; // batched decoder evaluations
+        int64_t n_steps;  // single-token steps evaluated by them
+    } whisper_decode_batching_stats;
+
+    // n_batch_max: max steps per evaluation, 0 to disable (default: 0). wait_us: max wait for the other states
+    WHISPER_API void whisper_decode_batching_set(struct whisper_context * ctx, int n_batch_max, int wait_us);
+
+    WHISPER_API struct whisper_decode_batching_stats whisper_decode_batching_get_stats(struct whisper_context * ctx);
+
+    // CPU scheduler
+    // Process-wide: the graphs of all the contexts and states run on a shared pool of threads, within a budget of n_cores
+    // threads, instead of creating params.n_threads threads each. A graph starts once a core is free and gets up to
+    // params.n_threads of the free cores, so concurrent transcriptions never oversubscribe the CPU. The graphs that wait
+    // for a core start by priority class (params.priority), then in arrival order - a graph is never preempted, so a
+    // waiting graph waits at most for the end of the running ones. The results are the same as without the scheduler.
+    // whisper_cpu_scheduler_set() can be called while transcriptions run: the running transcriptions keep the scheduler
+    // that they started with for all their graphs, the transcriptions started after the call use the new one
+    enum whisper_priority {
+        WHISPER_PRIORITY_INTERACTIVE = 0, // e.g. live streams
+        WHISPER_PRIORITY_NORMAL      = 1,
+        WHISPER_PRIORITY_BATCH       = 2, // e.g. offline jobs, use the cores that the other classes leave free
+        WHISPER_PRIORITY_COUNT,
+    };
+
+    typedef struct whisper_cpu_scheduler_stats {
+        int     n_cores;                           // 0 - disabled
+        int64_t n_graphs [WHISPER_PRIORITY_COUNT]; // graphs run
+        int64_t n_threads[WHISPER_PRIORITY_COUNT]; // threads granted to them (calling thread included)
+        int64_t n_waits  [WHISPER_PRIORITY_COUNT]; // graphs that waited for a core
+        int64_t t_wait_us[WHISPER_PRIORITY_COUNT]; // total time waited for a core
+    } whisper_cpu_scheduler_stats;
+
+    // n_cores: thread budget (0 = number of hardware threads, < 0 = disable). Returns the budget
+    WHISPER_API int whisper_cpu_scheduler_set(int n_cores);
+
+    WHISPER_API struct whisper_cpu_scheduler_stats whisper_cpu_scheduler_get_stats(void);
+
     // Convert RAW PCM audio to log mel spectrogram.
     // The resulting spectrogram is stored inside the default state of the provided whisper context.
     // Returns 0 on success
@@ -306,6 +376,63 @@ extern "C" {
     WHISPER_API whisper_token whisper_token_translate (struct whisper_context * ctx);
     WHISPER_API whisper_token whisper_token_transcribe(struct whisper_context * ctx);
 
+    // Performance counters of a state
+    // They add up over the whisper_full() calls of the state, until the release of the state to the state pool, or
+    // whisper_reset_timings() for the default state. whisper_full_parallel() adds the counters of all its states to the
+    // default state. t_load_us belongs to the context and is not reset.
+    typedef struct whisper_timings {
+        int64_t t_load_us;    // model loading (context)
+        int64_t t_mel_us;     // log mel spectrogram
+        int64_t t_vad_us;     // voice activity detection
+        int64_t t_encode_us;  // encoder evaluations
+        int64_t t_decode_us;  // decoder evaluations
+        int64_t t_sample_us;  // logits processing and sampling
+        int64_t t_draft_us;   // speculative decoding: draft model
+        int64_t t_cascade_us; // model cascade: windows decoded again with the larger model
+
+        int32_t n_encode;            // encoder evaluations
+        int32_t n_decode;            // decoder evaluations
+        int32_t n_sample;            // sampled tokens
+        int32_t n_fail_p;            // temperature fallbacks for the logprob threshold
+        int32_t n_fail_h;            // temperature fallbacks for the entropy threshold
+        int32_t n_nosp;              // windows skipped without speech
+        int32_t n_draft;             // drafted tokens
+        int32_t n_draft_accept;      // drafted tokens accepted by the main model
+        int32_t n_cascade;           // windows decoded with a cascade
+        int32_t n_cascade_escalated; // windows decoded again with the larger model
+        int64_t n_vad_frames;        // analysed spectrogram frames
+        int64_t n_vad_speech;        // spectrogram frames kept for decoding
+
+        size_t mem_scratch; // peak use of the scratch buffers (bytes)
+    } whisper_timings;
+
+    // Performance record of a 30 s window decoded by the last whisper_full() call, see whisper_full_n_windows()
+    typedef struct whisper_window_timings {
+        int64_t t0; // start of the window, in the units of the segment timestamps (10 ms)
+        int64_t t1; // end of the audio consumed by the window
+
+        int64_t t_total_us;       // encoding, decoding and output of the window
+        int64_t t_encode_us;      // encoder (share of the batched encoder with whisper_full_batch())
+        int64_t t_decode_us;      // decoder evaluations of all the temperatures (summed over the parallel fallbacks)
+        int64_t t_sample_us;      // logits processing and sampling of all the temperatures
+        int64_t t_first_token_us; // from the start of the window to the first sampled token (-1 - none)
+
+        int32_t n_decode;    // decoder evaluations (steps)
+        int32_t n_sample;    // tokens sampled by all the decoders of all the temperatures
+        int32_t n_tokens;    // tokens of the result
+        int32_t n_fallback;  // temperature fallbacks before the result
+        int32_t n_decoders;  // decoders at the temperature of the result
+        float   temperature; // temperature of the result
+
+        bool no_speech; // skipped without speech
+        bool escalated; // decoded again by the larger model of the cascade
+
+        size_t mem_scratch; // peak use of the scratch buffers during the window (bytes)
+    } whisper_window_timings;
+
+    WHISPER_API struct whisper_timings whisper_get_timings           (struct whisper_context * ctx);
+    WHISPER_API struct whisper_timings whisper_get_timings_from_state(struct whisper_context * ctx, struct whisper_state * state);
+
     // Performance information from the default state.
     WHISPER_API void whisper_print_timings(struct whisper_context * ctx);
     WHISPER_API void whisper_reset_timings(struct whisper_context * ctx);
@@ -326,6 +453,21 @@ extern "C" {
     // Use the whisper_full_...() functions to obtain the text segments
     typedef void (*whisper_new_segment_callback)(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data);
 
+    // Status of a token passed to the new token callback
+    enum whisper_token_status {
+        WHISPER_TOKEN_PROVISIONAL = 0, // appended to the hypothesis of the window being decoded
+        WHISPER_TOKEN_RETRACTED   = 1, // the last provisional token is no longer part of the hypothesis
+        WHISPER_TOKEN_FINAL       = 2, // the first provisional token is part of the result
+    };
+
+    // New token callback
+    // Called for each text token of the best hypothesis of the window being decoded, as soon as it is sampled
+    // The provisional tokens form a stack: when the hypothesis changes (beam search, temperature fallback, model cascade,
+    // skipped or aborted window), the tokens that are no longer part of it are retracted, last first. Once the window is
+    // done, its tokens are confirmed in order, before the new segment callback is called for its segments
+    // The token timestamps (t0, t1) are only available in the segments
+    typedef void (*whisper_new_token_callback)(struct whisper_context * ctx, struct whisper_state * state, const whisper_token_data * token, enum whisper_token_status status, void * user_data);
+
     // Progress callback
     typedef void (*whisper_progress_callback)(struct whisper_context * ctx, struct whisper_state * state, int progress, void * user_data);
 
@@ -334,6 +476,11 @@ extern "C" {
     // If it returns false, the computation is aborted
     typedef bool (*whisper_encoder_begin_callback)(struct whisper_context * ctx, struct whisper_state * state, void * user_data);
 
+    // Abort callback
+    // If not NULL, called between the decoding steps and between the nodes of the computation graphs
+    // If it returns true, the transcription stops (see whisper_full_stop_reason())
+    typedef bool (*whisper_abort_callback)(void * user_data);
+
     // Logits filter callback
     // Can be used to modify the logits before sampling
     // If not NULL, called after applying temperature to logits
@@ -377,6 +524,7 @@ extern "C" {
         bool speed_up;          // speed-up the audio by 2x using Phase Vocoder
         bool debug_mode;        // enable debug_mode provides extra info (eg. Dump log_mel)
         int  audio_ctx;         // overwrite the audio context size (0 = use default)
+        bool flash_attn;        // compute the encoder self-attention and the cross-attention block-wise, without the full KQ matrix
 
         // [EXPERIMENTAL] [TDRZ] tinydiarize
         bool tdrz_enable;       // enable tinydiarize speaker turn detection
@@ -404,7 +552,13 @@ extern "C" {
         float temperature_inc;
         float entropy_thold;    // similar to OpenAI's "compression_ratio_threshold"
         float logprob_thold;
-        float no_speech_thold;  // TODO: not implemented
+        float no_speech_thold;  // skip the windows with a higher no-speech probability and a logprob below logprob_thold (0.0f = disabled)
+
+        // [EXPERIMENTAL] number of fallback temperatures decoded concurrently with the current one (0 = sequential fallback,
+        // at most 16)
+        // bounds the latency of the hard windows, at the cost of more compute and of an extra whisper_state per temperature
+        // note: the logits filter callback is called from several threads
+        int n_fallback_parallel;
 
         struct {
             int best_of;    // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/transcribe.py#L264
@@ -413,13 +567,73 @@ extern "C" {
         struct {
             int beam_size;  // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/transcribe.py#L265
 
-            float patience; // TODO: not implemented, ref: https://arxiv.org/pdf/2204.05424.pdf
+            // stop once round(beam_size*patience) beams have completed - the beams that can no longer reach the score of
+            // the best completed one are always dropped (<= 0.0f: 1.0f). the completed beams keep their decoder, so
+            // values above 1.0f are clamped to 1.0f
+            float patience; // ref: https://arxiv.org/pdf/2204.05424.pdf
         } beam_search;
 
+        // [EXPERIMENTAL] speculative decoding, ref: https://arxiv.org/abs/2211.17192
+        // a smaller model with the same vocabulary drafts the next tokens, which are then verified by a single
+        // multi-token pass of the main model. used only for greedy decoding at temperature 0 - the output is unchanged
+        // note: the logits filter callback is applied to the draft logits too, with the draft context and state
+        // each transcription takes a state of the draft context with whisper_state_acquire() and releases it at the end,
+        // so the draft context can be shared by concurrent transcriptions. the default state of ctx_draft is not used
+        struct {
+            struct whisper_context * ctx_draft; // draft model (nullptr = disabled)
+            int n_draft;                        // max number of tokens to draft per step
+        } speculative;
+
+        // [EXPERIMENTAL] model cascade
+        // each window is decoded with this model first and decoded again with a larger model that has the same
+        // vocabulary if the result has low confidence. the segments of both models form a single timeline
+        // each transcription takes a state of ctx_large with whisper_state_acquire() and releases it at the end, so the
+        // larger model can be shared by concurrent transcriptions
+        struct {
+            struct whisper_context * ctx_large; // model to escalate to (nullptr = disabled)
+            float logprob_thold;                // escalate if the average logprob of the window is below this value
+            float entropy_thold;                // escalate if the entropy of the window is below this value (repetitions)
+            float token_p_thold;                // escalate if the probability of a text token is below this value
+        } cascade;
+
+        // [EXPERIMENTAL] voice activity detection
+        // only the speech regions of the audio are decoded - the silence between them is never encoded.
+        // the timestamps of the segments and tokens refer to the original audio
+        struct {
+            bool  enable;
+            float thold;          // speech frames are louder than the estimated noise floor by this much (dB)
+            float flatness_thold; // speech frames have a spectral flatness below this value (dB), rejects hiss and hum
+            int   min_speech_ms;  // drop speech regions shorter than this
+            int   min_silence_ms; // merge speech regions separated by a shorter pause
+            int   pad_ms;         // audio kept before and after each speech region
+        } vad;
+
+        // [EXPERIMENTAL] constrained decoding
+        // the text of each window is one of the given token sequences, e.g. the tokenized commands of a voice assistant.
+        // the logits are masked to the tokens that continue a sequence and the decoding of the window ends as soon as a
+        // sequence is complete. tokenize the text with a leading space, the way whisper decodes it
+        // whisper_full() returns -9 if a sequence is empty or contains a token id outside of [0, whisper_token_eot())
+        struct {
+            const whisper_token * const * tokens;   // [n_sequences] token sequences
+            const int                   * n_tokens; // [n_sequences] number of tokens of each sequence
+            int n_sequences;                        // 0 = free text
+        } constraint;
+
+        // whisper_full_parallel() only
+        struct {
+            int n_chunks;   // number of chunks, the threads pick up the next chunk once done (0 = n_processors)
+            int search_ms;  // split at the quietest 100 ms within this distance of the even split points (0 = exact split)
+            int overlap_ms; // start each chunk this much earlier and remove the text transcribed twice (0 = no overlap)
+        } parallel;
+
         // called for every newly generated text segment
         whisper_new_segment_callback new_segment_callback;
         void * new_segment_callback_user_data;
 
+        // called for every sampled, retracted and confirmed text token (not used by whisper_full_parallel())
+        whisper_new_token_callback new_token_callback;
+        void * new_token_callback_user_data;
+
         // called on each progress update
         whisper_progress_callback progress_callback;
         void * progress_callback_user_data;
@@ -431,6 +645,18 @@ extern "C" {
         // called by each decoder to filter obtained logits
         whisper_logits_filter_callback logits_filter_callback;
         void * logits_filter_callback_user_data;
+
+        // called between the decoding steps and the graph nodes - return true to stop the transcription
+        // note: called from the compute threads too, it must be thread-safe
+        whisper_abort_callback abort_callback;
+        void * abort_callback_user_data;
+
+        // stop the transcription this many ms after the start of the call (0 = no deadline)
+        int deadline_ms;
+
+        // priority class of the graphs with the CPU scheduler, see whisper_cpu_scheduler_set()
+        // whisper_full() returns -10 if it is not one of the classes
+        enum whisper_priority priority;
     };
 
     // NOTE: this function allocates memory, and it is the responsibility of the caller to free the pointer - see whisper_free_params()
@@ -457,7 +683,8 @@ extern "C" {
     // Result is stored in the default state of the context
     // Not thread safe if executed in parallel on the same context.
     // It seems this approach can offer some speedup in some cases.
-    // However, the transcription accuracy can be worse at the beginning and end of each chunk.
+    // The audio is split at quiet points near the even split points and the chunks can overlap (see params.parallel).
+    // However, the transcription accuracy can still be worse at the beginning and end of each chunk.
     WHISPER_API int whisper_full_parallel(
                 struct whisper_context * ctx,
             struct whisper_full_params   params,
@@ -465,6 +692,58 @@ extern "C" {
                                    int   n_samples,
                                    int   n_processors);
 
+    // Run whisper_full_with_state() on n_clips independent clips, each with its own state (e.g. whisper_state_acquire())
+    // The first window of the clips is encoded in batches: the spectrograms are stacked in a single encoder graph, so
+    // that each matrix multiplication of the encoder layers is done once for the whole batch. The clips are then
+    // decoded one after the other with params.n_threads.
+    // A batch holds as many clips as fit in a full window (n_audio_ctx/params.audio_ctx, at most 16), so set
+    // params.audio_ctx to cover the length of the clips (e.g. 3 s = 150) to get batches. params.vad disables the batching
+    // Returns 0 on success, otherwise the result of the first clip that failed. The results are in the states
+    WHISPER_API int whisper_full_batch(
+                struct whisper_context * ctx,
+                  struct whisper_state ** states,
+            struct whisper_full_params   params,
+                           const float ** samples,
+                             const int * n_samples,
+                                   int   n_clips);
+
+    // Why the last transcription of the state stopped early
+    // When stopped by params.abort_callback or params.deadline_ms, whisper_full() returns 0 and the state holds the
+    // segments of the windows that were completed - the window in progress is discarded
+    enum whisper_stop_reason {
+        WHISPER_STOP_NONE     = 0, // ran to the end of the audio (or failed)
+        WHISPER_STOP_ABORT    = 1, // params.abort_callback returned true or whisper_full_async_cancel()
+        WHISPER_STOP_DEADLINE = 2, // params.deadline_ms has passed
+    };
+
+    WHISPER_API enum whisper_stop_reason whisper_full_stop_reason           (struct whisper_context * ctx);
+    WHISPER_API enum whisper_stop_reason whisper_full_stop_reason_from_state(struct whisper_state * state);
+
+    // Asynchronous whisper_full_with_state(): the transcription runs on a new thread
+    // The samples are copied. The context, the state and the pointers in params (language, prompt, callbacks, ...) must
+    // stay valid until whisper_full_async_join(). params.abort_callback is still called, in addition to the cancellation
+    // Returns NULL if the thread could not be started
+    struct whisper_full_async;
+
+    WHISPER_API struct whisper_full_async * whisper_full_async_submit(
+                struct whisper_context * ctx,
+                  struct whisper_state * state,
+            struct whisper_full_params   params,
+                           const float * samples,
+                                   int   n_samples);
+
+    // Returns 1 if the transcription is done, 0 otherwise
+    WHISPER_API int whisper_full_async_poll(struct whisper_full_async * handle);
+
+    // Wait at most timeout_ms for the transcription (< 0 = no limit). Returns 1 if it is done, 0 otherwise
+    WHISPER_API int whisper_full_async_wait(struct whisper_full_async * handle, int timeout_ms);
+
+    // Ask the transcription to stop at the next decoding step or graph node - it stops with WHISPER_STOP_ABORT
+    WHISPER_API void whisper_full_async_cancel(struct whisper_full_async * handle);
+
+    // Wait for the transcription, free the handle and return the result of whisper_full_with_state()
+    WHISPER_API int whisper_full_async_join(struct whisper_full_async * handle);
+
     // Number of generated text segments
     // A segment can be a few words, a sentence, or even a paragraph.
     WHISPER_API int whisper_full_n_segments           (struct whisper_context * ctx);
@@ -484,7 +763,12 @@ extern "C" {
     WHISPER_API int64_t whisper_full_get_segment_t1_from_state(struct whisper_state * state, int i_segment);
 
     // Get whether the next segment is predicted as a speaker turn
-    WHISPER_API bool whisper_full_get_segment_speaker_turn_next(struct whisper_context * ctx, int i_segment);
+    WHISPER_API bool whisper_full_get_segment_speaker_turn_next           (struct whisper_context * ctx, int i_segment);
+    WHISPER_API bool whisper_full_get_segment_speaker_turn_next_from_state(struct whisper_state * state, int i_segment);
+
+    // Get the probability of the <|nospeech|> token at the first decoding step of the window of the specified segment
+    WHISPER_API float whisper_full_get_segment_no_speech_prob           (struct whisper_context * ctx, int i_segment);
+    WHISPER_API float whisper_full_get_segment_no_speech_prob_from_state(struct whisper_state * state, int i_segment);
 
     // Get the text of the specified segment
     WHISPER_API const char * whisper_full_get_segment_text           (struct whisper_context * ctx, int i_segment);
@@ -510,6 +794,15 @@ extern "C" {
     WHISPER_API float whisper_full_get_token_p           (struct whisper_context * ctx, int i_segment, int i_token);
     WHISPER_API float whisper_full_get_token_p_from_state(struct whisper_state * state, int i_segment, int i_token);
 
+    // Number of windows decoded by the last whisper_full() call, in the order of the audio
+    // The windows interrupted by an abort or a deadline have no record
+    WHISPER_API int whisper_full_n_windows           (struct whisper_context * ctx);
+    WHISPER_API int whisper_full_n_windows_from_state(struct whisper_state * state);
+
+    // Get the performance record of the specified window
+    WHISPER_API struct whisper_window_timings whisper_full_get_window_timings           (struct whisper_context * ctx, int i_window);
+    WHISPER_API struct whisper_window_timings whisper_full_get_window_timings_from_state(struct whisper_state * state, int i_window);
+
     ////////////////////////////////////////////////////////////////////////////
 
     // Temporary helpers needed for exposing ggml interface